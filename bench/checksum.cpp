@@ -0,0 +1,131 @@
+// Checks the checksum kernels against the scalar reference and times them on
+// MTU and jumbo sized packets, along with incremental updates
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "checksum.hpp"
+
+namespace {
+
+constexpr size_t SIZES[] = {1500, 9000, 65535};
+constexpr size_t BYTES_PER_RUN = 1 << 30;
+
+template <typename F> double time_ns(size_t count, F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+        f(i);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    return std::chrono::duration<double, std::nano>(elapsed).count() /
+           static_cast<double>(count);
+}
+
+// Every kernel has to agree with the reference for all sizes and alignments
+bool validate(const std::vector<uint8_t>& data) {
+    const auto kernels = detail::checksum_kernels();
+    for (size_t offset = 0; offset < 64; offset++) {
+        for (size_t size = 0; size + offset <= 4096; size++) {
+            const auto expected = kernels[0].sum(data.data() + offset, size);
+            for (const auto& kernel : kernels) {
+                if (kernel.sum(data.data() + offset, size) != expected) {
+                    printf("%s differs at offset %zu, size %zu\n", kernel.name,
+                           offset, size);
+                    return false;
+                }
+            }
+        }
+    }
+
+    // All ones words fold to 0xffff, not 0
+    const std::vector<uint8_t> ones(SIZES[1], 0xff);
+    for (const auto& kernel : kernels) {
+        if (kernel.sum(ones.data(), ones.size()) != 0xffff) {
+            printf("%s folds all ones wrong\n", kernel.name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// IPv4 TCP packet of `size` bytes with random payload
+std::vector<char> make_packet(size_t size, std::mt19937& rng) {
+    std::vector<char> packet(size);
+    for (auto& byte : packet)
+        byte = static_cast<char>(rng());
+
+    const uint8_t header[] = {
+        0x45, 0, static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size),
+        0, 0, 0x40, 0, 64, 6, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2,
+    };
+    std::memcpy(packet.data(), header, sizeof(header));
+    // Data offset of 5 words
+    packet[20 + 12] = 0x50;
+
+    return packet;
+}
+
+bool bench_updates(size_t size, std::mt19937& rng) {
+    auto packet = make_packet(size, rng);
+    const auto info = parse_packet(packet.data(), packet.size());
+    calculate_checksums(packet.data(), info);
+
+    const auto flips = 1 << 20;
+    const auto incremental = time_ns(flips, [&](size_t i) {
+        const auto offset = info.payload_offset + i % info.payload_length;
+        const auto old_byte = packet[offset];
+        packet[offset] = static_cast<char>(old_byte ^ (1 << (i % 8)));
+        update_checksums(packet.data(), info, offset, &old_byte, 1);
+    });
+
+    // The updated checksums have to match recomputed ones
+    auto recomputed = packet;
+    calculate_checksums(recomputed.data(), info);
+    if (recomputed != packet) {
+        printf("incremental update differs from recomputing\n");
+        return false;
+    }
+
+    const auto full = time_ns(flips / 16, [&](size_t i) {
+        const auto offset = info.payload_offset + i % info.payload_length;
+        packet[offset] = static_cast<char>(packet[offset] ^ (1 << (i % 8)));
+        calculate_checksums(packet.data(), info);
+    });
+
+    printf("%-10s %6zu B %8.1f ns/flip, recompute %8.1f ns\n", "update",
+           size, incremental, full);
+    return true;
+}
+
+} // namespace
+
+int main() {
+    std::mt19937 rng(1);
+    std::vector<uint8_t> data(SIZES[2] + 64);
+    for (auto& byte : data)
+        byte = static_cast<uint8_t>(rng());
+
+    if (!validate(data))
+        return 1;
+
+    for (const auto& kernel : detail::checksum_kernels()) {
+        for (const auto size : SIZES) {
+            uint16_t sink = 0;
+            const auto ns = time_ns(BYTES_PER_RUN / size, [&](size_t i) {
+                sink ^= kernel.sum(data.data() + (i & 1), size);
+            });
+            printf("%-10s %6zu B %8.1f ns %6.2f GB/s (%04x)\n", kernel.name,
+                   size, ns, static_cast<double>(size) / ns, sink);
+        }
+    }
+
+    for (const auto size : SIZES) {
+        if (!bench_updates(size, rng))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+// Times inserts, lookups and expiry of a million flows in `FlowTable`
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "flow_table.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr size_t FLOWS = 1 << 20;
+
+// UDP flows between distinct IPv4 endpoints
+std::vector<uint64_t> make_keys(size_t count, uint32_t salt) {
+    std::vector<uint64_t> keys;
+    keys.reserve(count);
+
+    PacketInfo info;
+    info.ip_version = 4;
+    info.protocol = 17;
+    info.src_addr[10] = info.src_addr[11] = 0xff;
+    info.dst_addr[10] = info.dst_addr[11] = 0xff;
+    for (size_t i = 0; i < count; i++) {
+        const auto host = static_cast<uint32_t>(i >> 4) ^ salt;
+        std::memcpy(info.src_addr.data() + 12, &host, sizeof(host));
+        info.dst_addr[15] = 1;
+        info.src_port = static_cast<uint16_t>(1024 + (i & 15));
+        info.dst_port = 443;
+        keys.push_back(FlowTable::key(info));
+    }
+
+    return keys;
+}
+
+template <typename F> void run(const char* name, size_t count, F&& f) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("%-16s %8zu ops %8.1f ns/op\n", name, count,
+           ns / static_cast<double>(count));
+}
+
+} // namespace
+
+int main() {
+    FlowTable table(FLOWS, 60s);
+    const auto keys = make_keys(FLOWS, 0);
+    const auto misses = make_keys(FLOWS, 0x5a5a5a5a);
+    auto now = PacketClock::time_point{} + 1h;
+
+    run("insert", keys.size(), [&] {
+        for (const auto key : keys)
+            table.find_or_insert(key, now).state<uint32_t>(0)++;
+    });
+
+    size_t found = 0;
+    run("lookup hit", keys.size(), [&] {
+        for (const auto key : keys)
+            found += table.find(key, now) != nullptr;
+    });
+    run("lookup miss", misses.size(), [&] {
+        for (const auto key : misses)
+            found += table.find(key, now) != nullptr;
+    });
+
+    // Entries are replaced once the table is full
+    run("insert full", misses.size(), [&] {
+        for (const auto key : misses)
+            table.find_or_insert(key, now).state<uint32_t>(1) = 1;
+    });
+
+    // Swept in steps, like inserts do
+    now += 2min;
+    const auto flows = table.size();
+    size_t expired = 0;
+    run("expire", flows, [&] {
+        while (table.size() > 0)
+            expired += table.expire(now, 4096);
+    });
+
+    printf("found %zu of %zu, expired %zu, %zu flows left\n", found,
+           keys.size(), expired, table.size());
+    printf("capacity %zu entries, %zu MiB\n", table.capacity(),
+           table.memory_usage() >> 20);
+
+    return found == keys.size() && table.size() == 0 ? 0 : 1;
+}
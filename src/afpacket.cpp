@@ -0,0 +1,385 @@
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "afpacket.hpp"
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "packet.hpp"
+#include "scheduler.hpp"
+
+namespace {
+
+// Tracks which blocks of a ring are still referenced by packets
+struct RingState {
+    char* ring;
+    size_t current = 0;
+    size_t held_count = 0;
+    std::array<bool, AfPacket::BLOCK_COUNT> held{};
+    // Buffers of the held blocks, so their packets can be moved out
+    std::array<std::weak_ptr<MovableBuffer>, AfPacket::BLOCK_COUNT> buffers;
+    // Bumped whenever a block goes back to the kernel, the packets of a
+    // block that was moved out don't hand back its next use
+    std::array<uint64_t, AfPacket::BLOCK_COUNT> generations{};
+
+    [[nodiscard]] tpacket_block_desc* block(size_t index) const noexcept {
+        return std::bit_cast<tpacket_block_desc*>(ring +
+                                                  index * AfPacket::BLOCK_SIZE);
+    }
+
+    [[nodiscard]] bool ready(size_t index) const noexcept {
+        std::atomic_ref status(block(index)->hdr.bh1.block_status);
+        return !held[index] &&
+               (status.load(std::memory_order_acquire) & TP_STATUS_USER);
+    }
+
+    void release(size_t index) noexcept {
+        std::atomic_ref status(block(index)->hdr.bh1.block_status);
+        status.store(TP_STATUS_KERNEL, std::memory_order_release);
+        generations[index]++;
+
+        if (held[index]) {
+            held[index] = false;
+            held_count--;
+        }
+    }
+
+    // Copies the packets of a held block out and hands the block back, so
+    // the kernel doesn't stall on it
+    void move_out(size_t index) {
+        if (const auto buffer = buffers[index].lock())
+            buffer->move(block(index)->hdr.bh1.blk_len);
+
+        buffers[index].reset();
+        release(index);
+    }
+};
+
+} // namespace
+
+std::optional<std::string>
+AfPacket::open_interface(Interface& iface, const std::string& dev) {
+    const auto fail = [&](const char* what) {
+        std::string message(512, '\0');
+        snprintf(message.data(), message.capacity(),
+                 "Failed to start filtering: %s for %s (%s).\n"
+                 "Make sure you run cluamsy as root or with CAP_NET_RAW.",
+                 what, dev.c_str(), strerror(errno));
+        return message;
+    };
+
+    iface.ifindex = static_cast<int>(if_nametoindex(dev.c_str()));
+    if (iface.ifindex == 0)
+        return fail("unknown interface");
+
+    iface.ring_fd =
+        socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    iface.send_fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (iface.ring_fd < 0 || iface.send_fd < 0)
+        return fail("failed to open packet sockets");
+
+    const int version = TPACKET_V3;
+    if (setsockopt(iface.ring_fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0)
+        return fail("TPACKET_V3 is not supported");
+
+    tpacket_req3 req{};
+    req.tp_block_size = BLOCK_SIZE;
+    req.tp_block_nr = BLOCK_COUNT;
+    req.tp_frame_size = FRAME_SIZE;
+    req.tp_frame_nr = BLOCK_SIZE * BLOCK_COUNT / FRAME_SIZE;
+    req.tp_retire_blk_tov = BLOCK_TIMEOUT_MS;
+    if (setsockopt(iface.ring_fd, SOL_PACKET, PACKET_RX_RING, &req,
+                   sizeof(req)) < 0)
+        return fail("failed to set up the receive ring");
+
+    iface.ring_size = BLOCK_SIZE * BLOCK_COUNT;
+    auto* const ring = mmap(nullptr, iface.ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, iface.ring_fd, 0);
+    if (ring == MAP_FAILED)
+        return fail("failed to map the receive ring");
+
+    iface.ring = static_cast<char*>(ring);
+
+    // Our own sends show up as outgoing packets on the other interface
+#ifdef PACKET_IGNORE_OUTGOING
+    const int ignore_outgoing = 1;
+    setsockopt(iface.ring_fd, SOL_PACKET, PACKET_IGNORE_OUTGOING,
+               &ignore_outgoing, sizeof(ignore_outgoing));
+#endif
+
+    sockaddr_ll addr{};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = iface.ifindex;
+    if (bind(iface.ring_fd, std::bit_cast<sockaddr*>(&addr), sizeof(addr)) <
+        0)
+        return fail("failed to bind the receive ring");
+
+    // Frames between the bridged hosts aren't addressed to us
+    packet_mreq mreq{};
+    mreq.mr_ifindex = iface.ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(iface.ring_fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0)
+        return fail("failed to enable promiscuous mode");
+
+    return std::nullopt;
+}
+
+std::optional<std::string> AfPacket::start(const std::string& filter) {
+    LOG("Starting");
+
+    const auto comma = filter.find(',');
+    if (comma == std::string::npos || comma == 0 ||
+        comma + 1 == filter.size())
+        return "Failed to start filtering: filter must be `dev_a,dev_b`";
+
+    const std::array<std::string, 2> devs{
+        filter.substr(0, comma),
+        filter.substr(comma + 1),
+    };
+    for (size_t i = 0; i < devs.size(); i++) {
+        if (auto error = open_interface(m_interfaces[i], devs[i])) {
+            close_interfaces();
+            return error;
+        }
+    }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0) {
+        close_interfaces();
+        return "Failed to start filtering: failed to create eventfd";
+    }
+
+    LOG("Bridging %s and %s, ring size: %zu", devs[0].c_str(),
+        devs[1].c_str(), BLOCK_SIZE * BLOCK_COUNT);
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .interfaces = m_interfaces,
+        .stop_fd = m_stop_fd,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+
+    return std::nullopt;
+}
+
+bool AfPacket::stop() {
+    if (m_stop_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for the AF_PACKET thread");
+    m_thread.join();
+
+    close_interfaces();
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("AF_PACKET stopped");
+
+    return true;
+}
+
+void AfPacket::close_interfaces() {
+    for (auto& iface : m_interfaces) {
+        if (iface.ring != nullptr)
+            munmap(iface.ring, iface.ring_size);
+
+        for (auto* fd : {&iface.ring_fd, &iface.send_fd}) {
+            if (*fd >= 0)
+                close(*fd);
+
+            *fd = -1;
+        }
+
+        iface = Interface{};
+    }
+
+    if (m_stop_fd >= 0)
+        close(m_stop_fd);
+
+    m_stop_fd = -1;
+}
+
+void AfPacket::thread(ThreadData thread_data) {
+    auto& interfaces = thread_data.interfaces;
+
+    // Shared with the deleters of block buffers
+    std::array<std::shared_ptr<RingState>, 2> rings;
+    for (size_t i = 0; i < rings.size(); i++) {
+        rings[i] = std::make_shared<RingState>();
+        rings[i]->ring = interfaces[i].ring;
+    }
+
+    const auto read_packets = [&](size_t iface_index) {
+        auto& ring = *rings[iface_index];
+
+        // Modules hold packets (e.g. lagged ones) for long enough to pin
+        // blocks. The oldest held blocks are moved out before the kernel
+        // runs into them, otherwise capture stops for the whole ring.
+        for (size_t i = 0; i < BLOCK_COUNT; i++) {
+            const auto index = (ring.current + i) % BLOCK_COUNT;
+            if (i != 0 && ring.held_count < HELD_BLOCKS_LIMIT)
+                break;
+
+            if (ring.held[index])
+                ring.move_out(index);
+        }
+
+        size_t packet_count = 0;
+        const auto current_timestamp = std::chrono::steady_clock::now();
+        while (packet_count < MAX_PACKETS && ring.ready(ring.current)) {
+            const auto index = ring.current;
+            auto* const block = ring.block(index);
+            auto* const block_data = std::bit_cast<char*>(block);
+            ring.current = (ring.current + 1) % BLOCK_COUNT;
+
+            ring.held[index] = true;
+            ring.held_count++;
+            const auto buffer = std::shared_ptr<MovableBuffer>(
+                new MovableBuffer{.data = block_data, .copy = {}},
+                [rings = rings[iface_index], index,
+                 generation = ring.generations[index]](MovableBuffer* buffer) {
+                    if (rings->generations[index] == generation)
+                        rings->release(index);
+
+                    delete buffer;
+                });
+            ring.buffers[index] = buffer;
+
+            auto* next = std::bit_cast<tpacket3_hdr*>(
+                block_data + block->hdr.bh1.offset_to_first_pkt);
+            for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+                auto* const packet = next;
+                next = std::bit_cast<tpacket3_hdr*>(
+                    std::bit_cast<char*>(packet) + packet->tp_next_offset);
+
+                const auto* const ll = std::bit_cast<const sockaddr_ll*>(
+                    std::bit_cast<char*>(packet) +
+                    TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+                if (ll->sll_pkttype == PACKET_OUTGOING)
+                    continue;
+
+                const uint32_t link_size = packet->tp_net - packet->tp_mac;
+                if (link_size < ETH_HLEN || packet->tp_snaplen <= link_size ||
+                    packet->tp_snaplen != packet->tp_len)
+                    continue;
+
+                const auto* const frame =
+                    std::bit_cast<char*>(packet) + packet->tp_mac;
+                auto* const data =
+                    std::bit_cast<char*>(packet) + packet->tp_net;
+                const size_t size = packet->tp_snaplen - link_size;
+
+                PacketAddress addr{};
+                addr.Id = pack_link_id(frame, ntohs(ll->sll_protocol));
+                addr.IfIdx = interfaces[iface_index].ifindex;
+                addr.Outbound = iface_index == 0;
+
+                g_packets.emplace_back(PacketNode{
+                    .packet = DenseBufferArraySlice(
+                        buffer, static_cast<size_t>(data - block_data), size),
+                    .addr = addr,
+                    .captured_at = current_timestamp,
+                });
+                packet_count++;
+            }
+        }
+    };
+
+    const auto write_packets = [&] {
+        for (const auto& packet : g_packets) {
+            const auto& out = interfaces[packet.addr.Outbound ? 1 : 0];
+
+            uint16_t ethertype = 0;
+            sockaddr_ll addr{};
+            addr.sll_family = AF_PACKET;
+            addr.sll_ifindex = out.ifindex;
+            addr.sll_halen = ETH_ALEN;
+            unpack_link_id(packet.addr.Id, addr.sll_addr, ethertype);
+            addr.sll_protocol = htons(ethertype);
+
+            if (sendto(out.send_fd, packet.packet.data(), packet.packet.size(),
+                       0, std::bit_cast<sockaddr*>(&addr), sizeof(addr)) < 0 &&
+                errno != ENOBUFS)
+                LOG("sendto failed: %s", strerror(errno));
+        }
+
+        g_packets.clear();
+    };
+
+    Scheduler scheduler;
+    std::array<pollfd, 4> fds{
+        pollfd{.fd = interfaces[0].ring_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = interfaces[1].ring_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = thread_data.stop_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = scheduler.fd(), .events = POLLIN, .revents = 0},
+    };
+    while (true) {
+        const auto res = poll(fds.data(), fds.size(), -1);
+
+        if (res < 0 && errno != EINTR) {
+            LOG("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        // STOP
+        if (fds[2].revents & POLLIN)
+            break;
+
+        if ((fds[0].revents | fds[1].revents) & POLLERR) {
+            LOG("Packet socket error");
+            break;
+        }
+
+        // READ
+        // Block status tells whether there's anything new, no need to look
+        // at the poll result
+        read_packets(0);
+        read_packets(1);
+
+        // TIMER
+        if (fds[3].revents & POLLIN)
+            scheduler.expire();
+
+        // Run modules
+        scheduler.schedule(run_modules(thread_data.modules).schedule_after);
+
+        // WRITE
+        write_packets();
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    write_packets();
+
+    for (const auto& ring : rings) {
+        if (ring->held_count != 0)
+            LOG("%zu ring blocks are still referenced", ring->held_count);
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.hpp"
+#include "module.hpp"
+
+// Linux AF_PACKET backend bridging two interfaces. Frames are received into
+// TPACKET_V3 block rings and handed to the modules straight from the mapped
+// blocks, a block goes back to the kernel once every packet in it was sent or
+// dropped. Packets from the first interface are outbound and sent out of the
+// second one and vice versa. Frames are sent on a SOCK_DGRAM socket, VLAN tags
+// and the original source MAC aren't preserved.
+// The filter is `dev_a,dev_b`.
+class AfPacket : public PacketBackend {
+public:
+    static const inline size_t BLOCK_SIZE = 1 << 20;
+    static const inline size_t BLOCK_COUNT = 64;
+    static const inline size_t FRAME_SIZE = 2048;
+    // Blocks are retired to userspace when full or after this many
+    // milliseconds
+    static const inline uint32_t BLOCK_TIMEOUT_MS = 1;
+    // Once this many blocks are held by modules (e.g. lagged packets), the
+    // packets of the oldest ones are copied out and the blocks handed back,
+    // so the ring doesn't run dry
+    static const inline size_t HELD_BLOCKS_LIMIT = BLOCK_COUNT / 2;
+    static const inline size_t MAX_PACKETS = 32;
+
+public:
+    explicit AfPacket(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    AfPacket(const AfPacket&) = delete;
+    AfPacket(AfPacket&&) = delete;
+    AfPacket& operator=(const AfPacket&) = delete;
+    AfPacket& operator=(AfPacket&&) = delete;
+
+    ~AfPacket() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    // Receive ring and send socket of one interface
+    struct Interface {
+        int ifindex = -1;
+        int ring_fd = -1;
+        int send_fd = -1;
+        char* ring = nullptr;
+        size_t ring_size = 0;
+    };
+
+    struct ThreadData {
+        std::array<Interface, 2>& interfaces;
+        int stop_fd;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+    static std::optional<std::string> open_interface(Interface& iface,
+                                                     const std::string& dev);
+    void close_interfaces();
+
+private:
+    std::thread m_thread;
+    std::array<Interface, 2> m_interfaces;
+    int m_stop_fd = -1;
+};
@@ -0,0 +1,634 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "afxdp.hpp"
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "packet.hpp"
+#include "scheduler.hpp"
+
+using namespace std::chrono_literals;
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static int bpf(int cmd, bpf_attr& attr) {
+    return static_cast<int>(syscall(__NR_bpf, cmd, &attr, sizeof(attr)));
+}
+
+static uint64_t to_u64(const void* ptr) {
+    return static_cast<uint64_t>(std::bit_cast<uintptr_t>(ptr));
+}
+
+namespace {
+
+// Our side of a ring is only ever touched by the backend thread, the other
+// side is synchronized with the kernel
+template <typename T> class RingView {
+public:
+    explicit RingView(const AfXdp::Ring& ring) : m_ring(ring) {}
+
+    T& operator[](uint32_t index) {
+        return std::bit_cast<T*>(m_ring.descs)[index & (AfXdp::RING_SIZE - 1)];
+    }
+
+    // Consumer side, returns the number of entries starting at `index`
+    uint32_t available(uint32_t& index) const {
+        index = load(m_ring.consumer, std::memory_order_relaxed);
+        return load(m_ring.producer, std::memory_order_acquire) - index;
+    }
+
+    void consume(uint32_t index) {
+        std::atomic_ref(*m_ring.consumer)
+            .store(index, std::memory_order_release);
+    }
+
+    // Producer side, returns the number of free entries starting at `index`
+    uint32_t free(uint32_t& index) const {
+        index = load(m_ring.producer, std::memory_order_relaxed);
+        return AfXdp::RING_SIZE -
+               (index - load(m_ring.consumer, std::memory_order_acquire));
+    }
+
+    void produce(uint32_t index) {
+        std::atomic_ref(*m_ring.producer)
+            .store(index, std::memory_order_release);
+    }
+
+private:
+    static uint32_t load(uint32_t* value, std::memory_order order) {
+        return std::atomic_ref(*value).load(order);
+    }
+
+private:
+    const AfXdp::Ring& m_ring;
+};
+
+struct FramePool {
+    std::vector<uint64_t> free;
+};
+
+// Returns a UMEM frame to the pool once no packet references it anymore
+struct FrameDeleter {
+    std::shared_ptr<FramePool> pool;
+    uint64_t frame;
+
+    void operator()(char*) const { pool->free.push_back(frame); }
+};
+
+} // namespace
+
+static bool map_ring(int fd, AfXdp::Ring& ring, const xdp_ring_offset& offset,
+                     size_t desc_size, off_t pgoff) {
+    ring.map_size = offset.desc + AfXdp::RING_SIZE * desc_size;
+    ring.map = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring.map == MAP_FAILED) {
+        ring.map = nullptr;
+        return false;
+    }
+
+    auto* const base = static_cast<char*>(ring.map);
+    ring.producer = std::bit_cast<uint32_t*>(base + offset.producer);
+    ring.consumer = std::bit_cast<uint32_t*>(base + offset.consumer);
+    ring.descs = base + offset.desc;
+    return true;
+}
+
+static void unmap_ring(AfXdp::Ring& ring) {
+    if (ring.map != nullptr)
+        munmap(ring.map, ring.map_size);
+
+    ring = AfXdp::Ring{};
+}
+
+std::optional<std::string> AfXdp::open_interface(Interface& iface,
+                                                 const std::string& dev,
+                                                 int shared_fd) {
+    const auto fail = [&](const char* what) {
+        std::string message(512, '\0');
+        snprintf(message.data(), message.capacity(),
+                 "Failed to start filtering: %s for %s (%s).\n"
+                 "Make sure you run cluamsy as root or with CAP_NET_ADMIN "
+                 "and CAP_BPF.",
+                 what, dev.c_str(), strerror(errno));
+        return message;
+    };
+
+    iface.ifindex = static_cast<int>(if_nametoindex(dev.c_str()));
+    if (iface.ifindex == 0)
+        return fail("unknown interface");
+
+    // Rebuilt frames are sent from the interface's own address
+    {
+        const auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        ifreq ifr{};
+        strncpy(ifr.ifr_name, dev.c_str(), IFNAMSIZ - 1);
+        const auto res = fd < 0 ? -1 : ioctl(fd, SIOCGIFHWADDR, &ifr);
+        if (fd >= 0)
+            close(fd);
+        if (res < 0)
+            return fail("failed to query the MAC address");
+
+        memcpy(iface.mac.data(), ifr.ifr_hwaddr.sa_data, iface.mac.size());
+    }
+
+    iface.xsk_fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (iface.xsk_fd < 0)
+        return fail("failed to open an XDP socket");
+
+    if (shared_fd < 0) {
+        xdp_umem_reg reg{};
+        reg.addr = to_u64(m_umem);
+        reg.len = FRAME_SIZE * FRAME_COUNT;
+        reg.chunk_size = FRAME_SIZE;
+        reg.headroom = 0;
+        if (setsockopt(iface.xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg,
+                       sizeof(reg)) < 0)
+            return fail("failed to register the UMEM");
+    }
+
+    // Sockets on different devices each need their own fill and completion
+    // rings, even when sharing the UMEM
+    const auto ring_size = RING_SIZE;
+    for (const auto option : {XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING,
+                              XDP_RX_RING, XDP_TX_RING}) {
+        if (setsockopt(iface.xsk_fd, SOL_XDP, option, &ring_size,
+                       sizeof(ring_size)) < 0)
+            return fail("failed to size the XDP rings");
+    }
+
+    xdp_mmap_offsets offsets{};
+    socklen_t offsets_size = sizeof(offsets);
+    if (getsockopt(iface.xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets,
+                   &offsets_size) < 0 ||
+        !map_ring(iface.xsk_fd, iface.rx, offsets.rx, sizeof(xdp_desc),
+                  XDP_PGOFF_RX_RING) ||
+        !map_ring(iface.xsk_fd, iface.tx, offsets.tx, sizeof(xdp_desc),
+                  XDP_PGOFF_TX_RING) ||
+        !map_ring(iface.xsk_fd, iface.fill, offsets.fr, sizeof(uint64_t),
+                  XDP_UMEM_PGOFF_FILL_RING) ||
+        !map_ring(iface.xsk_fd, iface.completion, offsets.cr,
+                  sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING))
+        return fail("failed to map the XDP rings");
+
+    sockaddr_xdp addr{};
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = iface.ifindex;
+    addr.sxdp_queue_id = 0;
+    if (shared_fd < 0) {
+        // Generic XDP can't do zero-copy
+        addr.sxdp_flags = XDP_COPY;
+    } else {
+        addr.sxdp_flags = XDP_SHARED_UMEM;
+        addr.sxdp_shared_umem_fd = shared_fd;
+    }
+    if (bind(iface.xsk_fd, std::bit_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        return fail("failed to bind the XDP socket");
+
+    // Map from rx queue to socket
+    bpf_attr attr{};
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 64;
+    iface.map_fd = bpf(BPF_MAP_CREATE, attr);
+    if (iface.map_fd < 0)
+        return fail("failed to create the XSKMAP");
+
+    const uint32_t queue_id = 0;
+    attr = bpf_attr{};
+    attr.map_fd = iface.map_fd;
+    attr.key = to_u64(&queue_id);
+    attr.value = to_u64(&iface.xsk_fd);
+    if (bpf(BPF_MAP_UPDATE_ELEM, attr) < 0)
+        return fail("failed to insert the XDP socket");
+
+    // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+    const std::array<bpf_insn, 6> insns{{
+        {.code = BPF_LDX | BPF_MEM | BPF_W,
+         .dst_reg = BPF_REG_2,
+         .src_reg = BPF_REG_1,
+         .off = offsetof(xdp_md, rx_queue_index),
+         .imm = 0},
+        {.code = BPF_LD | BPF_DW | BPF_IMM,
+         .dst_reg = BPF_REG_1,
+         .src_reg = BPF_PSEUDO_MAP_FD,
+         .off = 0,
+         .imm = iface.map_fd},
+        {.code = 0, .dst_reg = 0, .src_reg = 0, .off = 0, .imm = 0},
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K,
+         .dst_reg = BPF_REG_3,
+         .src_reg = 0,
+         .off = 0,
+         .imm = XDP_PASS},
+        {.code = BPF_JMP | BPF_CALL,
+         .dst_reg = 0,
+         .src_reg = 0,
+         .off = 0,
+         .imm = BPF_FUNC_redirect_map},
+        {.code = BPF_JMP | BPF_EXIT,
+         .dst_reg = 0,
+         .src_reg = 0,
+         .off = 0,
+         .imm = 0},
+    }};
+    static const char license[] = "GPL";
+    attr = bpf_attr{};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insn_cnt = insns.size();
+    attr.insns = to_u64(insns.data());
+    attr.license = to_u64(license);
+    iface.prog_fd = bpf(BPF_PROG_LOAD, attr);
+    if (iface.prog_fd < 0)
+        return fail("failed to load the XDP program");
+
+    // Detached again when the link is closed
+    attr = bpf_attr{};
+    attr.link_create.prog_fd = iface.prog_fd;
+    attr.link_create.target_ifindex = iface.ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    iface.link_fd = bpf(BPF_LINK_CREATE, attr);
+    if (iface.link_fd < 0)
+        return fail("failed to attach the XDP program");
+
+    return std::nullopt;
+}
+
+std::optional<std::string> AfXdp::start(const std::string& filter) {
+    LOG("Starting");
+
+    const auto comma = filter.find(',');
+    if (comma == std::string::npos || comma == 0 ||
+        comma + 1 == filter.size())
+        return "Failed to start filtering: filter must be `dev_a,dev_b`";
+
+    const std::array<std::string, 2> devs{
+        filter.substr(0, comma),
+        filter.substr(comma + 1),
+    };
+
+    auto* const umem =
+        mmap(nullptr, FRAME_SIZE * FRAME_COUNT, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED)
+        return "Failed to start filtering: failed to allocate the UMEM";
+
+    m_umem = static_cast<char*>(umem);
+
+    for (size_t i = 0; i < devs.size(); i++) {
+        const auto shared_fd = i == 0 ? -1 : m_interfaces[0].xsk_fd;
+        if (auto error = open_interface(m_interfaces[i], devs[i], shared_fd)) {
+            close_interfaces();
+            return error;
+        }
+    }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0) {
+        close_interfaces();
+        return "Failed to start filtering: failed to create eventfd";
+    }
+
+    LOG("Bridging %s and %s, UMEM size: %zu", devs[0].c_str(),
+        devs[1].c_str(), FRAME_SIZE * FRAME_COUNT);
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .interfaces = m_interfaces,
+        .umem = m_umem,
+        .stop_fd = m_stop_fd,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+
+    return std::nullopt;
+}
+
+bool AfXdp::stop() {
+    if (m_stop_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for the AF_XDP thread");
+    m_thread.join();
+
+    close_interfaces();
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("AF_XDP stopped");
+
+    return true;
+}
+
+void AfXdp::close_interfaces() {
+    for (auto& iface : m_interfaces) {
+        // Closing the link detaches the program
+        for (auto* fd :
+             {&iface.link_fd, &iface.prog_fd, &iface.map_fd, &iface.xsk_fd}) {
+            if (*fd >= 0)
+                close(*fd);
+
+            *fd = -1;
+        }
+
+        for (auto* ring :
+             {&iface.rx, &iface.tx, &iface.fill, &iface.completion})
+            unmap_ring(*ring);
+
+        iface = Interface{};
+    }
+
+    if (m_umem != nullptr)
+        munmap(m_umem, FRAME_SIZE * FRAME_COUNT);
+
+    m_umem = nullptr;
+
+    if (m_stop_fd >= 0)
+        close(m_stop_fd);
+
+    m_stop_fd = -1;
+}
+
+void AfXdp::thread(ThreadData thread_data) {
+    auto& interfaces = thread_data.interfaces;
+    auto* const umem = thread_data.umem;
+
+    // Shared with the deleters of frame buffers
+    const auto pool = std::make_shared<FramePool>();
+    pool->free.reserve(FRAME_COUNT);
+    for (size_t i = FRAME_COUNT; i-- > 0;)
+        pool->free.push_back(i * FRAME_SIZE);
+
+    const auto frame_buffer = [&](uint64_t frame) {
+        return std::shared_ptr<char>(umem + frame, FrameDeleter{pool, frame});
+    };
+
+    // Frames handed to the kernel for sending are referenced until their
+    // completion comes back
+    std::vector<std::vector<std::shared_ptr<char>>> in_flight(FRAME_COUNT);
+
+    // Descriptors queued for sending that haven't completed yet
+    std::array<size_t, 2> outstanding{};
+
+    const auto complete = [&](size_t iface_index) {
+        RingView<uint64_t> ring(interfaces[iface_index].completion);
+        uint32_t index = 0;
+        const auto count = ring.available(index);
+        for (uint32_t i = 0; i < count; i++) {
+            auto& refs = in_flight[ring[index + i] / FRAME_SIZE];
+            if (!refs.empty())
+                refs.pop_back();
+        }
+
+        ring.consume(index + count);
+        outstanding[iface_index] -= count;
+        return count;
+    };
+
+    // Copy mode sends from the syscall, a limited number of descriptors at a
+    // time
+    const auto kick = [&](size_t iface_index) {
+        while (outstanding[iface_index] != 0) {
+            if (sendto(interfaces[iface_index].xsk_fd, nullptr, 0,
+                       MSG_DONTWAIT, nullptr, 0) < 0 &&
+                errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+                LOG("sendto failed: %s", strerror(errno));
+                break;
+            }
+
+            if (complete(iface_index) == 0)
+                break;
+        }
+    };
+
+    const auto refill = [&](Interface& iface) {
+        RingView<uint64_t> ring(iface.fill);
+        uint32_t index = 0;
+        const auto count = static_cast<uint32_t>(
+            std::min<size_t>(ring.free(index), pool->free.size()));
+        for (uint32_t i = 0; i < count; i++) {
+            ring[index + i] = pool->free.back();
+            pool->free.pop_back();
+        }
+
+        ring.produce(index + count);
+    };
+
+    const auto receive = [&](size_t iface_index) {
+        auto& iface = interfaces[iface_index];
+        RingView<xdp_desc> ring(iface.rx);
+        uint32_t index = 0;
+        const auto count = std::min<uint32_t>(ring.available(index),
+                                              MAX_PACKETS);
+        const auto current_timestamp = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < count; i++) {
+            const auto desc = ring[index + i];
+            const auto frame = desc.addr - desc.addr % FRAME_SIZE;
+            const auto* const data = umem + desc.addr;
+            if (desc.len <= ETH_HLEN) {
+                pool->free.push_back(frame);
+                continue;
+            }
+
+            uint16_t ethertype = 0;
+            memcpy(&ethertype, data + 2 * ETH_ALEN, sizeof(ethertype));
+
+            PacketAddress addr{};
+            addr.Id = pack_link_id(data, ntohs(ethertype));
+            addr.IfIdx = iface.ifindex;
+            addr.Outbound = iface_index == 0;
+
+            const size_t size = desc.len - ETH_HLEN;
+            auto packet = [&] {
+                if (pool->free.size() >= MIN_FREE_FRAMES) {
+                    return DenseBufferArraySlice(
+                        frame_buffer(frame), desc.addr - frame + ETH_HLEN,
+                        size);
+                }
+
+                pool->free.push_back(frame);
+                return DenseBufferArraySlice(
+                    std::make_shared<std::vector<char>>(
+                        data + ETH_HLEN, data + ETH_HLEN + size),
+                    0, size);
+            }();
+
+            g_packets.emplace_back(PacketNode{
+                .packet = std::move(packet),
+                .addr = addr,
+                .captured_at = current_timestamp,
+            });
+        }
+
+        ring.consume(index + count);
+    };
+
+    const auto transmit = [&] {
+        std::array<uint32_t, 2> indices{};
+        std::array<uint32_t, 2> free{};
+        std::array<uint32_t, 2> queued{};
+        for (size_t i = 0; i < interfaces.size(); i++)
+            free[i] = RingView<xdp_desc>(interfaces[i].tx).free(indices[i]);
+
+        auto it = g_packets.begin();
+        for (; it != g_packets.end(); ++it) {
+            const auto out = it->addr.Outbound ? 1 : 0;
+            if (queued[out] == free[out])
+                break;
+
+            const auto& slice = it->packet;
+            const auto* const deleter =
+                std::get_deleter<FrameDeleter>(slice.buffer());
+
+            xdp_desc desc{};
+            std::shared_ptr<char> buffer;
+            if (deleter != nullptr && deleter->pool == pool &&
+                slice.offset() >= ETH_HLEN) {
+                // The frame header is still in front of the packet
+                desc.addr = deleter->frame + slice.offset() - ETH_HLEN;
+                desc.len = slice.size() + ETH_HLEN;
+                buffer = slice.buffer();
+            } else {
+                // Doesn't fit into a frame
+                if (slice.size() + ETH_HLEN > FRAME_SIZE)
+                    continue;
+
+                if (pool->free.empty())
+                    break;
+
+                const auto frame = pool->free.back();
+                pool->free.pop_back();
+
+                auto* const data = umem + frame;
+                std::array<unsigned char, ETH_ALEN> mac{};
+                uint16_t ethertype = 0;
+                unpack_link_id(it->addr.Id, mac.data(), ethertype);
+                ethertype = htons(ethertype);
+                memcpy(data, mac.data(), ETH_ALEN);
+                memcpy(data + ETH_ALEN, interfaces[out].mac.data(), ETH_ALEN);
+                memcpy(data + 2 * ETH_ALEN, &ethertype, sizeof(ethertype));
+                memcpy(data + ETH_HLEN, slice.data(), slice.size());
+
+                desc.addr = frame;
+                desc.len = slice.size() + ETH_HLEN;
+                buffer = frame_buffer(frame);
+            }
+
+            RingView<xdp_desc> ring(interfaces[out].tx);
+            ring[indices[out] + queued[out]] = desc;
+            queued[out]++;
+            in_flight[desc.addr / FRAME_SIZE].emplace_back(std::move(buffer));
+        }
+
+        g_packets.erase(g_packets.begin(), it);
+
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            if (queued[i] == 0)
+                continue;
+
+            RingView<xdp_desc>(interfaces[i].tx)
+                .produce(indices[i] + queued[i]);
+            outstanding[i] += queued[i];
+        }
+    };
+
+    for (auto& iface : interfaces)
+        refill(iface);
+
+    Scheduler scheduler;
+    std::array<pollfd, 4> fds{
+        pollfd{.fd = interfaces[0].xsk_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = interfaces[1].xsk_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = thread_data.stop_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = scheduler.fd(), .events = POLLIN, .revents = 0},
+    };
+    auto retry = false;
+    while (true) {
+        const auto res = poll(fds.data(), fds.size(), retry ? 1 : -1);
+
+        if (res < 0 && errno != EINTR) {
+            LOG("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        // STOP
+        if (fds[2].revents & POLLIN)
+            break;
+
+        if ((fds[0].revents | fds[1].revents) & POLLERR) {
+            LOG("XDP socket error");
+            break;
+        }
+
+        // READ
+        for (size_t i = 0; i < interfaces.size(); i++)
+            receive(i);
+
+        // TIMER
+        if (fds[3].revents & POLLIN)
+            scheduler.expire();
+
+        // Run modules
+        scheduler.schedule(run_modules(thread_data.modules).schedule_after);
+
+        // WRITE
+        transmit();
+
+        // Send and recycle frames
+        for (size_t i = 0; i < interfaces.size(); i++) {
+            kick(i);
+            complete(i);
+            refill(interfaces[i]);
+        }
+
+        // Tx rings were full, try again soon
+        retry =
+            !g_packets.empty() || outstanding[0] != 0 || outstanding[1] != 0;
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    transmit();
+    for (size_t i = 0; i < interfaces.size(); i++)
+        kick(i);
+
+    // Frames die with the UMEM
+    g_packets.clear();
+    in_flight.clear();
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.hpp"
+#include "module.hpp"
+
+// Linux AF_XDP backend bridging two interfaces, like `AfPacket`. An XDP
+// program redirects frames from queue 0 of both interfaces into XDP sockets
+// sharing one UMEM. Packets reference their UMEM frame until they're sent or
+// dropped, frames of sent packets are transmitted from where they were
+// received without copying.
+// Generic (SKB) mode is used so that it works on veth pairs.
+// The filter is `dev_a,dev_b`.
+class AfXdp : public PacketBackend {
+public:
+    static const inline size_t FRAME_SIZE = 4096;
+    static const inline size_t FRAME_COUNT = 8192;
+    static const inline uint32_t RING_SIZE = 2048;
+    // Once fewer frames are free (e.g. modules hold lagged packets), received
+    // packets are copied out of their frames so the fill rings don't run dry
+    static const inline size_t MIN_FREE_FRAMES = RING_SIZE;
+    static const inline size_t MAX_PACKETS = 64;
+
+    // Producer/consumer ring shared with the kernel
+    struct Ring {
+        uint32_t* producer = nullptr;
+        uint32_t* consumer = nullptr;
+        char* descs = nullptr;
+        void* map = nullptr;
+        size_t map_size = 0;
+    };
+
+public:
+    explicit AfXdp(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    AfXdp(const AfXdp&) = delete;
+    AfXdp(AfXdp&&) = delete;
+    AfXdp& operator=(const AfXdp&) = delete;
+    AfXdp& operator=(AfXdp&&) = delete;
+
+    ~AfXdp() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    struct Interface {
+        int ifindex = 0;
+        std::array<char, 6> mac{};
+
+        int xsk_fd = -1;
+        int map_fd = -1;
+        int prog_fd = -1;
+        int link_fd = -1;
+
+        Ring rx;
+        Ring tx;
+        Ring fill;
+        Ring completion;
+    };
+
+    struct ThreadData {
+        std::array<Interface, 2>& interfaces;
+        char* umem;
+        int stop_fd;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+    // `shared_fd` is the socket that registered the UMEM or -1 to register it
+    std::optional<std::string> open_interface(Interface& iface,
+                                              const std::string& dev,
+                                              int shared_fd);
+    void close_interfaces();
+
+private:
+    std::thread m_thread;
+    std::array<Interface, 2> m_interfaces;
+    char* m_umem = nullptr;
+    int m_stop_fd = -1;
+};
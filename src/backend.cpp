@@ -0,0 +1,167 @@
+#include <array>
+
+#include "backend.hpp"
+#include "common.hpp"
+#include "events.hpp"
+#include "packet.hpp"
+
+#include "bandwidth.hpp"
+#include "defragment.hpp"
+#include "drop.hpp"
+#include "duplicate.hpp"
+#include "fragment.hpp"
+#include "generator.hpp"
+#include "jitter.hpp"
+#include "lag.hpp"
+#include "ood.hpp"
+#include "replay.hpp"
+#include "reset.hpp"
+#include "tamper.hpp"
+#include "throttle.hpp"
+
+#ifdef _WIN32
+#include "divert.hpp"
+#endif
+
+#ifdef __linux__
+#include "afpacket.hpp"
+#include "afxdp.hpp"
+#include "nfqueue.hpp"
+#include "tcp_proxy.hpp"
+#include "tun.hpp"
+#include "udp_relay.hpp"
+#endif
+
+static constexpr std::array BACKEND_NAMES = {
+#ifdef _WIN32
+    "windivert",
+#endif
+#ifdef __linux__
+    "nfqueue",
+    "tun",
+    "afpacket",
+    "afxdp",
+    "udp",
+    "tcp",
+#endif
+    "pcap",
+    "generator",
+};
+
+std::vector<std::shared_ptr<Module>> PacketBackend::create_modules() {
+    std::vector<std::shared_ptr<Module>> modules;
+    modules.emplace_back(std::make_shared<DefragmentModule>());
+    modules.emplace_back(std::make_shared<LagModule>());
+    modules.emplace_back(std::make_shared<JitterModule>());
+    modules.emplace_back(std::make_shared<DropModule>());
+    modules.emplace_back(std::make_shared<ThrottleModule>());
+    modules.emplace_back(std::make_shared<BandwidthModule>());
+    modules.emplace_back(std::make_shared<DuplicateModule>());
+    modules.emplace_back(std::make_shared<OodModule>());
+    modules.emplace_back(std::make_shared<TamperModule>());
+    modules.emplace_back(std::make_shared<ResetModule>());
+    modules.emplace_back(std::make_shared<FragmentModule>());
+
+    return modules;
+}
+
+std::unique_ptr<PacketBackend>
+PacketBackend::create(std::string_view name,
+                      std::vector<std::shared_ptr<Module>> modules) {
+#ifdef _WIN32
+    if (name == "windivert")
+        return std::make_unique<WinDivert>(std::move(modules));
+#endif
+#ifdef __linux__
+    if (name == "nfqueue")
+        return std::make_unique<NfQueue>(std::move(modules));
+    if (name == "tun")
+        return std::make_unique<TunBackend>(std::move(modules));
+    if (name == "afpacket")
+        return std::make_unique<AfPacket>(std::move(modules));
+    if (name == "afxdp")
+        return std::make_unique<AfXdp>(std::move(modules));
+    if (name == "udp")
+        return std::make_unique<UdpRelay>(std::move(modules));
+    if (name == "tcp")
+        return std::make_unique<TcpProxy>(std::move(modules));
+#endif
+    if (name == "pcap")
+        return std::make_unique<PcapReplay>(std::move(modules));
+    if (name == "generator")
+        return std::make_unique<TrafficGenerator>(std::move(modules));
+
+    LOG("Unknown backend '%.*s'", static_cast<int>(name.size()), name.data());
+    return nullptr;
+}
+
+std::span<const char* const> PacketBackend::names() { return BACKEND_NAMES; }
+
+void PacketBackend::enable_modules() {
+    for (auto& module : m_modules) {
+        if (module->m_enabled)
+            module->enable();
+
+        module->m_was_enabled = module->m_enabled;
+    }
+}
+
+void PacketBackend::disable_modules() {
+    for (auto& module : m_modules) {
+        if (module->m_enabled && module->m_was_enabled)
+            module->disable();
+    }
+}
+
+void PacketBackend::flush_modules(
+    const std::vector<std::shared_ptr<Module>>& modules) {
+    for (const auto& module : modules) {
+        if (module->m_was_enabled) {
+            module->disable();
+            module->m_was_enabled = false;
+        }
+    }
+}
+
+Module::Result PacketBackend::run_modules(
+    const std::vector<std::shared_ptr<Module>>& modules) {
+    // Packets captured since the last run, the rest already carry their
+    // headers
+    parse_packets(g_packets.begin(), g_packets.end());
+
+    Module::Result result;
+    for (const auto& module : modules) {
+        if (module->m_enabled) {
+            // Initialize it if it wasn't
+            if (!module->m_was_enabled) {
+                module->enable();
+                module->m_was_enabled = true;
+
+                result.dirty = true;
+            }
+
+            const auto module_result = module->process();
+            if (module_result.schedule_after && result.schedule_after) {
+                result.schedule_after = std::min(*result.schedule_after,
+                                                 *module_result.schedule_after);
+            } else if (module_result.schedule_after) {
+                result.schedule_after = module_result.schedule_after;
+            }
+
+            result.dirty |= module_result.dirty;
+        } else if (module->m_was_enabled) {
+            module->disable();
+            module->m_was_enabled = false;
+
+            result.dirty = true;
+        }
+    }
+
+    // Notify main thread to redraw
+    if (result.dirty) {
+        SDL_Event event{events::REDRAW};
+        SDL_PushEvent(&event);
+    }
+
+    return result;
+}
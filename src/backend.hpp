@@ -0,0 +1,71 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "module.hpp"
+
+// Source and sink of packets for the module chain. Backends capture packets
+// into `g_packets`, run the modules and send whatever is left back out.
+class PacketBackend {
+public:
+    explicit PacketBackend(std::vector<std::shared_ptr<Module>> modules)
+        : m_modules(std::move(modules)) {}
+
+    PacketBackend(const PacketBackend&) = delete;
+    PacketBackend(PacketBackend&&) = delete;
+    PacketBackend& operator=(const PacketBackend&) = delete;
+    PacketBackend& operator=(PacketBackend&&) = delete;
+
+    virtual ~PacketBackend() = default;
+
+    // `filter` is interpreted by the backend (WinDivert filter, NFQUEUE
+    // queue number, ...)
+    virtual std::optional<std::string> start(const std::string& filter) = 0;
+    virtual bool stop() = 0;
+
+    // Offline backends finish once their input is exhausted
+    [[nodiscard]] virtual bool finished() const { return false; }
+    // Human readable statistics of the last run
+    [[nodiscard]] virtual std::optional<std::string> summary() const {
+        return std::nullopt;
+    }
+
+    [[nodiscard]] const std::vector<std::shared_ptr<Module>>& modules() const {
+        return m_modules;
+    }
+
+    static std::vector<std::shared_ptr<Module>> create_modules();
+
+    // Returns `nullptr` for backends that are unknown or not available on
+    // this platform
+    static std::unique_ptr<PacketBackend>
+    create(std::string_view name, std::vector<std::shared_ptr<Module>> modules);
+
+    static std::span<const char* const> names();
+    static const char* default_name() { return names().front(); }
+
+protected:
+    // Initialize modules enabled before start
+    void enable_modules();
+    // Run post-disable module cleanups
+    void disable_modules();
+
+    // Parses the headers of new packets and runs the module chain over
+    // `g_packets`. Returns the earliest wakeup requested by modules and
+    // notifies the main thread if any of them changed state.
+    static Module::Result
+    run_modules(const std::vector<std::shared_ptr<Module>>& modules);
+
+    // Disables running modules from the backend thread before it exits, so
+    // packets they hold end up in `g_packets` and can still be sent
+    static void
+    flush_modules(const std::vector<std::shared_ptr<Module>>& modules);
+
+protected:
+    std::vector<std::shared_ptr<Module>> m_modules;
+};
@@ -1,10 +1,28 @@
 #include <algorithm>
+#include <array>
+#include <cstring>
 #include <imgui.h>
+#include <string_view>
 
 #include "bandwidth.hpp"
+#include "clock.hpp"
 #include "common.hpp"
 #include "packet.hpp"
 
+static constexpr std::array GROUPING_NAMES = {
+    "None",
+    "Flow",
+    "Host",
+    "Port",
+};
+
+static constexpr std::array GROUPING_KEYS = {
+    "none",
+    "flow",
+    "host",
+    "port",
+};
+
 bool BandwidthModule::draw() {
     bool dirty = false;
     ImGui::PushID(m_short_name);
@@ -38,16 +56,88 @@ bool BandwidthModule::draw() {
         dirty = true;
     }
 
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Burst", &m_burst)) {
+        m_burst = std::max(0, m_burst);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Overhead", &m_overhead)) {
+        m_overhead = std::max(0, m_overhead);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Shape", &m_shape);
+
+    if (m_shape) {
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputInt("Queue", &m_queue_size)) {
+            m_queue_size = std::clamp(m_queue_size, 0, MAX_PACKETS);
+            dirty = true;
+        }
+    }
+
+    ImGui::SameLine();
+
+    auto grouping = static_cast<int>(m_grouping);
+    ImGui::SetNextItemWidth(6.f * ImGui::GetFontSize());
+    if (ImGui::Combo("Per", &grouping, GROUPING_NAMES.data(),
+                     GROUPING_NAMES.size())) {
+        m_grouping = static_cast<Grouping>(grouping);
+        dirty = true;
+    }
+
+    if (m_grouping != Grouping::None) {
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputInt("Class limit", &m_class_limit)) {
+            m_class_limit = std::max(0, m_class_limit);
+            dirty = true;
+        }
+    }
+
     ImGui::EndGroup();
     ImGui::PopID();
 
     return dirty;
 }
 
-void BandwidthModule::enable() { LOG("Enabling"); }
+void BandwidthModule::enable() {
+    LOG("Enabling");
+
+    for (auto& direction : m_directions)
+        direction.bucket.reset();
+}
+
 void BandwidthModule::disable() {
+    LOG("Disabling, flushing %zu packets",
+        m_directions[0].queued + m_directions[1].queued);
+
+    for (auto& direction : m_directions) {
+        // Round robin order first, then the classes over their own limit
+        for (auto* cls : direction.active)
+            g_packets.splice(g_packets.cend(), cls->queue);
+        for (; !direction.waiting.empty(); direction.waiting.pop())
+            g_packets.splice(g_packets.cend(),
+                             direction.waiting.top().second->queue);
+
+        direction.active.clear();
+        direction.classes.clear();
+        direction.queued = 0;
+        direction.fattest = nullptr;
+    }
+
     m_indicator = 0.f;
-    m_rate_stats.reset();
 }
 
 void BandwidthModule::apply_config(const toml::table& config) {
@@ -57,44 +147,247 @@ void BandwidthModule::apply_config(const toml::table& config) {
     m_outbound = config["outbound"].value_or(true);
 
     m_limit = std::max(config["limit"].value_or(10), 0);
+    m_burst = std::max(config["burst"].value_or(16), 0);
+    m_shape = config["shape"].value_or(false);
+    m_queue_size =
+        std::clamp(config["queue_size"].value_or(1000), 0, MAX_PACKETS);
+    m_overhead = std::max(config["overhead"].value_or(0), 0);
+    m_class_limit = std::max(config["class_limit"].value_or(0), 0);
+
+    const std::string_view grouping = config["per"].value_or("none");
+    const auto it = std::find(GROUPING_KEYS.begin(), GROUPING_KEYS.end(),
+                              grouping);
+    if (it != GROUPING_KEYS.end()) {
+        m_grouping = static_cast<Grouping>(it - GROUPING_KEYS.begin());
+    } else {
+        LOG("Unknown grouping '%.*s'", static_cast<int>(grouping.size()),
+            grouping.data());
+    }
+}
+
+void BandwidthModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& bandwidth = static_cast<const BandwidthModule&>(other);
+    m_inbound = bandwidth.m_inbound;
+    m_outbound = bandwidth.m_outbound;
+    m_limit = bandwidth.m_limit;
+    m_burst = bandwidth.m_burst;
+    m_shape = bandwidth.m_shape;
+    m_queue_size = bandwidth.m_queue_size;
+    m_overhead = bandwidth.m_overhead;
+    m_grouping = bandwidth.m_grouping;
+    m_class_limit = bandwidth.m_class_limit;
+}
+
+void BandwidthModule::apply_stream_policy(bool outbound,
+                                          StreamPolicy& policy) const {
+    if (!check_direction(outbound, m_inbound, m_outbound))
+        return;
+
+    auto limit = static_cast<size_t>(m_limit) * 1024;
+    // A stream is a single flow, it's held to the class limit too
+    if (m_grouping != Grouping::None && m_class_limit > 0)
+        limit = std::min(limit, static_cast<size_t>(m_class_limit) * 1024);
+
+    policy.rate = std::min(policy.rate.value_or(limit), limit);
+}
+
+uint64_t BandwidthModule::class_key(const PacketNode& packet) const noexcept {
+    const auto& info = packet.info;
+    const bool outbound = packet.addr.Outbound;
+    switch (m_grouping) {
+    case Grouping::None:
+        break;
+    case Grouping::Flow:
+        return info.flow_hash;
+    case Grouping::Host: {
+        const auto& addr = outbound ? info.dst_addr : info.src_addr;
+        uint64_t high;
+        uint64_t low;
+        std::memcpy(&high, addr.data(), sizeof(high));
+        std::memcpy(&low, addr.data() + sizeof(high), sizeof(low));
+        // IPv4 lives in the low half, keep it collision free
+        return low ^ (high * 0x9e3779b97f4a7c15);
+    }
+    case Grouping::Port:
+        return outbound ? info.src_port : info.dst_port;
+    }
+
+    return 0;
+}
+
+std::optional<std::chrono::nanoseconds> BandwidthModule::release_queued(
+    Direction& direction, PacketClock::time_point now, double rate,
+    double class_rate, double burst) {
+    auto& active = direction.active;
+    auto& waiting = direction.waiting;
+
+    // Classes that made up for their debt take their turn again
+    while (!waiting.empty() && waiting.top().first <= now) {
+        active.push_back(waiting.top().second);
+        waiting.pop();
+    }
+
+    // A bucket that never fills still starts out even, without any rate
+    // nothing is sent
+    const auto overhead = static_cast<size_t>(m_overhead);
+    while (!active.empty() && rate > 0. && direction.bucket.conforms()) {
+        auto& cls = *active.front();
+        if (class_rate > 0.) {
+            cls.bucket.replenish(now, class_rate, burst);
+            if (!cls.bucket.conforms()) {
+                waiting.emplace(now + cls.bucket.time_to_conform(class_rate),
+                                &cls);
+                active.pop_front();
+                continue;
+            }
+        }
+
+        const auto size = cls.queue.front().packet.size() + overhead;
+        if (cls.deficit < size) {
+            cls.deficit += QUANTUM;
+            active.pop_front();
+            active.push_back(&cls);
+            continue;
+        }
+
+        cls.deficit -= size;
+        direction.bucket.consume(size);
+        if (class_rate > 0.)
+            cls.bucket.consume(size);
+        g_packets.splice(g_packets.cend(), cls.queue, cls.queue.cbegin());
+        --direction.queued;
+
+        if (cls.queue.empty()) {
+            cls.deficit = 0;
+            active.pop_front();
+            if (direction.fattest == &cls)
+                direction.fattest = nullptr;
+        }
+    }
+
+    // Without any rate the queue stays until it's disabled
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    if (!active.empty() && rate > 0.)
+        schedule_after = direction.bucket.time_to_conform(rate);
+
+    if (!waiting.empty()) {
+        const auto wait = std::chrono::nanoseconds(waiting.top().first - now);
+        schedule_after = std::min(schedule_after.value_or(wait), wait);
+    }
+
+    return schedule_after;
+}
+
+void BandwidthModule::expire_classes(Direction& direction,
+                                     PacketClock::time_point now) {
+    // Sweeping once per timeout keeps the cost per packet constant
+    if (now - direction.last_expiry < CLASS_TIMEOUT)
+        return;
+
+    direction.last_expiry = now;
+
+    // Classes with queued packets are referenced by the round robin
+    const auto expired =
+        std::erase_if(direction.classes, [&](const auto& entry) {
+            const auto& cls = entry.second;
+            return cls.queue.empty() &&
+                   now - cls.last_active >= CLASS_TIMEOUT;
+        });
+    if (expired > 0)
+        LOG("Expired %zu idle classes", expired);
 }
 
 BandwidthModule::Result BandwidthModule::process() {
-    const auto current_time_point = std::chrono::steady_clock::now();
+    const auto current_time_point = PacketClock::now();
 
     // allow 0 limit which should drop all
-    if (m_limit < 0)
-        return {};
-
-    const auto limit = m_limit * 1024;
+    const auto rate = static_cast<double>(m_limit) * 1024.;
+    const auto burst = static_cast<double>(m_burst) * 1024.;
+    const auto class_rate = m_grouping == Grouping::None
+                                ? 0.
+                                : static_cast<double>(m_class_limit) * 1024.;
+    for (auto& direction : m_directions)
+        direction.bucket.replenish(current_time_point, rate, burst);
 
+    const auto overhead = static_cast<size_t>(m_overhead);
     const auto total_packets = g_packets.size();
     size_t dropped = 0;
+    for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
+        const auto it_copy = it++;
+        const auto& packet = *it_copy;
+        if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound))
+            continue;
+
+        auto& direction = m_directions[packet.addr.Outbound];
+        auto& cls = direction.classes[class_key(packet)];
+        cls.last_active = current_time_point;
+
+        // Queued packets go out in order, behind the ones already waiting
+        if (m_shape) {
+            const auto queue_size = static_cast<size_t>(m_queue_size);
 
-    m_rate_stats.set_max_tokens(limit);
-    m_rate_stats.replenish(current_time_point, limit);
-    for (auto it = g_packets.begin(); it != g_packets.end();) {
-        const auto packet = *it;
-        if (check_direction(packet.addr.Outbound, m_inbound, m_outbound)) {
-            const auto size = packet.packet.size();
-            if (!m_rate_stats.update(current_time_point, size)) {
-                LOG("Dropped with bandwidth %dKiB/s, direction %s",
-                    (int)m_limit,
-                    packet.addr.Outbound ? "OUTBOUND" : "INBOUND");
-                it = g_packets.erase(it);
-                dropped++;
-            } else {
-                ++it;
+            // A full queue makes room by dropping from the class holding the
+            // most packets, so a bulk flow can't crowd out the others
+            auto* fattest = direction.fattest;
+            if (direction.queued >= queue_size && fattest != nullptr &&
+                fattest->queue.size() > cls.queue.size() + 1) {
+                fattest->queue.erase(std::prev(fattest->queue.cend()));
+                --direction.queued;
+                ++dropped;
+            }
+
+            if (direction.queued < queue_size) {
+                if (cls.queue.empty())
+                    direction.active.push_back(&cls);
+
+                cls.queue.splice(cls.queue.cend(), g_packets, it_copy);
+                ++direction.queued;
+
+                if (fattest == nullptr ||
+                    cls.queue.size() > fattest->queue.size())
+                    direction.fattest = &cls;
+                continue;
+            }
+        } else {
+            if (class_rate > 0.)
+                cls.bucket.replenish(current_time_point, class_rate, burst);
+
+            if (rate > 0. && direction.bucket.conforms() &&
+                (class_rate <= 0. || cls.bucket.conforms())) {
+                const auto size = packet.packet.size() + overhead;
+                direction.bucket.consume(size);
+                if (class_rate > 0.)
+                    cls.bucket.consume(size);
+                continue;
             }
         }
+
+        LOG("Dropped with bandwidth %dKiB/s, direction %s", m_limit,
+            packet.addr.Outbound ? "OUTBOUND" : "INBOUND");
+        g_packets.erase(it_copy);
+        ++dropped;
     }
 
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    for (auto& direction : m_directions) {
+        if (const auto wait = release_queued(direction, current_time_point,
+                                             rate, class_rate, burst))
+            schedule_after = std::min(schedule_after.value_or(*wait), *wait);
+
+        expire_classes(direction, current_time_point);
+    }
+
+    auto dirty = false;
     const auto indicator =
-        static_cast<float>(dropped) / static_cast<float>(total_packets);
+        total_packets == 0
+            ? 0.f
+            : static_cast<float>(dropped) / static_cast<float>(total_packets);
     if (!almost_equal(indicator, m_indicator)) {
         m_indicator = indicator;
-        return {.dirty = true};
+        dirty = true;
     }
 
-    return {};
-}
\ No newline at end of file
+    return {.schedule_after = schedule_after, .dirty = dirty};
+}
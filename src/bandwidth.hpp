@@ -1,58 +1,96 @@
 #pragma once
 
-#include <cassert>
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cstdint>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <vector>
 
+#include "clock.hpp"
 #include "lua_util.hpp"
 #include "module.hpp"
-
-using namespace std::chrono_literals;
+#include "packet.hpp"
 
 namespace detail {
 
-class RateStats {
+// Byte-accurate token bucket. Tokens are kept fractional and time is accounted
+// on every refill, so the rate doesn't drift however often it's called. A
+// packet may be sent whenever the bucket isn't in debt and is charged in full,
+// which paces packets by their serialization delay and keeps the long-term
+// rate exact even with a burst smaller than a packet.
+class TokenBucket {
 public:
-    RateStats() = delete;
-    RateStats(size_t max_tokens) : m_max_tokens(max_tokens) {}
-
-    void set_max_tokens(size_t max_tokens) noexcept {
-        m_max_tokens = max_tokens;
+    void reset() noexcept {
+        m_tokens = 0.;
+        m_last_ts = {};
     }
 
-    void reset() noexcept { m_tokens = m_max_tokens; }
-
-    void replenish(std::chrono::steady_clock::time_point now_ts,
-                   size_t replenish_rate) noexcept {
+    // Rate in bytes per second, burst in bytes
+    void replenish(PacketClock::time_point now_ts, double rate,
+                   double burst) noexcept {
         const auto elapsed_seconds =
             std::chrono::duration<double>(now_ts - m_last_ts).count();
+        m_last_ts = now_ts;
 
-        // Replenish tokens based on elapsed time
-        m_tokens += static_cast<size_t>(elapsed_seconds *
-                                        static_cast<float>(replenish_rate));
-        if (m_tokens > m_max_tokens)
-            m_tokens = m_max_tokens;
+        m_tokens =
+            std::min(m_tokens + std::max(elapsed_seconds, 0.) * rate, burst);
     }
 
-    bool update(std::chrono::steady_clock::time_point now_ts,
-                size_t size) noexcept {
-        if (m_tokens >= size) {
-            m_tokens -= size;
-            m_last_ts = now_ts;
-            return true;
-        }
+    [[nodiscard]] bool conforms() const noexcept { return m_tokens >= 0.; }
 
-        return false;
+    void consume(size_t size) noexcept {
+        m_tokens -= static_cast<double>(size);
+    }
+
+    // Time until the debt is paid off at `rate`
+    [[nodiscard]] std::chrono::nanoseconds
+    time_to_conform(double rate) const noexcept {
+        if (conforms())
+            return std::chrono::nanoseconds::zero();
+
+        return std::chrono::ceil<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(-m_tokens / rate));
     }
 
 private:
-    size_t m_max_tokens;
-    size_t m_tokens = 0;
-    std::chrono::steady_clock::time_point m_last_ts;
+    double m_tokens = 0.;
+    // Starts at the epoch, so the first refill fills the bucket
+    PacketClock::time_point m_last_ts;
 };
 
 } // namespace detail
 
+// Limits the rate per direction. Packets over the limit are dropped, or with
+// shaping enabled queued until the bucket lets them go.
+//
+// Packets can be grouped into classes (flows, hosts or ports) below the
+// direction's limit, each with an optional limit of its own. Queued classes
+// share the direction's rate through deficit round robin, so one bulk flow
+// can't starve the others.
 class BandwidthModule : public Module {
+private:
+    // Upper bound for the queue size of each direction
+    static inline int MAX_PACKETS = 1 << 20;
+    // Bytes a class may send per round
+    static inline size_t QUANTUM = 1514;
+    // Classes without packets for this long are forgotten
+    static constexpr inline auto CLASS_TIMEOUT = std::chrono::seconds(30);
+
+public:
+    enum class Grouping : int {
+        // One class for all packets of a direction
+        None,
+        // 5-tuple
+        Flow,
+        // Address of the remote side
+        Host,
+        // Local port
+        Port,
+    };
+
 public:
     BandwidthModule() {
         m_display_name = "Bandwidth";
@@ -65,12 +103,22 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
+    void apply_stream_policy(bool outbound,
+                             StreamPolicy& policy) const override;
+
     static void lua_setup(lua_State* L) {
         luaL_Reg methods[] = {
             {"limit", lua_method_limit},
+            {"burst", lua_method_burst},
+            {"shape", lua_method_shape},
+            {"queue_size", lua_method_queue_size},
+            {"overhead", lua_method_overhead},
+            {"grouping", lua_method_grouping},
+            {"class_limit", lua_method_class_limit},
             {},
         };
 
@@ -91,15 +139,139 @@ public:
 private:
     static int lua_method_limit(lua_State* L) {
         auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
-        const auto rets = lua_getset(L, module->m_limit, 2);
+
+        int limit = module->m_limit;
+        const auto rets = lua_getset(L, limit, 2);
+        if (rets == 0)
+            module->m_limit = std::max(limit, 0);
+
+        return rets;
+    };
+
+    static int lua_method_burst(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+
+        int burst = module->m_burst;
+        const auto rets = lua_getset(L, burst, 2);
+        if (rets == 0)
+            module->m_burst = std::max(burst, 0);
 
         return rets;
     };
 
+    static int lua_method_shape(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_shape, 2);
+
+        return rets;
+    };
+
+    static int lua_method_queue_size(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+
+        int queue_size = module->m_queue_size;
+        const auto rets = lua_getset(L, queue_size, 2);
+        if (rets == 0)
+            module->m_queue_size = std::clamp(queue_size, 0, MAX_PACKETS);
+
+        return rets;
+    };
+
+    static int lua_method_overhead(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+
+        int overhead = module->m_overhead;
+        const auto rets = lua_getset(L, overhead, 2);
+        if (rets == 0)
+            module->m_overhead = std::max(overhead, 0);
+
+        return rets;
+    };
+
+    static int lua_method_grouping(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+
+        int grouping = static_cast<int>(module->m_grouping);
+        const auto rets = lua_getset(L, grouping, 2);
+        if (rets == 0) {
+            module->m_grouping = static_cast<Grouping>(
+                std::clamp(grouping, 0, static_cast<int>(Grouping::Port)));
+        }
+
+        return rets;
+    };
+
+    static int lua_method_class_limit(lua_State* L) {
+        auto* module = *std::bit_cast<BandwidthModule**>(lua_touserdata(L, 1));
+
+        int class_limit = module->m_class_limit;
+        const auto rets = lua_getset(L, class_limit, 2);
+        if (rets == 0)
+            module->m_class_limit = std::max(class_limit, 0);
+
+        return rets;
+    };
+
+private:
+    struct Class {
+        // Only used with a class limit
+        detail::TokenBucket bucket;
+        PacketList queue;
+        // Bytes the class may still send this round
+        size_t deficit = 0;
+        PacketClock::time_point last_active;
+    };
+
+    // Class over its own limit and when it may send again
+    using WaitingClass = std::pair<PacketClock::time_point, Class*>;
+
+    struct Direction {
+        detail::TokenBucket bucket;
+        // Nodes of the map don't move, the queues below point into it. Not
+        // kept in `g_flows`: a class owns its queued packets and mustn't be
+        // evicted while it has any, and hosts and ports aren't flows.
+        std::unordered_map<uint64_t, Class> classes;
+        // Classes with queued packets in round robin order
+        std::deque<Class*> active;
+        // Classes with queued packets over their own limit, earliest on top
+        std::priority_queue<WaitingClass, std::vector<WaitingClass>,
+                            std::greater<WaitingClass>>
+            waiting;
+        size_t queued = 0;
+        // Class that held the most packets when it last grew, a full queue
+        // drops from it
+        Class* fattest = nullptr;
+        PacketClock::time_point last_expiry;
+    };
+
+    uint64_t class_key(const PacketNode& packet) const noexcept;
+
+    // Sends queued packets of a direction the buckets allow, returns when to
+    // try again
+    std::optional<std::chrono::nanoseconds>
+    release_queued(Direction& direction, PacketClock::time_point now,
+                   double rate, double class_rate, double burst);
+
+    // Forgets classes that have been idle for a while
+    void expire_classes(Direction& direction, PacketClock::time_point now);
+
 private:
     bool m_inbound = true;
     bool m_outbound = true;
+    // KiB per second
     int m_limit = 10;
+    // KiB that may be sent at once after being idle
+    int m_burst = 16;
+    // Queue packets instead of dropping them
+    bool m_shape = false;
+    // Packets queued at most per direction, the rest is dropped
+    int m_queue_size = 1000;
+    // Bytes added to every packet, e.g. 38 for Ethernet framing
+    int m_overhead = 0;
+    Grouping m_grouping = Grouping::None;
+    // KiB per second for each class, 0 for no limit of their own
+    int m_class_limit = 0;
 
-    detail::RateStats m_rate_stats{0};
+    // Indexed by `Outbound`
+    std::array<Direction, 2> m_directions;
 };
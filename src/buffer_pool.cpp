@@ -0,0 +1,189 @@
+#include <new>
+#include <optional>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "buffer_pool.hpp"
+#include "common.hpp"
+
+static constexpr size_t PAGE_SIZE = 4096;
+
+static size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+namespace {
+
+// The leased buffer is handed back when its control block is deallocated,
+// that's the very last thing `std::shared_ptr` does with it
+struct LeaseDeleter {
+    void operator()(char* /*buffer*/) const noexcept {}
+};
+
+} // namespace
+
+template <typename T> struct BufferPool::LeaseAllocator {
+    using value_type = T;
+
+    std::shared_ptr<BufferPool> pool;
+    uint32_t index;
+
+    LeaseAllocator(std::shared_ptr<BufferPool> pool, uint32_t index)
+        : pool(std::move(pool)), index(index) {}
+
+    template <typename U>
+    LeaseAllocator(const LeaseAllocator<U>& other)
+        : pool(other.pool), index(other.index) {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(
+            pool->allocate_control_block(index, count * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t count) noexcept {
+        pool->release(index, ptr, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const LeaseAllocator<U>& other) const noexcept {
+        return pool == other.pool && index == other.index;
+    }
+};
+
+BufferPool::BufferPool(const Options& options)
+    : m_buffer_size(round_up(options.buffer_size, PAGE_SIZE)),
+      m_buffer_count(options.buffer_count) {
+    const auto size = m_buffer_size * m_buffer_count;
+
+#ifdef _WIN32
+    if (options.huge_pages) {
+        // Needs SeLockMemoryPrivilege
+        if (const auto large_page_size = GetLargePageMinimum();
+            large_page_size != 0) {
+            m_memory_size = round_up(size, large_page_size);
+            m_memory = static_cast<char*>(VirtualAlloc(
+                nullptr, m_memory_size,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE));
+            m_huge_pages = m_memory != nullptr;
+        }
+    }
+
+    if (m_memory == nullptr) {
+        m_memory_size = size;
+        m_memory = static_cast<char*>(VirtualAlloc(
+            nullptr, m_memory_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+    }
+#else
+    if (options.huge_pages) {
+#ifdef MAP_HUGETLB
+        // Only succeeds if huge pages were reserved (vm.nr_hugepages)
+        constexpr size_t huge_page_size = 2 << 20;
+        m_memory_size = round_up(size, huge_page_size);
+        auto* const memory =
+            mmap(nullptr, m_memory_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            m_memory = static_cast<char*>(memory);
+            m_huge_pages = true;
+        }
+#endif
+    }
+
+    if (m_memory == nullptr) {
+        m_memory_size = size;
+        auto* const memory = mmap(nullptr, m_memory_size,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED)
+            m_memory = static_cast<char*>(memory);
+
+#ifdef MADV_HUGEPAGE
+        // Transparent huge pages are the next best thing
+        if (m_memory != nullptr && options.huge_pages)
+            madvise(m_memory, m_memory_size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+
+    if (m_memory == nullptr) {
+        LOG("Failed to allocate %zu bytes, buffers come from the heap", size);
+        m_buffer_count = 0;
+        m_memory_size = 0;
+        return;
+    }
+
+    if (options.prefault) {
+        for (size_t offset = 0; offset < m_memory_size; offset += PAGE_SIZE)
+            m_memory[offset] = 0;
+    }
+
+    m_control_blocks = std::make_unique<ControlBlock[]>(m_buffer_count);
+
+    // Lowest addresses are leased first
+    m_free.reserve(m_buffer_count);
+    for (auto i = m_buffer_count; i-- > 0;)
+        m_free.push_back(static_cast<uint32_t>(i));
+
+    LOG("%zu buffers of %zu bytes, huge pages: %d", m_buffer_count,
+        m_buffer_size, m_huge_pages);
+}
+
+BufferPool::~BufferPool() {
+    if (m_memory == nullptr)
+        return;
+
+#ifdef _WIN32
+    VirtualFree(m_memory, 0, MEM_RELEASE);
+#else
+    munmap(m_memory, m_memory_size);
+#endif
+}
+
+std::shared_ptr<BufferPool> BufferPool::create(const Options& options) {
+    return std::shared_ptr<BufferPool>(new BufferPool(options));
+}
+
+std::shared_ptr<char> BufferPool::lease() {
+    std::optional<uint32_t> index;
+    {
+        const std::lock_guard lock(m_mutex);
+        if (!m_free.empty()) {
+            index = m_free.back();
+            m_free.pop_back();
+        } else if (!m_exhausted) {
+            LOG("All %zu buffers are leased, falling back to the heap",
+                m_buffer_count);
+            m_exhausted = true;
+        }
+    }
+
+    if (!index) {
+        auto buffer = std::make_shared<std::vector<char>>(m_buffer_size);
+        return {buffer, buffer->data()};
+    }
+
+    return {m_memory + *index * m_buffer_size, LeaseDeleter{},
+            LeaseAllocator<char>(shared_from_this(), *index)};
+}
+
+void* BufferPool::allocate_control_block(uint32_t index, size_t size) {
+    if (size > sizeof(ControlBlock))
+        return ::operator new(size);
+
+    return &m_control_blocks[index];
+}
+
+void BufferPool::release(uint32_t index, void* control_block,
+                         size_t size) noexcept {
+    if (size > sizeof(ControlBlock))
+        ::operator delete(control_block);
+
+    const std::lock_guard lock(m_mutex);
+    m_free.push_back(index);
+    m_exhausted = false;
+}
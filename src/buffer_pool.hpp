@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Fixed number of equally sized packet buffers allocated once when a backend
+// starts. Leased buffers go back to the free list when the last slice
+// referencing them is gone, the `std::shared_ptr` control blocks live in the
+// pool too, so leasing doesn't touch the allocator.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+    struct Options {
+        size_t buffer_size;
+        size_t buffer_count;
+        // Touch every page up front, so the first burst doesn't fault
+        bool prefault = true;
+        // Back the pool with huge (large) pages if the system has them to
+        // spare, regular pages are used otherwise
+        bool huge_pages = false;
+    };
+
+public:
+    BufferPool(const BufferPool&) = delete;
+    BufferPool(BufferPool&&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    BufferPool& operator=(BufferPool&&) = delete;
+
+    ~BufferPool();
+
+    static std::shared_ptr<BufferPool> create(const Options& options);
+
+    // Returns a buffer of `buffer_size()` bytes, falls back to the heap when
+    // all of them are leased
+    [[nodiscard]] std::shared_ptr<char> lease();
+
+    [[nodiscard]] size_t buffer_size() const noexcept { return m_buffer_size; }
+    [[nodiscard]] bool huge_pages() const noexcept { return m_huge_pages; }
+
+private:
+    template <typename T> struct LeaseAllocator;
+
+    // Big enough for the control block of a leased `std::shared_ptr`
+    struct alignas(std::max_align_t) ControlBlock {
+        std::byte storage[128];
+    };
+
+    explicit BufferPool(const Options& options);
+
+    void* allocate_control_block(uint32_t index, size_t size);
+    void release(uint32_t index, void* control_block, size_t size) noexcept;
+
+private:
+    size_t m_buffer_size;
+    size_t m_buffer_count;
+
+    char* m_memory = nullptr;
+    size_t m_memory_size = 0;
+    bool m_huge_pages = false;
+
+    std::unique_ptr<ControlBlock[]> m_control_blocks;
+
+    std::mutex m_mutex;
+    std::vector<uint32_t> m_free;
+    bool m_exhausted = false;
+};
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHECKSUM_X86_64
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#include "checksum.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+static constexpr uint8_t PROTO_ICMP = 1;
+static constexpr uint8_t PROTO_TCP = 6;
+static constexpr uint8_t PROTO_UDP = 17;
+static constexpr uint8_t PROTO_ICMPV6 = 58;
+
+static uint16_t swap16(uint16_t value) {
+    return static_cast<uint16_t>(value << 8 | value >> 8);
+}
+
+// Adds the end-around carries back in, what's left is the 16-bit sum
+static uint16_t reduce(uint64_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return static_cast<uint16_t>(sum);
+}
+
+static uint16_t fold(uint64_t sum) {
+    return static_cast<uint16_t>(~reduce(sum));
+}
+
+// Big endian words one at a time, what the other kernels are checked against
+static uint16_t sum_reference(const uint8_t* data, size_t size) {
+    uint64_t sum = 0;
+    for (; size >= 2; data += 2, size -= 2)
+        sum += load_be16(data);
+
+    // Odd trailing byte is padded with zero
+    if (size != 0)
+        sum += static_cast<uint64_t>(data[0]) << 8;
+
+    return reduce(sum);
+}
+
+// The sum doesn't depend on the byte order (RFC 1071), the kernels add native
+// words and swap the folded result once
+static uint16_t finish_native(uint64_t sum) {
+    const auto folded = reduce(sum);
+    if constexpr (std::endian::native == std::endian::little)
+        return swap16(folded);
+    else
+        return folded;
+}
+
+// Native 32-bit words, the last one padded with zeros
+static uint64_t add_native(const uint8_t* data, size_t size, uint64_t sum) {
+    for (; size >= 4; data += 4, size -= 4) {
+        uint32_t word;
+        std::memcpy(&word, data, sizeof(word));
+        sum += word;
+    }
+
+    if (size != 0) {
+        uint32_t word = 0;
+        std::memcpy(&word, data, size);
+        sum += word;
+    }
+
+    return sum;
+}
+
+static uint16_t sum_scalar(const uint8_t* data, size_t size) {
+    return finish_native(add_native(data, size, 0));
+}
+
+#ifdef CHECKSUM_X86_64
+
+// 32-bit words are widened into 64-bit lanes, which can't overflow
+static uint16_t sum_sse2(const uint8_t* data, size_t size) {
+    const auto zero = _mm_setzero_si128();
+    auto low = zero;
+    auto high = zero;
+    for (; size >= 32; data += 32, size -= 32) {
+        const auto a = _mm_loadu_si128(std::bit_cast<const __m128i*>(data));
+        const auto b =
+            _mm_loadu_si128(std::bit_cast<const __m128i*>(data + 16));
+        low = _mm_add_epi64(low, _mm_unpacklo_epi32(a, zero));
+        high = _mm_add_epi64(high, _mm_unpackhi_epi32(a, zero));
+        low = _mm_add_epi64(low, _mm_unpacklo_epi32(b, zero));
+        high = _mm_add_epi64(high, _mm_unpackhi_epi32(b, zero));
+    }
+
+    std::array<uint64_t, 2> lanes;
+    _mm_storeu_si128(std::bit_cast<__m128i*>(lanes.data()),
+                     _mm_add_epi64(low, high));
+
+    return finish_native(add_native(data, size, lanes[0] + lanes[1]));
+}
+
+TARGET_AVX2 static uint16_t sum_avx2(const uint8_t* data, size_t size) {
+    const auto zero = _mm256_setzero_si256();
+    auto low = zero;
+    auto high = zero;
+    for (; size >= 64; data += 64, size -= 64) {
+        const auto a =
+            _mm256_loadu_si256(std::bit_cast<const __m256i*>(data));
+        const auto b =
+            _mm256_loadu_si256(std::bit_cast<const __m256i*>(data + 32));
+        low = _mm256_add_epi64(low, _mm256_unpacklo_epi32(a, zero));
+        high = _mm256_add_epi64(high, _mm256_unpackhi_epi32(a, zero));
+        low = _mm256_add_epi64(low, _mm256_unpacklo_epi32(b, zero));
+        high = _mm256_add_epi64(high, _mm256_unpackhi_epi32(b, zero));
+    }
+
+    const auto sum = _mm256_add_epi64(low, high);
+    std::array<uint64_t, 2> lanes;
+    _mm_storeu_si128(std::bit_cast<__m128i*>(lanes.data()),
+                     _mm_add_epi64(_mm256_castsi256_si128(sum),
+                                   _mm256_extracti128_si256(sum, 1)));
+
+    return finish_native(add_native(data, size, lanes[0] + lanes[1]));
+}
+
+// The CPU has to support AVX2 and the OS has to save the YMM registers
+static bool cpu_has_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    std::array<int, 4> regs;
+    __cpuid(regs.data(), 0);
+    if (regs[0] < 7)
+        return false;
+
+    __cpuid(regs.data(), 1);
+    if ((regs[2] & (1 << 27)) == 0 || (_xgetbv(0) & 0b110) != 0b110)
+        return false;
+
+    __cpuidex(regs.data(), 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_OSXSAVE) == 0)
+        return false;
+
+    unsigned xcr0_low, xcr0_high;
+    __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0_low & 0b110) != 0b110)
+        return false;
+
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0 &&
+           (ebx & bit_AVX2) != 0;
+#endif
+}
+
+#endif
+
+std::span<const detail::ChecksumKernel> detail::checksum_kernels() {
+    static const auto kernels = [] {
+        std::vector<ChecksumKernel> kernels = {
+            {"reference", sum_reference},
+            {"scalar", sum_scalar},
+        };
+
+#ifdef CHECKSUM_X86_64
+        // Part of x86-64 itself
+        kernels.push_back({"sse2", sum_sse2});
+        if (cpu_has_avx2())
+            kernels.push_back({"avx2", sum_avx2});
+#endif
+
+        return kernels;
+    }();
+
+    return kernels;
+}
+
+uint16_t checksum_sum(const char* data, size_t size) {
+    static const auto kernel = detail::checksum_kernels().back().sum;
+
+    const auto* const bytes = std::bit_cast<const uint8_t*>(data);
+    const auto sum = kernel(bytes, size);
+    assert(sum == sum_reference(bytes, size));
+
+    return sum;
+}
+
+// Offset of the checksum in the transport header, 0 if there's none to take
+// care of
+static size_t transport_checksum_offset(const PacketInfo& info) {
+    // Only the first fragment has a transport header, its checksum covers
+    // the whole reassembled packet
+    if (info.fragment || info.payload_offset == info.l4_offset)
+        return 0;
+
+    switch (info.protocol) {
+    case PROTO_TCP:
+        return 16;
+    case PROTO_UDP:
+        return 6;
+    case PROTO_ICMP:
+    case PROTO_ICMPV6:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Sum of `size` bytes `offset` bytes into the packet. Bytes at odd offsets
+// are the low halves of the packet's words.
+static uint16_t sum_at(const uint8_t* data, size_t size, size_t offset) {
+    // Small edits aren't worth a kernel call
+    const auto sum =
+        size < 64 ? sum_reference(data, size)
+                  : checksum_sum(std::bit_cast<const char*>(data), size);
+    return offset % 2 != 0 ? swap16(sum) : sum;
+}
+
+// HC' = ~(~HC + ~m + m') of RFC 1624, for the bytes at `offset` changing from
+// `old_bytes` to `new_bytes`
+static uint16_t adjust(uint16_t checksum, const uint8_t* new_bytes,
+                       const uint8_t* old_bytes, size_t size, size_t offset) {
+    return fold(static_cast<uint16_t>(~checksum) +
+                static_cast<uint16_t>(~sum_at(old_bytes, size, offset)) +
+                sum_at(new_bytes, size, offset));
+}
+
+void calculate_ipv4_checksum(char* data, size_t header_size) {
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    store_be16(bytes + 10, 0);
+    store_be16(bytes + 10,
+               static_cast<uint16_t>(~checksum_sum(data, header_size)));
+}
+
+void calculate_checksums(char* data, const PacketInfo& info) {
+    if (info.ip_version == 0)
+        return;
+
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    if (info.ip_version == 4)
+        calculate_ipv4_checksum(data, info.l4_offset);
+
+    const auto checksum_offset = transport_checksum_offset(info);
+    if (checksum_offset == 0)
+        return;
+
+    auto* const l4 = bytes + info.l4_offset;
+    const size_t l4_size = info.length - info.l4_offset;
+
+    // ICMP is the only one without a pseudo header
+    uint64_t sum = 0;
+    if (info.protocol != PROTO_ICMP) {
+        const auto address_offset = info.ip_version == 4 ? 12 : 0;
+        const auto address_size = info.ip_version == 4 ? 4 : 16;
+        sum += sum_reference(info.src_addr.data() + address_offset,
+                             address_size);
+        sum += sum_reference(info.dst_addr.data() + address_offset,
+                             address_size);
+        sum += info.protocol + (l4_size >> 16) + (l4_size & 0xffff);
+    }
+
+    store_be16(l4 + checksum_offset, 0);
+    auto checksum =
+        fold(sum + checksum_sum(std::bit_cast<const char*>(l4), l4_size));
+
+    // Zero means no checksum for UDP
+    if (info.protocol == PROTO_UDP && checksum == 0)
+        checksum = 0xffff;
+
+    store_be16(l4 + checksum_offset, checksum);
+}
+
+void update_checksums(char* data, const PacketInfo& info, size_t offset,
+                      const char* old_bytes, size_t size) {
+    if (info.ip_version == 0 || size == 0)
+        return;
+
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    const auto* old = std::bit_cast<const uint8_t*>(old_bytes);
+    auto end = offset + size;
+    assert(end <= info.length);
+
+    if (offset < info.l4_offset) {
+        assert(end <= info.l4_offset);
+        if (info.ip_version == 4) {
+            store_be16(bytes + 10, adjust(load_be16(bytes + 10),
+                                          bytes + offset, old, size, offset));
+        }
+
+        // Of the IP header only the addresses are part of the pseudo header
+        const size_t addresses_begin = info.ip_version == 4 ? 12 : 8;
+        const size_t addresses_end = info.ip_version == 4 ? 20 : 40;
+        const auto begin = std::max(offset, addresses_begin);
+        end = std::min(end, addresses_end);
+        if (begin >= end || info.protocol == PROTO_ICMP)
+            return;
+
+        old += begin - offset;
+        offset = begin;
+        size = end - begin;
+    }
+
+    const auto checksum_offset = transport_checksum_offset(info);
+    if (checksum_offset == 0)
+        return;
+
+    auto* const field = bytes + info.l4_offset + checksum_offset;
+    const auto checksum = load_be16(field);
+
+    // Zero means no checksum for UDP, there's nothing to keep valid
+    if (info.protocol == PROTO_UDP && checksum == 0)
+        return;
+
+    auto updated = adjust(checksum, bytes + offset, old, size, offset);
+    if (info.protocol == PROTO_UDP && updated == 0)
+        updated = 0xffff;
+
+    store_be16(field, updated);
+}
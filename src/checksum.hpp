@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+#include "packet.hpp"
+
+// Recomputes the IPv4 header and transport (TCP, UDP, ICMP, ICMPv6)
+// checksums of a parsed packet after it was modified
+void calculate_checksums(char* data, const PacketInfo& info);
+
+// Recomputes only the IPv4 header checksum of the `header_size` bytes long
+// header at `data`, for packets whose transport checksum covers more than
+// the packet itself (i.e. fragments)
+void calculate_ipv4_checksum(char* data, size_t header_size);
+
+// Updates the checksums of a parsed packet after the `size` bytes at
+// `offset` changed from `old_bytes` (RFC 1624), without touching the rest of
+// the packet. The bytes lie within the IP header or the transport segment and
+// outside the checksum fields, checksums that weren't valid before stay
+// invalid.
+void update_checksums(char* data, const PacketInfo& info, size_t offset,
+                      const char* old_bytes, size_t size);
+
+// One's complement sum of the big endian 16-bit words of `data`, an odd
+// trailing byte is padded with zero. Folded to 16 bits, not complemented.
+uint16_t checksum_sum(const char* data, size_t size);
+
+namespace detail {
+
+struct ChecksumKernel {
+    const char* name;
+    uint16_t (*sum)(const uint8_t* data, size_t size);
+};
+
+// Implementations of `checksum_sum` the CPU can run, the scalar reference
+// first and the one in use last
+std::span<const ChecksumKernel> checksum_kernels();
+
+} // namespace detail
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+// Time source for modules. Live backends run on the steady clock, offline
+// backends drive it from the timestamps of the packets they replay.
+class PacketClock {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    [[nodiscard]] static time_point now() noexcept {
+        if (s_virtual_now)
+            return *s_virtual_now;
+
+        return std::chrono::steady_clock::now();
+    }
+
+    // Overrides the clock for the calling thread, `std::nullopt` restores the
+    // steady clock
+    static void set_virtual(std::optional<time_point> now) noexcept {
+        s_virtual_now = now;
+    }
+
+private:
+    static inline thread_local std::optional<time_point> s_virtual_now;
+};
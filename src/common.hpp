@@ -1,20 +1,29 @@
 #pragma once
 
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <limits>
 #include <lua.hpp>
+
+#ifdef _WIN32
 #include <windivert.h>
+#endif
 
 #ifndef NDEBUG
-#define LOG(fmt, ...) fprintf(stderr, __FUNCTION__ ": " fmt "\n", ##__VA_ARGS__)
+#define LOG(fmt, ...)                                                          \
+    fprintf(stderr, "%s: " fmt "\n", __FUNCTION__, ##__VA_ARGS__)
 #else
 #define LOG(fmt, ...)
 #endif
 
-inline bool check_chance(float chance) {
-    return static_cast<float>(rand()) / RAND_MAX * 100.f < chance;
+// Uniform roll in percent
+inline float roll_percent() {
+    return static_cast<float>(rand()) / RAND_MAX * 100.f;
 }
 
+inline bool check_chance(float chance) { return roll_percent() < chance; }
+
 // inline helper for inbound outbound check
 inline bool check_direction(bool outbound_packet, bool handle_inbound,
                             bool handle_outbound) {
@@ -28,7 +37,9 @@ almost_equal(float a, float b,
     return std::abs(a - b) < epsilon;
 }
 
+#ifdef _WIN32
 // elevate
 BOOL IsElevated();
 BOOL IsRunAsAdmin();
 BOOL tryElevate(HWND hWnd, BOOL silent);
+#endif
@@ -0,0 +1,339 @@
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <imgui.h>
+#include <memory>
+#include <vector>
+
+#include "checksum.hpp"
+#include "common.hpp"
+#include "defragment.hpp"
+
+size_t DefragmentModule::KeyHash::operator()(const Key& key) const noexcept {
+    // FNV-1a over the fields, leaving out the padding
+    uint64_t hash = 0xcbf29ce484222325;
+    const auto add = [&](const auto& value) {
+        const auto bytes = std::bit_cast<std::array<uint8_t, sizeof(value)>>(
+            value);
+        for (const auto byte : bytes)
+            hash = (hash ^ byte) * 0x100000001b3;
+    };
+    add(key.src_addr);
+    add(key.dst_addr);
+    add(key.id);
+    add(key.ip_version);
+    add(key.protocol);
+
+    return static_cast<size_t>(hash);
+}
+
+bool DefragmentModule::draw() {
+    bool dirty = false;
+
+    ImGui::PushID(m_short_name);
+    ImGui::BeginGroup();
+
+    ImGui::PushStyleColor(ImGuiCol_Text, {m_indicator, 0.f, 0.f, 1.f});
+    ImGui::Bullet();
+    ImGui::PopStyleColor();
+
+    if (m_indicator > 0.f) {
+        m_indicator -= ImGui::GetIO().DeltaTime * 10.f;
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::Text("%s", m_display_name);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Enable", &m_enabled);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Inbound", &m_inbound);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Outbound", &m_outbound);
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Memory(KiB)", &m_memory_limit)) {
+        m_memory_limit = std::clamp(m_memory_limit, 1, MAX_MEMORY_LIMIT);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    int timeout = static_cast<int>(m_timeout.count());
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Timeout(ms)", &timeout)) {
+        m_timeout =
+            std::chrono::milliseconds(std::clamp(timeout, 1, MAX_TIMEOUT));
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::Text("%zu datagrams, %zu KiB", m_datagrams.size(),
+                m_memory >> 10);
+
+    ImGui::EndGroup();
+    ImGui::PopID();
+
+    return dirty;
+}
+
+void DefragmentModule::enable() {
+    LOG("Enabling");
+    assert(m_datagrams.empty() && m_memory == 0);
+}
+
+void DefragmentModule::disable() {
+    LOG("Disabling, sending on %zu incomplete datagrams",
+        m_datagrams.size());
+
+    // Fragments go on as they are rather than getting lost
+    for (auto& datagram : m_datagrams)
+        g_packets.splice(g_packets.cend(), datagram.fragments);
+
+    m_datagrams.clear();
+    m_index.clear();
+    m_memory = 0;
+    m_indicator = 0.f;
+}
+
+void DefragmentModule::apply_config(const toml::table& config) {
+    Module::apply_config(config);
+
+    m_inbound = config["inbound"].value_or(true);
+    m_outbound = config["outbound"].value_or(true);
+
+    m_memory_limit = std::clamp(config["memory_limit"].value_or(4096), 1,
+                                MAX_MEMORY_LIMIT);
+    m_timeout = std::chrono::milliseconds(
+        std::clamp(config["timeout"].value_or(30000), 1, MAX_TIMEOUT));
+}
+
+void DefragmentModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& defragment = static_cast<const DefragmentModule&>(other);
+    m_inbound = defragment.m_inbound;
+    m_outbound = defragment.m_outbound;
+    m_memory_limit = defragment.m_memory_limit;
+    m_timeout = defragment.m_timeout;
+}
+
+void DefragmentModule::release(std::list<Datagram>::iterator it) {
+    m_memory -= sizeof(Datagram) + it->size;
+    m_index.erase(it->key);
+    m_datagrams.erase(it);
+}
+
+bool DefragmentModule::evict(PacketClock::time_point now, size_t needed) {
+    const auto limit = static_cast<size_t>(m_memory_limit) << 10;
+    while (!m_datagrams.empty() &&
+           (now - m_datagrams.front().first_seen > m_timeout ||
+            m_memory + needed > limit)) {
+        LOG("Dropping %zu fragments of an incomplete datagram",
+            m_datagrams.front().fragments.size());
+        release(m_datagrams.begin());
+    }
+
+    return m_memory + needed <= limit;
+}
+
+std::optional<std::list<DefragmentModule::Datagram>::iterator>
+DefragmentModule::add(PacketList::iterator it,
+                      const FragmentHeader& fragment,
+                      PacketClock::time_point now) {
+    const auto& info = it->info;
+    const size_t data_size = info.length - fragment.data_offset;
+    const size_t end = fragment.offset + data_size;
+
+    // Only the last fragment may end off the 8 byte grid, and nothing past
+    // what the length fields can describe
+    if ((fragment.more && data_size % 8 != 0) || end > MAX_BLOCKS * 8) {
+        LOG("Dropping a malformed fragment");
+        g_packets.erase(it);
+        return std::nullopt;
+    }
+
+    const Key key{
+        .src_addr = info.src_addr,
+        .dst_addr = info.dst_addr,
+        .id = fragment.id,
+        .ip_version = info.ip_version,
+        .protocol = info.ip_version == 4 ? info.protocol : uint8_t{0},
+    };
+
+    auto index_it = m_index.find(key);
+    const auto charged = it->packet.size() + sizeof(PacketNode);
+    const auto needed =
+        charged + (index_it == m_index.end() ? sizeof(Datagram) : 0);
+    if (!evict(now, needed)) {
+        LOG("Dropping a fragment over the memory limit");
+        g_packets.erase(it);
+        return std::nullopt;
+    }
+
+    // Evicting may have taken the fragment's datagram
+    index_it = m_index.find(key);
+    if (index_it == m_index.end()) {
+        auto& datagram = m_datagrams.emplace_back();
+        datagram.key = key;
+        datagram.first_seen = now;
+        index_it = m_index.emplace(key, std::prev(m_datagrams.end())).first;
+        m_memory += sizeof(Datagram);
+    }
+
+    const auto datagram_it = index_it->second;
+    auto& datagram = *datagram_it;
+    // A slice pins its whole backing buffer (a pool buffer, ring block or
+    // UMEM frame), that would escape the limit and could starve the backend
+    auto& packet = it->packet;
+    const auto modified = packet.modified();
+    packet = DenseBufferArraySlice(std::make_shared<std::vector<char>>(
+                                       packet.data(),
+                                       packet.data() + packet.size()),
+                                   0, packet.size());
+    if (modified)
+        static_cast<void>(packet.mutable_data());
+
+    datagram.size += charged;
+    m_memory += charged;
+    datagram.fragments.splice(datagram.fragments.cend(), g_packets, it);
+
+    for (auto block = fragment.offset / 8; block < (end + 7) / 8; block++) {
+        if (!datagram.received[block]) {
+            datagram.received[block] = true;
+            datagram.received_blocks++;
+        }
+    }
+
+    datagram.has_first |= fragment.offset == 0;
+    if (!fragment.more)
+        datagram.total_size = end;
+
+    const auto blocks = (datagram.total_size.value_or(0) + 7) / 8;
+    if (!datagram.has_first || !datagram.total_size ||
+        datagram.received_blocks < blocks)
+        return std::nullopt;
+
+    // Fragments past the end may have filled in the count
+    for (size_t block = 0; block < blocks; block++) {
+        if (!datagram.received[block])
+            return std::nullopt;
+    }
+
+    return datagram_it;
+}
+
+std::optional<PacketNode>
+DefragmentModule::assemble(const Datagram& datagram) {
+    // The headers come from the first fragment
+    const auto first = std::find_if(
+        datagram.fragments.begin(), datagram.fragments.end(),
+        [](const PacketNode& packet) {
+            const auto fragment =
+                parse_fragment_header(packet.packet.data(), packet.info);
+            return fragment->offset == 0;
+        });
+    assert(first != datagram.fragments.end());
+
+    const auto first_fragment =
+        *parse_fragment_header(first->packet.data(), first->info);
+    const size_t header_size = first_fragment.header_size;
+    const auto size = header_size + *datagram.total_size;
+    const auto ipv4 = first->info.ip_version == 4;
+    if ((ipv4 ? size : size - 40) > 65535) {
+        LOG("Dropping a datagram of %zu bytes", size);
+        return std::nullopt;
+    }
+
+    DenseBufferArraySlice slice(std::make_shared<std::vector<char>>(size), 0,
+                                size);
+
+    // Written through `mutable_data()`, so backends handing out verdicts
+    // send the whole datagram in place of the first fragment
+    auto* const data = slice.mutable_data();
+    std::memcpy(data, first->packet.data(), header_size);
+    for (const auto& packet : datagram.fragments) {
+        const auto fragment =
+            *parse_fragment_header(packet.packet.data(), packet.info);
+        if (fragment.offset >= *datagram.total_size)
+            continue;
+
+        const auto data_size =
+            std::min<size_t>(packet.info.length - fragment.data_offset,
+                             *datagram.total_size - fragment.offset);
+        std::memcpy(data + header_size + fragment.offset,
+                    packet.packet.data() + fragment.data_offset, data_size);
+    }
+
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    if (ipv4) {
+        store_be16(bytes + 2, static_cast<uint16_t>(size));
+        // Keeps the don't fragment flag, clears the rest and the offset
+        bytes[6] &= 0x40;
+        bytes[7] = 0;
+        calculate_ipv4_checksum(data, header_size);
+    } else {
+        // The fragment header is left out
+        store_be16(bytes + 4, static_cast<uint16_t>(size - 40));
+        bytes[first_fragment.next_header_offset] =
+            first->packet.data()[first_fragment.header_size];
+    }
+
+    const auto info = parse_packet(data, size);
+    return PacketNode{
+        .packet = std::move(slice),
+        .addr = first->addr,
+        .captured_at = datagram.fragments.begin()->captured_at,
+        .info = info,
+    };
+}
+
+DefragmentModule::Result DefragmentModule::process() {
+    const auto now = PacketClock::now();
+    evict(now, 0);
+
+    auto assembled = 0;
+    for (auto it = g_packets.begin(); it != g_packets.end();) {
+        const auto it_copy = it++;
+        const auto& packet = *it_copy;
+        if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound))
+            continue;
+
+        const auto fragment =
+            parse_fragment_header(packet.packet.data(), packet.info);
+        if (!fragment || !fragment->is_fragment)
+            continue;
+
+        // Takes the fragment out of `g_packets`
+        const auto datagram = add(it_copy, *fragment, now);
+        if (!datagram)
+            continue;
+
+        if (auto whole = assemble(**datagram)) {
+            g_packets.insert(it, *whole);
+            assembled++;
+        }
+
+        release(*datagram);
+    }
+
+    auto dirty = false;
+    const auto indicator = assembled > 0 ? 1.f : 0.f;
+    if (!almost_equal(indicator, m_indicator)) {
+        m_indicator = indicator;
+        dirty = true;
+    }
+
+    return {.dirty = dirty};
+}
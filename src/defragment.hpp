@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <optional>
+#include <unordered_map>
+
+#include "clock.hpp"
+#include "lua_util.hpp"
+#include "module.hpp"
+#include "packet.hpp"
+
+// Reassembles IPv4 and IPv6 fragments into whole datagrams, so the modules
+// after it see every datagram as one packet with its transport header. The
+// fragments are held until the datagram is complete, datagrams are given up
+// when they time out or when holding them would exceed the memory limit,
+// oldest first.
+class DefragmentModule : public Module {
+private:
+    static inline int MAX_MEMORY_LIMIT = 1 << 20;
+    static inline int MAX_TIMEOUT = 120000;
+
+public:
+    DefragmentModule() {
+        m_display_name = "Defragment";
+        m_short_name = "Defragment";
+    }
+
+    virtual ~DefragmentModule() = default;
+
+    bool draw() override;
+
+    void enable() override;
+    void disable() override;
+
+    void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
+
+    Result process() override;
+
+    static void lua_setup(lua_State* L) {
+        luaL_Reg methods[] = {
+            {"memory_limit", lua_method_memory_limit},
+            {"timeout", lua_method_timeout},
+            {},
+        };
+
+        luaL_newmetatable(L, "Defragment");
+
+        // Inherit from `Module`
+        luaL_getmetatable(L, "Module");
+        lua_setmetatable(L, -2);
+
+        luaL_setfuncs(L, methods, 0);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
+private:
+    static int lua_method_memory_limit(lua_State* L) {
+        auto* module =
+            *std::bit_cast<DefragmentModule**>(lua_touserdata(L, 1));
+
+        int memory_limit = module->m_memory_limit;
+        const auto rets = lua_getset(L, memory_limit, 2);
+        if (rets == 0)
+            module->m_memory_limit =
+                std::clamp(memory_limit, 1, MAX_MEMORY_LIMIT);
+
+        return rets;
+    };
+
+    static int lua_method_timeout(lua_State* L) {
+        auto* module =
+            *std::bit_cast<DefragmentModule**>(lua_touserdata(L, 1));
+
+        int timeout = static_cast<int>(module->m_timeout.count());
+        const auto rets = lua_getset(L, timeout, 2);
+        if (rets == 0)
+            module->m_timeout =
+                std::chrono::milliseconds(std::clamp(timeout, 1, MAX_TIMEOUT));
+
+        return rets;
+    };
+
+private:
+    // Fragment data is tracked in blocks of 8 bytes, the unit of fragment
+    // offsets
+    static constexpr size_t MAX_BLOCKS = 65536 / 8;
+
+    struct Key {
+        std::array<uint8_t, 16> src_addr;
+        std::array<uint8_t, 16> dst_addr;
+        uint32_t id;
+        uint8_t ip_version;
+        // IPv4 only, IPv6 ids are unique across protocols
+        uint8_t protocol;
+
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const noexcept;
+    };
+
+    struct Datagram {
+        Key key;
+        PacketClock::time_point first_seen;
+        // In the order they arrived, later ones win where they overlap
+        PacketList fragments;
+        // Bytes of the fragments and their nodes
+        size_t size = 0;
+        std::bitset<MAX_BLOCKS> received;
+        size_t received_blocks = 0;
+        bool has_first = false;
+        // Size of the data once the last fragment arrived
+        std::optional<size_t> total_size;
+    };
+
+    // Holds a fragment until its datagram is complete, returns the datagram
+    // once it is. Held fragments are copied out of the buffer they were
+    // captured into, so the memory limit covers everything they keep alive.
+    std::optional<std::list<Datagram>::iterator>
+    add(PacketList::iterator it, const FragmentHeader& fragment,
+        PacketClock::time_point now);
+    // The whole datagram as one packet, `std::nullopt` if it's too long
+    static std::optional<PacketNode> assemble(const Datagram& datagram);
+    void release(std::list<Datagram>::iterator it);
+    // Gives up datagrams that timed out, and the oldest ones until `needed`
+    // more bytes fit the memory limit. Returns whether they do.
+    bool evict(PacketClock::time_point now, size_t needed);
+
+private:
+    bool m_inbound = true;
+    bool m_outbound = true;
+    // In KiB
+    int m_memory_limit = 4096;
+    std::chrono::milliseconds m_timeout = std::chrono::seconds(30);
+
+    // Oldest first
+    std::list<Datagram> m_datagrams;
+    std::unordered_map<Key, std::list<Datagram>::iterator, KeyHash> m_index;
+    size_t m_memory = 0;
+};
@@ -1,17 +1,62 @@
 #pragma once
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
+// Memory a backend may move while slices reference it, e.g. a block of a
+// kernel ring whose packets are copied out so that the block can go back to
+// the kernel before the modules are done with them. Slices read the bytes from
+// wherever `data` points at the time.
+struct MovableBuffer {
+    char* data;
+    // Where the bytes went once they were moved
+    std::vector<char> copy;
+
+    void move(size_t size) {
+        copy.assign(data, data + size);
+        data = copy.data();
+    }
+};
+
+// Buffers are referenced through a `std::shared_ptr<char>` to their first
+// byte, so that besides heap vectors they can also point into memory owned by
+// someone else (e.g. a block of a kernel ring) that's handed back once the
+// last slice referencing it is gone.
+//
+// Copies of a slice (e.g. duplicated packets) share its bytes, writing
+// through `mutable_data()` copies them out first so the other copies are left
+// alone. Slices stay marked as shared after their copies are gone, at worst
+// that costs one copy too many.
 class DenseBufferArraySlice {
 public:
     DenseBufferArraySlice() = delete;
     DenseBufferArraySlice(const std::shared_ptr<std::vector<char>>& buffer,
                           size_t offset, size_t size)
+        : m_buffer(buffer, buffer->data()), m_offset(offset), m_size(size) {}
+    DenseBufferArraySlice(const std::shared_ptr<char>& buffer, size_t offset,
+                          size_t size)
         : m_buffer(buffer), m_offset(offset), m_size(size) {}
-
-    DenseBufferArraySlice(const DenseBufferArraySlice&) = default;
-    DenseBufferArraySlice& operator=(const DenseBufferArraySlice&) = default;
+    DenseBufferArraySlice(const std::shared_ptr<MovableBuffer>& buffer,
+                          size_t offset, size_t size)
+        : m_buffer(buffer, buffer->data), m_movable(buffer.get()),
+          m_offset(offset), m_size(size) {}
+
+    DenseBufferArraySlice(const DenseBufferArraySlice& other)
+        : m_buffer(other.m_buffer), m_movable(other.m_movable),
+          m_offset(other.m_offset), m_size(other.m_size), m_shared(true),
+          m_modified(other.m_modified) {
+        other.m_shared = true;
+    }
+    DenseBufferArraySlice& operator=(const DenseBufferArraySlice& other) {
+        m_buffer = other.m_buffer;
+        m_movable = other.m_movable;
+        m_offset = other.m_offset;
+        m_size = other.m_size;
+        m_shared = other.m_shared = true;
+        m_modified = other.m_modified;
+        return *this;
+    }
 
     DenseBufferArraySlice(DenseBufferArraySlice&&) = default;
     DenseBufferArraySlice& operator=(DenseBufferArraySlice&&) = default;
@@ -22,32 +67,64 @@ public:
 
     ~DenseBufferArraySlice() = default;
 
-    [[nodiscard]] const std::shared_ptr<std::vector<char>>&
-    buffer() const noexcept {
+    [[nodiscard]] const std::shared_ptr<char>& buffer() const noexcept {
         return m_buffer;
     }
 
-    [[nodiscard]] char* data() noexcept { return m_buffer->data() + m_offset; }
     [[nodiscard]] const char* data() const noexcept {
-        return m_buffer->data() + m_offset;
+        return base() + m_offset;
     }
     [[nodiscard]] size_t size() const noexcept { return m_size; }
     [[nodiscard]] size_t offset() const noexcept { return m_offset; }
 
+    // Bytes of the slice for modification, copied into a buffer of their own
+    // if other slices share them
+    [[nodiscard]] char* mutable_data() {
+        if (m_shared) {
+            auto buffer = std::make_shared<std::vector<char>>(
+                data(), data() + m_size);
+            m_buffer = std::shared_ptr<char>(buffer, buffer->data());
+            m_movable = nullptr;
+            m_offset = 0;
+            m_shared = false;
+        }
+
+        m_modified = true;
+        return base() + m_offset;
+    }
+
+    // Drops the bytes past `size`, e.g. to keep the head of a packet that's
+    // split up
+    void truncate(size_t size) noexcept { m_size = std::min(m_size, size); }
+
+    // Were the bytes written to through `mutable_data()`
+    [[nodiscard]] bool modified() const noexcept { return m_modified; }
+
+private:
+    [[nodiscard]] char* base() const noexcept {
+        return m_movable != nullptr ? m_movable->data : m_buffer.get();
+    }
+
 private:
-    std::shared_ptr<std::vector<char>> m_buffer;
+    // Keeps a movable buffer alive too, its `data` is read through
+    // `m_movable`
+    std::shared_ptr<char> m_buffer;
+    MovableBuffer* m_movable = nullptr;
     size_t m_offset;
     size_t m_size;
+    mutable bool m_shared = false;
+    bool m_modified = false;
 };
 
 class DenseBufferArray {
 public:
     explicit DenseBufferArray(std::vector<char>&& buffer)
-        : m_buffer(std::make_shared<std::vector<char>>(buffer)) {}
+        : DenseBufferArray(
+              std::make_shared<std::vector<char>>(std::move(buffer))) {}
     explicit DenseBufferArray(const std::shared_ptr<std::vector<char>>& buffer)
-        : m_buffer(buffer) {}
-    explicit DenseBufferArray(std::shared_ptr<std::vector<char>>&& buffer)
-        : m_buffer(buffer) {}
+        : m_buffer(buffer, buffer->data()) {}
+    explicit DenseBufferArray(std::shared_ptr<char> buffer)
+        : m_buffer(std::move(buffer)) {}
 
     DenseBufferArray(const DenseBufferArray&) = default;
     DenseBufferArray& operator=(const DenseBufferArray&) = default;
@@ -57,8 +134,7 @@ public:
 
     ~DenseBufferArray() = default;
 
-    [[nodiscard]] const std::shared_ptr<std::vector<char>>&
-    buffer() const noexcept {
+    [[nodiscard]] const std::shared_ptr<char>& buffer() const noexcept {
         return m_buffer;
     }
 
@@ -68,5 +144,5 @@ public:
     }
 
 private:
-    std::shared_ptr<std::vector<char>> m_buffer;
+    std::shared_ptr<char> m_buffer;
 };
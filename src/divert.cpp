@@ -1,38 +1,20 @@
 #include <array>
-#include <bit>
 #include <cassert>
 #include <chrono>
 #include <memory.h>
 #include <thread>
 #include <windivert.h>
 
-#include "SDL_events.h"
 #include "common.hpp"
 #include "dense_buffers.hpp"
 #include "divert.hpp"
-#include "events.hpp"
 #include "module.hpp"
 #include "packet.hpp"
-
-#include "bandwidth.hpp"
-#include "drop.hpp"
-#include "duplicate.hpp"
-#include "lag.hpp"
-#include "tamper.hpp"
-#include "throttle.hpp"
+#include "scheduler.hpp"
 
 static constexpr INT16 DIVERT_PRIORITY = 0;
 static constexpr UINT64 QUEUE_LEN = 2 << 10;
 
-WinDivert::WinDivert() {
-    m_modules.emplace_back(std::make_shared<LagModule>());
-    m_modules.emplace_back(std::make_shared<DropModule>());
-    m_modules.emplace_back(std::make_shared<ThrottleModule>());
-    m_modules.emplace_back(std::make_shared<BandwidthModule>());
-    m_modules.emplace_back(std::make_shared<DuplicateModule>());
-    m_modules.emplace_back(std::make_shared<TamperModule>());
-}
-
 std::optional<std::string> WinDivert::start(const std::string& filter) {
     LOG("Starting");
 
@@ -62,13 +44,15 @@ std::optional<std::string> WinDivert::start(const std::string& filter) {
     LOG("WinDivert internal queue length: %llu, queue time: %llu", QUEUE_LEN,
         QUEUE_TIME);
 
-    // Initialize modules
-    for (auto& module : m_modules) {
-        if (module->m_enabled)
-            module->enable();
+    m_buffer_pool = BufferPool::create({
+        .buffer_size = BUFFER_SIZE,
+        .buffer_count = BUFFER_COUNT,
+        .prefault = true,
+        .huge_pages = true,
+    });
 
-        module->m_was_enabled = module->m_enabled;
-    }
+    // Initialize modules
+    enable_modules();
 
     LOG("Starting threads");
 
@@ -76,6 +60,7 @@ std::optional<std::string> WinDivert::start(const std::string& filter) {
     ThreadData thread_data = {
         .divert_handle = m_divert_handle,
         .stop_event_handle = m_stop_event_handle,
+        .buffer_pool = *m_buffer_pool,
         .modules = m_modules,
     };
 
@@ -103,14 +88,10 @@ bool WinDivert::stop() {
     CloseHandle(m_stop_event_handle);
     m_stop_event_handle = nullptr;
 
-    // Write thread should've sent all packets already
-    assert(g_packets.empty());
+    m_buffer_pool = nullptr;
 
     // Run post-disable module cleanups
-    for (auto& module : m_modules) {
-        if (module->m_enabled && module->m_was_enabled)
-            module->disable();
-    }
+    disable_modules();
 
     LOG("WinDivert stopped");
 
@@ -118,7 +99,8 @@ bool WinDivert::stop() {
 }
 
 struct PendingWrite {
-    // Strong reference to the buffer being send
+    // Strong reference to the buffer being send, empty when the packets were
+    // gathered into the staging buffer
     std::optional<DenseBufferArray> buffer;
     std::array<WINDIVERT_ADDRESS, WinDivert::MAX_PACKETS> addresses;
 };
@@ -136,12 +118,16 @@ void WinDivert::thread(ThreadData thread_data) {
     std::optional<PendingWrite> pending_write;
 
     // Start reading
-    auto dense_buffer = std::make_shared<std::vector<char>>(BUFFER_SIZE);
+    auto dense_buffer = thread_data.buffer_pool.lease();
     std::array<WINDIVERT_ADDRESS, MAX_PACKETS> read_addresses{};
     UINT read_addresses_length = sizeof(read_addresses);
-    WinDivertRecvEx(thread_data.divert_handle, dense_buffer->data(),
-                    dense_buffer->size(), nullptr, 0, read_addresses.data(),
-                    &read_addresses_length, &read_overlap);
+    WinDivertRecvEx(thread_data.divert_handle, dense_buffer.get(), BUFFER_SIZE,
+                    nullptr, 0, read_addresses.data(), &read_addresses_length,
+                    &read_overlap);
+
+    // Packets that aren't contiguous in a single dense buffer are copied here
+    // before sending, it's not touched again until the write completes
+    std::vector<char> staging_buffer(BUFFER_SIZE);
 
     const auto stage_write = [&] {
         pending_write = PendingWrite{
@@ -149,55 +135,70 @@ void WinDivert::thread(ThreadData thread_data) {
             .addresses = {},
         };
 
-        // Find biggest contiguous dense buffer slice
-        auto it = g_packets.cbegin();
-        const auto& first_slice = it->packet;
+        // Take as many packets as fit into a single send, checking whether
+        // they're all contiguous in the first packet's dense buffer
+        const auto& first_slice = g_packets.front().packet;
+        auto contiguous = true;
         auto contiguous_slice_offset = first_slice.offset();
+        size_t write_size = 0;
         size_t write_packet_count = 0;
-        for (; it != g_packets.cend(); ++it, write_packet_count++) {
+        auto it = g_packets.cbegin();
+        for (; it != g_packets.cend() && write_packet_count < MAX_PACKETS;
+             ++it, write_packet_count++) {
             const auto& slice = it->packet;
-
-            // Check for buffer equality
-            if (slice != first_slice)
+            if (write_size + slice.size() > BUFFER_SIZE)
                 break;
 
-            // Check if there is an hole
-            if (contiguous_slice_offset != slice.offset())
-                break;
+            // Check for buffer equality and holes
+            if (slice != first_slice ||
+                contiguous_slice_offset != slice.offset())
+                contiguous = false;
 
             pending_write->addresses[write_packet_count] = it->addr;
             contiguous_slice_offset += slice.size();
+            write_size += slice.size();
         }
 
-        // Write
-        pending_write->buffer = DenseBufferArray(first_slice.buffer());
-
-        const auto* buffer_data =
-            first_slice.buffer()->data() + first_slice.offset();
-        const auto buffer_size = contiguous_slice_offset - first_slice.offset();
-        // LOG("Writing %zu/%zu packets at once, slice_offset=%zu "
-        //     "buffer_offset=%zu size=%zu",
-        //     write_packet_count, g_packets.size(), first_slice.offset(),
-        //     contiguous_slice_offset, buffer_size);
-        WinDivertSendEx(thread_data.divert_handle, buffer_data, buffer_size,
+        const char* write_data = nullptr;
+        if (contiguous) {
+            // Send straight from the dense buffer
+            pending_write->buffer = DenseBufferArray(first_slice.buffer());
+            write_data = first_slice.data();
+        } else {
+            // Gather the scattered slices, copying is much cheaper than
+            // sending them a few at a time
+            size_t offset = 0;
+            for (auto gather_it = g_packets.cbegin(); gather_it != it;
+                 ++gather_it) {
+                const auto& slice = gather_it->packet;
+                memcpy(staging_buffer.data() + offset, slice.data(),
+                       slice.size());
+                offset += slice.size();
+            }
+
+            write_data = staging_buffer.data();
+        }
+
+        // LOG("Writing %zu/%zu packets at once, size=%zu contiguous=%d",
+        //     write_packet_count, g_packets.size(), write_size, contiguous);
+        WinDivertSendEx(thread_data.divert_handle, write_data, write_size,
                         nullptr, 0, pending_write->addresses.data(),
                         write_packet_count * sizeof(WINDIVERT_ADDRESS),
                         &write_overlap);
         g_packets.erase(g_packets.cbegin(), it);
     };
 
-    std::optional<std::chrono::milliseconds> wait_timeout;
-    const std::array<HANDLE, 3> events{
+    Scheduler scheduler;
+    const std::array<HANDLE, 4> events{
         write_event_handle,
         read_event_handle,
         thread_data.stop_event_handle,
+        scheduler.handle(),
     };
     auto should_stop = false;
     while (true) {
         const auto res = WaitForMultipleObjects(
-            events.size(), events.data(), false,
-            wait_timeout ? wait_timeout->count() : INFINITE);
-        wait_timeout = std::nullopt;
+            events.size(), events.data(), false, INFINITE);
 
         auto stop = false;
         switch (res) {
@@ -219,90 +220,51 @@ void WinDivert::thread(ThreadData thread_data) {
             }
 
             // Convert to dense buffer array
-            dense_buffer->resize(read);
-
             DenseBufferArray dense_buffers(std::move(dense_buffer));
-            dense_buffer = std::make_shared<std::vector<char>>(
-                BUFFER_SIZE); // Allocate a new buffer
-            // LOG("new packets buf size %zu", BUFFER_SIZE);
+            dense_buffer = thread_data.buffer_pool.lease();
 
-            const auto* const data = dense_buffers.buffer()->data();
+            const auto* const data = dense_buffers.buffer().get();
             const auto packet_count =
                 read_addresses_length / sizeof(WINDIVERT_ADDRESS);
             size_t offset = 0;
             const auto current_timestamp = std::chrono::steady_clock::now();
-            for (size_t i = 0; i < packet_count; i++) {
-                const auto* const iphdr =
-                    std::bit_cast<PWINDIVERT_IPHDR>(data + offset);
-
-                uint16_t packet_size = 0;
-                if (iphdr->Version == 4) {
-                    packet_size = ntohs(iphdr->Length);
-                    // LOG("pkt id %i ttl %i size %i", iphdr->Id, iphdr->TTL,
-                    //     packet_size);
-                } else {
-                    const auto* const ipv6hdr =
-                        std::bit_cast<PWINDIVERT_IPV6HDR>(data + offset);
-                    packet_size =
-                        htons(ipv6hdr->Length) + sizeof(WINDIVERT_IPV6HDR);
-                    // LOG("pkt6 id %i ttl %i size %d", ipv6hdr->FlowLabel0,
-                    //     ipv6hdr->HopLimit, packet_size);
+            for (size_t i = 0; i < packet_count && offset < read; i++) {
+                // Packets are back to back, their length comes from the IP
+                // header
+                const auto info = parse_packet(data + offset, read - offset);
+                if (info.ip_version == 0) {
+                    LOG("Dropping %zu packets after an invalid IP header",
+                        packet_count - i);
+                    break;
                 }
 
                 g_packets.emplace_back(PacketNode{
-                    .packet = dense_buffers.slice(offset, packet_size),
+                    .packet = dense_buffers.slice(offset, info.length),
                     .addr = read_addresses[i],
                     .captured_at = current_timestamp,
+                    .info = info,
                 });
 
-                offset += packet_size;
+                offset += info.length;
             }
 
             // Read again
             read_addresses_length = sizeof(read_addresses);
-            WinDivertRecvEx(thread_data.divert_handle, dense_buffer->data(),
-                            dense_buffer->size(), nullptr, 0,
-                            read_addresses.data(), &read_addresses_length,
-                            &read_overlap);
+            WinDivertRecvEx(thread_data.divert_handle, dense_buffer.get(),
+                            BUFFER_SIZE, nullptr, 0, read_addresses.data(),
+                            &read_addresses_length, &read_overlap);
 
             [[fallthrough]];
         }
-        case WAIT_TIMEOUT: {
-            // Run modules
-            auto dirty = false;
-            for (const auto& module : thread_data.modules) {
-                if (module->m_enabled) {
-                    // Initialize it if it wasn't
-                    if (!module->m_was_enabled) {
-                        module->enable();
-                        module->m_was_enabled = true;
-
-                        dirty = true;
-                    }
-
-                    const auto result = module->process();
-                    if (result.schedule_after && wait_timeout) {
-                        wait_timeout = std::chrono::milliseconds(
-                            std::min(wait_timeout->count(),
-                                     result.schedule_after->count()));
-                    } else if (result.schedule_after) {
-                        wait_timeout = result.schedule_after;
-                    }
-
-                    dirty |= result.dirty;
-                } else if (module->m_was_enabled) {
-                    module->disable();
-                    module->m_was_enabled = false;
-
-                    dirty = true;
-                }
-            }
+        // TIMER
+        case WAIT_OBJECT_0 + 3: {
+            // A module deadline is due, unless this is a read falling through
+            if (res == WAIT_OBJECT_0 + 3)
+                scheduler.expire();
 
-            // Notify main thread to redraw
-            if (dirty) {
-                SDL_Event event{events::REDRAW};
-                SDL_PushEvent(&event);
-            }
+            // Run modules
+            scheduler.schedule(
+                run_modules(thread_data.modules).schedule_after);
 
             if (!pending_write && !g_packets.empty())
                 stage_write();
@@ -342,6 +304,11 @@ void WinDivert::thread(ThreadData thread_data) {
         }
         // STOP
         case WAIT_OBJECT_0 + 2:
+            // Send out whatever modules are still holding
+            flush_modules(thread_data.modules);
+            if (!pending_write && !g_packets.empty())
+                stage_write();
+
             if (pending_write)
                 should_stop = true;
             else
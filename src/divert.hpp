@@ -6,45 +6,45 @@
 #include <optional>
 #include <thread>
 
+#include "backend.hpp"
+#include "buffer_pool.hpp"
 #include "module.hpp"
 
-class WinDivert {
+class WinDivert : public PacketBackend {
 public:
     static const inline size_t QUEUE_LENGTH = 4096;
     static const inline size_t QUEUE_TIME = 100;
     static const inline size_t BUFFER_SIZE = 0xffff;
+    static const inline size_t BUFFER_COUNT = 64;
     static const inline size_t MAX_PACKETS = 32;
 
 public:
-    WinDivert();
+    explicit WinDivert(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
 
     WinDivert(const WinDivert&) = delete;
     WinDivert(WinDivert&&) = delete;
     WinDivert& operator=(const WinDivert&) = delete;
     WinDivert& operator=(WinDivert&&) = delete;
 
-    ~WinDivert() { stop(); };
+    ~WinDivert() override { stop(); };
 
-    std::optional<std::string> start(const std::string& filter);
-    bool stop();
-
-    [[nodiscard]] const std::vector<std::shared_ptr<Module>>& modules() const {
-        return m_modules;
-    }
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
 
 private:
     struct ThreadData {
         HANDLE divert_handle;
         HANDLE stop_event_handle;
+        BufferPool& buffer_pool;
         const std::vector<std::shared_ptr<Module>>& modules;
     };
 
     static void thread(ThreadData thread_data);
 
 private:
-    std::vector<std::shared_ptr<Module>> m_modules;
-
     std::thread m_thread;
     HANDLE m_divert_handle = nullptr;
     HANDLE m_stop_event_handle = nullptr;
+    std::shared_ptr<BufferPool> m_buffer_pool;
 };
@@ -1,10 +1,35 @@
 #include <algorithm>
+#include <array>
 #include <imgui.h>
+#include <string_view>
 
 #include "common.hpp"
 #include "drop.hpp"
 #include "packet.hpp"
 
+static constexpr std::array MODEL_NAMES = {
+    "Bernoulli",
+    "Gilbert-Elliott",
+    "Four-state",
+};
+
+static constexpr std::array MODEL_KEYS = {
+    "bernoulli",
+    "gilbert_elliott",
+    "four_state",
+};
+
+// Input for a chance in percent
+static bool input_percent(const char* label, float& value) {
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat(label, &value)) {
+        value = std::clamp(value, 0.f, 100.f);
+        return true;
+    }
+
+    return false;
+}
+
 bool DropModule::draw() {
     bool dirty = false;
 
@@ -38,19 +63,53 @@ bool DropModule::draw() {
 
     ImGui::SameLine();
 
+    auto model = static_cast<int>(m_model);
     ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
-    if (ImGui::InputFloat("Chance", &m_chance)) {
-        m_chance = std::clamp(m_chance, 0.f, 100.f);
+    if (ImGui::Combo("Model", &model, MODEL_NAMES.data(),
+                     MODEL_NAMES.size())) {
+        set_model(static_cast<Model>(model));
         dirty = true;
     }
 
+    ImGui::SameLine();
+
+    switch (m_model) {
+    case Model::Bernoulli:
+        dirty |= input_percent("Chance", m_chance);
+        break;
+    case Model::GilbertElliott:
+        dirty |= input_percent("Good to bad", m_p);
+        ImGui::SameLine();
+        dirty |= input_percent("Bad to good", m_r);
+        ImGui::SameLine();
+        dirty |= input_percent("Good loss", m_loss_good);
+        ImGui::SameLine();
+        dirty |= input_percent("Bad loss", m_loss_bad);
+        break;
+    case Model::FourState:
+        dirty |= input_percent("p13", m_p13);
+        ImGui::SameLine();
+        dirty |= input_percent("p31", m_p31);
+        ImGui::SameLine();
+        dirty |= input_percent("p32", m_p32);
+        ImGui::SameLine();
+        dirty |= input_percent("p23", m_p23);
+        ImGui::SameLine();
+        dirty |= input_percent("p14", m_p14);
+        break;
+    }
+
     ImGui::EndGroup();
     ImGui::PopID();
 
     return dirty;
 }
 
-void DropModule::enable() { LOG("Enabling"); }
+void DropModule::enable() {
+    LOG("Enabling");
+
+    set_model(m_model);
+}
 void DropModule::disable() {
     LOG("Disabling");
 
@@ -64,6 +123,103 @@ void DropModule::apply_config(const toml::table& config) {
     m_outbound = config["outbound"].value_or(true);
 
     m_chance = std::clamp(config["chance"].value_or(100.f), 0.f, 100.f);
+
+    m_p = std::clamp(config["p"].value_or(1.f), 0.f, 100.f);
+    m_r = std::clamp(config["r"].value_or(25.f), 0.f, 100.f);
+    m_loss_good = std::clamp(config["loss_good"].value_or(0.f), 0.f, 100.f);
+    m_loss_bad = std::clamp(config["loss_bad"].value_or(100.f), 0.f, 100.f);
+
+    m_p13 = std::clamp(config["p13"].value_or(1.f), 0.f, 100.f);
+    m_p31 = std::clamp(config["p31"].value_or(25.f), 0.f, 100.f);
+    m_p32 = std::clamp(config["p32"].value_or(0.f), 0.f, 100.f);
+    m_p23 = std::clamp(config["p23"].value_or(0.f), 0.f, 100.f);
+    m_p14 = std::clamp(config["p14"].value_or(0.f), 0.f, 100.f);
+
+    const std::string_view model = config["model"].value_or("bernoulli");
+    const auto it = std::find(MODEL_KEYS.begin(), MODEL_KEYS.end(), model);
+    if (it != MODEL_KEYS.end()) {
+        set_model(static_cast<Model>(it - MODEL_KEYS.begin()));
+    } else {
+        LOG("Unknown model '%.*s'", static_cast<int>(model.size()),
+            model.data());
+    }
+}
+
+void DropModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& drop = static_cast<const DropModule&>(other);
+    m_inbound = drop.m_inbound;
+    m_outbound = drop.m_outbound;
+    m_chance = drop.m_chance;
+    m_p = drop.m_p;
+    m_r = drop.m_r;
+    m_loss_good = drop.m_loss_good;
+    m_loss_bad = drop.m_loss_bad;
+    m_p13 = drop.m_p13;
+    m_p31 = drop.m_p31;
+    m_p32 = drop.m_p32;
+    m_p23 = drop.m_p23;
+    m_p14 = drop.m_p14;
+
+    // Workers copy the settings every batch, the chains only restart when
+    // the model changed
+    if (drop.m_model != m_model)
+        set_model(drop.m_model);
+}
+
+void DropModule::set_model(Model model) {
+    m_model = model;
+    m_bad = {};
+    m_states = {};
+}
+
+bool DropModule::next_drop(bool outbound) {
+    switch (m_model) {
+    case Model::Bernoulli:
+        return check_chance(m_chance);
+    case Model::GilbertElliott: {
+        // Loss is decided by the current state, then the chain moves on
+        auto& bad = m_bad[outbound];
+        const auto drop = check_chance(bad ? m_loss_bad : m_loss_good);
+        bad = check_chance(bad ? 100.f - m_r : m_p);
+
+        return drop;
+    }
+    case Model::FourState: {
+        // One roll picks the transition, losses are the states entered
+        auto& state = m_states[outbound];
+        const auto roll = roll_percent();
+        switch (state) {
+        case State::GapReceived:
+            if (roll < m_p13) {
+                state = State::BurstLost;
+            } else if (roll < m_p13 + m_p14) {
+                state = State::GapLost;
+            }
+            break;
+        case State::BurstReceived:
+            if (roll < m_p23) {
+                state = State::BurstLost;
+            }
+            break;
+        case State::BurstLost:
+            if (roll < m_p31) {
+                state = State::GapReceived;
+            } else if (roll < m_p31 + m_p32) {
+                state = State::BurstReceived;
+            }
+            break;
+        case State::GapLost:
+            state = State::GapReceived;
+            break;
+        }
+
+        return state == State::BurstLost || state == State::GapLost;
+    }
+    }
+
+    return false;
 }
 
 DropModule::Result DropModule::process() {
@@ -72,8 +228,9 @@ DropModule::Result DropModule::process() {
     for (auto it = g_packets.begin(); it != g_packets.end();) {
         auto& packet = *it;
         if (check_direction(packet.addr.Outbound, m_inbound, m_outbound) &&
-            check_chance(m_chance)) {
-            LOG("Dropped with chance %.1f%%, direction %s", m_chance,
+            next_drop(packet.addr.Outbound)) {
+            LOG("Dropped with model %s, direction %s",
+                MODEL_NAMES[static_cast<size_t>(m_model)],
                 packet.addr.Outbound ? "OUTBOUND" : "INBOUND");
             it = g_packets.erase(it);
             ++dropped;
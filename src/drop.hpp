@@ -1,8 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "lua_util.hpp"
 #include "module.hpp"
 
 class DropModule : public Module {
+public:
+    enum class Model : int {
+        // Every packet is dropped independently with `chance`
+        Bernoulli,
+        // Good and bad state, each with its own loss chance
+        GilbertElliott,
+        // Gap and burst periods with isolated losses in gaps, as in netem's
+        // `loss state`
+        FourState,
+    };
+
 public:
     DropModule() {
         m_display_name = "Drop";
@@ -17,12 +33,23 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
     static void lua_setup(lua_State* L) {
         luaL_Reg methods[] = {
             {"chance", lua_method_chance},
+            {"model", lua_method_model},
+            {"p", lua_method_p},
+            {"r", lua_method_r},
+            {"loss_good", lua_method_loss_good},
+            {"loss_bad", lua_method_loss_bad},
+            {"p13", lua_method_p13},
+            {"p31", lua_method_p31},
+            {"p32", lua_method_p32},
+            {"p23", lua_method_p23},
+            {"p14", lua_method_p14},
             {},
         };
 
@@ -41,15 +68,126 @@ public:
     }
 
 private:
+    // Chances are kept within 0..100 like the UI and config do, and the
+    // transitions out of a state within what's left by the others, or the
+    // loss model's chains would break
+    static int lua_getset_percent(lua_State* L, float& value,
+                                  float max = 100.f) {
+        float percent = value;
+        const auto rets = lua_getset(L, percent, 2);
+        if (rets == 0)
+            value = std::clamp(percent, 0.f, std::clamp(max, 0.f, 100.f));
+
+        return rets;
+    }
+
     static int lua_method_chance(lua_State* L) {
         auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
-        const auto rets = lua_getset(L, module->m_chance, 2);
+        return lua_getset_percent(L, module->m_chance);
+    };
+
+    static int lua_method_model(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+
+        int model = static_cast<int>(module->m_model);
+        const auto rets = lua_getset(L, model, 2);
+        if (rets == 0) {
+            module->set_model(static_cast<Model>(
+                std::clamp(model, 0, static_cast<int>(Model::FourState))));
+        }
 
         return rets;
     };
 
+    static int lua_method_p(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p);
+    };
+
+    static int lua_method_r(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_r);
+    };
+
+    static int lua_method_loss_good(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_loss_good);
+    };
+
+    static int lua_method_loss_bad(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_loss_bad);
+    };
+
+    static int lua_method_p13(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p13,
+                                  100.f - module->m_p14);
+    };
+
+    static int lua_method_p31(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p31,
+                                  100.f - module->m_p32);
+    };
+
+    static int lua_method_p32(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p32,
+                                  100.f - module->m_p31);
+    };
+
+    static int lua_method_p23(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p23);
+    };
+
+    static int lua_method_p14(lua_State* L) {
+        auto* module = *std::bit_cast<DropModule**>(lua_touserdata(L, 1));
+        return lua_getset_percent(L, module->m_p14,
+                                  100.f - module->m_p13);
+    };
+
+    // Switches the model and starts every direction over in its first state
+    void set_model(Model model);
+
+    // Advances the chain of the packet's direction, returns whether to drop
+    bool next_drop(bool outbound);
+
 private:
+    // States of the four-state model, numbered like in the paper by Salsano
+    // et al. the model comes from
+    enum class State : uint8_t {
+        // 1: received during a gap
+        GapReceived,
+        // 2: received during a burst
+        BurstReceived,
+        // 3: lost during a burst
+        BurstLost,
+        // 4: isolated loss during a gap
+        GapLost,
+    };
+
     bool m_inbound = true;
     bool m_outbound = true;
     float m_chance = 10.f;
+    Model m_model = Model::Bernoulli;
+
+    // Gilbert-Elliott transition and loss chances, in percent
+    float m_p = 1.f;
+    float m_r = 25.f;
+    float m_loss_good = 0.f;
+    float m_loss_bad = 100.f;
+
+    // Four-state transition chances, in percent
+    float m_p13 = 1.f;
+    float m_p31 = 25.f;
+    float m_p32 = 0.f;
+    float m_p23 = 0.f;
+    float m_p14 = 0.f;
+
+    // Chains are advanced per direction, indexed by `Outbound`, so that
+    // bursts in one direction don't bleed into the other
+    std::array<bool, 2> m_bad{};
+    std::array<State, 2> m_states{};
 };
@@ -75,21 +75,29 @@ void DuplicateModule::apply_config(const toml::table& config) {
     m_count = std::max(config["count"].value_or(100), 0);
 }
 
+void DuplicateModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& duplicate = static_cast<const DuplicateModule&>(other);
+    m_inbound = duplicate.m_inbound;
+    m_outbound = duplicate.m_outbound;
+    m_chance = duplicate.m_chance;
+    m_count = duplicate.m_count;
+}
+
 DuplicateModule::Result DuplicateModule::process() {
     const auto total_packets = g_packets.size();
     auto duplicated = 0;
-    for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
+    for (auto it = g_packets.cbegin(); it != g_packets.cend(); ++it) {
         const auto& packet = *it;
         if (check_direction(packet.addr.Outbound, m_inbound, m_outbound) &&
             check_chance(m_chance)) {
             LOG("Duplicated with chance %.1f%%, direction %s", m_chance,
                 packet.addr.Outbound ? "OUTBOUND" : "INBOUND");
+            // Copies go in front, so they aren't rolled for again
             for (auto i = 0; i < m_count; i++)
-                it = g_packets.insert(it, packet);
-            std::advance(it, m_count);
+                g_packets.insert(it, packet);
             ++duplicated;
-        } else {
-            ++it;
         }
     }
 
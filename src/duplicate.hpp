@@ -17,6 +17,7 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
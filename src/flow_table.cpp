@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <tuple>
+
+#include "flow_table.hpp"
+
+thread_local FlowTable g_flows;
+
+namespace {
+
+constexpr size_t INITIAL_CAPACITY = 1024;
+
+uint64_t load64(const uint8_t* data) noexcept {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint64_t mix(uint64_t hash, uint64_t value) noexcept {
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+    return hash ^ (hash >> 29);
+}
+
+// splitmix64 finalizer, spreads the bits over the index mask
+uint64_t finalize(uint64_t hash) noexcept {
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+    return hash ^ (hash >> 31);
+}
+
+} // namespace
+
+FlowTable::FlowTable(size_t max_flows, std::chrono::nanoseconds idle_timeout)
+    : m_max_flows(std::max<size_t>(max_flows, 1)),
+      m_max_capacity(std::bit_ceil(
+          std::max(m_max_flows / 3 * 4 + 4, INITIAL_CAPACITY))),
+      m_idle_timeout(idle_timeout) {}
+
+uint64_t FlowTable::key(const PacketInfo& info) noexcept {
+    // Order the endpoints, so both directions end up with the same key
+    const bool swap = std::tie(info.dst_addr, info.dst_port) <
+                      std::tie(info.src_addr, info.src_port);
+    const auto& addr_a = swap ? info.dst_addr : info.src_addr;
+    const auto& addr_b = swap ? info.src_addr : info.dst_addr;
+    const auto port_a = swap ? info.dst_port : info.src_port;
+    const auto port_b = swap ? info.src_port : info.dst_port;
+
+    auto hash = mix(0, info.protocol);
+    hash = mix(hash, load64(addr_a.data()));
+    hash = mix(hash, load64(addr_a.data() + 8));
+    hash = mix(hash, load64(addr_b.data()));
+    hash = mix(hash, load64(addr_b.data() + 8));
+    hash = mix(hash, static_cast<uint64_t>(port_a) << 16 | port_b);
+    hash = finalize(hash);
+
+    // 0 marks empty entries
+    return hash != 0 ? hash : 1;
+}
+
+size_t FlowTable::allocate_slot() noexcept {
+    static std::atomic<size_t> s_next_slot = 0;
+
+    const auto slot = s_next_slot++;
+    assert(slot < SLOT_COUNT && "Out of flow table slots");
+    return slot;
+}
+
+FlowTable::Entry* FlowTable::find(uint64_t key,
+                                  PacketClock::time_point now) noexcept {
+    if (m_size == 0)
+        return nullptr;
+
+    const auto mask = m_capacity - 1;
+    for (auto index = key & mask;; index = (index + 1) & mask) {
+        auto& entry = m_entries[index];
+        if (entry.key == key)
+            return idle(entry, now) ? nullptr : &entry;
+        if (entry.key == 0)
+            return nullptr;
+    }
+}
+
+FlowTable::Entry& FlowTable::find_or_insert(uint64_t key,
+                                            PacketClock::time_point now) {
+    if (m_capacity == 0)
+        grow();
+
+    expire(now, SWEEP_STEP);
+
+    auto mask = m_capacity - 1;
+    auto index = key & mask;
+    for (;; index = (index + 1) & mask) {
+        auto& entry = m_entries[index];
+        if (entry.key == key) {
+            // Same 5-tuple, but a new connection
+            if (idle(entry, now))
+                entry.slots = {};
+
+            entry.last_seen = now;
+            return entry;
+        }
+        if (entry.key == 0)
+            break;
+    }
+
+    // Make room, entries move so the free spot has to be searched again
+    const auto full = m_size >= m_max_flows;
+    const auto grow_needed = !full && m_capacity < m_max_capacity &&
+                             (m_size + 1) * 4 > m_capacity * 3;
+    if (full)
+        evict(key & mask);
+    else if (grow_needed)
+        grow();
+
+    if (full || grow_needed) {
+        mask = m_capacity - 1;
+        for (index = key & mask; m_entries[index].key != 0;
+             index = (index + 1) & mask)
+            ;
+    }
+
+    auto& entry = m_entries[index];
+    entry.key = key;
+    entry.last_seen = now;
+    entry.slots = {};
+    ++m_size;
+
+    return entry;
+}
+
+bool FlowTable::erase(uint64_t key) noexcept {
+    if (m_size == 0)
+        return false;
+
+    const auto mask = m_capacity - 1;
+    for (auto index = key & mask;; index = (index + 1) & mask) {
+        const auto entry_key = m_entries[index].key;
+        if (entry_key == key) {
+            erase_at(index);
+            return true;
+        }
+        if (entry_key == 0)
+            return false;
+    }
+}
+
+size_t FlowTable::expire(PacketClock::time_point now, size_t budget) noexcept {
+    if (m_size == 0)
+        return 0;
+
+    size_t removed = 0;
+    for (; budget > 0; --budget) {
+        const auto& entry = m_entries[m_cursor];
+        if (entry.key != 0 && idle(entry, now)) {
+            // The next entry may have moved into the cursor's spot
+            erase_at(m_cursor);
+            ++removed;
+            continue;
+        }
+
+        m_cursor = (m_cursor + 1) & (m_capacity - 1);
+    }
+
+    return removed;
+}
+
+void FlowTable::clear() noexcept {
+    m_entries.reset();
+    m_capacity = 0;
+    m_size = 0;
+    m_cursor = 0;
+}
+
+void FlowTable::grow() {
+    const auto capacity = m_capacity == 0
+                              ? std::min(INITIAL_CAPACITY, m_max_capacity)
+                              : m_capacity * 2;
+    auto entries = std::make_unique<Entry[]>(capacity);
+
+    const auto mask = capacity - 1;
+    for (size_t i = 0; i < m_capacity; i++) {
+        const auto& entry = m_entries[i];
+        if (entry.key == 0)
+            continue;
+
+        auto index = entry.key & mask;
+        while (entries[index].key != 0)
+            index = (index + 1) & mask;
+
+        entries[index] = entry;
+    }
+
+    m_entries = std::move(entries);
+    m_capacity = capacity;
+    m_cursor = 0;
+}
+
+void FlowTable::evict(size_t home) noexcept {
+    // Least recently seen entry close to where the new one goes, the window
+    // is stretched until it covers at least one entry
+    const auto mask = m_capacity - 1;
+    auto victim = std::numeric_limits<size_t>::max();
+    for (size_t i = 0;
+         i < EVICT_WINDOW || victim == std::numeric_limits<size_t>::max();
+         i++) {
+        const auto index = (home + i) & mask;
+        const auto& entry = m_entries[index];
+        if (entry.key == 0)
+            continue;
+
+        if (victim == std::numeric_limits<size_t>::max() ||
+            entry.last_seen < m_entries[victim].last_seen)
+            victim = index;
+    }
+
+    erase_at(victim);
+}
+
+void FlowTable::erase_at(size_t index) noexcept {
+    const auto mask = m_capacity - 1;
+    auto hole = index;
+    for (auto next = (hole + 1) & mask; m_entries[next].key != 0;
+         next = (next + 1) & mask) {
+        // Entries can only move back as far as their home
+        const auto home = m_entries[next].key & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            m_entries[hole] = m_entries[next];
+            hole = next;
+        }
+    }
+
+    m_entries[hole].key = 0;
+    --m_size;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include "clock.hpp"
+#include "packet.hpp"
+
+// Per-connection state of the modules, keyed by a 64-bit hash of the 5-tuple
+// that's the same for both directions. Entries are one cache line each and
+// live in an open addressing table with linear probing, lookups and inserts
+// are constant time on average. The table grows up to the size needed for
+// `max_flows` and never beyond, once full an insert replaces the entry seen
+// least recently among the ones next to it.
+//
+// Every module owning state registers a slot once (see `allocate_slot`) and
+// keeps up to `SLOT_SIZE` bytes per flow in it, zeroed when the flow is new.
+// Entries idle for longer than the idle timeout are treated as new and swept
+// away a few at a time.
+class FlowTable {
+public:
+    static constexpr size_t SLOT_SIZE = 16;
+    static constexpr size_t SLOT_COUNT = 3;
+
+    static constexpr size_t DEFAULT_MAX_FLOWS = 1 << 20;
+    static constexpr auto DEFAULT_IDLE_TIMEOUT = std::chrono::seconds(120);
+
+    struct alignas(64) Entry {
+        // 0 if the entry is empty
+        uint64_t key;
+        PacketClock::time_point last_seen;
+        std::array<std::array<std::byte, SLOT_SIZE>, SLOT_COUNT> slots;
+
+        // State of the module owning `slot`, zero-initialized for new flows
+        template <typename T> [[nodiscard]] T& state(size_t slot) noexcept {
+            static_assert(sizeof(T) <= SLOT_SIZE && alignof(T) <= SLOT_SIZE);
+            static_assert(std::is_trivially_copyable_v<T> &&
+                          std::is_trivially_destructible_v<T>);
+            assert(slot < SLOT_COUNT);
+
+            return *std::launder(reinterpret_cast<T*>(slots[slot].data()));
+        }
+    };
+    static_assert(sizeof(Entry) == 64);
+
+public:
+    explicit FlowTable(
+        size_t max_flows = DEFAULT_MAX_FLOWS,
+        std::chrono::nanoseconds idle_timeout = DEFAULT_IDLE_TIMEOUT);
+
+    FlowTable(const FlowTable&) = delete;
+    FlowTable& operator=(const FlowTable&) = delete;
+
+    // Key of the flow the packet belongs to, never 0
+    [[nodiscard]] static uint64_t key(const PacketInfo& info) noexcept;
+
+    // Reserves a slot for a module's state, call once per module type
+    [[nodiscard]] static size_t allocate_slot() noexcept;
+
+    // Entry of a flow that was seen within the idle timeout, `nullptr`
+    // otherwise. Pointers stay valid until the next insert.
+    [[nodiscard]] Entry* find(uint64_t key,
+                              PacketClock::time_point now) noexcept;
+
+    // Entry of a flow, inserted if it's new or was idle for too long. Marks
+    // the flow as seen at `now`.
+    [[nodiscard]] Entry& find_or_insert(uint64_t key,
+                                        PacketClock::time_point now);
+
+    bool erase(uint64_t key) noexcept;
+
+    // Checks up to `budget` entries for idle flows and removes them, returns
+    // how many were removed
+    size_t expire(PacketClock::time_point now, size_t budget) noexcept;
+
+    void clear() noexcept;
+
+    [[nodiscard]] size_t size() const noexcept { return m_size; }
+    [[nodiscard]] size_t capacity() const noexcept { return m_capacity; }
+    [[nodiscard]] size_t max_flows() const noexcept { return m_max_flows; }
+
+    // Bytes taken by the entries, at most `max_flows() * 4 / 3` entries
+    // rounded up to a power of two
+    [[nodiscard]] size_t memory_usage() const noexcept {
+        return m_capacity * sizeof(Entry);
+    }
+
+private:
+    // Entries checked for idle flows on every insert
+    static constexpr size_t SWEEP_STEP = 2;
+    // Entries next to the home one considered for eviction when full
+    static constexpr size_t EVICT_WINDOW = 8;
+
+    [[nodiscard]] bool idle(const Entry& entry,
+                            PacketClock::time_point now) const noexcept {
+        return now - entry.last_seen > m_idle_timeout;
+    }
+
+    void grow();
+    void evict(size_t home) noexcept;
+    // Removes the entry at `index`, moving the ones probed after it back
+    void erase_at(size_t index) noexcept;
+
+private:
+    size_t m_max_flows;
+    size_t m_max_capacity;
+    std::chrono::nanoseconds m_idle_timeout;
+
+    std::unique_ptr<Entry[]> m_entries;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    // Next entry to check for idleness
+    size_t m_cursor = 0;
+};
+
+// Flows seen by the module chain of the current backend thread, allocated on
+// the first insert
+extern thread_local FlowTable g_flows;
@@ -0,0 +1,430 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <imgui.h>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "checksum.hpp"
+#include "common.hpp"
+#include "fragment.hpp"
+
+static constexpr std::array ORDER_NAMES = {
+    "In order",
+    "Reverse",
+    "Random",
+};
+
+static constexpr std::array ORDER_KEYS = {
+    "in_order",
+    "reverse",
+    "random",
+};
+
+static constexpr uint8_t PROTO_FRAGMENT = 44;
+static constexpr size_t IPV6_FRAGMENT_HEADER_SIZE = 8;
+
+bool FragmentModule::draw() {
+    bool dirty = false;
+
+    ImGui::PushID(m_short_name);
+    ImGui::BeginGroup();
+
+    ImGui::PushStyleColor(ImGuiCol_Text, {m_indicator, 0.f, 0.f, 1.f});
+    ImGui::Bullet();
+    ImGui::PopStyleColor();
+
+    if (m_indicator > 0.f) {
+        m_indicator -= ImGui::GetIO().DeltaTime * 10.f;
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::Text("%s", m_display_name);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Enable", &m_enabled);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Inbound", &m_inbound);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Outbound", &m_outbound);
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(6.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("MTU", &m_mtu)) {
+        m_mtu = std::clamp(m_mtu, MIN_MTU, MAX_MTU);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Drop DF", &m_drop_df);
+
+    ImGui::SameLine();
+
+    auto order = static_cast<int>(m_order);
+    ImGui::SetNextItemWidth(6.f * ImGui::GetFontSize());
+    if (ImGui::Combo("Order", &order, ORDER_NAMES.data(),
+                     ORDER_NAMES.size())) {
+        m_order = static_cast<Order>(order);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat("Drop", &m_drop)) {
+        m_drop = std::clamp(m_drop, 0.f, 100.f);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    int delay = static_cast<int>(m_delay.count());
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Delay(ms)", &delay)) {
+        m_delay = std::chrono::milliseconds(std::clamp(delay, 1, MAX_DELAY));
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat("Delay chance", &m_delay_chance)) {
+        m_delay_chance = std::clamp(m_delay_chance, 0.f, 100.f);
+        dirty = true;
+    }
+
+    ImGui::EndGroup();
+    ImGui::PopID();
+
+    return dirty;
+}
+
+void FragmentModule::enable() {
+    LOG("Enabling");
+    assert(m_held.empty());
+}
+
+void FragmentModule::disable() {
+    LOG("Disabling, flushing %zu fragments", m_held.size());
+
+    g_packets.splice(g_packets.cend(), m_held);
+    m_deadlines.clear();
+
+    m_indicator = 0.f;
+}
+
+void FragmentModule::apply_config(const toml::table& config) {
+    Module::apply_config(config);
+
+    m_inbound = config["inbound"].value_or(true);
+    m_outbound = config["outbound"].value_or(true);
+
+    m_mtu = std::clamp(config["mtu"].value_or(1280), MIN_MTU, MAX_MTU);
+    m_drop_df = config["drop_df"].value_or(false);
+    m_drop = std::clamp(config["drop"].value_or(0.f), 0.f, 100.f);
+    m_delay = std::chrono::milliseconds(
+        std::clamp(config["delay"].value_or(50), 1, MAX_DELAY));
+    m_delay_chance =
+        std::clamp(config["delay_chance"].value_or(0.f), 0.f, 100.f);
+
+    const std::string_view order = config["order"].value_or("in_order");
+    const auto it = std::find(ORDER_KEYS.begin(), ORDER_KEYS.end(), order);
+    if (it != ORDER_KEYS.end()) {
+        m_order = static_cast<Order>(it - ORDER_KEYS.begin());
+    } else {
+        LOG("Unknown order '%.*s'", static_cast<int>(order.size()),
+            order.data());
+    }
+}
+
+void FragmentModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& fragment = static_cast<const FragmentModule&>(other);
+    m_inbound = fragment.m_inbound;
+    m_outbound = fragment.m_outbound;
+    m_mtu = fragment.m_mtu;
+    m_drop_df = fragment.m_drop_df;
+    m_drop = fragment.m_drop;
+    m_order = fragment.m_order;
+    m_delay = fragment.m_delay;
+    m_delay_chance = fragment.m_delay_chance;
+}
+
+PacketList FragmentModule::split_ipv4(PacketNode& packet,
+                                      const FragmentHeader& header) {
+    const auto* const bytes =
+        std::bit_cast<const uint8_t*>(packet.packet.data());
+    const size_t header_size = header.header_size;
+    const size_t mtu = m_mtu;
+
+    // Options without the copied flag only go into the first fragment
+    std::array<uint8_t, 60> later_header{};
+    std::memcpy(later_header.data(), bytes, 20);
+    size_t later_header_size = 20;
+    for (size_t i = 20; i < header_size;) {
+        const auto type = bytes[i];
+        // End of options
+        if (type == 0)
+            break;
+        // No operation
+        if (type == 1) {
+            i++;
+            continue;
+        }
+
+        const size_t length = i + 1 < header_size ? bytes[i + 1] : 0;
+        if (length < 2 || i + length > header_size)
+            break;
+
+        if ((type & 0x80) != 0) {
+            std::memcpy(later_header.data() + later_header_size, bytes + i,
+                        length);
+            later_header_size += length;
+        }
+
+        i += length;
+    }
+
+    // Padded to 32-bit words with end of options
+    later_header_size = (later_header_size + 3) & ~size_t{3};
+    later_header[0] = static_cast<uint8_t>(0x40 | later_header_size / 4);
+
+    // Data of all fragments but the last is a multiple of 8 bytes
+    const auto first_chunk = (mtu - header_size) & ~size_t{7};
+    const auto later_chunk = (mtu - later_header_size) & ~size_t{7};
+    const size_t data_size = packet.info.length - header_size;
+    if (mtu <= header_size || first_chunk < 8 || data_size <= first_chunk)
+        return {};
+
+    const auto later_count = (data_size - first_chunk + later_chunk - 1) /
+                             later_chunk;
+    const auto later_size =
+        later_count * later_header_size + data_size - first_chunk;
+    const auto buffer = std::make_shared<std::vector<char>>(later_size);
+
+    PacketList fragments;
+    const auto fragment_header = [&](uint8_t* data, size_t size,
+                                     size_t offset, bool more) {
+        store_be16(data + 2, static_cast<uint16_t>(size));
+        // Don't fragment is cleared, it's too late for that
+        store_be16(data + 6, static_cast<uint16_t>((more ? 0x2000 : 0) |
+                                                   (offset / 8)));
+    };
+
+    // The later fragments are copied before the first one's header changes
+    size_t buffer_offset = 0;
+    for (auto chunk_offset = first_chunk; chunk_offset < data_size;
+         chunk_offset += later_chunk) {
+        const auto chunk = std::min(later_chunk, data_size - chunk_offset);
+        const auto size = later_header_size + chunk;
+        DenseBufferArraySlice slice(buffer, buffer_offset, size);
+        buffer_offset += size;
+
+        // Written through `mutable_data()`, so backends handing out
+        // verdicts send the fragment in place of the packet
+        auto* const data = slice.mutable_data();
+        auto* const fragment_bytes = std::bit_cast<uint8_t*>(data);
+        std::memcpy(data, later_header.data(), later_header_size);
+        std::memcpy(data + later_header_size,
+                    bytes + header_size + chunk_offset, chunk);
+        fragment_header(fragment_bytes, size, header.offset + chunk_offset,
+                        chunk_offset + chunk < data_size || header.more);
+        calculate_ipv4_checksum(data, later_header_size);
+
+        fragments.emplace_back(PacketNode{
+            .packet = std::move(slice),
+            .addr = packet.addr,
+            .captured_at = packet.captured_at,
+            .info = parse_packet(data, size),
+        });
+    }
+
+    // The first fragment is the head of the packet's buffer, only copied if
+    // someone else shares it
+    auto slice = std::move(packet.packet);
+    slice.truncate(header_size + first_chunk);
+    auto* const data = slice.mutable_data();
+    fragment_header(std::bit_cast<uint8_t*>(data), header_size + first_chunk,
+                    header.offset, true);
+    calculate_ipv4_checksum(data, header_size);
+
+    const auto info = parse_packet(data, header_size + first_chunk);
+    fragments.insert(fragments.cbegin(), PacketNode{
+                                             .packet = std::move(slice),
+                                             .addr = packet.addr,
+                                             .captured_at = packet.captured_at,
+                                             .info = info,
+                                         });
+
+    return fragments;
+}
+
+PacketList FragmentModule::split_ipv6(const PacketNode& packet,
+                                      const FragmentHeader& header) {
+    // Only the source fragments IPv6 packets, once
+    if (header.is_fragment)
+        return {};
+
+    const auto* const bytes = packet.packet.data();
+    const size_t header_size = header.header_size;
+    const size_t mtu = m_mtu;
+    const auto chunk_size =
+        mtu > header_size + IPV6_FRAGMENT_HEADER_SIZE
+            ? (mtu - header_size - IPV6_FRAGMENT_HEADER_SIZE) & ~size_t{7}
+            : 0;
+    const size_t data_size = packet.info.length - header_size;
+    if (chunk_size < 8 || data_size <= chunk_size)
+        return {};
+
+    // The fragment header grows the packet, so every fragment is copied
+    const auto count = (data_size + chunk_size - 1) / chunk_size;
+    const auto fragment_header_offset = header_size;
+    const auto buffer = std::make_shared<std::vector<char>>(
+        count * (header_size + IPV6_FRAGMENT_HEADER_SIZE) + data_size);
+    const auto id = m_next_id++;
+
+    PacketList fragments;
+    size_t buffer_offset = 0;
+    for (size_t chunk_offset = 0; chunk_offset < data_size;
+         chunk_offset += chunk_size) {
+        const auto chunk = std::min(chunk_size, data_size - chunk_offset);
+        const auto size = header_size + IPV6_FRAGMENT_HEADER_SIZE + chunk;
+        DenseBufferArraySlice slice(buffer, buffer_offset, size);
+        buffer_offset += size;
+
+        auto* const data = slice.mutable_data();
+        auto* const fragment_bytes = std::bit_cast<uint8_t*>(data);
+        std::memcpy(data, bytes, header_size);
+        std::memcpy(data + header_size + IPV6_FRAGMENT_HEADER_SIZE,
+                    bytes + header_size + chunk_offset, chunk);
+
+        store_be16(fragment_bytes + 4, static_cast<uint16_t>(size - 40));
+        fragment_bytes[header.next_header_offset] = PROTO_FRAGMENT;
+
+        auto* const fragment_header = fragment_bytes + fragment_header_offset;
+        fragment_header[0] =
+            static_cast<uint8_t>(bytes[header.next_header_offset]);
+        fragment_header[1] = 0;
+        store_be16(fragment_header + 2,
+                   static_cast<uint16_t>(
+                       chunk_offset | (chunk_offset + chunk < data_size)));
+        store_be32(fragment_header + 4, id);
+
+        fragments.emplace_back(PacketNode{
+            .packet = std::move(slice),
+            .addr = packet.addr,
+            .captured_at = packet.captured_at,
+            .info = parse_packet(data, size),
+        });
+    }
+
+    return fragments;
+}
+
+void FragmentModule::impair(PacketList& fragments,
+                            PacketClock::time_point now) {
+    std::vector<PacketList::const_iterator> order;
+    for (auto it = fragments.cbegin(); it != fragments.cend();) {
+        const auto it_copy = it++;
+        if (check_chance(m_drop)) {
+            fragments.erase(it_copy);
+        } else if (check_chance(m_delay_chance)) {
+            // Deadlines only grow, so the held fragments stay in order
+            auto deadline = now + m_delay;
+            if (!m_deadlines.empty())
+                deadline = std::max(deadline, m_deadlines.back());
+
+            m_held.splice(m_held.cend(), fragments, it_copy);
+            m_deadlines.push_back(deadline);
+        } else {
+            order.push_back(it_copy);
+        }
+    }
+
+    switch (m_order) {
+    case Order::InOrder:
+        return;
+    case Order::Reverse:
+        std::reverse(order.begin(), order.end());
+        break;
+    case Order::Random:
+        std::shuffle(order.begin(), order.end(), m_rng);
+        break;
+    }
+
+    for (const auto it : order)
+        fragments.splice(fragments.cend(), fragments, it);
+}
+
+FragmentModule::Result FragmentModule::process() {
+    const auto now = PacketClock::now();
+    const auto total_packets = g_packets.size();
+    auto fragmented = 0;
+    for (auto it = g_packets.begin(); it != g_packets.end();) {
+        const auto it_copy = it++;
+        auto& packet = *it_copy;
+        const auto& info = packet.info;
+        if (info.length <= m_mtu ||
+            !check_direction(packet.addr.Outbound, m_inbound, m_outbound))
+            continue;
+
+        const auto header =
+            parse_fragment_header(packet.packet.data(), packet.info);
+        if (!header)
+            continue;
+
+        const auto ipv4 = info.ip_version == 4;
+        const auto dont_fragment =
+            !ipv4 || (packet.packet.data()[6] & 0x40) != 0;
+        if (m_drop_df && dont_fragment) {
+            g_packets.erase(it_copy);
+            continue;
+        }
+
+        auto fragments = ipv4 ? split_ipv4(packet, *header)
+                              : split_ipv6(packet, *header);
+        if (fragments.empty())
+            continue;
+
+        g_packets.erase(it_copy);
+        impair(fragments, now);
+        g_packets.splice(it, fragments);
+        fragmented++;
+    }
+
+    auto dirty = false;
+    const auto indicator =
+        total_packets != 0
+            ? static_cast<float>(fragmented) / static_cast<float>(total_packets)
+            : 0.f;
+    if (!almost_equal(indicator, m_indicator)) {
+        m_indicator = indicator;
+        dirty = true;
+    }
+
+    // Send the delayed fragments that are due
+    while (!m_deadlines.empty() &&
+           (now >= m_deadlines.front() || m_held.size() > MAX_PACKETS)) {
+        g_packets.splice(g_packets.cend(), m_held, m_held.cbegin());
+        m_deadlines.pop_front();
+    }
+
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    if (!m_deadlines.empty())
+        schedule_after = m_deadlines.front() - now;
+
+    return {.schedule_after = schedule_after, .dirty = dirty};
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
+
+#include "clock.hpp"
+#include "lua_util.hpp"
+#include "module.hpp"
+#include "packet.hpp"
+
+// Splits IPv4 and IPv6 packets larger than the MTU into fragments, which can
+// then be dropped, delayed or sent out of order one by one. The first IPv4
+// fragment keeps the packet's buffer, the others share one new buffer.
+class FragmentModule : public Module {
+private:
+    // Threshold for how many fragments to delay at most
+    static inline size_t MAX_PACKETS = 1 << 16;
+    static inline int MIN_MTU = 68;
+    static inline int MAX_MTU = 65535;
+    static inline int MAX_DELAY = 10000;
+
+public:
+    enum class Order : int {
+        InOrder,
+        Reverse,
+        Random,
+    };
+
+public:
+    FragmentModule() {
+        m_display_name = "Fragment";
+        m_short_name = "Fragment";
+    }
+
+    virtual ~FragmentModule() = default;
+
+    bool draw() override;
+
+    void enable() override;
+    void disable() override;
+
+    void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
+
+    Result process() override;
+
+    static void lua_setup(lua_State* L) {
+        luaL_Reg methods[] = {
+            {"mtu", lua_method_mtu},
+            {"drop_df", lua_method_drop_df},
+            {"drop", lua_method_drop},
+            {"order", lua_method_order},
+            {"delay", lua_method_delay},
+            {"delay_chance", lua_method_delay_chance},
+            {},
+        };
+
+        luaL_newmetatable(L, "Fragment");
+
+        // Inherit from `Module`
+        luaL_getmetatable(L, "Module");
+        lua_setmetatable(L, -2);
+
+        luaL_setfuncs(L, methods, 0);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
+private:
+    static int lua_method_mtu(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+
+        int mtu = module->m_mtu;
+        const auto rets = lua_getset(L, mtu, 2);
+        if (rets == 0)
+            module->m_mtu = std::clamp(mtu, MIN_MTU, MAX_MTU);
+
+        return rets;
+    };
+
+    static int lua_method_drop_df(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_drop_df, 2);
+
+        return rets;
+    };
+
+    static int lua_method_drop(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_drop, 2);
+
+        return rets;
+    };
+
+    static int lua_method_order(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+
+        int order = static_cast<int>(module->m_order);
+        const auto rets = lua_getset(L, order, 2);
+        if (rets == 0) {
+            module->m_order = static_cast<Order>(
+                std::clamp(order, 0, static_cast<int>(Order::Random)));
+        }
+
+        return rets;
+    };
+
+    static int lua_method_delay(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+
+        int delay = static_cast<int>(module->m_delay.count());
+        const auto rets = lua_getset(L, delay, 2);
+        if (rets == 0)
+            module->m_delay =
+                std::chrono::milliseconds(std::clamp(delay, 1, MAX_DELAY));
+
+        return rets;
+    };
+
+    static int lua_method_delay_chance(lua_State* L) {
+        auto* module = *std::bit_cast<FragmentModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_delay_chance, 2);
+
+        return rets;
+    };
+
+private:
+    // Fragments of the packet in order, empty if it can't be split up at
+    // the MTU. Takes the buffer of IPv4 packets that are split up.
+    PacketList split_ipv4(PacketNode& packet, const FragmentHeader& header);
+    PacketList split_ipv6(const PacketNode& packet,
+                          const FragmentHeader& header);
+    // Drops, delays and reorders the fragments of one packet
+    void impair(PacketList& fragments, PacketClock::time_point now);
+
+private:
+    bool m_inbound = true;
+    bool m_outbound = true;
+    int m_mtu = 1280;
+    // Drops packets over the MTU that may not be fragmented, like routers
+    // do. That's IPv4 packets with the don't fragment flag and all IPv6
+    // packets.
+    bool m_drop_df = false;
+    // Chances per fragment in percent
+    float m_drop = 0.f;
+    Order m_order = Order::InOrder;
+    std::chrono::milliseconds m_delay{50};
+    float m_delay_chance = 0.f;
+
+    std::mt19937_64 m_rng{std::random_device{}()};
+    uint32_t m_next_id = static_cast<uint32_t>(m_rng());
+
+    // Delayed fragments and when they're due, in the same order
+    PacketList m_held;
+    std::deque<PacketClock::time_point> m_deadlines;
+};
@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#include "clock.hpp"
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "generator.hpp"
+#include "packet.hpp"
+
+using namespace std::chrono_literals;
+
+namespace {
+
+// Headers of a flow, only lengths, ids and sequence numbers change per packet
+struct Flow {
+    std::array<char, 60> header;
+    uint8_t header_size;
+    bool ipv6;
+    bool tcp;
+    bool outbound;
+    uint16_t ip_id;
+    uint32_t seq;
+};
+
+} // namespace
+
+static void write16(char* data, uint16_t value) {
+    data[0] = static_cast<char>(value >> 8);
+    data[1] = static_cast<char>(value);
+}
+
+static void write32(char* data, uint32_t value) {
+    write16(data, static_cast<uint16_t>(value >> 16));
+    write16(data + 2, static_cast<uint16_t>(value));
+}
+
+static uint16_t ipv4_checksum(const char* header) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < 20; i += 2)
+        sum += (static_cast<uint8_t>(header[i]) << 8) |
+               static_cast<uint8_t>(header[i + 1]);
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return static_cast<uint16_t>(~sum);
+}
+
+static Flow make_flow(uint32_t index, bool ipv6, bool tcp, bool outbound) {
+    Flow flow{};
+    flow.ipv6 = ipv6;
+    flow.tcp = tcp;
+    flow.outbound = outbound;
+
+    // 10.0.0.0/9 and fd00::/64 hosts talking to a single server, inbound
+    // flows have them swapped
+    auto* const ip = flow.header.data();
+    size_t ip_size = 0;
+    const auto local = index + 1;
+    if (ipv6) {
+        ip_size = 40;
+        ip[0] = 0x60;
+        ip[6] = static_cast<char>(tcp ? 6 : 17);
+        ip[7] = 64;
+
+        std::array<char, 16> host{};
+        std::array<char, 16> server{};
+        host[0] = server[0] = static_cast<char>(0xfd);
+        server[7] = 1;
+        write32(host.data() + 12, local);
+        server[15] = 1;
+
+        memcpy(ip + 8, outbound ? host.data() : server.data(), 16);
+        memcpy(ip + 24, outbound ? server.data() : host.data(), 16);
+    } else {
+        ip_size = 20;
+        ip[0] = 0x45;
+        // Don't fragment
+        ip[6] = 0x40;
+        ip[8] = 64;
+        ip[9] = static_cast<char>(tcp ? 6 : 17);
+
+        const uint32_t host = 0x0a000000 | (local & 0x7fffff);
+        const uint32_t server = 0x0a800001;
+        write32(ip + 12, outbound ? host : server);
+        write32(ip + 16, outbound ? server : host);
+    }
+
+    auto* const transport = ip + ip_size;
+    const auto host_port = static_cast<uint16_t>(1024 + index % 64512);
+    const uint16_t server_port = tcp ? 80 : 9;
+    write16(transport, outbound ? host_port : server_port);
+    write16(transport + 2, outbound ? server_port : host_port);
+    if (tcp) {
+        // Data offset and ACK | PSH
+        transport[12] = 0x50;
+        transport[13] = 0x18;
+        write16(transport + 14, 0xffff);
+        flow.header_size = static_cast<uint8_t>(ip_size + 20);
+    } else {
+        flow.header_size = static_cast<uint8_t>(ip_size + 8);
+    }
+
+    return flow;
+}
+
+static std::optional<std::string>
+parse_settings(const std::string& filter,
+               TrafficGenerator::Settings& settings) {
+    const auto parse_number = [](std::string_view text, uint64_t max,
+                                 auto& value) {
+        uint64_t number = 0;
+        const auto [ptr, ec] =
+            std::from_chars(text.data(), text.data() + text.size(), number);
+        if (ec != std::errc() || ptr != text.data() + text.size() ||
+            number > max)
+            return false;
+
+        value = static_cast<std::remove_reference_t<decltype(value)>>(number);
+        return true;
+    };
+
+    std::istringstream stream(filter);
+    std::string token;
+    while (stream >> token) {
+        const auto separator = token.find('=');
+        if (separator == std::string::npos)
+            return "expected key=value, got '" + token + "'";
+
+        const auto key = std::string_view(token).substr(0, separator);
+        const auto value = std::string_view(token).substr(separator + 1);
+
+        auto valid = true;
+        if (key == "rate") {
+            valid = parse_number(value, 1'000'000'000, settings.rate) &&
+                    settings.rate != 0;
+        } else if (key == "duration") {
+            valid = parse_number(value, 1'000'000, settings.duration);
+        } else if (key == "count") {
+            uint64_t count = 0;
+            valid = parse_number(value, UINT64_MAX, count);
+            settings.count = count;
+        } else if (key == "flows") {
+            valid = parse_number(value, 1 << 23, settings.flows) &&
+                    settings.flows != 0;
+        } else if (key == "size") {
+            settings.imix = value == "imix";
+            if (!settings.imix) {
+                const auto dash = value.find('-');
+                valid = parse_number(value.substr(0, dash), 0xffff,
+                                     settings.min_size);
+                settings.max_size = settings.min_size;
+                if (valid && dash != std::string_view::npos)
+                    valid = parse_number(value.substr(dash + 1), 0xffff,
+                                         settings.max_size) &&
+                            settings.min_size <= settings.max_size;
+            }
+        } else if (key == "tcp") {
+            valid = parse_number(value, 100, settings.tcp);
+        } else if (key == "ipv6") {
+            valid = parse_number(value, 100, settings.ipv6);
+        } else if (key == "inbound") {
+            valid = parse_number(value, 100, settings.inbound);
+        } else if (key == "seed") {
+            valid = parse_number(value, UINT64_MAX, settings.seed);
+        } else {
+            return "unknown setting '" + std::string(key) + "'";
+        }
+
+        if (!valid)
+            return "invalid value for '" + std::string(key) + "'";
+    }
+
+    return std::nullopt;
+}
+
+std::optional<std::string> TrafficGenerator::start(const std::string& filter) {
+    LOG("Starting");
+
+    m_settings = {};
+    if (const auto err = parse_settings(filter, m_settings))
+        return "Failed to start generator: " + *err;
+
+    m_stats = {};
+    m_stop = false;
+    m_finished = false;
+
+    m_buffer_pool = BufferPool::create({
+        .buffer_size = BUFFER_SIZE,
+        .buffer_count = BUFFER_COUNT,
+        .prefault = true,
+        .huge_pages = true,
+    });
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .settings = m_settings,
+        .stats = m_stats,
+        .stop = m_stop,
+        .finished = m_finished,
+        .buffer_pool = *m_buffer_pool,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+    m_running = true;
+
+    return std::nullopt;
+}
+
+bool TrafficGenerator::stop() {
+    if (!m_running)
+        return false;
+
+    LOG("Stopping");
+
+    m_stop = true;
+
+    LOG("Waiting for the generator thread");
+    m_thread.join();
+    m_running = false;
+    m_buffer_pool = nullptr;
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("Generator stopped");
+
+    return true;
+}
+
+std::optional<std::string> TrafficGenerator::summary() const {
+    if (!finished())
+        return std::nullopt;
+
+    const auto elapsed_seconds =
+        std::chrono::duration<double>(m_stats.elapsed).count();
+    const auto generated_seconds =
+        std::chrono::duration<double>(m_stats.generated_time).count();
+    const auto rate =
+        elapsed_seconds > 0. ? static_cast<double>(m_stats.generated) /
+                                   elapsed_seconds
+                             : 0.;
+    const auto delivered =
+        m_stats.generated > 0
+            ? 100. * static_cast<double>(m_stats.received) /
+                  static_cast<double>(m_stats.generated)
+            : 0.;
+    const auto mean_delay_ms =
+        m_stats.received > 0
+            ? std::chrono::duration<double, std::milli>(m_stats.delay)
+                      .count() /
+                  static_cast<double>(m_stats.received)
+            : 0.;
+
+    std::string summary(512, '\0');
+    const auto length = snprintf(
+        summary.data(), summary.size(),
+        "Generated %llu packets (%llu bytes), %llu packets (%llu bytes, "
+        "%.2f%%) left the modules after %.3fms on average. "
+        "%.3fs of traffic in %.3fs (%.0f packets/s)",
+        static_cast<unsigned long long>(m_stats.generated),
+        static_cast<unsigned long long>(m_stats.generated_bytes),
+        static_cast<unsigned long long>(m_stats.received),
+        static_cast<unsigned long long>(m_stats.received_bytes), delivered,
+        mean_delay_ms, generated_seconds, elapsed_seconds, rate);
+    summary.resize(std::max(length, 0));
+
+    return summary;
+}
+
+void TrafficGenerator::thread(ThreadData thread_data) {
+    const auto& settings = thread_data.settings;
+    auto& stats = thread_data.stats;
+    const auto started_at = std::chrono::steady_clock::now();
+
+    std::mt19937_64 rng(settings.seed);
+    const auto percent = [&](uint8_t share) { return rng() % 100 < share; };
+
+    std::vector<Flow> flows;
+    flows.reserve(settings.flows);
+    for (uint32_t i = 0; i < settings.flows; i++) {
+        const auto ipv6 = percent(settings.ipv6);
+        const auto tcp = percent(settings.tcp);
+        const auto outbound = !percent(settings.inbound);
+        flows.emplace_back(make_flow(i, ipv6, tcp, outbound));
+    }
+
+    std::uniform_int_distribution<uint32_t> flow_distribution(
+        0, settings.flows - 1);
+    std::uniform_int_distribution<uint16_t> size_distribution(
+        settings.min_size, settings.max_size);
+    const auto next_size = [&]() -> uint16_t {
+        if (!settings.imix)
+            return size_distribution(rng);
+
+        // 7:4:1
+        const auto pick = rng() % 12;
+        return pick < 7 ? 40 : pick < 11 ? 576 : 1500;
+    };
+
+    const auto total = settings.count.value_or(settings.rate *
+                                               settings.duration);
+    const auto interval_ns = 1e9 / static_cast<double>(settings.rate);
+    const auto time_of = [&](uint64_t index) {
+        return PacketClock::time_point(
+            std::chrono::duration_cast<PacketClock::time_point::duration>(
+                std::chrono::nanoseconds(static_cast<uint64_t>(
+                    static_cast<double>(index) * interval_ns))));
+    };
+
+    std::shared_ptr<char> dense_buffer;
+    size_t buffer_offset = 0;
+
+    uint64_t next_index = 0;
+    PacketClock::time_point now{};
+    PacketClock::set_virtual(now);
+    std::optional<PacketClock::time_point> wakeup;
+
+    const auto receive_packets = [&] {
+        for (const auto& packet : g_packets) {
+            stats.received++;
+            stats.received_bytes += packet.packet.size();
+            stats.delay += now - packet.captured_at;
+        }
+
+        g_packets.clear();
+    };
+
+    while (!thread_data.stop.load(std::memory_order_relaxed)) {
+        if (next_index == total && !wakeup)
+            break;
+
+        if (next_index < total &&
+            (!wakeup || time_of(next_index) <= *wakeup)) {
+            // Generate a batch of packets less than a millisecond apart, the
+            // clock is at the last packet of it
+            auto batch_end = time_of(next_index) + 1ms;
+            if (wakeup)
+                batch_end = std::min(batch_end, *wakeup);
+
+            size_t packet_count = 0;
+            do {
+                const auto captured_at = time_of(next_index);
+                now = captured_at;
+
+                auto& flow = flows[flow_distribution(rng)];
+                const size_t size =
+                    std::max<size_t>(next_size(), flow.header_size);
+                if (!dense_buffer || BUFFER_SIZE - buffer_offset < size) {
+                    dense_buffer = thread_data.buffer_pool.lease();
+                    buffer_offset = 0;
+                }
+
+                auto* const data = dense_buffer.get() + buffer_offset;
+                memcpy(data, flow.header.data(), flow.header_size);
+                if (flow.ipv6) {
+                    write16(data + 4, static_cast<uint16_t>(size - 40));
+                } else {
+                    write16(data + 2, static_cast<uint16_t>(size));
+                    write16(data + 4, flow.ip_id++);
+                    write16(data + 10, ipv4_checksum(data));
+                }
+
+                auto* const transport = data + (flow.ipv6 ? 40 : 20);
+                if (flow.tcp) {
+                    write32(transport + 4, flow.seq);
+                    flow.seq += size - flow.header_size;
+                } else {
+                    write16(transport + 4, static_cast<uint16_t>(
+                                               size - (flow.ipv6 ? 40 : 20)));
+                }
+
+                PacketAddress addr{};
+                addr.Outbound = flow.outbound;
+
+                g_packets.emplace_back(PacketNode{
+                    .packet = DenseBufferArraySlice(dense_buffer,
+                                                    buffer_offset, size),
+                    .addr = addr,
+                    .captured_at = captured_at,
+                });
+
+                buffer_offset += size;
+                stats.generated++;
+                stats.generated_bytes += size;
+                next_index++;
+            } while (++packet_count < MAX_PACKETS && next_index < total &&
+                     time_of(next_index) <= batch_end);
+
+            PacketClock::set_virtual(now);
+        } else {
+            now = *wakeup;
+            PacketClock::set_virtual(now);
+        }
+
+        // Run modules
+        const auto result = run_modules(thread_data.modules);
+
+        // Time has to move forward for the wakeup to make progress
+        wakeup = std::nullopt;
+        if (result.schedule_after)
+            wakeup = now + std::max<PacketClock::time_point::duration>(
+                               *result.schedule_after, 1us);
+
+        receive_packets();
+    }
+
+    // Whatever modules are still holding arrives at the end
+    flush_modules(thread_data.modules);
+    receive_packets();
+
+    PacketClock::set_virtual(std::nullopt);
+
+    stats.generated_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now.time_since_epoch());
+    stats.elapsed = std::chrono::steady_clock::now() - started_at;
+    thread_data.finished.store(true, std::memory_order_release);
+
+    LOG("Generator finished");
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include "backend.hpp"
+#include "buffer_pool.hpp"
+#include "module.hpp"
+
+// Offline backend generating UDP and TCP packets in memory and counting what
+// comes out of the modules, as fast as possible. Like `PcapReplay`, modules
+// see the generated timestamps as their clock, so runs are repeatable and
+// independent of the hardware.
+// The filter is a list of `key=value` settings, e.g.
+//   rate=1000000 duration=10 flows=1024 size=imix tcp=50 ipv6=25
+class TrafficGenerator : public PacketBackend {
+public:
+    static const inline size_t BUFFER_SIZE = 0x40000;
+    static const inline size_t BUFFER_COUNT = 64;
+    static const inline size_t MAX_PACKETS = 32;
+
+    struct Settings {
+        // Packets per second of generated time
+        uint64_t rate = 1'000'000;
+        // Seconds of generated time, unless a packet count is given
+        uint64_t duration = 10;
+        std::optional<uint64_t> count;
+        uint32_t flows = 1024;
+        // IP packet size range, `imix` picks 40/576/1500 bytes at 7:4:1
+        uint16_t min_size = 40;
+        uint16_t max_size = 1500;
+        bool imix = true;
+        // Percentage of TCP, IPv6 and inbound flows
+        uint8_t tcp = 0;
+        uint8_t ipv6 = 0;
+        uint8_t inbound = 0;
+        uint64_t seed = 1;
+    };
+
+public:
+    explicit TrafficGenerator(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    TrafficGenerator(const TrafficGenerator&) = delete;
+    TrafficGenerator(TrafficGenerator&&) = delete;
+    TrafficGenerator& operator=(const TrafficGenerator&) = delete;
+    TrafficGenerator& operator=(TrafficGenerator&&) = delete;
+
+    ~TrafficGenerator() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+    [[nodiscard]] bool finished() const override {
+        return m_finished.load(std::memory_order_acquire);
+    }
+    [[nodiscard]] std::optional<std::string> summary() const override;
+
+private:
+    struct Stats {
+        uint64_t generated = 0;
+        uint64_t generated_bytes = 0;
+        uint64_t received = 0;
+        uint64_t received_bytes = 0;
+        // Sum of the time received packets spent in the modules
+        std::chrono::nanoseconds delay{};
+        std::chrono::nanoseconds generated_time{};
+        std::chrono::steady_clock::duration elapsed{};
+    };
+
+    struct ThreadData {
+        const Settings& settings;
+        Stats& stats;
+        const std::atomic_bool& stop;
+        std::atomic_bool& finished;
+        BufferPool& buffer_pool;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+private:
+    std::thread m_thread;
+    bool m_running = false;
+    std::atomic_bool m_stop = false;
+    std::atomic_bool m_finished = false;
+
+    Settings m_settings;
+    Stats m_stats;
+    std::shared_ptr<BufferPool> m_buffer_pool;
+};
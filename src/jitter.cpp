@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <fstream>
+#include <imgui.h>
+#include <sstream>
+
+#include "common.hpp"
+#include "jitter.hpp"
+
+static constexpr std::array DISTRIBUTION_NAMES = {
+    "Uniform", "Normal", "Pareto", "Pareto-normal", "Empirical",
+};
+
+static constexpr std::array DISTRIBUTION_KEYS = {
+    "uniform", "normal", "pareto", "paretonormal", "empirical",
+};
+
+bool JitterModule::draw() {
+    bool dirty = false;
+
+    ImGui::PushID(m_short_name);
+    ImGui::BeginGroup();
+
+    ImGui::PushStyleColor(ImGuiCol_Text, {m_indicator, 0.f, 0.f, 1.f});
+    ImGui::Bullet();
+    ImGui::PopStyleColor();
+
+    if (m_indicator > 0.f) {
+        m_indicator -= ImGui::GetIO().DeltaTime * 10.f;
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::Text("%s", m_display_name);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Enable", &m_enabled);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Inbound", &m_inbound);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Outbound", &m_outbound);
+
+    ImGui::SameLine();
+
+    auto distribution = static_cast<int>(m_distribution);
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::Combo("Distribution", &distribution, DISTRIBUTION_NAMES.data(),
+                     DISTRIBUTION_NAMES.size())) {
+        m_distribution = static_cast<Distribution>(distribution);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    if (m_distribution == Distribution::Empirical) {
+        ImGui::Text("%s", m_cdf ? m_cdf_path.c_str() : "No CDF loaded");
+    } else {
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputFloat("Mean", &m_mean)) {
+            m_mean = std::max(m_mean, 0.f);
+            dirty = true;
+        }
+
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputFloat("Jitter", &m_jitter)) {
+            m_jitter = std::max(m_jitter, 0.f);
+            dirty = true;
+        }
+    }
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Reorder", &m_reorder);
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat("Chance", &m_chance)) {
+        m_chance = std::clamp(m_chance, 0.f, 100.f);
+        dirty = true;
+    }
+
+    ImGui::EndGroup();
+    ImGui::PopID();
+
+    return dirty;
+}
+
+void JitterModule::enable() {
+    LOG("Enabling");
+    assert(m_held_packets.empty());
+}
+
+void JitterModule::disable() {
+    LOG("Disabling, flushing %zu packets", m_held_packets.size());
+
+    // Send all held packets in the order they were due
+    while (!m_deadlines.empty()) {
+        g_packets.splice(g_packets.cend(), m_held_packets,
+                         m_deadlines.top().packet);
+        m_deadlines.pop();
+    }
+
+    m_indicator = 0.f;
+}
+
+void JitterModule::apply_config(const toml::table& config) {
+    Module::apply_config(config);
+
+    m_inbound = config["inbound"].value_or(true);
+    m_outbound = config["outbound"].value_or(true);
+
+    m_chance = std::clamp(config["chance"].value_or(100.f), 0.f, 100.f);
+    m_mean = std::max(config["mean"].value_or(50.f), 0.f);
+    m_jitter = std::max(config["jitter"].value_or(10.f), 0.f);
+    m_reorder = config["reorder"].value_or(true);
+
+    const std::string_view distribution =
+        config["distribution"].value_or("normal");
+    const auto it = std::find(DISTRIBUTION_KEYS.begin(),
+                              DISTRIBUTION_KEYS.end(), distribution);
+    if (it != DISTRIBUTION_KEYS.end()) {
+        m_distribution =
+            static_cast<Distribution>(it - DISTRIBUTION_KEYS.begin());
+    } else {
+        LOG("Unknown distribution '%.*s'",
+            static_cast<int>(distribution.size()), distribution.data());
+    }
+
+    m_cdf_path = config["cdf_file"].value_or("");
+    m_cdf = m_cdf_path.empty() ? nullptr : load_cdf(m_cdf_path);
+    if (m_distribution == Distribution::Empirical && !m_cdf)
+        LOG("Empirical distribution without a CDF, packets aren't delayed");
+}
+
+void JitterModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& jitter = static_cast<const JitterModule&>(other);
+    m_inbound = jitter.m_inbound;
+    m_outbound = jitter.m_outbound;
+    m_chance = jitter.m_chance;
+    m_distribution = jitter.m_distribution;
+    m_mean = jitter.m_mean;
+    m_jitter = jitter.m_jitter;
+    m_reorder = jitter.m_reorder;
+    m_cdf_path = jitter.m_cdf_path;
+    m_cdf = jitter.m_cdf;
+}
+
+std::shared_ptr<const std::vector<JitterModule::CdfPoint>>
+JitterModule::load_cdf(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        LOG("Opening CDF '%s' failed", path.c_str());
+        return nullptr;
+    }
+
+    std::vector<CdfPoint> points;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (const auto comment = line.find('#'); comment != line.npos)
+            line.resize(comment);
+
+        std::istringstream stream(line);
+        CdfPoint point{};
+        if (!(stream >> point.delay_ms))
+            continue;
+
+        if (!(stream >> point.probability) || point.delay_ms < 0.0 ||
+            point.probability < 0.0) {
+            LOG("Ignoring invalid CDF line '%s'", line.c_str());
+            continue;
+        }
+
+        points.push_back(point);
+    }
+
+    // A CDF grows with the delay
+    std::sort(points.begin(), points.end(),
+              [](const CdfPoint& a, const CdfPoint& b) {
+                  return a.delay_ms < b.delay_ms;
+              });
+    for (size_t i = 1; i < points.size(); i++) {
+        points[i].probability =
+            std::max(points[i].probability, points[i - 1].probability);
+    }
+
+    if (points.empty() || points.back().probability <= 0.0) {
+        LOG("CDF '%s' has no points", path.c_str());
+        return nullptr;
+    }
+
+    const auto total = points.back().probability;
+    for (auto& point : points)
+        point.probability /= total;
+
+    LOG("Loaded %zu CDF points from '%s'", points.size(), path.c_str());
+    return std::make_shared<const std::vector<CdfPoint>>(std::move(points));
+}
+
+double JitterModule::next_delay() {
+    const double mean = m_mean;
+    const double jitter = m_jitter;
+
+    const auto normal = [&] {
+        return std::normal_distribution<double>(mean, jitter)(m_rng);
+    };
+
+    // Shape and scale picked so the mean and standard deviation match
+    const auto pareto = [&] {
+        if (jitter <= 0.0 || mean <= 0.0)
+            return mean;
+
+        const auto ratio = mean / jitter;
+        const auto shape = 1.0 + std::sqrt(1.0 + ratio * ratio);
+        const auto scale = mean * (shape - 1.0) / shape;
+        const auto uniform =
+            std::uniform_real_distribution<double>(0.0, 1.0)(m_rng);
+        return scale / std::pow(1.0 - uniform, 1.0 / shape);
+    };
+
+    switch (m_distribution) {
+    case Distribution::Uniform:
+        return std::uniform_real_distribution<double>(mean - jitter,
+                                                      mean + jitter)(m_rng);
+    case Distribution::Normal:
+        return jitter > 0.0 ? normal() : mean;
+    case Distribution::Pareto:
+        return pareto();
+    case Distribution::ParetoNormal:
+        return (jitter > 0.0 ? normal() : mean) / 4.0 + pareto() * 3.0 / 4.0;
+    case Distribution::Empirical: {
+        if (!m_cdf)
+            return 0.0;
+
+        // Inverse transform, interpolating between points
+        const auto& points = *m_cdf;
+        const auto uniform =
+            std::uniform_real_distribution<double>(0.0, 1.0)(m_rng);
+        const auto it = std::lower_bound(
+            points.begin(), points.end(), uniform,
+            [](const CdfPoint& point, double probability) {
+                return point.probability < probability;
+            });
+        if (it == points.begin())
+            return it->delay_ms;
+        if (it == points.end())
+            return points.back().delay_ms;
+
+        const auto& low = *std::prev(it);
+        const auto& high = *it;
+        const auto span = high.probability - low.probability;
+        if (span <= 0.0)
+            return high.delay_ms;
+
+        return low.delay_ms + (high.delay_ms - low.delay_ms) *
+                                  (uniform - low.probability) / span;
+    }
+    }
+
+    return mean;
+}
+
+JitterModule::Result JitterModule::process() {
+    const auto current_time_point = PacketClock::now();
+    for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
+        const auto it_copy = it++;
+        const auto& packet = *it_copy;
+        if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound) ||
+            !check_chance(m_chance))
+            continue;
+
+        const auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double, std::milli>(
+                std::max(next_delay(), 0.0)));
+        auto deadline = packet.captured_at + delay;
+
+        // Not before anything held earlier
+        if (!m_reorder)
+            deadline = std::max(deadline, m_last_deadline);
+        m_last_deadline = std::max(m_last_deadline, deadline);
+
+        m_held_packets.splice(m_held_packets.cend(), g_packets, it_copy);
+        m_deadlines.push(HeldPacket{
+            .deadline = deadline,
+            .sequence = m_sequence++,
+            .packet = std::prev(m_held_packets.cend()),
+        });
+    }
+
+    // Try sending overdue packets
+    auto dirty = false;
+    if (m_indicator > 0.f) {
+        m_indicator = 0.f;
+        dirty = true;
+    }
+
+    while (!m_deadlines.empty() &&
+           (current_time_point >= m_deadlines.top().deadline ||
+            m_held_packets.size() > MAX_PACKETS)) {
+        g_packets.splice(g_packets.cend(), m_held_packets,
+                         m_deadlines.top().packet);
+        m_deadlines.pop();
+        m_indicator = 1.f;
+        dirty = true;
+    }
+
+    // Wake up when the next one is due
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    if (!m_deadlines.empty())
+        schedule_after = m_deadlines.top().deadline - current_time_point;
+
+    return {.schedule_after = schedule_after, .dirty = dirty};
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "clock.hpp"
+#include "lua_util.hpp"
+#include "module.hpp"
+#include "packet.hpp"
+
+// Delays every packet by its own random amount. Delays are drawn from a
+// distribution with the given mean and jitter (standard deviation, or the
+// spread of the uniform distribution) or from an empirical CDF.
+class JitterModule : public Module {
+private:
+    // Threshold for how many packet to hold at most
+    static inline size_t MAX_PACKETS = 1 << 20;
+
+public:
+    enum class Distribution : int {
+        Uniform,
+        Normal,
+        Pareto,
+        // 1/4 normal and 3/4 Pareto, like netem's paretonormal
+        ParetoNormal,
+        Empirical,
+    };
+
+    // Point of an empirical CDF, probabilities are normalized to end at 1
+    struct CdfPoint {
+        double delay_ms;
+        double probability;
+    };
+
+public:
+    JitterModule() {
+        m_display_name = "Jitter";
+        m_short_name = "Jitter";
+    }
+
+    virtual ~JitterModule() = default;
+
+    bool draw() override;
+
+    void enable() override;
+    void disable() override;
+
+    void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
+
+    Result process() override;
+
+    // Reads `delay_ms probability` pairs, one per line. `#` starts a
+    // comment.
+    static std::shared_ptr<const std::vector<CdfPoint>>
+    load_cdf(const std::string& path);
+
+    static void lua_setup(lua_State* L) {
+        luaL_Reg methods[] = {
+            {"chance", lua_method_chance},
+            {"distribution", lua_method_distribution},
+            {"mean", lua_method_mean},
+            {"jitter", lua_method_jitter},
+            {"reorder", lua_method_reorder},
+            {},
+        };
+
+        luaL_newmetatable(L, "Jitter");
+
+        // Inherit from `Module`
+        luaL_getmetatable(L, "Module");
+        lua_setmetatable(L, -2);
+
+        luaL_setfuncs(L, methods, 0);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
+private:
+    static int lua_method_chance(lua_State* L) {
+        auto* module = *std::bit_cast<JitterModule**>(lua_touserdata(L, 1));
+
+        float chance = module->m_chance;
+        const auto rets = lua_getset(L, chance, 2);
+        if (rets == 0)
+            module->m_chance = std::clamp(chance, 0.f, 100.f);
+
+        return rets;
+    };
+
+    // Index into the distributions, an empirical one uses the CDF loaded
+    // from the config
+    static int lua_method_distribution(lua_State* L) {
+        auto* module = *std::bit_cast<JitterModule**>(lua_touserdata(L, 1));
+
+        int distribution = static_cast<int>(module->m_distribution);
+        const auto rets = lua_getset(L, distribution, 2);
+        if (rets == 0) {
+            module->m_distribution = static_cast<Distribution>(std::clamp(
+                distribution, 0, static_cast<int>(Distribution::Empirical)));
+        }
+
+        return rets;
+    };
+
+    static int lua_method_mean(lua_State* L) {
+        auto* module = *std::bit_cast<JitterModule**>(lua_touserdata(L, 1));
+
+        float mean = module->m_mean;
+        const auto rets = lua_getset(L, mean, 2);
+        if (rets == 0)
+            module->m_mean = std::max(mean, 0.f);
+
+        return rets;
+    };
+
+    static int lua_method_jitter(lua_State* L) {
+        auto* module = *std::bit_cast<JitterModule**>(lua_touserdata(L, 1));
+
+        float jitter = module->m_jitter;
+        const auto rets = lua_getset(L, jitter, 2);
+        if (rets == 0)
+            module->m_jitter = std::max(jitter, 0.f);
+
+        return rets;
+    };
+
+    static int lua_method_reorder(lua_State* L) {
+        auto* module = *std::bit_cast<JitterModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_reorder, 2);
+
+        return rets;
+    };
+
+    // In milliseconds
+    double next_delay();
+
+private:
+    struct HeldPacket {
+        PacketClock::time_point deadline;
+        // Breaks ties, so packets with the same deadline keep their order
+        uint64_t sequence;
+        PacketList::const_iterator packet;
+
+        bool operator>(const HeldPacket& other) const noexcept {
+            return deadline != other.deadline ? deadline > other.deadline
+                                              : sequence > other.sequence;
+        }
+    };
+
+    bool m_inbound = true;
+    bool m_outbound = true;
+    float m_chance = 100.f;
+    Distribution m_distribution = Distribution::Normal;
+    // Milliseconds
+    float m_mean = 50.f;
+    float m_jitter = 10.f;
+    // Let packets overtake each other, otherwise a packet never leaves
+    // before the ones held before it
+    bool m_reorder = true;
+
+    std::string m_cdf_path;
+    std::shared_ptr<const std::vector<CdfPoint>> m_cdf;
+
+    std::mt19937_64 m_rng{std::random_device{}()};
+
+    PacketList m_held_packets;
+    // Earliest deadline on top
+    std::priority_queue<HeldPacket, std::vector<HeldPacket>,
+                        std::greater<HeldPacket>>
+        m_deadlines;
+    uint64_t m_sequence = 0;
+    PacketClock::time_point m_last_deadline;
+};
@@ -4,6 +4,7 @@
 #include <imgui.h>
 #include <optional>
 
+#include "clock.hpp"
 #include "common.hpp"
 #include "lag.hpp"
 #include "packet.hpp"
@@ -88,16 +89,41 @@ void LagModule::apply_config(const toml::table& config) {
         std::max(config["lag_time"].value_or(200), 0));
 }
 
+void LagModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& lag = static_cast<const LagModule&>(other);
+    m_inbound = lag.m_inbound;
+    m_outbound = lag.m_outbound;
+    m_chance = lag.m_chance;
+    m_lag_time = lag.m_lag_time;
+}
+
+void LagModule::apply_stream_policy(bool outbound,
+                                    StreamPolicy& policy) const {
+    // Every byte is delayed, chance has no meaning for a stream
+    if (check_direction(outbound, m_inbound, m_outbound))
+        policy.delay += m_lag_time;
+}
+
 LagModule::Result LagModule::process() {
-    const auto current_time_point = std::chrono::steady_clock::now();
+    const auto current_time_point = PacketClock::now();
     for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
         const auto it_copy = it++;
         const auto& packet = *it_copy;
-        if (check_direction(packet.addr.Outbound, m_inbound, m_outbound) &&
-            check_chance(m_chance)) {
-            m_lagged_packets.splice(m_lagged_packets.cend(), g_packets,
-                                    it_copy);
-        }
+        if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound) ||
+            !check_chance(m_chance))
+            continue;
+
+        // Every packet is held for the same time, so keeping them ordered by
+        // capture time orders them by deadline too. Packets arrive in capture
+        // order, the right spot is almost always the back.
+        auto pos = m_lagged_packets.cend();
+        while (pos != m_lagged_packets.cbegin() &&
+               std::prev(pos)->captured_at > packet.captured_at)
+            --pos;
+
+        m_lagged_packets.splice(pos, g_packets, it_copy);
     }
 
     // Try sending overdue packets
@@ -107,33 +133,30 @@ LagModule::Result LagModule::process() {
         dirty = true;
     }
 
-    std::optional<std::chrono::milliseconds> schedule_after = std::nullopt;
-    for (auto it = m_lagged_packets.cbegin(); it != m_lagged_packets.cend();) {
-        const auto it_copy = it++;
-        const auto& packet = *it_copy;
+    while (!m_lagged_packets.empty() &&
+           current_time_point >=
+               m_lagged_packets.front().captured_at + m_lag_time) {
+        g_packets.splice(g_packets.cend(), m_lagged_packets,
+                         m_lagged_packets.cbegin());
+        m_indicator = 1.f;
+        dirty = true;
+    }
 
-        if (current_time_point > packet.captured_at + m_lag_time) {
-            g_packets.splice(g_packets.cend(), m_lagged_packets, it_copy);
-            m_indicator = 1.f;
-            dirty = true;
-        } else {
-            const auto will_send_after_ms =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    packet.captured_at + m_lag_time - current_time_point);
-
-            if (schedule_after) {
-                schedule_after = std::chrono::milliseconds(std::min(
-                    schedule_after->count(), will_send_after_ms.count()));
-            } else {
-                schedule_after = will_send_after_ms;
-            }
+    // If buffer is full let the oldest ones go early
+    if (m_lagged_packets.size() > MAX_PACKETS) {
+        const auto overflow = m_lagged_packets.size() - MAX_PACKETS;
+        LOG("Buffer full, releasing %zu packets early", overflow);
+        for (size_t i = 0; i < overflow; i++) {
+            g_packets.splice(g_packets.cend(), m_lagged_packets,
+                             m_lagged_packets.cbegin());
         }
     }
 
-    // If buffer is full just flush things out
-    if (m_lagged_packets.size() > MAX_PACKETS) {
-        LOG("Buffer full, flushing");
-        g_packets.splice(g_packets.cend(), m_lagged_packets);
+    // Wake up when the next one is due
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    if (!m_lagged_packets.empty()) {
+        schedule_after = m_lagged_packets.front().captured_at + m_lag_time -
+                         current_time_point;
     }
 
     return {.schedule_after = schedule_after, .dirty = dirty};
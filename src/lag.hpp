@@ -4,12 +4,10 @@
 #include "module.hpp"
 #include "packet.hpp"
 
-using namespace std::chrono_literals;
-
 class LagModule : public Module {
 private:
-    // Threshold for how many packet to throttle at most
-    static inline size_t MAX_PACKETS = 1024;
+    // Threshold for how many packet to lag at most
+    static inline size_t MAX_PACKETS = 1 << 20;
 
 public:
     LagModule() {
@@ -25,9 +23,13 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
+    void apply_stream_policy(bool outbound,
+                             StreamPolicy& policy) const override;
+
     static void lua_setup(lua_State* L) {
         luaL_Reg methods[] = {
             {"chance", lua_method_chance},
@@ -73,7 +75,8 @@ private:
     bool m_inbound = true;
     bool m_outbound = true;
     float m_chance = 10.f;
-    std::chrono::milliseconds m_lag_time = 200ms;
+    std::chrono::milliseconds m_lag_time{200};
 
-    std::list<PacketNode> m_lagged_packets;
+    // Ordered by capture time
+    PacketList m_lagged_packets;
 };
@@ -1,13 +1,20 @@
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#endif
 
 #include <SDL.h>
 #include <cassert>
 
 #include "bandwidth.hpp"
+#include "defragment.hpp"
 #include "drop.hpp"
 #include "duplicate.hpp"
+#include "fragment.hpp"
+#include "jitter.hpp"
 #include "lag.hpp"
+#include "ood.hpp"
+#include "reset.hpp"
 #include "tamper.hpp"
 #include "throttle.hpp"
 
@@ -82,12 +89,17 @@ void Lua::push_api(const std::vector<std::shared_ptr<Module>>& modules) {
 
     LOG("Initializing modules api");
     Module::lua_setup(L);
+    DefragmentModule::lua_setup(L);
     LagModule::lua_setup(L);
+    JitterModule::lua_setup(L);
     DropModule::lua_setup(L);
     ThrottleModule::lua_setup(L);
     BandwidthModule::lua_setup(L);
     DuplicateModule::lua_setup(L);
+    OodModule::lua_setup(L);
     TamperModule::lua_setup(L);
+    ResetModule::lua_setup(L);
+    FragmentModule::lua_setup(L);
 
     LOG("Creating modules");
     lua_newtable(L); // cluamsy
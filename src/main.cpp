@@ -1,20 +1,26 @@
 #include "events.hpp"
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#endif
 
 #include <SDL.h>
 #include <SDL_opengl.h>
+#include <atomic>
 #include <cmath>
+#include <csignal>
 #include <imgui.h>
 #include <imgui_impl_opengl3.h>
 #include <imgui_impl_sdl2.h>
 #include <imgui_internal.h>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 
+#include "backend.hpp"
 #include "common.hpp"
 #include "config.hpp"
-#include "divert.hpp"
 #include "lua.hpp"
 #include "module.hpp"
 
@@ -25,27 +31,42 @@ bool InputText(const char* label, std::string* str,
                void* user_data = nullptr);
 }
 
+static void apply_config(const std::vector<std::shared_ptr<Module>>& modules,
+                         const toml::table& config) {
+    for (const auto& module : modules) {
+        const auto* module_entry = config[module->m_short_name].as_table();
+        if (module_entry)
+            module->apply_config(*module_entry);
+    }
+}
+
 class Application {
 private:
     Application(
         SDL_Window* window, SDL_GLContext gl_context,
         const std::unordered_map<std::string, toml::table>& config_entries)
-        : m_config_entries(config_entries), m_window(window),
+        : m_config_entries(config_entries),
+          m_modules(PacketBackend::create_modules()), m_window(window),
           m_gl_context(gl_context) {};
 
 public:
     Application(Application&& other) noexcept
         : m_config_entries(std::move(other.m_config_entries)),
+          m_modules(std::move(other.m_modules)),
+          m_backend_name(std::move(other.m_backend_name)),
           m_lua(std::move(other.m_lua)), m_window(other.m_window),
           m_gl_context(other.m_gl_context) {
         // TODO: I hate move semantics
-        m_lua.push_api(m_win_divert.modules());
+        m_lua.push_api(m_modules);
 
         other.m_window = nullptr;
         other.m_gl_context = nullptr;
     }
 
     ~Application() {
+        // Stop before the modules go away
+        m_backend = nullptr;
+
         if (m_gl_context)
             SDL_GL_DeleteContext(m_gl_context);
 
@@ -59,7 +80,9 @@ public:
 
     static std::optional<Application>
     init(std::unordered_map<std::string, toml::table> config_entries) {
+#ifdef _WIN32
         SetProcessDPIAware();
+#endif
 
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, 0);
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
@@ -123,8 +146,12 @@ public:
 
             float dpi_scaling = ddpi / 96.f;
             ImGui::GetStyle().ScaleAllSizes(dpi_scaling);
+#ifdef _WIN32
             io.Fonts->AddFontFromFileTTF("C:/Windows/Fonts/consola.ttf",
                                          std::round(12.0f * dpi_scaling));
+#else
+            io.FontGlobalScale = dpi_scaling;
+#endif
         }
 
         // Run the main loop
@@ -175,9 +202,23 @@ public:
         ImGui::SetWindowSize(io.DisplaySize);
 
         if (ImGui::Button(m_enabled ? "Stop" : "Start")) {
-            toggle_win_divert();
+            toggle_backend();
+            dirty = true;
+        }
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        ImGui::BeginDisabled(m_enabled);
+        if (ImGui::BeginCombo("Backend", m_backend_name.c_str())) {
+            for (const auto* name : PacketBackend::names()) {
+                if (ImGui::Selectable(name, m_backend_name == name))
+                    m_backend_name = name;
+            }
+            ImGui::EndCombo();
+
             dirty = true;
         }
+        ImGui::EndDisabled();
         ImGui::SameLine();
 
         ImGui::SetNextItemWidth(32.f * ImGui::GetFontSize());
@@ -195,15 +236,13 @@ public:
                                       m_selected_config_entry == name)) {
                     m_filter = config["filter"].value_or("");
                     m_selected_config_entry = name;
-
-                    for (auto& module : m_win_divert.modules()) {
-                        const auto* module_entry =
-                            config[module->m_short_name].as_table();
-                        if (module_entry) {
-                            module->apply_config(*module_entry);
-                        }
+                    if (!m_enabled) {
+                        m_backend_name = config["backend"].value_or(
+                            PacketBackend::default_name());
                     }
 
+                    apply_config(m_modules, config);
+
                     dirty = true;
                 }
             }
@@ -218,7 +257,7 @@ public:
                                m_error_message.c_str());
         }
 
-        for (const auto& module : m_win_divert.modules()) {
+        for (const auto& module : m_modules) {
             dirty |= module->draw();
         }
 
@@ -240,18 +279,26 @@ public:
     }
 
 private:
-    void toggle_win_divert() {
+    void toggle_backend() {
         auto was_enabled = m_enabled;
         if (!was_enabled) {
-            const auto err = m_win_divert.start(m_filter);
+            m_backend = PacketBackend::create(m_backend_name, m_modules);
+            if (!m_backend) {
+                m_error_message = "Unknown backend '" + m_backend_name + "'";
+                return;
+            }
+
+            const auto err = m_backend->start(m_filter);
             if (err) {
                 m_error_message = *err;
+                m_backend = nullptr;
             } else {
                 m_error_message = "";
                 m_enabled = true;
             }
         } else {
-            m_win_divert.stop();
+            m_backend->stop();
+            m_backend = nullptr;
             m_enabled = false;
         }
     }
@@ -260,12 +307,14 @@ private:
     std::unordered_map<std::string, toml::table> m_config_entries;
     std::optional<std::string_view> m_selected_config_entry;
 
-    WinDivert m_win_divert;
+    std::vector<std::shared_ptr<Module>> m_modules;
+    std::string m_backend_name = PacketBackend::default_name();
+    std::unique_ptr<PacketBackend> m_backend;
     Lua m_lua;
 
     std::string m_filter;
     std::string m_error_message;
-    // Is windivert enabled
+    // Is the backend running
     bool m_enabled = false;
 
 private:
@@ -273,6 +322,7 @@ private:
     SDL_GLContext m_gl_context = nullptr;
 };
 
+#ifdef _WIN32
 static bool check_is_running() {
     // It will be closed and destroyed when programm terminates (according to
     // MSDN).
@@ -289,11 +339,99 @@ static bool check_is_running() {
 
     return false;
 }
+#endif
+
+static std::atomic_bool s_interrupted = false;
+
+// Runs the module chain without a window until interrupted or the backend
+// runs out of input, e.g.
+//   cluamsy --headless --config lan --backend nfqueue --filter 0
+static int run_headless(const std::unordered_map<std::string, toml::table>&
+                            config_entries,
+                        const char* config_name, const char* backend_name,
+                        const char* filter) {
+    auto modules = PacketBackend::create_modules();
+
+    const toml::table* config = nullptr;
+    if (config_name) {
+        const auto it = config_entries.find(config_name);
+        if (it == config_entries.end()) {
+            fprintf(stderr, "Unknown config entry '%s'\n", config_name);
+            return -1;
+        }
+
+        config = &it->second;
+        apply_config(modules, *config);
+    }
+
+    std::string backend = PacketBackend::default_name();
+    if (backend_name)
+        backend = backend_name;
+    else if (config)
+        backend = (*config)["backend"].value_or(backend);
+
+    std::string filter_text;
+    if (filter)
+        filter_text = filter;
+    else if (config)
+        filter_text = (*config)["filter"].value_or("");
+
+    auto packet_backend = PacketBackend::create(backend, std::move(modules));
+    if (!packet_backend) {
+        fprintf(stderr, "Unknown backend '%s'\n", backend.c_str());
+        return -1;
+    }
+
+    if (const auto err = packet_backend->start(filter_text)) {
+        fprintf(stderr, "%s\n", err->c_str());
+        return -1;
+    }
+
+    std::signal(SIGINT, [](int) { s_interrupted = true; });
+    std::signal(SIGTERM, [](int) { s_interrupted = true; });
+    while (!s_interrupted && !packet_backend->finished())
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    packet_backend->stop();
+
+    if (const auto summary = packet_backend->summary())
+        printf("%s\n", summary->c_str());
+
+    return 0;
+}
 
 int main(int argc, char* argv[]) {
     // LOG("Is Run As Admin: %d", IsRunAsAdmin());
     // LOG("Is Elevated: %d", IsElevated());
 
+    auto headless = false;
+    const char* config_name = nullptr;
+    const char* backend_name = nullptr;
+    const char* filter = nullptr;
+    for (auto i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        const auto* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--headless") {
+            headless = true;
+        } else if (arg == "--config" && value) {
+            config_name = value;
+            i++;
+        } else if (arg == "--backend" && value) {
+            backend_name = value;
+            i++;
+        } else if (arg == "--filter" && value) {
+            filter = value;
+            i++;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--headless] [--config NAME] [--backend NAME] "
+                    "[--filter FILTER]\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+
+#ifdef _WIN32
     if (check_is_running()) {
         MessageBoxA(NULL, "There's already an instance of clumsy running.",
                     "Aborting", MB_OK);
@@ -304,6 +442,15 @@ int main(int argc, char* argv[]) {
     freopen("CONIN$", "r", stdin);
     freopen("CONOUT$", "w", stdout);
     freopen("CONOUT$", "w", stderr);
+#endif
+
+    if (headless) {
+        const auto config_entries = parse_config();
+        return run_headless(
+            config_entries.value_or(
+                std::unordered_map<std::string, toml::table>()),
+            config_name, backend_name, filter);
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) <
         0) {
@@ -1,17 +1,33 @@
 #pragma once
 
+#include <bit>
 #include <chrono>
 #include <lua.hpp>
+#include <optional>
 #include <toml.hpp>
 
 #include "lua_util.hpp"
 
+// Impairment of one direction of a byte stream. Stream backends can't run
+// packet modules, modules with a stream equivalent describe it with this.
+struct StreamPolicy {
+    std::chrono::milliseconds delay{};
+    // Bytes per second
+    std::optional<size_t> rate;
+    // Chance in percent to stall the stream for `stall_time`, rolled whenever
+    // data arrives
+    float stall_chance = 0.f;
+    std::chrono::milliseconds stall_time{};
+};
+
 class Module {
-    friend class WinDivert;
+    friend class PacketBackend;
 
 public:
     struct Result {
-        std::optional<std::chrono::milliseconds> schedule_after = std::nullopt;
+        // Nanosecond precise, the backend's `Scheduler` takes care of waking
+        // up on time
+        std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
         bool dirty = false;
     };
 
@@ -34,8 +50,19 @@ public:
         m_enabled = config["enabled"].value_or(false);
     };
 
+    // Copies user facing settings (but not state) from another instance of
+    // the same module, used to keep per-thread module chains in sync
+    virtual void copy_settings(const Module& other) {
+        m_enabled = other.m_enabled;
+    };
+
     virtual Result process() = 0;
 
+    // Adds the module's effect on the `outbound` direction of a stream to
+    // `policy`, modules without a stream equivalent leave it untouched
+    virtual void apply_stream_policy(bool /*outbound*/,
+                                     StreamPolicy& /*policy*/) const {}
+
     static void lua_setup(lua_State* L) {
         luaL_newmetatable(L, "Module");
 
@@ -64,6 +91,6 @@ public:
     float m_indicator = 0.f;
 
 private:
-    // Checked in `WinDivert`
+    // Checked in `PacketBackend`
     bool m_was_enabled = false;
 };
@@ -0,0 +1,616 @@
+#include <arpa/inet.h>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+#include <linux/netlink.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <span>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "nfqueue.hpp"
+#include "packet.hpp"
+#include "scheduler.hpp"
+
+// Netlink header + nfgenmsg + attributes preceding a full sized payload
+static constexpr size_t MAX_MESSAGE_SIZE = 0xffff + 0x400;
+
+namespace {
+
+// Builds a batch of nfnetlink messages that's sent with a single syscall
+class NetlinkBatch {
+public:
+    void begin(uint16_t msg_type, uint16_t flags, uint16_t queue_num) {
+        m_message_offset = m_buffer.size();
+        m_buffer.resize(m_message_offset + NLMSG_HDRLEN +
+                        NLMSG_ALIGN(sizeof(nfgenmsg)));
+
+        auto* header =
+            std::bit_cast<nlmsghdr*>(m_buffer.data() + m_message_offset);
+        header->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | msg_type;
+        header->nlmsg_flags = NLM_F_REQUEST | flags;
+        header->nlmsg_seq = m_seq++;
+        header->nlmsg_pid = 0;
+
+        auto* gen = std::bit_cast<nfgenmsg*>(NLMSG_DATA(header));
+        gen->nfgen_family = AF_UNSPEC;
+        gen->version = NFNETLINK_V0;
+        gen->res_id = htons(queue_num);
+    }
+
+    void put(uint16_t type, const void* data, size_t size) {
+        const auto attr_offset = m_buffer.size();
+        m_buffer.resize(attr_offset + NLA_ALIGN(NLA_HDRLEN + size));
+
+        auto* attr = std::bit_cast<nlattr*>(m_buffer.data() + attr_offset);
+        attr->nla_type = type;
+        attr->nla_len = NLA_HDRLEN + size;
+        memcpy(m_buffer.data() + attr_offset + NLA_HDRLEN, data, size);
+    }
+
+    void end() {
+        auto* header =
+            std::bit_cast<nlmsghdr*>(m_buffer.data() + m_message_offset);
+        header->nlmsg_len = m_buffer.size() - m_message_offset;
+    }
+
+    // The kernel replaces the packet with `payload` if there is one
+    void verdict(uint16_t msg_type, uint16_t queue_num, uint32_t verdict,
+                 uint32_t id, std::span<const char> payload = {}) {
+        const nfqnl_msg_verdict_hdr verdict_header{
+            .verdict = htonl(verdict),
+            .id = htonl(id),
+        };
+
+        begin(msg_type, 0, queue_num);
+        put(NFQA_VERDICT_HDR, &verdict_header, sizeof(verdict_header));
+        if (!payload.empty())
+            put(NFQA_PAYLOAD, payload.data(), payload.size());
+        end();
+    }
+
+    bool send(int fd) {
+        if (m_buffer.empty())
+            return true;
+
+        const auto sent = ::send(fd, m_buffer.data(), m_buffer.size(), 0);
+        m_buffer.clear();
+
+        return sent >= 0;
+    }
+
+private:
+    std::vector<char> m_buffer;
+    size_t m_message_offset = 0;
+    uint32_t m_seq = 0;
+};
+
+// Verdict state of every packet the kernel still holds for us. Packet ids
+// are assigned sequentially per queue, so the state is kept in a deque that
+// starts at the oldest id without a verdict.
+class Outstanding {
+public:
+    void push(uint32_t id) {
+        if (m_states.empty()) {
+            m_base_id = id;
+        } else {
+            // Fill gaps so that indices keep matching ids, wrapping like the
+            // ids do
+            const uint32_t idx = id - m_base_id;
+            if (idx > m_states.size())
+                m_states.resize(idx, false);
+        }
+
+        m_states.push_back(true);
+        m_last_id = id;
+    }
+
+    [[nodiscard]] bool queued(uint32_t id) const noexcept {
+        const uint32_t idx = id - m_base_id;
+        return idx < m_states.size() && m_states[idx];
+    }
+
+    // Is `id` the oldest packet still waiting for a verdict
+    [[nodiscard]] bool oldest(uint32_t id) const noexcept {
+        return !m_states.empty() && id == m_base_id;
+    }
+
+    void done(uint32_t id) {
+        const uint32_t idx = id - m_base_id;
+        assert(idx < m_states.size());
+        m_states[idx] = false;
+
+        while (!m_states.empty() && !m_states.front()) {
+            m_states.pop_front();
+            m_base_id++;
+        }
+    }
+
+    [[nodiscard]] bool empty() const noexcept { return m_states.empty(); }
+    [[nodiscard]] uint32_t last_id() const noexcept { return m_last_id; }
+
+private:
+    uint32_t m_base_id = 0;
+    uint32_t m_last_id = 0;
+    std::deque<bool> m_states;
+};
+
+// Id ranges of receive buffers that are no longer referenced by any packet.
+// Ids from a released range that never got a verdict were dropped by modules.
+struct ReleasedBatches {
+    std::mutex mutex;
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+};
+
+struct BatchDeleter {
+    std::shared_ptr<ReleasedBatches> released;
+    std::optional<std::pair<uint32_t, uint32_t>> ids;
+
+    void operator()(std::vector<char>* buffer) const {
+        if (ids) {
+            std::lock_guard lock(released->mutex);
+            released->ranges.push_back(*ids);
+        }
+
+        delete buffer;
+    }
+};
+
+} // namespace
+
+static std::shared_ptr<std::vector<char>>
+allocate_buffer(const std::shared_ptr<ReleasedBatches>& released) {
+    return {new std::vector<char>(NfQueue::BUFFER_SIZE),
+            BatchDeleter{.released = released, .ids = std::nullopt}};
+}
+
+static bool configure_queue(int fd, uint16_t queue_num) {
+    NetlinkBatch batch;
+
+    const nfqnl_msg_config_cmd bind_cmd{
+        .command = NFQNL_CFG_CMD_BIND,
+        ._pad = 0,
+        .pf = 0,
+    };
+    batch.begin(NFQNL_MSG_CONFIG, NLM_F_ACK, queue_num);
+    batch.put(NFQA_CFG_CMD, &bind_cmd, sizeof(bind_cmd));
+    batch.end();
+
+    const nfqnl_msg_config_params params{
+        .copy_range = htonl(0xffff),
+        .copy_mode = NFQNL_COPY_PACKET,
+    };
+    const auto queue_length = htonl(NfQueue::QUEUE_LENGTH);
+    // Let packets through instead of dropping them if we can't keep up
+    const auto flags = htonl(NFQA_CFG_F_FAIL_OPEN);
+    batch.begin(NFQNL_MSG_CONFIG, NLM_F_ACK, queue_num);
+    batch.put(NFQA_CFG_PARAMS, &params, sizeof(params));
+    batch.put(NFQA_CFG_QUEUE_MAXLEN, &queue_length, sizeof(queue_length));
+    batch.put(NFQA_CFG_FLAGS, &flags, sizeof(flags));
+    batch.put(NFQA_CFG_MASK, &flags, sizeof(flags));
+    batch.end();
+
+    if (!batch.send(fd))
+        return false;
+
+    // Wait for both acks
+    std::vector<char> buffer(0x1000);
+    for (auto acks = 0; acks < 2;) {
+        const auto read = recv(fd, buffer.data(), buffer.size(), 0);
+        if (read < 0)
+            return false;
+
+        auto remaining = static_cast<int>(read);
+        for (auto* header = std::bit_cast<nlmsghdr*>(buffer.data());
+             NLMSG_OK(header, remaining);
+             header = NLMSG_NEXT(header, remaining)) {
+            if (header->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            const auto* err = std::bit_cast<nlmsgerr*>(NLMSG_DATA(header));
+            if (err->error != 0) {
+                errno = -err->error;
+                return false;
+            }
+
+            acks++;
+        }
+    }
+
+    return true;
+}
+
+std::optional<std::string> NfQueue::start(const std::string& filter) {
+    LOG("Starting");
+
+    uint16_t queue_num = 0;
+    const auto* const filter_end = filter.data() + filter.size();
+    const auto [ptr, ec] =
+        std::from_chars(filter.data(), filter_end, queue_num);
+    if (ec != std::errc() || ptr != filter_end)
+        return "Failed to start filtering: filter must be an NFQUEUE queue "
+               "number";
+
+    m_netlink_fd =
+        socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    m_raw4_fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    m_raw6_fd = socket(AF_INET6, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_netlink_fd < 0 || m_raw4_fd < 0 || m_raw6_fd < 0 || m_stop_fd < 0) {
+        const auto error = errno;
+        close_fds();
+
+        std::string message(512, '\0');
+        snprintf(message.data(), message.capacity(),
+                 "Failed to start filtering: failed to open sockets "
+                 "(%s).\n"
+                 "Make sure you run cluamsy as root or with CAP_NET_ADMIN.",
+                 strerror(error));
+        return message;
+    }
+
+    // Receive errors would only tell us that the kernel dropped packets
+    const int enable = 1;
+    setsockopt(m_netlink_fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &enable,
+               sizeof(enable));
+    const int rcvbuf = 8 << 20;
+    setsockopt(m_netlink_fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+               sizeof(rcvbuf));
+
+    const auto mark = INJECT_MARK;
+    setsockopt(m_raw4_fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark));
+    setsockopt(m_raw6_fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark));
+
+    sockaddr_nl addr{};
+    addr.nl_family = AF_NETLINK;
+    if (bind(m_netlink_fd, std::bit_cast<sockaddr*>(&addr), sizeof(addr)) <
+            0 ||
+        !configure_queue(m_netlink_fd, queue_num)) {
+        const auto error = errno;
+        close_fds();
+
+        std::string message(512, '\0');
+        snprintf(message.data(), message.capacity(),
+                 "Failed to start filtering: failed to bind queue %u (%s)",
+                 queue_num, strerror(error));
+        return message;
+    }
+
+    m_queue_num = queue_num;
+    LOG("Bound to queue %u, queue length: %zu", queue_num, QUEUE_LENGTH);
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .netlink_fd = m_netlink_fd,
+        .raw4_fd = m_raw4_fd,
+        .raw6_fd = m_raw6_fd,
+        .stop_fd = m_stop_fd,
+        .queue_num = m_queue_num,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+
+    return std::nullopt;
+}
+
+bool NfQueue::stop() {
+    if (m_netlink_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for the nfqueue thread");
+    m_thread.join();
+
+    NetlinkBatch batch;
+    const nfqnl_msg_config_cmd unbind_cmd{
+        .command = NFQNL_CFG_CMD_UNBIND,
+        ._pad = 0,
+        .pf = 0,
+    };
+    batch.begin(NFQNL_MSG_CONFIG, 0, m_queue_num);
+    batch.put(NFQA_CFG_CMD, &unbind_cmd, sizeof(unbind_cmd));
+    batch.end();
+    batch.send(m_netlink_fd);
+
+    close_fds();
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("NFQUEUE stopped");
+
+    return true;
+}
+
+void NfQueue::close_fds() {
+    for (auto* fd : {&m_netlink_fd, &m_raw4_fd, &m_raw6_fd, &m_stop_fd}) {
+        if (*fd >= 0)
+            close(*fd);
+
+        *fd = -1;
+    }
+}
+
+// Copies of packets that already got their verdict can only be sent as new
+// packets
+static void inject(int raw4_fd, int raw6_fd, const PacketNode& packet) {
+    const auto* data = packet.packet.data();
+    const auto size = packet.packet.size();
+    if (size == 0)
+        return;
+
+    ssize_t sent = 0;
+    const auto version = static_cast<uint8_t>(data[0]) >> 4;
+    if (version == 4 && size >= 20) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        memcpy(&addr.sin_addr, data + 16, sizeof(addr.sin_addr));
+        sent = sendto(raw4_fd, data, size, 0, std::bit_cast<sockaddr*>(&addr),
+                      sizeof(addr));
+    } else if (version == 6 && size >= 40) {
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        memcpy(&addr.sin6_addr, data + 24, sizeof(addr.sin6_addr));
+        sent = sendto(raw6_fd, data, size, 0, std::bit_cast<sockaddr*>(&addr),
+                      sizeof(addr));
+    }
+
+    if (sent < 0)
+        LOG("Injecting packet failed: %s", strerror(errno));
+}
+
+void NfQueue::thread(ThreadData thread_data) {
+    const auto released = std::make_shared<ReleasedBatches>();
+    Outstanding outstanding;
+    NetlinkBatch verdicts;
+
+    const auto queue_num = thread_data.queue_num;
+    auto buffer = allocate_buffer(released);
+
+    const auto read_packets = [&] {
+        DenseBufferArray dense_buffers(buffer);
+        auto* const data = buffer->data();
+
+        std::optional<uint32_t> first_id;
+        uint32_t last_id = 0;
+        size_t packet_count = 0;
+        size_t offset = 0;
+        const auto current_timestamp = std::chrono::steady_clock::now();
+        while (packet_count < MAX_PACKETS &&
+               BUFFER_SIZE - offset >= MAX_MESSAGE_SIZE) {
+            const auto read = recv(thread_data.netlink_fd, data + offset,
+                                   BUFFER_SIZE - offset, MSG_DONTWAIT);
+            if (read < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    LOG("recv failed: %s", strerror(errno));
+
+                break;
+            }
+
+            auto remaining = static_cast<int>(read);
+            for (auto* header = std::bit_cast<nlmsghdr*>(data + offset);
+                 NLMSG_OK(header, remaining);
+                 header = NLMSG_NEXT(header, remaining)) {
+                if (header->nlmsg_type !=
+                    ((NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET))
+                    continue;
+
+                const nfqnl_msg_packet_hdr* packet_header = nullptr;
+                const char* payload = nullptr;
+                size_t payload_size = 0;
+                uint32_t ifindex = 0;
+
+                // Walk attributes
+                auto* attr = std::bit_cast<nlattr*>(
+                    static_cast<char*>(NLMSG_DATA(header)) +
+                    NLMSG_ALIGN(sizeof(nfgenmsg)));
+                auto attrs_size = static_cast<int>(
+                    header->nlmsg_len - NLMSG_HDRLEN -
+                    NLMSG_ALIGN(sizeof(nfgenmsg)));
+                while (attrs_size >= static_cast<int>(NLA_HDRLEN) &&
+                       attr->nla_len >= NLA_HDRLEN &&
+                       attr->nla_len <= attrs_size) {
+                    const auto* attr_data =
+                        std::bit_cast<const char*>(attr) + NLA_HDRLEN;
+                    switch (attr->nla_type & NLA_TYPE_MASK) {
+                    case NFQA_PACKET_HDR:
+                        packet_header =
+                            std::bit_cast<const nfqnl_msg_packet_hdr*>(
+                                attr_data);
+                        break;
+                    case NFQA_PAYLOAD:
+                        payload = attr_data;
+                        payload_size = attr->nla_len - NLA_HDRLEN;
+                        break;
+                    case NFQA_IFINDEX_INDEV:
+                    case NFQA_IFINDEX_OUTDEV:
+                        memcpy(&ifindex, attr_data, sizeof(ifindex));
+                        ifindex = ntohl(ifindex);
+                        break;
+                    default:
+                        break;
+                    }
+
+                    attrs_size -= static_cast<int>(NLA_ALIGN(attr->nla_len));
+                    attr = std::bit_cast<nlattr*>(
+                        std::bit_cast<char*>(attr) + NLA_ALIGN(attr->nla_len));
+                }
+
+                if (packet_header == nullptr)
+                    continue;
+
+                const auto id = ntohl(packet_header->packet_id);
+                outstanding.push(id);
+                if (!first_id)
+                    first_id = id;
+                last_id = id;
+
+                // Nothing to send back, let it go
+                if (payload == nullptr || payload_size == 0) {
+                    verdicts.verdict(NFQNL_MSG_VERDICT, queue_num, NF_ACCEPT,
+                                     id);
+                    outstanding.done(id);
+                    continue;
+                }
+
+                PacketAddress addr{};
+                addr.Id = id;
+                addr.IfIdx = ifindex;
+                addr.Queue = queue_num;
+                addr.Outbound = packet_header->hook == NF_INET_LOCAL_OUT ||
+                                packet_header->hook == NF_INET_POST_ROUTING;
+
+                // Packets are sliced straight out of the receive buffer
+                g_packets.emplace_back(PacketNode{
+                    .packet =
+                        dense_buffers.slice(payload - data, payload_size),
+                    .addr = addr,
+                    .captured_at = current_timestamp,
+                });
+                packet_count++;
+            }
+
+            offset = NLMSG_ALIGN(offset + read);
+        }
+
+        if (!first_id)
+            return;
+
+        // Remember which ids this buffer carries and allocate a new one
+        std::get_deleter<BatchDeleter>(buffer)->ids =
+            std::make_pair(*first_id, last_id);
+        buffer = allocate_buffer(released);
+    };
+
+    const auto write_packets = [&] {
+        // Consecutive packets that are each the oldest outstanding one are
+        // accepted with a single batch verdict.
+        std::optional<uint32_t> batch_id;
+        const auto flush_batch = [&] {
+            if (batch_id) {
+                verdicts.verdict(NFQNL_MSG_VERDICT_BATCH, queue_num,
+                                 NF_ACCEPT, *batch_id);
+                batch_id = std::nullopt;
+            }
+        };
+
+        for (const auto& packet : g_packets) {
+            const auto id = static_cast<uint32_t>(packet.addr.Id);
+            if (!outstanding.queued(id)) {
+                inject(thread_data.raw4_fd, thread_data.raw6_fd, packet);
+                continue;
+            }
+
+            if (packet.packet.modified()) {
+                // Changes only stick if the verdict carries them
+                flush_batch();
+                verdicts.verdict(NFQNL_MSG_VERDICT, queue_num, NF_ACCEPT, id,
+                                 {packet.packet.data(), packet.packet.size()});
+            } else if (outstanding.oldest(id)) {
+                batch_id = id;
+            } else {
+                flush_batch();
+                verdicts.verdict(NFQNL_MSG_VERDICT, queue_num, NF_ACCEPT, id);
+            }
+
+            outstanding.done(id);
+        }
+
+        flush_batch();
+        g_packets.clear();
+    };
+
+    const auto drop_released = [&] {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        {
+            std::lock_guard lock(released->mutex);
+            ranges.swap(released->ranges);
+        }
+
+        for (const auto& [first_id, last_id] : ranges) {
+            for (auto id = first_id; id != last_id + 1; id++) {
+                if (!outstanding.queued(id))
+                    continue;
+
+                verdicts.verdict(NFQNL_MSG_VERDICT, queue_num, NF_DROP, id);
+                outstanding.done(id);
+            }
+        }
+    };
+
+    Scheduler scheduler;
+    std::array<pollfd, 3> fds{
+        pollfd{.fd = thread_data.netlink_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = thread_data.stop_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = scheduler.fd(), .events = POLLIN, .revents = 0},
+    };
+    while (true) {
+        const auto res = poll(fds.data(), fds.size(), -1);
+
+        if (res < 0 && errno != EINTR) {
+            LOG("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        // STOP
+        if (fds[1].revents & POLLIN)
+            break;
+
+        // READ
+        if (fds[0].revents & POLLIN)
+            read_packets();
+
+        if (fds[0].revents & (POLLERR | POLLHUP)) {
+            LOG("Netlink socket closed");
+            break;
+        }
+
+        // TIMER
+        if (fds[2].revents & POLLIN)
+            scheduler.expire();
+
+        // Run modules
+        scheduler.schedule(run_modules(thread_data.modules).schedule_after);
+
+        // WRITE
+        write_packets();
+        drop_released();
+        if (!verdicts.send(thread_data.netlink_fd))
+            LOG("Sending verdicts failed: %s", strerror(errno));
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    write_packets();
+    drop_released();
+
+    // Let everything still held in the kernel through
+    if (!outstanding.empty()) {
+        verdicts.verdict(NFQNL_MSG_VERDICT_BATCH, queue_num, NF_ACCEPT,
+                         outstanding.last_id());
+    }
+
+    verdicts.send(thread_data.netlink_fd);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include "backend.hpp"
+#include "module.hpp"
+
+// Linux netfilter queue backend. Packets are steered into the queue by the
+// user's ruleset, e.g.
+//   nft add rule inet filter output meta mark != 0x636c queue num 0
+// The filter string is the queue number.
+class NfQueue : public PacketBackend {
+public:
+    static const inline size_t QUEUE_LENGTH = 4096;
+    static const inline size_t BUFFER_SIZE = 0x40000;
+    static const inline size_t MAX_PACKETS = 32;
+    // Copies of already verdicted packets (duplicates) are reinjected through
+    // raw sockets with this mark, exclude it from the queue rules
+    static const inline uint32_t INJECT_MARK = 0x636c;
+
+public:
+    explicit NfQueue(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    NfQueue(const NfQueue&) = delete;
+    NfQueue(NfQueue&&) = delete;
+    NfQueue& operator=(const NfQueue&) = delete;
+    NfQueue& operator=(NfQueue&&) = delete;
+
+    ~NfQueue() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    struct ThreadData {
+        int netlink_fd;
+        int raw4_fd;
+        int raw6_fd;
+        int stop_fd;
+        uint16_t queue_num;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+    void close_fds();
+
+private:
+    std::thread m_thread;
+    int m_netlink_fd = -1;
+    int m_raw4_fd = -1;
+    int m_raw6_fd = -1;
+    int m_stop_fd = -1;
+    uint16_t m_queue_num = 0;
+};
@@ -1,176 +1,288 @@
-// out of order arrange packets module
-#include "common.h"
-#include "iup.h"
-#include <stdbool.h>
-#define NAME "ood"
-// keep a picked packet at most for KEEP_TURNS_MAX steps, or if there's no
-// following one, it will just be sent
-#define KEEP_TURNS_MAX 10
-
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput;
-
-static volatile short oodEnabled = 0, oodInbound = 1, oodOutbound = 1,
-                      chance = 1000; // [0-10000]
-static PacketNode* oodPacket = NULL;
-static int giveUpCnt;
-
-static Ihandle* oodSetupUI() {
-    Ihandle* oodControlsBox =
-        IupHbox(inboundCheckbox = IupToggle("Inbound", NULL),
-                outboundCheckbox = IupToggle("Outbound", NULL),
-                IupLabel("Chance(%):"), chanceInput = IupText(NULL), NULL);
-
-    IupSetAttribute(chanceInput, "VISIBLECOLUMNS", "4");
-    IupSetAttribute(chanceInput, "VALUE", "10.0");
-    IupSetCallback(chanceInput, "VALUECHANGED_CB", uiSyncChance);
-    IupSetAttribute(chanceInput, SYNCED_VALUE, (char*)&chance);
-    IupSetCallback(inboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
-    IupSetAttribute(inboundCheckbox, SYNCED_VALUE, (char*)&oodInbound);
-    IupSetCallback(outboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
-    IupSetAttribute(outboundCheckbox, SYNCED_VALUE, (char*)&oodOutbound);
-
-    // enable by default to avoid confusing
-    IupSetAttribute(inboundCheckbox, "VALUE", "ON");
-    IupSetAttribute(outboundCheckbox, "VALUE", "ON");
-
-    if (parameterized) {
-        setFromParameter(inboundCheckbox, "VALUE", NAME "-inbound");
-        setFromParameter(outboundCheckbox, "VALUE", NAME "-outbound");
-        setFromParameter(chanceInput, "VALUE", NAME "-chance");
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdlib>
+#include <imgui.h>
+#include <string_view>
+
+#include "common.hpp"
+#include "ood.hpp"
+
+static constexpr std::array MODE_NAMES = {
+    "Packets",
+    "Time",
+};
+
+static constexpr std::array MODE_KEYS = {
+    "packets",
+    "time",
+};
+
+// Ticks of the time mode are milliseconds of the packet clock
+static uint64_t time_tick(PacketClock::time_point now) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            now.time_since_epoch())
+            .count());
+}
+
+bool OodModule::draw() {
+    bool dirty = false;
+
+    ImGui::PushID(m_short_name);
+    ImGui::BeginGroup();
+
+    ImGui::PushStyleColor(ImGuiCol_Text, {m_indicator, 0.f, 0.f, 1.f});
+    ImGui::Bullet();
+    ImGui::PopStyleColor();
+
+    if (m_indicator > 0.f) {
+        m_indicator -= ImGui::GetIO().DeltaTime * 10.f;
+        dirty = true;
     }
 
-    return oodControlsBox;
+    ImGui::SameLine();
+
+    ImGui::Text("%s", m_display_name);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Enable", &m_enabled);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Inbound", &m_inbound);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Outbound", &m_outbound);
+
+    ImGui::SameLine();
+
+    auto mode = static_cast<int>(m_mode);
+    ImGui::SetNextItemWidth(6.f * ImGui::GetFontSize());
+    if (ImGui::Combo("Mode", &mode, MODE_NAMES.data(), MODE_NAMES.size())) {
+        m_mode = static_cast<Mode>(mode);
+        dirty = true;
+    }
+
+    if (m_mode == Mode::Packets) {
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputInt("Displacement", &m_displacement)) {
+            m_displacement = std::clamp(m_displacement, 1, MAX_DISPLACEMENT);
+            dirty = true;
+        }
+    }
+
+    ImGui::SameLine();
+
+    int delay = static_cast<int>(m_delay.count());
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Delay(ms)", &delay)) {
+        m_delay = std::chrono::milliseconds(std::clamp(delay, 1, MAX_DELAY));
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat("Chance", &m_chance)) {
+        m_chance = std::clamp(m_chance, 0.f, 100.f);
+        dirty = true;
+    }
+
+    ImGui::EndGroup();
+    ImGui::PopID();
+
+    return dirty;
 }
 
-static void oodStartUp() {
-    LOG("ood enabled");
-    giveUpCnt = KEEP_TURNS_MAX;
-    // assert on the issue that repeatly enable/disable abort the program
-    assert(oodPacket == NULL);
+void OodModule::enable() {
+    LOG("Enabling");
+
+    for ([[maybe_unused]] const auto& wheel : m_wheels)
+        assert(wheel.held == 0);
 }
 
-static void oodCloseDown(PacketNode* head, PacketNode* tail) {
-    UNREFERENCED_PARAMETER(tail);
-    LOG("ood disabled");
-    if (oodPacket != NULL) {
-        insertAfter(oodPacket, head);
-        oodPacket = NULL; // ! need to empty the ood packet
-    }
+void OodModule::disable() {
+    LOG("Disabling, flushing %zu packets",
+        m_wheels[0].held + m_wheels[1].held);
+
+    for (auto& wheel : m_wheels)
+        flush(wheel);
+
+    m_indicator = 0.f;
 }
 
-// find the next packet fits the direction check or null
-static PacketNode* nextCorrectDirectionNode(PacketNode* p) {
-    if (p == NULL) {
-        return NULL;
+void OodModule::apply_config(const toml::table& config) {
+    Module::apply_config(config);
+
+    m_inbound = config["inbound"].value_or(true);
+    m_outbound = config["outbound"].value_or(true);
+
+    m_chance = std::clamp(config["chance"].value_or(10.f), 0.f, 100.f);
+    m_displacement =
+        std::clamp(config["displacement"].value_or(3), 1, MAX_DISPLACEMENT);
+    m_delay = std::chrono::milliseconds(
+        std::clamp(config["delay"].value_or(100), 1, MAX_DELAY));
+
+    const std::string_view mode = config["mode"].value_or("packets");
+    const auto it = std::find(MODE_KEYS.begin(), MODE_KEYS.end(), mode);
+    if (it != MODE_KEYS.end()) {
+        m_mode = static_cast<Mode>(it - MODE_KEYS.begin());
+    } else {
+        LOG("Unknown mode '%.*s'", static_cast<int>(mode.size()),
+            mode.data());
     }
+}
 
-    do {
-        p = p->next;
-    } while (p->next != NULL &&
-             !checkDirection(p->addr.Outbound, oodInbound, oodOutbound));
+void OodModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
 
-    return p->next == NULL ? NULL : p;
+    const auto& ood = static_cast<const OodModule&>(other);
+    m_inbound = ood.m_inbound;
+    m_outbound = ood.m_outbound;
+    m_chance = ood.m_chance;
+    m_mode = ood.m_mode;
+    m_displacement = ood.m_displacement;
+    m_delay = ood.m_delay;
 }
 
-// not really perfect swap since it assumes a is before b
-static void swapNode(PacketNode* a, PacketNode* b) {
-    assert(a->prev && a->next && b->prev &&
-           b->next); // not accidentally swapping head/tail
-    assert(a != b);  // treat swap self as error here since we shouldn't really
-                     // be doing it
-    if (a->next == b) {
-        // adjacent nodes need special care
-        a->prev->next = b;
-        b->next->prev = a;
-        a->next = b->next;
-        b->prev = a->prev;
-        a->prev = b;
-        b->next = a;
-    } else {
-        PacketNode *pa = a->prev, *na = a->next, *pb = b->prev, *nb = b->next;
-        pa->next = na->prev = b;
-        b->prev = pa;
-        b->next = na;
-        pb->next = nb->prev = a;
-        a->prev = pb;
-        a->next = nb;
+size_t OodModule::release_slot(Wheel& wheel, PacketList& packets,
+                               PacketList::const_iterator pos) {
+    auto& slot = wheel.slots[wheel.tick % wheel.slots.size()];
+    const auto released = slot.size();
+    wheel.held -= released;
+    packets.splice(pos, slot);
+
+    return released;
+}
+
+void OodModule::flush(Wheel& wheel) {
+    if (wheel.held == 0)
+        return;
+
+    // Every slot is due within one turn of the wheel
+    const auto tick = wheel.tick;
+    for (size_t i = 0; i < wheel.slots.size(); i++) {
+        ++wheel.tick;
+        release_slot(wheel, g_packets, g_packets.cend());
     }
+
+    assert(wheel.held == 0);
+    wheel.tick = tick;
 }
 
-static short oodProcess(PacketNode* head, PacketNode* tail) {
-    if (oodPacket != NULL) {
-        if (!isListEmpty() || --giveUpCnt == 0) {
-            LOG("Ooo sent direction %s, is giveup %s",
-                oodPacket->addr.Outbound ? "OUTBOUND" : "INBOUND",
-                giveUpCnt ? "NO" : "YES");
-            insertAfter(oodPacket, head);
-            oodPacket = NULL;
-            giveUpCnt = KEEP_TURNS_MAX;
-        } // skip picking packets when having oodPacket already
-    } else if (!isListEmpty()) {
-        PacketNode* pac = head->next;
-        if (pac->next == tail) {
-            // only contains a single packet, then pick it out and insert later
-            if (checkDirection(pac->addr.Outbound, oodInbound, oodOutbound) &&
-                calcChance(chance)) {
-                oodPacket = popNode(pac);
-                LOG("Ooo picked packet w/ chance %.1f%%, direction %s",
-                    chance / 100.0,
-                    pac->addr.Outbound ? "OUTBOUND" : "INBOUND");
-                return TRUE;
+void OodModule::prepare(Wheel& wheel, PacketClock::time_point now) {
+    const auto window = m_mode == Mode::Packets
+                            ? static_cast<size_t>(m_displacement)
+                            : static_cast<size_t>(m_delay.count());
+    if (wheel.mode == m_mode && wheel.slots.size() == window + 1)
+        return;
+
+    flush(wheel);
+
+    wheel.mode = m_mode;
+    wheel.slots.resize(window + 1);
+    wheel.tick = m_mode == Mode::Time ? time_tick(now) : 0;
+}
+
+OodModule::Result OodModule::process() {
+    const auto current_time_point = PacketClock::now();
+    const auto current_tick = time_tick(current_time_point);
+
+    // Packets due in time mode, sent before the ones that just arrived
+    PacketList due;
+    for (auto& wheel : m_wheels) {
+        prepare(wheel, current_time_point);
+        if (wheel.mode != Mode::Time)
+            continue;
+
+        while (wheel.held > 0 && wheel.tick < current_tick) {
+            ++wheel.tick;
+            release_slot(wheel, due, due.cend());
+        }
+
+        wheel.tick = std::max(wheel.tick, current_tick);
+    }
+
+    const auto total_packets = g_packets.size();
+    size_t picked = 0;
+    for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
+        const auto it_copy = it++;
+        const auto& packet = *it_copy;
+        if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound))
+            continue;
+
+        auto& wheel = m_wheels[packet.addr.Outbound];
+        if (wheel.held < MAX_PACKETS && check_chance(m_chance)) {
+            const auto window = wheel.slots.size() - 1;
+            const auto displacement =
+                1 + static_cast<size_t>(rand()) % window;
+            auto& slot =
+                wheel.slots[(wheel.tick + displacement) % wheel.slots.size()];
+            slot.splice(slot.cend(), g_packets, it_copy);
+
+            // Nothing went by the packet yet
+            if (wheel.held++ == 0)
+                wheel.last_passed = current_time_point;
+
+            ++picked;
+            LOG("Holding back by %zu %s, direction %s", displacement,
+                wheel.mode == Mode::Packets ? "packets" : "ms",
+                packet.addr.Outbound ? "OUTBOUND" : "INBOUND");
+            continue;
+        }
+
+        if (wheel.mode == Mode::Packets) {
+            // The packet went by the held ones, those due now follow it. The
+            // released ones go by the rest too, so no packet is overtaken by
+            // more than the displacement.
+            wheel.last_passed = current_time_point;
+            for (size_t going_by = 1; going_by > 0 && wheel.held > 0;
+                 --going_by) {
+                ++wheel.tick;
+                going_by += release_slot(wheel, g_packets, it);
             }
-        } else if (calcChance(chance)) {
-            // since there's already multiple packets in the queue, do a reorder
-            // will be enough
-            PacketNode *first = head, *second;
-            do {
-                first = nextCorrectDirectionNode(first);
-                second = nextCorrectDirectionNode(first);
-                // calculate chance per swap
-                if (first && second && calcChance(chance)) {
-                    swapNode(first, second);
-                    LOG("Multiple packets OOD swapping");
-                } else {
-                    // move forward first to progress
-                    first = second;
-                }
-            } while (first && second);
-            return TRUE;
         }
     }
 
-    return FALSE;
-}
+    g_packets.splice(g_packets.cbegin(), due);
 
-static int ood_enable(lua_State* L) {
-    int type = lua_gettop(L) > 0 ? lua_type(L, -1) : LUA_TNIL;
-    switch (type) {
-    case LUA_TBOOLEAN:
-        bool enabled = lua_toboolean(L, -1);
-        oodEnabled = enabled;
-        break;
-    case LUA_TNIL:
-        lua_pushboolean(L, oodEnabled);
-        return 1;
-    default:
-        char message[256];
-        int message_length = snprintf(message, sizeof(message),
-                                      "Invalid argument #1 to ood_enable: '%s'",
-                                      lua_typename(L, type));
-        lua_pushlstring(L, message, message_length);
-        lua_error(L);
-        break;
+    std::optional<std::chrono::nanoseconds> schedule_after = std::nullopt;
+    for (auto& wheel : m_wheels) {
+        if (wheel.held == 0)
+            continue;
+
+        std::chrono::nanoseconds wait;
+        if (wheel.mode == Mode::Packets) {
+            // Give up on the packets following
+            if (current_time_point - wheel.last_passed >= m_delay) {
+                LOG("Giving up on %zu held packets", wheel.held);
+                flush(wheel);
+                continue;
+            }
+
+            wait = wheel.last_passed + m_delay - current_time_point;
+        } else {
+            wait = std::chrono::milliseconds(wheel.tick + 1) -
+                   current_time_point.time_since_epoch();
+        }
+
+        schedule_after = std::min(schedule_after.value_or(wait), wait);
     }
 
-    return 0;
-}
+    auto dirty = false;
+    const auto indicator =
+        total_packets == 0
+            ? 0.f
+            : static_cast<float>(picked) / static_cast<float>(total_packets);
+    if (!almost_equal(indicator, m_indicator)) {
+        m_indicator = indicator;
+        dirty = true;
+    }
 
-static void push_lua_functions(lua_State* L) {
-    lua_pushcfunction(L, ood_enable);
-    lua_setfield(L, -2, "enable");
+    return {.schedule_after = schedule_after, .dirty = dirty};
 }
-
-Module oodModule = {"Out of order", NAME, (short*)&oodEnabled, oodSetupUI,
-                    oodStartUp, oodCloseDown, oodProcess,
-                    // runtime fields
-                    0, 0, NULL, push_lua_functions};
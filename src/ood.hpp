@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "clock.hpp"
+#include "lua_util.hpp"
+#include "module.hpp"
+#include "packet.hpp"
+
+// Sends packets out of order. Picked packets are held back until a random
+// number of later packets of the same direction went by, or a random time
+// passed, never more than the configured window.
+class OodModule : public Module {
+private:
+    // Threshold for how many packets to hold at most per direction
+    static inline size_t MAX_PACKETS = 1 << 16;
+    static inline int MAX_DISPLACEMENT = 1024;
+    static inline int MAX_DELAY = 10000;
+
+public:
+    enum class Mode : int {
+        // Displacement counted in packets going by, released ones included.
+        // Packets released at the same tick may overtake a few more. Held
+        // packets are given up after the delay if not enough packets follow.
+        Packets,
+        // Displacement in milliseconds, with 1ms precision
+        Time,
+    };
+
+public:
+    OodModule() {
+        m_display_name = "Out of order";
+        m_short_name = "Ood";
+    }
+
+    virtual ~OodModule() = default;
+
+    bool draw() override;
+
+    void enable() override;
+    void disable() override;
+
+    void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
+
+    Result process() override;
+
+    static void lua_setup(lua_State* L) {
+        luaL_Reg methods[] = {
+            {"chance", lua_method_chance},
+            {"mode", lua_method_mode},
+            {"displacement", lua_method_displacement},
+            {"delay", lua_method_delay},
+            {},
+        };
+
+        luaL_newmetatable(L, "Ood");
+
+        // Inherit from `Module`
+        luaL_getmetatable(L, "Module");
+        lua_setmetatable(L, -2);
+
+        luaL_setfuncs(L, methods, 0);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
+private:
+    static int lua_method_chance(lua_State* L) {
+        auto* module = *std::bit_cast<OodModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_chance, 2);
+
+        return rets;
+    };
+
+    static int lua_method_mode(lua_State* L) {
+        auto* module = *std::bit_cast<OodModule**>(lua_touserdata(L, 1));
+
+        int mode = static_cast<int>(module->m_mode);
+        const auto rets = lua_getset(L, mode, 2);
+        if (rets == 0) {
+            module->m_mode = static_cast<Mode>(
+                std::clamp(mode, 0, static_cast<int>(Mode::Time)));
+        }
+
+        return rets;
+    };
+
+    static int lua_method_displacement(lua_State* L) {
+        auto* module = *std::bit_cast<OodModule**>(lua_touserdata(L, 1));
+
+        int displacement = module->m_displacement;
+        const auto rets = lua_getset(L, displacement, 2);
+        if (rets == 0)
+            module->m_displacement =
+                std::clamp(displacement, 1, MAX_DISPLACEMENT);
+
+        return rets;
+    };
+
+    static int lua_method_delay(lua_State* L) {
+        auto* module = *std::bit_cast<OodModule**>(lua_touserdata(L, 1));
+
+        int delay = static_cast<int>(module->m_delay.count());
+        const auto rets = lua_getset(L, delay, 2);
+        if (rets == 0)
+            module->m_delay =
+                std::chrono::milliseconds(std::clamp(delay, 1, MAX_DELAY));
+
+        return rets;
+    };
+
+private:
+    // Held packets by the tick they're released at, a tick is a packet
+    // going by or a millisecond passing depending on the mode. Holding and
+    // releasing is constant time per packet and tick.
+    struct Wheel {
+        Mode mode = Mode::Packets;
+        // One slot more than the window, so the current tick has its own
+        std::vector<PacketList> slots;
+        uint64_t tick = 0;
+        size_t held = 0;
+        // When the last packet went by, for giving up in packets mode
+        PacketClock::time_point last_passed;
+    };
+
+    // Moves the packets of the wheel's current slot in front of `pos` of
+    // `packets`, returns how many there were
+    static size_t release_slot(Wheel& wheel, PacketList& packets,
+                               PacketList::const_iterator pos);
+    // Sends all held packets in the order they were due
+    static void flush(Wheel& wheel);
+    // Flushes the wheel if it doesn't fit the current settings
+    void prepare(Wheel& wheel, PacketClock::time_point now);
+
+private:
+    bool m_inbound = true;
+    bool m_outbound = true;
+    float m_chance = 10.f;
+    Mode m_mode = Mode::Packets;
+    // Packets that may overtake a held one
+    int m_displacement = 3;
+    // Longest a packet is held in time mode. In packets mode held packets
+    // are given up when no packet went by for this long.
+    std::chrono::milliseconds m_delay{100};
+
+    // Indexed by `Outbound`
+    std::array<Wheel, 2> m_wheels;
+};
@@ -1,3 +1,329 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <mutex>
+
 #include "packet.hpp"
 
-std::list<PacketNode> g_packets;
+thread_local PacketList g_packets;
+
+namespace {
+
+// Nodes allocated at once when a pool runs dry
+constexpr size_t SLAB_NODES = 256;
+
+struct FreeNode {
+    FreeNode* next;
+};
+
+// Slabs are never released, so nodes can move between threads freely. Free
+// nodes of exited threads are parked here for the next one.
+std::mutex g_spare_mutex;
+FreeNode* g_spare_nodes = nullptr;
+
+// Trivially destructible, packet lists destroyed late during thread exit can
+// still use them
+thread_local FreeNode* t_free_nodes = nullptr;
+thread_local bool t_exiting = false;
+
+void park(FreeNode* first, FreeNode* last) {
+    const std::lock_guard lock(g_spare_mutex);
+    last->next = g_spare_nodes;
+    g_spare_nodes = first;
+}
+
+// Hands the free nodes of an exiting thread over to the spare list
+struct PoolGuard {
+    ~PoolGuard() {
+        t_exiting = true;
+        if (t_free_nodes == nullptr)
+            return;
+
+        auto* last = t_free_nodes;
+        while (last->next != nullptr)
+            last = last->next;
+
+        park(std::exchange(t_free_nodes, nullptr), last);
+    }
+};
+
+thread_local PoolGuard t_pool_guard;
+
+void refill() {
+    // Make sure the nodes are handed back when the thread exits
+    static_cast<void>(&t_pool_guard);
+
+    {
+        const std::lock_guard lock(g_spare_mutex);
+        t_free_nodes = std::exchange(g_spare_nodes, nullptr);
+    }
+
+    if (t_free_nodes != nullptr)
+        return;
+
+    static_assert(sizeof(PacketNode) >= sizeof(FreeNode));
+    auto* const slab = static_cast<char*>(
+        ::operator new(SLAB_NODES * sizeof(PacketNode),
+                       std::align_val_t{alignof(PacketNode)}));
+    for (size_t i = SLAB_NODES; i-- > 0;)
+        t_free_nodes =
+            new (slab + i * sizeof(PacketNode)) FreeNode{t_free_nodes};
+}
+
+} // namespace
+
+void* detail::allocate_packet_node() {
+    if (t_free_nodes == nullptr)
+        refill();
+
+    auto* const node = t_free_nodes;
+    t_free_nodes = node->next;
+    return node;
+}
+
+void detail::free_packet_node(void* node) noexcept {
+    auto* const free_node = new (node) FreeNode{nullptr};
+    if (t_exiting) {
+        park(free_node, free_node);
+        return;
+    }
+
+    free_node->next = t_free_nodes;
+    t_free_nodes = free_node;
+}
+
+namespace {
+
+// Not pulling in the socket headers just for these
+constexpr uint8_t PROTO_HOPOPTS = 0;
+constexpr uint8_t PROTO_ICMP = 1;
+constexpr uint8_t PROTO_TCP = 6;
+constexpr uint8_t PROTO_UDP = 17;
+constexpr uint8_t PROTO_ROUTING = 43;
+constexpr uint8_t PROTO_FRAGMENT = 44;
+constexpr uint8_t PROTO_AH = 51;
+constexpr uint8_t PROTO_ICMPV6 = 58;
+constexpr uint8_t PROTO_DSTOPTS = 60;
+
+// Returns the offset of the transport header, 0 if the IP header is invalid
+size_t parse_ipv4(const uint8_t* data, size_t size, PacketInfo& info) {
+    if (size < 20)
+        return 0;
+
+    const size_t header_length = (data[0] & 0x0f) * 4;
+    const size_t total_length = load_be16(data + 2);
+    if (header_length < 20 || total_length < header_length ||
+        header_length > size)
+        return 0;
+
+    info.length = static_cast<uint16_t>(std::min(total_length, size));
+    info.protocol = data[9];
+    info.fragment = (load_be16(data + 6) & 0x1fff) != 0;
+
+    info.src_addr[10] = info.src_addr[11] = 0xff;
+    info.dst_addr[10] = info.dst_addr[11] = 0xff;
+    memcpy(info.src_addr.data() + 12, data + 12, 4);
+    memcpy(info.dst_addr.data() + 12, data + 16, 4);
+
+    return header_length;
+}
+
+size_t parse_ipv6(const uint8_t* data, size_t size, PacketInfo& info) {
+    if (size < 40)
+        return 0;
+
+    const size_t length = std::min<size_t>(40 + load_be16(data + 4), size);
+    info.length = static_cast<uint16_t>(length);
+
+    memcpy(info.src_addr.data(), data + 8, 16);
+    memcpy(info.dst_addr.data(), data + 24, 16);
+
+    // Skip the extension headers
+    auto next_header = data[6];
+    size_t offset = 40;
+    while (offset + 8 <= length) {
+        const auto* const header = data + offset;
+        if (next_header == PROTO_HOPOPTS || next_header == PROTO_ROUTING ||
+            next_header == PROTO_DSTOPTS) {
+            offset += (header[1] + 1) * 8;
+        } else if (next_header == PROTO_AH) {
+            offset += (header[1] + 2) * 4;
+        } else if (next_header == PROTO_FRAGMENT) {
+            info.fragment |= (load_be16(header + 2) & 0xfff8) != 0;
+            offset += 8;
+        } else {
+            break;
+        }
+
+        next_header = header[0];
+    }
+
+    if (offset > length)
+        return 0;
+
+    info.protocol = next_header;
+    return offset;
+}
+
+// 64-bit finalizer of MurmurHash3
+uint64_t mix(uint64_t value) {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccd;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53;
+    value ^= value >> 33;
+    return value;
+}
+
+uint64_t hash_endpoint(const std::array<uint8_t, 16>& address, uint16_t port) {
+    uint64_t high = 0;
+    uint64_t low = 0;
+    memcpy(&high, address.data(), sizeof(high));
+    memcpy(&low, address.data() + 8, sizeof(low));
+    return mix(high ^ mix(low ^ port));
+}
+
+} // namespace
+
+PacketInfo parse_packet(const char* data, size_t size) {
+    const auto* const bytes = std::bit_cast<const uint8_t*>(data);
+
+    PacketInfo info;
+    info.parsed = true;
+    if (size == 0)
+        return info;
+
+    size_t l4_offset = 0;
+    switch (bytes[0] >> 4) {
+    case 4:
+        l4_offset = parse_ipv4(bytes, size, info);
+        break;
+    case 6:
+        l4_offset = parse_ipv6(bytes, size, info);
+        break;
+    default:
+        break;
+    }
+
+    if (l4_offset == 0)
+        return PacketInfo{.parsed = true};
+
+    info.ip_version = bytes[0] >> 4;
+    info.l4_offset = static_cast<uint16_t>(l4_offset);
+
+    // Whatever follows the transport header, or the IP header if the
+    // transport header is missing or truncated
+    size_t payload_offset = l4_offset;
+    const auto* const l4 = bytes + l4_offset;
+    const size_t l4_size = info.length - l4_offset;
+    if (!info.fragment) {
+        switch (info.protocol) {
+        case PROTO_TCP:
+            if (l4_size >= 20) {
+                const size_t header_length = (l4[12] >> 4) * 4;
+                info.src_port = load_be16(l4);
+                info.dst_port = load_be16(l4 + 2);
+                if (header_length >= 20 && header_length <= l4_size)
+                    payload_offset += header_length;
+            }
+            break;
+        case PROTO_UDP:
+            if (l4_size >= 8) {
+                info.src_port = load_be16(l4);
+                info.dst_port = load_be16(l4 + 2);
+                payload_offset += 8;
+            }
+            break;
+        case PROTO_ICMP:
+        case PROTO_ICMPV6:
+            if (l4_size >= 8)
+                payload_offset += 8;
+            break;
+        default:
+            break;
+        }
+    }
+
+    info.payload_offset = static_cast<uint16_t>(payload_offset);
+    info.payload_length = static_cast<uint16_t>(info.length - payload_offset);
+    info.flow_hash = flow_hash(info);
+
+    return info;
+}
+
+uint32_t flow_hash(const PacketInfo& info) {
+    // Summing makes it independent of the direction
+    const auto hash = hash_endpoint(info.src_addr, info.src_port) +
+                      hash_endpoint(info.dst_addr, info.dst_port);
+    return static_cast<uint32_t>(mix(hash ^ info.protocol));
+}
+
+std::optional<FragmentHeader> parse_fragment_header(const char* data,
+                                                    const PacketInfo& info) {
+    const auto* const bytes = std::bit_cast<const uint8_t*>(data);
+    FragmentHeader header;
+    if (info.ip_version == 4) {
+        const auto flags_offset = load_be16(bytes + 6);
+        header.header_size = info.l4_offset;
+        header.data_offset = info.l4_offset;
+        header.offset = (flags_offset & 0x1fff) * 8u;
+        header.more = (flags_offset & 0x2000) != 0;
+        header.is_fragment = header.more || header.offset != 0;
+        if (header.is_fragment)
+            header.id = load_be16(bytes + 4);
+
+        return header;
+    }
+
+    if (info.ip_version != 6)
+        return std::nullopt;
+
+    // Same walk as `parse_ipv6`, minding where the fragment header goes
+    auto next_header = bytes[6];
+    size_t next_header_offset = 6;
+    size_t offset = 40;
+    header.header_size = header.data_offset = 40;
+    header.next_header_offset = 6;
+    while (offset + 8 <= info.length) {
+        const auto* const extension = bytes + offset;
+        if (next_header == PROTO_HOPOPTS || next_header == PROTO_ROUTING) {
+            offset += (extension[1] + 1) * 8;
+            if (offset > info.length)
+                return std::nullopt;
+
+            header.header_size = header.data_offset =
+                static_cast<uint16_t>(offset);
+            header.next_header_offset =
+                static_cast<uint16_t>(extension - bytes);
+        } else if (next_header == PROTO_DSTOPTS) {
+            offset += (extension[1] + 1) * 8;
+        } else if (next_header == PROTO_AH) {
+            offset += (extension[1] + 2) * 4;
+        } else if (next_header == PROTO_FRAGMENT) {
+            header.header_size = static_cast<uint16_t>(offset);
+            header.next_header_offset =
+                static_cast<uint16_t>(next_header_offset);
+            header.data_offset = static_cast<uint16_t>(offset + 8);
+            header.is_fragment = true;
+            header.offset = load_be16(extension + 2) & 0xfff8;
+            header.more = (extension[3] & 1) != 0;
+            header.id = load_be32(extension + 4);
+            break;
+        } else {
+            break;
+        }
+
+        next_header = extension[0];
+        next_header_offset = static_cast<size_t>(extension - bytes);
+    }
+
+    return header;
+}
+
+void parse_packets(PacketList::iterator first, PacketList::iterator last) {
+    for (auto it = first; it != last; ++it) {
+        auto& node = *it;
+        if (!node.info.parsed)
+            node.info = parse_packet(node.packet.data(), node.packet.size());
+    }
+}
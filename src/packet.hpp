@@ -1,16 +1,368 @@
 #pragma once
 
+#include <array>
 #include <chrono>
-#include <list>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
 
+#ifdef _WIN32
 #include <windivert.h>
+#endif
 
 #include "dense_buffers.hpp"
 
+#ifdef _WIN32
+using PacketAddress = WINDIVERT_ADDRESS;
+#else
+// Subset of `WINDIVERT_ADDRESS` the modules rely on, filled in by the
+// non-WinDivert backends.
+struct PacketAddress {
+    uint64_t Id;    // Backend specific packet id (e.g. NFQUEUE packet id)
+    uint32_t IfIdx; // Interface the packet was captured on
+    uint16_t Queue; // Backend queue the packet was captured from
+    uint8_t Outbound : 1;
+};
+
+// Link layer backends keep the destination MAC and ethertype of a frame in
+// its packet id, that's all that's needed to send it out again
+inline uint64_t pack_link_id(const char* mac, uint16_t ethertype) {
+    uint64_t id = static_cast<uint64_t>(ethertype) << 48;
+    for (size_t i = 0; i < 6; i++)
+        id |= static_cast<uint64_t>(static_cast<uint8_t>(mac[i])) << (i * 8);
+
+    return id;
+}
+
+inline void unpack_link_id(uint64_t id, unsigned char* mac,
+                           uint16_t& ethertype) {
+    ethertype = static_cast<uint16_t>(id >> 48);
+    for (size_t i = 0; i < 6; i++)
+        mac[i] = static_cast<unsigned char>(id >> (i * 8));
+}
+#endif
+
+// Unaligned big endian header fields
+inline uint16_t load_be16(const uint8_t* data) {
+    return static_cast<uint16_t>(data[0] << 8 | data[1]);
+}
+
+inline uint32_t load_be32(const uint8_t* data) {
+    return static_cast<uint32_t>(load_be16(data)) << 16 | load_be16(data + 2);
+}
+
+inline void store_be16(uint8_t* data, uint16_t value) {
+    data[0] = static_cast<uint8_t>(value >> 8);
+    data[1] = static_cast<uint8_t>(value);
+}
+
+inline void store_be32(uint8_t* data, uint32_t value) {
+    store_be16(data, static_cast<uint16_t>(value >> 16));
+    store_be16(data + 2, static_cast<uint16_t>(value));
+}
+
+// Network and transport headers of a packet, parsed once before it enters
+// the module chain. Offsets are relative to the start of the packet.
+struct PacketInfo {
+    bool parsed = false;
+    // 4 or 6, 0 if the packet doesn't start with a valid IP header
+    uint8_t ip_version = 0;
+    // Transport protocol (`IPPROTO_*`) behind any IPv6 extension headers
+    uint8_t protocol = 0;
+    // Set for fragments other than the first one, they have no transport
+    // header
+    bool fragment = false;
+    // Length according to the IP header, anything past it (e.g. ethernet
+    // padding) isn't part of the packet
+    uint16_t length = 0;
+    uint16_t l4_offset = 0;
+    uint16_t payload_offset = 0;
+    uint16_t payload_length = 0;
+    // Host byte order, 0 for protocols without ports
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+    // IPv4 addresses are mapped into IPv6 (::ffff:a.b.c.d)
+    std::array<uint8_t, 16> src_addr{};
+    std::array<uint8_t, 16> dst_addr{};
+    // Hash of the 5-tuple, the same for both directions of a flow
+    uint32_t flow_hash = 0;
+};
+
+// Parses the headers of the packet at `data`, `size` may include trailing
+// bytes that aren't part of it
+PacketInfo parse_packet(const char* data, size_t size);
+
+// Hash of the addresses, ports and protocol of `info`
+uint32_t flow_hash(const PacketInfo& info);
+
+// Where an IP packet stands in fragmentation. Offsets are relative to the
+// start of the packet.
+struct FragmentHeader {
+    // Headers every fragment repeats: the IPv4 header, or the IPv6 header
+    // with the extension headers up to the routing header. The IPv6 fragment
+    // header follows them.
+    uint16_t header_size = 0;
+    // IPv6 only, the byte holding the protocol of what follows the repeated
+    // headers
+    uint16_t next_header_offset = 0;
+    // Start of the data that's split up between the fragments
+    uint16_t data_offset = 0;
+    bool is_fragment = false;
+    // Fragment fields, 0 unless `is_fragment`. The offset is in bytes.
+    uint32_t id = 0;
+    uint32_t offset = 0;
+    bool more = false;
+};
+
+// Fragmentation of the parsed packet at `data`, `std::nullopt` unless it's a
+// valid IP packet
+std::optional<FragmentHeader> parse_fragment_header(const char* data,
+                                                    const PacketInfo& info);
+
 struct PacketNode {
     DenseBufferArraySlice packet;
-    WINDIVERT_ADDRESS addr;
+    PacketAddress addr;
     std::chrono::steady_clock::time_point captured_at;
+    // Filled in by `parse_packets` unless the backend already did
+    PacketInfo info{};
+
+    // Links of the `PacketList` the node is in
+    PacketNode* prev = nullptr;
+    PacketNode* next = nullptr;
 };
 
-extern std::list<PacketNode> g_packets;
+namespace detail {
+
+// Node storage is recycled through a free list of the calling thread, so
+// queueing packets doesn't hit the allocator once the pools are warm.
+// Nodes may be freed on another thread than the one that allocated them.
+void* allocate_packet_node();
+void free_packet_node(void* node) noexcept;
+
+} // namespace detail
+
+// Intrusive doubly linked list of pooled `PacketNode`s. Mirrors the parts of
+// `std::list` the backends and modules use, splicing relinks nodes without
+// touching the pool.
+class PacketList {
+public:
+    template <bool Const> class Iterator {
+        friend class PacketList;
+
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = PacketNode;
+        using difference_type = std::ptrdiff_t;
+        using pointer =
+            std::conditional_t<Const, const PacketNode*, PacketNode*>;
+        using reference =
+            std::conditional_t<Const, const PacketNode&, PacketNode&>;
+
+        Iterator() = default;
+        Iterator(PacketNode* node, const PacketList* list)
+            : m_node(node), m_list(list) {}
+
+        // Mutable iterators convert to const ones
+        template <bool OtherConst>
+            requires(Const && !OtherConst)
+        Iterator(const Iterator<OtherConst>& other)
+            : m_node(other.m_node), m_list(other.m_list) {}
+
+        reference operator*() const { return *m_node; }
+        pointer operator->() const { return m_node; }
+
+        Iterator& operator++() {
+            m_node = m_node->next;
+            return *this;
+        }
+        Iterator operator++(int) {
+            auto copy = *this;
+            ++*this;
+            return copy;
+        }
+        Iterator& operator--() {
+            m_node = m_node != nullptr ? m_node->prev : m_list->m_tail;
+            return *this;
+        }
+        Iterator operator--(int) {
+            auto copy = *this;
+            --*this;
+            return copy;
+        }
+
+        template <bool OtherConst>
+        bool operator==(const Iterator<OtherConst>& other) const {
+            return m_node == other.m_node;
+        }
+
+    private:
+        template <bool> friend class Iterator;
+
+        // `nullptr` past the end
+        PacketNode* m_node = nullptr;
+        const PacketList* m_list = nullptr;
+    };
+
+    using iterator = Iterator<false>;
+    using const_iterator = Iterator<true>;
+
+public:
+    PacketList() = default;
+
+    PacketList(const PacketList& other) {
+        for (const auto& packet : other)
+            emplace_back(packet);
+    }
+    PacketList& operator=(const PacketList& other) {
+        if (this != &other) {
+            clear();
+            for (const auto& packet : other)
+                emplace_back(packet);
+        }
+
+        return *this;
+    }
+
+    PacketList(PacketList&& other) noexcept { splice(cend(), other); }
+    PacketList& operator=(PacketList&& other) noexcept {
+        if (this != &other) {
+            clear();
+            splice(cend(), other);
+        }
+
+        return *this;
+    }
+
+    ~PacketList() { clear(); }
+
+    [[nodiscard]] iterator begin() noexcept { return {m_head, this}; }
+    [[nodiscard]] iterator end() noexcept { return {nullptr, this}; }
+    [[nodiscard]] const_iterator begin() const noexcept {
+        return {m_head, this};
+    }
+    [[nodiscard]] const_iterator end() const noexcept {
+        return {nullptr, this};
+    }
+    [[nodiscard]] const_iterator cbegin() const noexcept { return begin(); }
+    [[nodiscard]] const_iterator cend() const noexcept { return end(); }
+
+    [[nodiscard]] PacketNode& front() noexcept { return *m_head; }
+    [[nodiscard]] PacketNode& back() noexcept { return *m_tail; }
+
+    [[nodiscard]] size_t size() const noexcept { return m_size; }
+    [[nodiscard]] bool empty() const noexcept { return m_size == 0; }
+
+    template <typename... Args> PacketNode& emplace_back(Args&&... args) {
+        return *insert_node(nullptr, std::forward<Args>(args)...);
+    }
+
+    iterator insert(const_iterator pos, const PacketNode& packet) {
+        return {insert_node(pos.m_node, packet), this};
+    }
+
+    iterator erase(const_iterator pos) noexcept {
+        auto* const next = pos.m_node->next;
+        unlink(pos.m_node);
+        destroy(pos.m_node);
+        return {next, this};
+    }
+
+    iterator erase(const_iterator first, const_iterator last) noexcept {
+        while (first != last)
+            first = erase(first);
+
+        return {last.m_node, this};
+    }
+
+    void clear() noexcept { erase(cbegin(), cend()); }
+
+    // Moves all packets of `other` in front of `pos`
+    void splice(const_iterator pos, PacketList& other) noexcept {
+        if (other.empty())
+            return;
+
+        auto* const first = other.m_head;
+        auto* const last = other.m_tail;
+        link_range(pos.m_node, first, last);
+        m_size += other.m_size;
+
+        other.m_head = other.m_tail = nullptr;
+        other.m_size = 0;
+    }
+
+    // Moves the packet at `it` of `other` in front of `pos`
+    void splice(const_iterator pos, PacketList& other,
+                const_iterator it) noexcept {
+        if (&other == this &&
+            (pos == it || pos.m_node == it.m_node->next))
+            return;
+
+        other.unlink(it.m_node);
+        link_range(pos.m_node, it.m_node, it.m_node);
+        m_size++;
+    }
+
+private:
+    template <typename... Args>
+    PacketNode* insert_node(PacketNode* pos, Args&&... args) {
+        auto* const node = new (detail::allocate_packet_node())
+            PacketNode(std::forward<Args>(args)...);
+        link_range(pos, node, node);
+        m_size++;
+        return node;
+    }
+
+    // Links the chain `first`..`last` in front of `pos` (the end if
+    // `nullptr`), sizes are up to the caller
+    void link_range(PacketNode* pos, PacketNode* first,
+                    PacketNode* last) noexcept {
+        auto* const prev = pos != nullptr ? pos->prev : m_tail;
+        first->prev = prev;
+        last->next = pos;
+
+        if (prev != nullptr)
+            prev->next = first;
+        else
+            m_head = first;
+
+        if (pos != nullptr)
+            pos->prev = last;
+        else
+            m_tail = last;
+    }
+
+    void unlink(PacketNode* node) noexcept {
+        if (node->prev != nullptr)
+            node->prev->next = node->next;
+        else
+            m_head = node->next;
+
+        if (node->next != nullptr)
+            node->next->prev = node->prev;
+        else
+            m_tail = node->prev;
+
+        node->prev = node->next = nullptr;
+        m_size--;
+    }
+
+    static void destroy(PacketNode* node) noexcept {
+        node->~PacketNode();
+        detail::free_packet_node(node);
+    }
+
+private:
+    PacketNode* m_head = nullptr;
+    PacketNode* m_tail = nullptr;
+    size_t m_size = 0;
+};
+
+// Packets in flight through the module chain of the current backend thread
+extern thread_local PacketList g_packets;
+
+// Parses the nodes in `[first, last)` that weren't parsed yet
+void parse_packets(PacketList::iterator first, PacketList::iterator last);
@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "common.hpp"
+#include "pcap.hpp"
+
+static constexpr uint32_t PCAP_MAGIC_MICROSECONDS = 0xa1b2c3d4;
+static constexpr uint32_t PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+static constexpr size_t PCAP_HEADER_SIZE = 24;
+static constexpr size_t PCAP_RECORD_HEADER_SIZE = 16;
+
+static constexpr uint32_t PCAPNG_SECTION_HEADER = 0x0a0d0d0a;
+static constexpr uint32_t PCAPNG_INTERFACE_DESCRIPTION = 1;
+static constexpr uint32_t PCAPNG_SIMPLE_PACKET = 3;
+static constexpr uint32_t PCAPNG_ENHANCED_PACKET = 6;
+static constexpr uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+static constexpr size_t PCAPNG_BLOCK_HEADER_SIZE = 8;
+
+static constexpr uint16_t PCAPNG_OPT_END = 0;
+static constexpr uint16_t PCAPNG_OPT_IF_TSRESOL = 9;
+static constexpr uint16_t PCAPNG_OPT_EPB_FLAGS = 2;
+
+static constexpr uint64_t NANOSECONDS = 1'000'000'000;
+
+static constexpr size_t align4(size_t size) { return (size + 3) & ~3ULL; }
+
+bool MappedFile::open(const std::string& path) {
+    close();
+
+#ifdef _WIN32
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(m_file, &size)) {
+        close();
+        return false;
+    }
+    m_size = size.QuadPart;
+
+    // Empty files can't be mapped
+    if (m_size != 0) {
+        m_mapping =
+            CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr) {
+            close();
+            return false;
+        }
+    }
+#else
+    m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        return false;
+
+    struct stat st {};
+    if (fstat(m_fd, &st) < 0) {
+        close();
+        return false;
+    }
+    m_size = st.st_size;
+#endif
+
+    return true;
+}
+
+void MappedFile::close() {
+    unmap();
+
+#ifdef _WIN32
+    if (m_mapping != nullptr)
+        CloseHandle(m_mapping);
+    m_mapping = nullptr;
+
+    if (m_file != INVALID_HANDLE_VALUE)
+        CloseHandle(m_file);
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+#endif
+
+    m_size = 0;
+}
+
+void MappedFile::unmap() {
+    if (m_window == nullptr)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_window);
+#else
+    munmap(const_cast<char*>(m_window), m_window_size);
+#endif
+
+    m_window = nullptr;
+    m_window_offset = 0;
+    m_window_size = 0;
+}
+
+const char* MappedFile::view(uint64_t offset, size_t size) {
+    if (offset + size > m_size || offset + size < offset)
+        return nullptr;
+
+    if (m_window != nullptr && offset >= m_window_offset &&
+        offset + size <= m_window_offset + m_window_size)
+        return m_window + (offset - m_window_offset);
+
+    unmap();
+
+    // Windows need to start at the allocation granularity
+#ifdef _WIN32
+    SYSTEM_INFO info{};
+    GetSystemInfo(&info);
+    const uint64_t granularity = info.dwAllocationGranularity;
+#else
+    const uint64_t granularity = sysconf(_SC_PAGESIZE);
+#endif
+    const auto window_offset = offset - offset % granularity;
+    const auto window_size = static_cast<size_t>(std::min<uint64_t>(
+        std::max<uint64_t>(WINDOW_SIZE, offset - window_offset + size),
+        m_size - window_offset));
+
+#ifdef _WIN32
+    const auto* window = static_cast<const char*>(MapViewOfFile(
+        m_mapping, FILE_MAP_READ, static_cast<DWORD>(window_offset >> 32),
+        static_cast<DWORD>(window_offset), window_size));
+    if (window == nullptr)
+        return nullptr;
+#else
+    auto* window = mmap(nullptr, window_size, PROT_READ, MAP_PRIVATE, m_fd,
+                        static_cast<off_t>(window_offset));
+    if (window == MAP_FAILED)
+        return nullptr;
+
+    madvise(window, window_size, MADV_SEQUENTIAL);
+#endif
+
+    m_window = static_cast<const char*>(window);
+    m_window_offset = window_offset;
+    m_window_size = window_size;
+
+    return m_window + (offset - m_window_offset);
+}
+
+uint16_t PcapReader::read16(const char* data) const noexcept {
+    uint16_t value = 0;
+    memcpy(&value, data, sizeof(value));
+    return m_swapped ? static_cast<uint16_t>((value >> 8) | (value << 8))
+                     : value;
+}
+
+uint32_t PcapReader::read32(const char* data) const noexcept {
+    uint32_t value = 0;
+    memcpy(&value, data, sizeof(value));
+    if (m_swapped) {
+        value = ((value & 0xff000000) >> 24) | ((value & 0x00ff0000) >> 8) |
+                ((value & 0x0000ff00) << 8) | ((value & 0x000000ff) << 24);
+    }
+
+    return value;
+}
+
+std::optional<std::string> PcapReader::open(const std::string& path) {
+    m_interfaces.clear();
+    m_last_timestamp_ns = 0;
+
+    if (!m_file.open(path))
+        return "Failed to open '" + path + "'";
+
+    const auto* header = m_file.view(0, PCAP_HEADER_SIZE);
+    if (header == nullptr)
+        return "'" + path + "' is too short to be a capture";
+
+    m_swapped = false;
+    const auto magic = read32(header);
+    m_swapped = true;
+    const auto swapped_magic = read32(header);
+    m_swapped = false;
+
+    if (magic == PCAPNG_SECTION_HEADER) {
+        // Byte order is read from the section header
+        m_pcapng = true;
+        m_offset = 0;
+        return std::nullopt;
+    }
+
+    if (magic == PCAP_MAGIC_MICROSECONDS || magic == PCAP_MAGIC_NANOSECONDS) {
+        m_nanoseconds = magic == PCAP_MAGIC_NANOSECONDS;
+    } else if (swapped_magic == PCAP_MAGIC_MICROSECONDS ||
+               swapped_magic == PCAP_MAGIC_NANOSECONDS) {
+        m_swapped = true;
+        m_nanoseconds = swapped_magic == PCAP_MAGIC_NANOSECONDS;
+    } else {
+        return "'" + path + "' is not a pcap or pcapng file";
+    }
+
+    m_pcapng = false;
+    m_link_type = static_cast<uint16_t>(read32(header + 20));
+    m_offset = PCAP_HEADER_SIZE;
+
+    return std::nullopt;
+}
+
+std::optional<PcapReader::Record> PcapReader::next() {
+    return m_pcapng ? next_pcapng() : next_pcap();
+}
+
+std::optional<PcapReader::Record> PcapReader::next_pcap() {
+    const auto* header = m_file.view(m_offset, PCAP_RECORD_HEADER_SIZE);
+    if (header == nullptr)
+        return std::nullopt;
+
+    const uint64_t seconds = read32(header);
+    const uint64_t fraction = read32(header + 4);
+    const auto captured_size = read32(header + 8);
+
+    const auto* data =
+        m_file.view(m_offset + PCAP_RECORD_HEADER_SIZE, captured_size);
+    if (data == nullptr) {
+        LOG("Truncated record at offset %llu",
+            static_cast<unsigned long long>(m_offset));
+        return std::nullopt;
+    }
+
+    m_offset += PCAP_RECORD_HEADER_SIZE + captured_size;
+
+    return Record{
+        .data = data,
+        .size = captured_size,
+        .timestamp_ns = seconds * NANOSECONDS +
+                        (m_nanoseconds ? fraction : fraction * 1000),
+        .link_type = m_link_type,
+        .outbound = std::nullopt,
+    };
+}
+
+void PcapReader::parse_interface(const char* body, size_t body_size) {
+    if (body_size < 8)
+        return;
+
+    Interface iface{
+        .link_type = read16(body),
+        .ts_mul = 1000,
+        .ts_div = 1,
+    };
+
+    // Look for a non-default timestamp resolution
+    size_t offset = 8;
+    while (offset + 4 <= body_size) {
+        const auto code = read16(body + offset);
+        const auto length = read16(body + offset + 2);
+        if (code == PCAPNG_OPT_END || offset + 4 + length > body_size)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && length >= 1) {
+            const auto resolution = static_cast<uint8_t>(body[offset + 4]);
+            const auto exponent = resolution & 0x7f;
+            if (resolution & 0x80) {
+                // Power of two
+                iface.ts_mul = NANOSECONDS;
+                iface.ts_div = exponent < 64 ? 1ULL << exponent : 1;
+            } else if (exponent <= 9) {
+                iface.ts_mul = 1;
+                for (auto i = exponent; i < 9; i++)
+                    iface.ts_mul *= 10;
+                iface.ts_div = 1;
+            } else {
+                iface.ts_mul = 1;
+                iface.ts_div = 1;
+                for (auto i = 9; i < exponent && i < 19; i++)
+                    iface.ts_div *= 10;
+            }
+        }
+
+        offset += 4 + align4(length);
+    }
+
+    m_interfaces.push_back(iface);
+}
+
+std::optional<PcapReader::Record> PcapReader::next_pcapng() {
+    while (true) {
+        const auto* header = m_file.view(m_offset, PCAPNG_BLOCK_HEADER_SIZE);
+        if (header == nullptr)
+            return std::nullopt;
+
+        // Section header type reads the same in both byte orders, the byte
+        // order of the rest of the section follows from its magic
+        if (read32(header) == PCAPNG_SECTION_HEADER) {
+            const auto* magic = m_file.view(m_offset + 8, 4);
+            if (magic == nullptr)
+                return std::nullopt;
+
+            m_swapped = false;
+            if (read32(magic) != PCAPNG_BYTE_ORDER_MAGIC) {
+                m_swapped = true;
+                if (read32(magic) != PCAPNG_BYTE_ORDER_MAGIC) {
+                    LOG("Invalid section header byte order magic");
+                    return std::nullopt;
+                }
+            }
+
+            m_interfaces.clear();
+        }
+
+        const auto type = read32(header);
+        const auto total_length = read32(header + 4);
+        if (total_length < 12 || total_length % 4 != 0) {
+            LOG("Invalid block length %u at offset %llu", total_length,
+                static_cast<unsigned long long>(m_offset));
+            return std::nullopt;
+        }
+
+        const auto* block = m_file.view(m_offset, total_length);
+        if (block == nullptr) {
+            LOG("Truncated block at offset %llu",
+                static_cast<unsigned long long>(m_offset));
+            return std::nullopt;
+        }
+
+        m_offset += total_length;
+
+        const auto* body = block + PCAPNG_BLOCK_HEADER_SIZE;
+        const size_t body_size = total_length - 12;
+        switch (type) {
+        case PCAPNG_INTERFACE_DESCRIPTION:
+            parse_interface(body, body_size);
+            break;
+        case PCAPNG_ENHANCED_PACKET: {
+            if (body_size < 20)
+                break;
+
+            const auto interface_id = read32(body);
+            if (interface_id >= m_interfaces.size())
+                break;
+
+            const auto& iface = m_interfaces[interface_id];
+            const auto timestamp =
+                (static_cast<uint64_t>(read32(body + 4)) << 32) |
+                read32(body + 8);
+            const auto captured_size = read32(body + 12);
+            if (20 + static_cast<size_t>(captured_size) > body_size)
+                break;
+
+            // Direction is in the first two bits of the flags option
+            std::optional<bool> outbound;
+            auto offset = 20 + align4(captured_size);
+            while (offset + 4 <= body_size) {
+                const auto code = read16(body + offset);
+                const auto length = read16(body + offset + 2);
+                if (code == PCAPNG_OPT_END || offset + 4 + length > body_size)
+                    break;
+
+                if (code == PCAPNG_OPT_EPB_FLAGS && length >= 4) {
+                    const auto direction = read32(body + offset + 4) & 0b11;
+                    if (direction != 0)
+                        outbound = direction == 0b10;
+                }
+
+                offset += 4 + align4(length);
+            }
+
+            m_last_timestamp_ns =
+                timestamp / iface.ts_div * iface.ts_mul +
+                timestamp % iface.ts_div * iface.ts_mul /
+                    iface.ts_div;
+
+            return Record{
+                .data = body + 20,
+                .size = captured_size,
+                .timestamp_ns = m_last_timestamp_ns,
+                .link_type = iface.link_type,
+                .outbound = outbound,
+            };
+        }
+        case PCAPNG_SIMPLE_PACKET: {
+            if (body_size < 4 || m_interfaces.empty())
+                break;
+
+            const auto original_size = read32(body);
+
+            // Simple packets have no timestamps, reuse the last one
+            return Record{
+                .data = body + 4,
+                .size = std::min<size_t>(original_size, body_size - 4),
+                .timestamp_ns = m_last_timestamp_ns,
+                .link_type = m_interfaces.front().link_type,
+                .outbound = std::nullopt,
+            };
+        }
+        default:
+            break;
+        }
+    }
+}
+
+bool PcapWriter::open(const std::string& path) {
+    close();
+
+    m_file = fopen(path.c_str(), "wb");
+    if (m_file == nullptr)
+        return false;
+
+    m_buffer.resize(1 << 20);
+    setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+
+    struct {
+        uint32_t magic;
+        uint16_t version_major;
+        uint16_t version_minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t network;
+    } header{
+        .magic = PCAP_MAGIC_NANOSECONDS,
+        .version_major = 2,
+        .version_minor = 4,
+        .thiszone = 0,
+        .sigfigs = 0,
+        .snaplen = 0x40000,
+        .network = PcapReader::LINKTYPE_RAW,
+    };
+    static_assert(sizeof(header) == PCAP_HEADER_SIZE);
+
+    return fwrite(&header, sizeof(header), 1, m_file) == 1;
+}
+
+void PcapWriter::close() {
+    if (m_file != nullptr)
+        fclose(m_file);
+
+    m_file = nullptr;
+}
+
+void PcapWriter::write(const char* data, size_t size, uint64_t timestamp_ns) {
+    const std::array<uint32_t, 4> header{
+        static_cast<uint32_t>(timestamp_ns / NANOSECONDS),
+        static_cast<uint32_t>(timestamp_ns % NANOSECONDS),
+        static_cast<uint32_t>(size),
+        static_cast<uint32_t>(size),
+    };
+
+    fwrite(header.data(), sizeof(header), 1, m_file);
+    fwrite(data, size, 1, m_file);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#endif
+
+// Read-only file mapped through a sliding window, so that only the part of
+// the file that's currently being read is resident no matter its size.
+class MappedFile {
+public:
+    static const inline size_t WINDOW_SIZE = 64 << 20;
+
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile(MappedFile&&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path);
+    void close();
+
+    // Returns a pointer to `size` bytes at `offset` or `nullptr` if they're
+    // past the end of the file. Valid until the next call.
+    [[nodiscard]] const char* view(uint64_t offset, size_t size);
+
+    [[nodiscard]] uint64_t size() const noexcept { return m_size; }
+
+private:
+    void unmap();
+
+private:
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+    uint64_t m_size = 0;
+
+    const char* m_window = nullptr;
+    uint64_t m_window_offset = 0;
+    size_t m_window_size = 0;
+};
+
+// Streaming reader for pcap and pcapng captures
+class PcapReader {
+public:
+    static const inline uint16_t LINKTYPE_NULL = 0;
+    static const inline uint16_t LINKTYPE_ETHERNET = 1;
+    static const inline uint16_t LINKTYPE_RAW = 101;
+    static const inline uint16_t LINKTYPE_LINUX_SLL = 113;
+    static const inline uint16_t LINKTYPE_IPV4 = 228;
+    static const inline uint16_t LINKTYPE_IPV6 = 229;
+
+    struct Record {
+        // Points into the mapped file, valid until the next `next()` call
+        const char* data;
+        size_t size;
+        uint64_t timestamp_ns;
+        uint16_t link_type;
+        // Only known for pcapng packets with direction flags
+        std::optional<bool> outbound;
+    };
+
+public:
+    std::optional<std::string> open(const std::string& path);
+
+    std::optional<Record> next();
+
+private:
+    struct Interface {
+        uint16_t link_type;
+        // Multiplier and divisor converting timestamps to nanoseconds
+        uint64_t ts_mul;
+        uint64_t ts_div;
+    };
+
+    std::optional<Record> next_pcap();
+    std::optional<Record> next_pcapng();
+
+    [[nodiscard]] uint16_t read16(const char* data) const noexcept;
+    [[nodiscard]] uint32_t read32(const char* data) const noexcept;
+
+    void parse_interface(const char* body, size_t body_size);
+
+private:
+    MappedFile m_file;
+    uint64_t m_offset = 0;
+
+    bool m_pcapng = false;
+    bool m_swapped = false;
+
+    // pcap
+    uint16_t m_link_type = 0;
+    bool m_nanoseconds = false;
+
+    // pcapng
+    std::vector<Interface> m_interfaces;
+    uint64_t m_last_timestamp_ns = 0;
+};
+
+// Writes raw IP packets into a nanosecond resolution pcap file
+class PcapWriter {
+public:
+    PcapWriter() = default;
+
+    PcapWriter(const PcapWriter&) = delete;
+    PcapWriter(PcapWriter&&) = delete;
+    PcapWriter& operator=(const PcapWriter&) = delete;
+    PcapWriter& operator=(PcapWriter&&) = delete;
+
+    ~PcapWriter() { close(); }
+
+    bool open(const std::string& path);
+    void close();
+
+    void write(const char* data, size_t size, uint64_t timestamp_ns);
+
+private:
+    FILE* m_file = nullptr;
+    std::vector<char> m_buffer;
+};
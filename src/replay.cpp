@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "clock.hpp"
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "packet.hpp"
+#include "replay.hpp"
+
+using namespace std::chrono_literals;
+
+static PacketClock::time_point to_time_point(uint64_t timestamp_ns) {
+    return PacketClock::time_point(
+        std::chrono::duration_cast<PacketClock::time_point::duration>(
+            std::chrono::nanoseconds(timestamp_ns)));
+}
+
+static uint64_t to_timestamp_ns(PacketClock::time_point time_point) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               time_point.time_since_epoch())
+        .count();
+}
+
+// Strips the link layer header, returns `std::nullopt` for non-IP frames
+static std::optional<std::pair<const char*, size_t>>
+network_layer(const PcapReader::Record& record) {
+    const auto* data = record.data;
+    auto size = record.size;
+
+    switch (record.link_type) {
+    case PcapReader::LINKTYPE_ETHERNET: {
+        size_t header_size = 14;
+        if (size < header_size)
+            return std::nullopt;
+
+        // Skip VLAN tags
+        auto ether_type = (static_cast<uint8_t>(data[12]) << 8) |
+                          static_cast<uint8_t>(data[13]);
+        while ((ether_type == 0x8100 || ether_type == 0x88a8) &&
+               size >= header_size + 4) {
+            ether_type = (static_cast<uint8_t>(data[header_size + 2]) << 8) |
+                         static_cast<uint8_t>(data[header_size + 3]);
+            header_size += 4;
+        }
+
+        if (ether_type != 0x0800 && ether_type != 0x86dd)
+            return std::nullopt;
+
+        data += header_size;
+        size -= header_size;
+        break;
+    }
+    case PcapReader::LINKTYPE_LINUX_SLL:
+        if (size < 16)
+            return std::nullopt;
+
+        data += 16;
+        size -= 16;
+        break;
+    case PcapReader::LINKTYPE_NULL:
+        if (size < 4)
+            return std::nullopt;
+
+        data += 4;
+        size -= 4;
+        break;
+    case PcapReader::LINKTYPE_RAW:
+    case PcapReader::LINKTYPE_IPV4:
+    case PcapReader::LINKTYPE_IPV6:
+        break;
+    default:
+        return std::nullopt;
+    }
+
+    if (size == 0)
+        return std::nullopt;
+
+    // Cut off link layer padding
+    const auto version = static_cast<uint8_t>(data[0]) >> 4;
+    if (version == 4 && size >= 20) {
+        const size_t length = (static_cast<uint8_t>(data[2]) << 8) |
+                              static_cast<uint8_t>(data[3]);
+        size = std::min(size, length);
+    } else if (version == 6 && size >= 40) {
+        const size_t length = (static_cast<uint8_t>(data[4]) << 8) |
+                              static_cast<uint8_t>(data[5]);
+        // Zero for jumbograms
+        if (length != 0)
+            size = std::min(size, length + 40);
+    } else {
+        return std::nullopt;
+    }
+
+    return std::make_pair(data, size);
+}
+
+std::optional<std::string> PcapReplay::start(const std::string& filter) {
+    LOG("Starting");
+
+    const auto trim = [](std::string_view text) {
+        const auto first = text.find_first_not_of(" \t");
+        if (first == std::string_view::npos)
+            return std::string();
+
+        const auto last = text.find_last_not_of(" \t");
+        return std::string(text.substr(first, last - first + 1));
+    };
+
+    std::string input_path = trim(filter);
+    std::string output_path;
+    if (const auto separator = filter.rfind('>');
+        separator != std::string::npos) {
+        input_path = trim(std::string_view(filter).substr(0, separator));
+        output_path = trim(std::string_view(filter).substr(separator + 1));
+    }
+
+    if (input_path.empty())
+        return "Failed to start replay: filter must be "
+               "'input.pcapng > output.pcap'";
+
+    if (const auto err = m_reader.open(input_path))
+        return "Failed to start replay: " + *err;
+
+    if (!output_path.empty()) {
+        m_writer.emplace();
+        if (!m_writer->open(output_path)) {
+            m_writer = std::nullopt;
+            return "Failed to start replay: failed to create '" +
+                   output_path + "'";
+        }
+    }
+
+    m_stats = {};
+    m_stop = false;
+    m_finished = false;
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .reader = m_reader,
+        .writer = m_writer,
+        .stats = m_stats,
+        .stop = m_stop,
+        .finished = m_finished,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+    m_running = true;
+
+    return std::nullopt;
+}
+
+bool PcapReplay::stop() {
+    if (!m_running)
+        return false;
+
+    LOG("Stopping");
+
+    m_stop = true;
+
+    LOG("Waiting for the replay thread");
+    m_thread.join();
+    m_running = false;
+
+    m_writer = std::nullopt;
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("Replay stopped");
+
+    return true;
+}
+
+std::optional<std::string> PcapReplay::summary() const {
+    if (!finished())
+        return std::nullopt;
+
+    const auto elapsed_seconds =
+        std::chrono::duration<double>(m_stats.elapsed).count();
+    const auto capture_seconds =
+        static_cast<double>(m_stats.last_timestamp_ns -
+                            m_stats.first_timestamp_ns) /
+        1e9;
+    const auto rate =
+        elapsed_seconds > 0. ? static_cast<double>(m_stats.read) /
+                                   elapsed_seconds
+                             : 0.;
+
+    std::string summary(512, '\0');
+    const auto length = snprintf(
+        summary.data(), summary.size(),
+        "Replayed %llu packets (%llu non-IP skipped), wrote %llu packets. "
+        "%.3fs of capture in %.3fs (%.0f packets/s)",
+        static_cast<unsigned long long>(m_stats.read),
+        static_cast<unsigned long long>(m_stats.skipped),
+        static_cast<unsigned long long>(m_stats.written), capture_seconds,
+        elapsed_seconds, rate);
+    summary.resize(std::max(length, 0));
+
+    return summary;
+}
+
+void PcapReplay::thread(ThreadData thread_data) {
+    auto& stats = thread_data.stats;
+    const auto started_at = std::chrono::steady_clock::now();
+
+    // Next IP packet in the capture
+    const auto next_packet = [&] {
+        while (auto record = thread_data.reader.next()) {
+            if (network_layer(*record))
+                return record;
+
+            stats.skipped++;
+        }
+
+        return std::optional<PcapReader::Record>();
+    };
+
+    // Packets are copied into dense buffers that fill up over several steps
+    std::shared_ptr<std::vector<char>> dense_buffer;
+    size_t buffer_offset = 0;
+
+    auto record = next_packet();
+    if (record)
+        stats.first_timestamp_ns = record->timestamp_ns;
+
+    PacketClock::time_point now{};
+    std::optional<PacketClock::time_point> wakeup;
+    const auto write_packets = [&]() {
+        if (thread_data.writer) {
+            const auto departed_at = to_timestamp_ns(now);
+            for (const auto& packet : g_packets) {
+                thread_data.writer->write(packet.packet.data(),
+                                          packet.packet.size(), departed_at);
+            }
+        }
+
+        stats.written += g_packets.size();
+        g_packets.clear();
+    };
+
+    while (!thread_data.stop.load(std::memory_order_relaxed)) {
+        if (!record && !wakeup)
+            break;
+
+        if (record && (!wakeup || to_time_point(record->timestamp_ns) <=
+                                      *wakeup)) {
+            // Captures aren't always ordered, never go back in time
+            now = std::max(now, to_time_point(record->timestamp_ns));
+            PacketClock::set_virtual(now);
+
+            // Take every packet captured by now
+            size_t packet_count = 0;
+            do {
+                const auto [data, size] = *network_layer(*record);
+                if (!dense_buffer ||
+                    dense_buffer->size() - buffer_offset < size) {
+                    dense_buffer = std::make_shared<std::vector<char>>(
+                        std::max(BUFFER_SIZE, size));
+                    buffer_offset = 0;
+                }
+
+                memcpy(dense_buffer->data() + buffer_offset, data, size);
+
+                PacketAddress addr{};
+                // Direction is only recorded in pcapng, treat the rest as
+                // outbound
+                addr.Outbound = record->outbound.value_or(true);
+
+                g_packets.emplace_back(PacketNode{
+                    .packet = DenseBufferArraySlice(dense_buffer,
+                                                    buffer_offset, size),
+                    .addr = addr,
+                    .captured_at = now,
+                });
+
+                buffer_offset += size;
+                stats.read++;
+                stats.last_timestamp_ns = record->timestamp_ns;
+
+                record = next_packet();
+            } while (record && ++packet_count < MAX_PACKETS &&
+                     to_time_point(record->timestamp_ns) <= now);
+        } else {
+            now = *wakeup;
+            PacketClock::set_virtual(now);
+        }
+
+        // Run modules
+        const auto result = run_modules(thread_data.modules);
+
+        // Time has to move forward for the wakeup to make progress
+        wakeup = std::nullopt;
+        if (result.schedule_after)
+            wakeup = now + std::max<PacketClock::time_point::duration>(
+                               *result.schedule_after, 1us);
+
+        write_packets();
+    }
+
+    // Whatever modules are still holding departs at the end of the capture
+    flush_modules(thread_data.modules);
+    write_packets();
+
+    PacketClock::set_virtual(std::nullopt);
+
+    stats.elapsed = std::chrono::steady_clock::now() - started_at;
+    thread_data.finished.store(true, std::memory_order_release);
+
+    LOG("Replay finished");
+}
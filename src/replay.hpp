@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include "backend.hpp"
+#include "module.hpp"
+#include "pcap.hpp"
+
+// Offline backend feeding a pcap/pcapng capture through the modules as fast
+// as possible. Modules see the recorded timestamps as their clock and the
+// output capture gets the time packets left the module chain.
+// The filter is `input.pcapng > output.pcap`, the output is optional.
+class PcapReplay : public PacketBackend {
+public:
+    static const inline size_t BUFFER_SIZE = 0xffff;
+    static const inline size_t MAX_PACKETS = 32;
+
+public:
+    explicit PcapReplay(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    PcapReplay(const PcapReplay&) = delete;
+    PcapReplay(PcapReplay&&) = delete;
+    PcapReplay& operator=(const PcapReplay&) = delete;
+    PcapReplay& operator=(PcapReplay&&) = delete;
+
+    ~PcapReplay() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+    [[nodiscard]] bool finished() const override {
+        return m_finished.load(std::memory_order_acquire);
+    }
+    [[nodiscard]] std::optional<std::string> summary() const override;
+
+private:
+    struct Stats {
+        uint64_t read = 0;
+        uint64_t skipped = 0;
+        uint64_t written = 0;
+        uint64_t first_timestamp_ns = 0;
+        uint64_t last_timestamp_ns = 0;
+        std::chrono::steady_clock::duration elapsed{};
+    };
+
+    struct ThreadData {
+        PcapReader& reader;
+        std::optional<PcapWriter>& writer;
+        Stats& stats;
+        const std::atomic_bool& stop;
+        std::atomic_bool& finished;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+private:
+    std::thread m_thread;
+    bool m_running = false;
+    std::atomic_bool m_stop = false;
+    std::atomic_bool m_finished = false;
+
+    PcapReader m_reader;
+    std::optional<PcapWriter> m_writer;
+    Stats m_stats;
+};
@@ -1,133 +1,367 @@
-// Reset injection packet module
-#include "common.h"
-#include "iup.h"
-#include <stdbool.h>
-#include <stdlib.h>
-#define NAME "reset"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <imgui.h>
+#include <memory>
+#include <string_view>
+#include <vector>
 
-static const unsigned int TCP_MIN_SIZE =
-    sizeof(WINDIVERT_IPHDR) + sizeof(WINDIVERT_TCPHDR);
+#include "checksum.hpp"
+#include "common.hpp"
+#include "reset.hpp"
 
-static Ihandle *inboundCheckbox, *outboundCheckbox, *chanceInput, *rstButton;
+static constexpr std::array TRIGGER_NAMES = {
+    "Handshake",
+    "Bytes",
+    "Random",
+};
 
-static volatile short resetEnabled = 0, resetInbound = 1, resetOutbound = 1,
-                      chance = 0, // [0-10000]
-    setNextCount = 0;
+static constexpr std::array TRIGGER_KEYS = {
+    "handshake",
+    "bytes",
+    "random",
+};
 
-static int resetSetRSTNextButtonCb(Ihandle* ih) {
-    UNREFERENCED_PARAMETER(ih);
+static constexpr uint8_t PROTO_TCP = 6;
 
-    if (!(*resetModule.enabledFlag)) {
-        return IUP_DEFAULT;
+static constexpr uint8_t TCP_FIN = 0x01;
+static constexpr uint8_t TCP_SYN = 0x02;
+static constexpr uint8_t TCP_RST = 0x04;
+static constexpr uint8_t TCP_ACK = 0x10;
+
+static constexpr size_t IPV4_HEADER_SIZE = 20;
+static constexpr size_t IPV6_HEADER_SIZE = 40;
+static constexpr size_t TCP_HEADER_SIZE = 20;
+static constexpr uint8_t RST_TTL = 64;
+
+// Bare RST between the endpoints of `packet`, from its receiver back to its
+// sender if `reverse`
+static PacketNode make_rst(const PacketNode& packet, const PacketAddress& addr,
+                           bool reverse, uint32_t seq, uint32_t ack,
+                           uint8_t flags) {
+    const auto& info = packet.info;
+    const auto& src_addr = reverse ? info.dst_addr : info.src_addr;
+    const auto& dst_addr = reverse ? info.src_addr : info.dst_addr;
+
+    const auto ip_size =
+        info.ip_version == 4 ? IPV4_HEADER_SIZE : IPV6_HEADER_SIZE;
+    const auto size = ip_size + TCP_HEADER_SIZE;
+    DenseBufferArraySlice slice(std::make_shared<std::vector<char>>(size), 0,
+                                size);
+
+    // Written through `mutable_data()`, so backends handing out verdicts
+    // send the new bytes in place of the original packet
+    auto* const data = slice.mutable_data();
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    if (info.ip_version == 4) {
+        bytes[0] = 0x45;
+        store_be16(bytes + 2, static_cast<uint16_t>(size));
+        // Don't fragment
+        store_be16(bytes + 6, 0x4000);
+        bytes[8] = RST_TTL;
+        bytes[9] = PROTO_TCP;
+        std::copy_n(src_addr.begin() + 12, 4, bytes + 12);
+        std::copy_n(dst_addr.begin() + 12, 4, bytes + 16);
+    } else {
+        bytes[0] = 0x60;
+        store_be16(bytes + 4, static_cast<uint16_t>(TCP_HEADER_SIZE));
+        bytes[6] = PROTO_TCP;
+        bytes[7] = RST_TTL;
+        std::copy(src_addr.begin(), src_addr.end(), bytes + 8);
+        std::copy(dst_addr.begin(), dst_addr.end(), bytes + 24);
     }
 
-    InterlockedIncrement16(&setNextCount);
+    // Window and urgent pointer stay zero
+    auto* const tcp = bytes + ip_size;
+    store_be16(tcp, reverse ? info.dst_port : info.src_port);
+    store_be16(tcp + 2, reverse ? info.src_port : info.dst_port);
+    store_be32(tcp + 4, seq);
+    store_be32(tcp + 8, ack);
+    tcp[12] = (TCP_HEADER_SIZE / 4) << 4;
+    tcp[13] = flags;
+
+    const auto rst_info = parse_packet(data, size);
+    calculate_checksums(data, rst_info);
 
-    return IUP_DEFAULT;
+    return PacketNode{
+        .packet = std::move(slice),
+        .addr = addr,
+        .captured_at = packet.captured_at,
+        .info = rst_info,
+    };
 }
 
-static Ihandle* resetSetupUI() {
-    Ihandle* dupControlsBox =
-        IupHbox(rstButton = IupButton("RST next packet", NULL),
-                inboundCheckbox = IupToggle("Inbound", NULL),
-                outboundCheckbox = IupToggle("Outbound", NULL),
-                IupLabel("Chance(%):"), chanceInput = IupText(NULL), NULL);
-
-    IupSetAttribute(chanceInput, "VISIBLECOLUMNS", "4");
-    IupSetAttribute(chanceInput, "VALUE", "0");
-    IupSetCallback(chanceInput, "VALUECHANGED_CB", uiSyncChance);
-    IupSetAttribute(chanceInput, SYNCED_VALUE, (char*)&chance);
-    IupSetCallback(inboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
-    IupSetAttribute(inboundCheckbox, SYNCED_VALUE, (char*)&resetInbound);
-    IupSetCallback(outboundCheckbox, "ACTION", (Icallback)uiSyncToggle);
-    IupSetAttribute(outboundCheckbox, SYNCED_VALUE, (char*)&resetOutbound);
-    IupSetCallback(rstButton, "ACTION", resetSetRSTNextButtonCb);
-    IupSetAttribute(rstButton, "PADDING", "4x");
-
-    // enable by default to avoid confusing
-    IupSetAttribute(inboundCheckbox, "VALUE", "ON");
-    IupSetAttribute(outboundCheckbox, "VALUE", "ON");
-
-    if (parameterized) {
-        setFromParameter(inboundCheckbox, "VALUE", NAME "-inbound");
-        setFromParameter(outboundCheckbox, "VALUE", NAME "-outbound");
-        setFromParameter(chanceInput, "VALUE", NAME "-chance");
+bool ResetModule::draw() {
+    bool dirty = false;
+
+    ImGui::PushID(m_short_name);
+    ImGui::BeginGroup();
+
+    ImGui::PushStyleColor(ImGuiCol_Text, {m_indicator, 0.f, 0.f, 1.f});
+    ImGui::Bullet();
+    ImGui::PopStyleColor();
+
+    if (m_indicator > 0.f) {
+        m_indicator -= ImGui::GetIO().DeltaTime * 10.f;
+        dirty = true;
     }
 
-    return dupControlsBox;
+    ImGui::SameLine();
+
+    ImGui::Text("%s", m_display_name);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Enable", &m_enabled);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Inbound", &m_inbound);
+
+    ImGui::SameLine();
+
+    dirty |= ImGui::Checkbox("Outbound", &m_outbound);
+
+    ImGui::SameLine();
+
+    auto trigger = static_cast<int>(m_trigger);
+    ImGui::SetNextItemWidth(7.f * ImGui::GetFontSize());
+    if (ImGui::Combo("Trigger", &trigger, TRIGGER_NAMES.data(),
+                     TRIGGER_NAMES.size())) {
+        m_trigger = static_cast<Trigger>(trigger);
+        dirty = true;
+    }
+
+    if (m_trigger != Trigger::Handshake) {
+        ImGui::SameLine();
+
+        ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+        if (ImGui::InputInt("Bytes", &m_bytes)) {
+            m_bytes = std::clamp(m_bytes, 1, MAX_BYTES);
+            dirty = true;
+        }
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(6.f * ImGui::GetFontSize());
+    if (ImGui::InputInt("Port", &m_port)) {
+        m_port = std::clamp(m_port, 0, 65535);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    ImGui::SetNextItemWidth(8.f * ImGui::GetFontSize());
+    if (ImGui::InputFloat("Chance", &m_chance)) {
+        m_chance = std::clamp(m_chance, 0.f, 100.f);
+        dirty = true;
+    }
+
+    ImGui::SameLine();
+
+    if (ImGui::Button("Reset next")) {
+        request_reset();
+        dirty = true;
+    }
+
+    ImGui::EndGroup();
+    ImGui::PopID();
+
+    return dirty;
 }
 
-static void resetStartup() {
-    LOG("reset enabled");
-    InterlockedExchange16(&setNextCount, 0);
+void ResetModule::enable() {
+    LOG("Enabling");
 }
 
-static void resetCloseDown(PacketNode* head, PacketNode* tail) {
-    UNREFERENCED_PARAMETER(head);
-    UNREFERENCED_PARAMETER(tail);
-    LOG("reset disabled");
-    InterlockedExchange16(&setNextCount, 0);
+void ResetModule::disable() {
+    LOG("Disabling");
+
+    // Requests don't outlive the module being enabled
+    m_pending_resets->store(0, std::memory_order_relaxed);
+    m_indicator = 0.f;
 }
 
-static short resetProcess(PacketNode* head, PacketNode* tail) {
-    short reset = FALSE;
-    PacketNode* pac = head->next;
-    while (pac != tail) {
-        if (checkDirection(pac->addr.Outbound, resetInbound, resetOutbound) &&
-            pac->packetLen > TCP_MIN_SIZE &&
-            (setNextCount || calcChance(chance))) {
-            PWINDIVERT_TCPHDR pTcpHdr;
-            WinDivertHelperParsePacket(pac->packet, pac->packetLen, NULL, NULL,
-                                       NULL, NULL, NULL, &pTcpHdr, NULL, NULL,
-                                       NULL, NULL, NULL);
-
-            if (pTcpHdr != NULL) {
-                LOG("injecting reset w/ chance %.1f%%", chance / 100.0);
-                pTcpHdr->Rst = 1;
-                WinDivertHelperCalcChecksums(pac->packet, pac->packetLen, NULL,
-                                             0);
-
-                reset = TRUE;
-                if (setNextCount > 0) {
-                    InterlockedDecrement16(&setNextCount);
-                }
-            }
-        }
+void ResetModule::apply_config(const toml::table& config) {
+    Module::apply_config(config);
 
-        pac = pac->next;
+    m_inbound = config["inbound"].value_or(true);
+    m_outbound = config["outbound"].value_or(true);
+
+    m_chance = std::clamp(config["chance"].value_or(0.f), 0.f, 100.f);
+    m_bytes = std::clamp(config["bytes"].value_or(1000), 1, MAX_BYTES);
+    m_port = std::clamp(config["port"].value_or(0), 0, 65535);
+
+    const std::string_view trigger = config["trigger"].value_or("handshake");
+    const auto it =
+        std::find(TRIGGER_KEYS.begin(), TRIGGER_KEYS.end(), trigger);
+    if (it != TRIGGER_KEYS.end()) {
+        m_trigger = static_cast<Trigger>(it - TRIGGER_KEYS.begin());
+    } else {
+        LOG("Unknown trigger '%.*s'", static_cast<int>(trigger.size()),
+            trigger.data());
+    }
+}
+
+void ResetModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& reset = static_cast<const ResetModule&>(other);
+    m_inbound = reset.m_inbound;
+    m_outbound = reset.m_outbound;
+    m_chance = reset.m_chance;
+    m_trigger = reset.m_trigger;
+    m_bytes = reset.m_bytes;
+    m_port = reset.m_port;
+    m_pending_resets = reset.m_pending_resets;
+}
+
+void ResetModule::request_reset() {
+    if (m_enabled)
+        m_pending_resets->fetch_add(1, std::memory_order_relaxed);
+}
+
+bool ResetModule::claim_reset() {
+    auto pending = m_pending_resets->load(std::memory_order_relaxed);
+    while (pending != 0) {
+        if (m_pending_resets->compare_exchange_weak(
+                pending, pending - 1, std::memory_order_relaxed))
+            return true;
     }
-    return reset;
+
+    return false;
 }
 
-static int reset_enable(lua_State* L) {
-    int type = lua_gettop(L) > 0 ? lua_type(L, -1) : LUA_TNIL;
-    switch (type) {
-    case LUA_TBOOLEAN:
-        bool enabled = lua_toboolean(L, -1);
-        resetEnabled = enabled;
+void ResetModule::pick(const PacketInfo& info, bool syn,
+                       Connection& connection) {
+    connection.phase = Phase::Ignored;
+    if (m_port != 0 && info.src_port != m_port && info.dst_port != m_port)
+        return;
+    if (!check_chance(m_chance))
+        return;
+
+    switch (m_trigger) {
+    case Trigger::Handshake:
+        if (syn)
+            connection.phase = Phase::Armed;
         break;
-    case LUA_TNIL:
-        lua_pushboolean(L, resetEnabled);
-        return 1;
-    default:
-        char message[256];
-        int message_length = snprintf(
-            message, sizeof(message),
-            "Invalid argument #1 to reset_enable: '%s'", lua_typename(L, type));
-        lua_pushlstring(L, message, message_length);
-        lua_error(L);
+    case Trigger::Bytes:
+        connection.phase = Phase::Counting;
+        connection.remaining = static_cast<uint32_t>(m_bytes);
+        break;
+    case Trigger::Random:
+        connection.phase = Phase::Counting;
+        connection.remaining = static_cast<uint32_t>(1 + rand() % m_bytes);
         break;
     }
-
-    return 0;
 }
 
-static void push_lua_functions(lua_State* L) {
-    lua_pushcfunction(L, reset_enable);
-    lua_setfield(L, -2, "enable");
+void ResetModule::reset(PacketList::const_iterator it,
+                        const PacketAddress& reverse_addr) {
+    const auto& packet = *it;
+    const auto& info = packet.info;
+    const auto* const tcp =
+        std::bit_cast<const uint8_t*>(packet.packet.data()) + info.l4_offset;
+    const auto seq = load_be32(tcp + 4);
+    const auto ack = load_be32(tcp + 8);
+    const auto flags = tcp[13];
+
+    // Sequence space taken by the packet, what its receiver would ack
+    const auto next_seq = seq + info.payload_length +
+                          ((flags & TCP_SYN) != 0 ? 1 : 0) +
+                          ((flags & TCP_FIN) != 0 ? 1 : 0);
+
+    // The receiver accepts a RST at the sequence number it expects next. The
+    // sender only takes one acking what it sent, it checks the ack number
+    // while its SYN is unanswered and the sequence number otherwise.
+    if ((flags & TCP_ACK) != 0) {
+        g_packets.insert(it, make_rst(packet, packet.addr, false, seq, ack,
+                                      TCP_RST | TCP_ACK));
+        g_packets.insert(it, make_rst(packet, reverse_addr, true, ack,
+                                      next_seq, TCP_RST | TCP_ACK));
+    } else {
+        g_packets.insert(it,
+                         make_rst(packet, packet.addr, false, seq, 0, TCP_RST));
+        g_packets.insert(it, make_rst(packet, reverse_addr, true, 0, next_seq,
+                                      TCP_RST | TCP_ACK));
+    }
+
+    g_packets.erase(it);
 }
 
-Module resetModule = {"Set TCP RST", NAME, (short*)&resetEnabled, resetSetupUI,
-                      resetStartup, resetCloseDown, resetProcess,
-                      // runtime fields
-                      0, 0, NULL, push_lua_functions};
+ResetModule::Result ResetModule::process() {
+    const auto now = PacketClock::now();
+    const auto total_packets = g_packets.size();
+    auto resets = 0;
+    for (auto it = g_packets.cbegin(); it != g_packets.cend();) {
+        const auto it_copy = it++;
+        const auto& packet = *it_copy;
+        const auto& info = packet.info;
+
+        // Needs the whole TCP header, only the first fragment has it
+        if (info.protocol != PROTO_TCP || info.fragment ||
+            info.payload_offset == info.l4_offset ||
+            !check_direction(packet.addr.Outbound, m_inbound, m_outbound))
+            continue;
+
+        auto& entry = g_flows.find_or_insert(FlowTable::key(info), now);
+        auto& connection = entry.state<Connection>(CONNECTION_SLOT);
+
+        const auto flags = static_cast<uint8_t>(
+            packet.packet.data()[info.l4_offset + 13]);
+        const auto syn = (flags & (TCP_SYN | TCP_ACK)) == TCP_SYN;
+
+        auto reverse_addr = packet.addr;
+        reverse_addr.Outbound = !packet.addr.Outbound;
+#ifndef _WIN32
+        // Packet ids of link layer backends carry an ethertype in the top
+        // bits, other backends' ids are meaningless for injected packets
+        auto& link_ids = entry.state<std::array<uint64_t, 2>>(LINK_ID_SLOT);
+        link_ids[packet.addr.Outbound] = packet.addr.Id;
+        if ((packet.addr.Id >> 48) != 0 && link_ids[!packet.addr.Outbound] != 0)
+            reverse_addr.Id = link_ids[!packet.addr.Outbound];
+#endif
+
+        // A SYN on a known 5-tuple opens a new connection
+        if (syn)
+            connection.phase = Phase::New;
+
+        if (claim_reset()) {
+            // Resets whatever connection comes next
+            connection.phase = Phase::Armed;
+        } else if (connection.phase == Phase::New) {
+            pick(info, syn, connection);
+        }
+
+        if (connection.phase == Phase::Counting) {
+            // Lets the bytes through, the packet after them gets replaced
+            connection.remaining -=
+                std::min<uint32_t>(connection.remaining, info.payload_length);
+            if (connection.remaining == 0)
+                connection.phase = Phase::Armed;
+
+            continue;
+        }
+
+        if (connection.phase != Phase::Armed)
+            continue;
+
+        LOG("Resetting %u -> %u", info.src_port, info.dst_port);
+        reset(it_copy, reverse_addr);
+        connection.phase = Phase::Reset;
+        resets++;
+    }
+
+    const auto indicator =
+        total_packets != 0
+            ? static_cast<float>(resets) / static_cast<float>(total_packets)
+            : 0.f;
+    if (!almost_equal(indicator, m_indicator)) {
+        m_indicator = indicator;
+        return {.dirty = true};
+    }
+
+    return {};
+}
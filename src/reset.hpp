@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "flow_table.hpp"
+#include "lua_util.hpp"
+#include "module.hpp"
+#include "packet.hpp"
+
+// Resets TCP connections. New connections are picked by port and chance and
+// tracked in the flow table, at the trigger point the packet is replaced by a
+// RST towards its receiver and another one is sent back to its sender, both
+// sequenced so the endpoints accept them. Connections that weren't picked
+// cost a flow table lookup per packet.
+class ResetModule : public Module {
+private:
+    static inline int MAX_BYTES = 1 << 30;
+
+public:
+    enum class Trigger : int {
+        // On the SYN, connections already open when the module got enabled
+        // aren't picked
+        Handshake,
+        // Once `bytes` of payload went by in either direction
+        Bytes,
+        // At a random point within the first `bytes` of payload
+        Random,
+    };
+
+public:
+    ResetModule() {
+        m_display_name = "Set TCP RST";
+        m_short_name = "Reset";
+    }
+
+    virtual ~ResetModule() = default;
+
+    bool draw() override;
+
+    void enable() override;
+    void disable() override;
+
+    void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
+
+    Result process() override;
+
+    static void lua_setup(lua_State* L) {
+        luaL_Reg methods[] = {
+            {"chance", lua_method_chance},
+            {"trigger", lua_method_trigger},
+            {"bytes", lua_method_bytes},
+            {"port", lua_method_port},
+            {"reset_next", lua_method_reset_next},
+            {},
+        };
+
+        luaL_newmetatable(L, "Reset");
+
+        // Inherit from `Module`
+        luaL_getmetatable(L, "Module");
+        lua_setmetatable(L, -2);
+
+        luaL_setfuncs(L, methods, 0);
+
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+
+        lua_pop(L, 1);
+    }
+
+private:
+    static int lua_method_chance(lua_State* L) {
+        auto* module = *std::bit_cast<ResetModule**>(lua_touserdata(L, 1));
+        const auto rets = lua_getset(L, module->m_chance, 2);
+
+        return rets;
+    };
+
+    static int lua_method_trigger(lua_State* L) {
+        auto* module = *std::bit_cast<ResetModule**>(lua_touserdata(L, 1));
+
+        int trigger = static_cast<int>(module->m_trigger);
+        const auto rets = lua_getset(L, trigger, 2);
+        if (rets == 0) {
+            module->m_trigger = static_cast<Trigger>(
+                std::clamp(trigger, 0, static_cast<int>(Trigger::Random)));
+        }
+
+        return rets;
+    };
+
+    static int lua_method_bytes(lua_State* L) {
+        auto* module = *std::bit_cast<ResetModule**>(lua_touserdata(L, 1));
+
+        int bytes = module->m_bytes;
+        const auto rets = lua_getset(L, bytes, 2);
+        if (rets == 0)
+            module->m_bytes = std::clamp(bytes, 1, MAX_BYTES);
+
+        return rets;
+    };
+
+    static int lua_method_port(lua_State* L) {
+        auto* module = *std::bit_cast<ResetModule**>(lua_touserdata(L, 1));
+
+        int port = module->m_port;
+        const auto rets = lua_getset(L, port, 2);
+        if (rets == 0)
+            module->m_port = std::clamp(port, 0, 65535);
+
+        return rets;
+    };
+
+    static int lua_method_reset_next(lua_State* L) {
+        auto* module = *std::bit_cast<ResetModule**>(lua_touserdata(L, 1));
+        module->request_reset();
+
+        return 0;
+    };
+
+private:
+    enum class Phase : uint8_t {
+        // Not decided on yet, zeroed flow table slots start here
+        New,
+        Ignored,
+        // Counting down the payload until the trigger point
+        Counting,
+        // Reset on the next packet
+        Armed,
+        Reset,
+    };
+
+    struct Connection {
+        Phase phase;
+        uint32_t remaining;
+    };
+
+    // Flow table slots of the module, shared by all instances
+    static inline const size_t CONNECTION_SLOT = FlowTable::allocate_slot();
+#ifndef _WIN32
+    // Last packet id per direction, link layer backends need the other
+    // direction's for the MAC address of the RST going back
+    static inline const size_t LINK_ID_SLOT = FlowTable::allocate_slot();
+#endif
+
+    // Queues a "reset next" request, ignored while disabled
+    void request_reset();
+    // Takes one queued request, if there is any
+    bool claim_reset();
+
+    // Decides on a new connection given its first packet
+    void pick(const PacketInfo& info, bool syn, Connection& connection);
+
+    // Replaces the packet at `it` with a RST to its receiver and one back to
+    // its sender, the latter sent with `reverse_addr`
+    static void reset(PacketList::const_iterator it,
+                      const PacketAddress& reverse_addr);
+
+private:
+    bool m_inbound = true;
+    bool m_outbound = true;
+    // Percent of new connections picked
+    float m_chance = 0.f;
+    Trigger m_trigger = Trigger::Handshake;
+    int m_bytes = 1000;
+    // Picks only connections from or to this port, 0 for any
+    int m_port = 0;
+
+    // "Reset next" requests not handled yet. Copies of the module share the
+    // counter of the one they copy, so whichever chain sees a TCP packet
+    // first claims a request and it's handled once.
+    std::shared_ptr<std::atomic<uint64_t>> m_pending_resets =
+        std::make_shared<std::atomic<uint64_t>>(0);
+};
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#include "common.hpp"
+#include "scheduler.hpp"
+
+using namespace std::chrono_literals;
+
+using Clock = std::chrono::steady_clock;
+
+Scheduler::Scheduler(std::chrono::nanoseconds spin_time)
+    : m_spin_time(spin_time) {
+#ifdef _WIN32
+    m_timer = CreateWaitableTimerExW(nullptr, nullptr,
+                                     CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                     TIMER_ALL_ACCESS);
+    // Needs Windows 10 1803
+    if (m_timer == nullptr)
+        m_timer = CreateWaitableTimerW(nullptr, false, nullptr);
+
+    if (m_timer == nullptr)
+        LOG("CreateWaitableTimer failed: %lu", GetLastError());
+#else
+    // The steady clock is CLOCK_MONOTONIC
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timer_fd < 0)
+        LOG("timerfd_create failed: %s", strerror(errno));
+#endif
+}
+
+Scheduler::~Scheduler() {
+#ifdef _WIN32
+    if (m_timer != nullptr)
+        CloseHandle(m_timer);
+#else
+    if (m_timer_fd >= 0)
+        close(m_timer_fd);
+#endif
+}
+
+void Scheduler::schedule(std::optional<std::chrono::nanoseconds> after) {
+    if (!after) {
+        if (m_deadline) {
+            m_deadline = std::nullopt;
+#ifdef _WIN32
+            CancelWaitableTimer(m_timer);
+#else
+            const itimerspec disarm{};
+            timerfd_settime(m_timer_fd, 0, &disarm, nullptr);
+#endif
+        }
+
+        return;
+    }
+
+    const auto now = Clock::now();
+    m_deadline = now + *after;
+    arm(std::max(now, *m_deadline - m_overshoot - m_spin_time));
+}
+
+bool Scheduler::expire() {
+#ifndef _WIN32
+    // Clear the readiness, the count doesn't matter
+    uint64_t expirations = 0;
+    if (read(m_timer_fd, &expirations, sizeof(expirations)) < 0)
+        return false;
+#endif
+
+    if (!m_deadline)
+        return false;
+
+    // Learn how late the timer tends to be, a big outlier (e.g. the thread
+    // being descheduled) is clamped so it doesn't throw off the estimate
+    auto now = Clock::now();
+    const auto late = std::clamp<std::chrono::nanoseconds>(
+        now - m_fire_at, std::chrono::nanoseconds::zero(), MAX_OVERSHOOT);
+    m_overshoot += (late - m_overshoot) / 8;
+
+    // Still too far off to spin for, wait some more
+    if (*m_deadline - now > m_overshoot + 2 * m_spin_time) {
+        arm(*m_deadline - m_overshoot - m_spin_time);
+        return false;
+    }
+
+    while (now < *m_deadline)
+        now = Clock::now();
+
+    m_deadline = std::nullopt;
+    return true;
+}
+
+void Scheduler::arm(Clock::time_point fire_at) {
+    m_fire_at = fire_at;
+
+#ifdef _WIN32
+    // Relative due time in 100ns intervals
+    const auto after = std::max<std::chrono::nanoseconds>(
+        fire_at - Clock::now(), std::chrono::nanoseconds::zero());
+    LARGE_INTEGER due_time;
+    due_time.QuadPart = -std::max<LONGLONG>(after.count() / 100, 1);
+    SetWaitableTimer(m_timer, &due_time, 0, nullptr, nullptr, false);
+#else
+    // A zero value would disarm it
+    const auto since_epoch =
+        std::max<Clock::duration>(fire_at.time_since_epoch(), 1ns);
+    const auto seconds =
+        std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+    const itimerspec spec{
+        .it_interval = {},
+        .it_value =
+            {
+                .tv_sec = seconds.count(),
+                .tv_nsec = (since_epoch - seconds).count(),
+            },
+    };
+    timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+#endif
+}
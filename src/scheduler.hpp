@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#endif
+
+// Wakes a backend thread up when the earliest module deadline is due. Poll
+// timeouts are whole milliseconds and tend to overshoot, so the deadline is
+// armed on a high resolution timer instead: a timerfd on Linux, a waitable
+// timer on Windows. The timer fires a little early by the overshoot measured
+// so far plus the spin time, and `expire()` busy waits the rest of the way.
+class Scheduler {
+public:
+    static const inline std::chrono::nanoseconds DEFAULT_SPIN_TIME =
+        std::chrono::microseconds(20);
+    // Overshoot estimates past this are treated as a one-off stall
+    static const inline std::chrono::nanoseconds MAX_OVERSHOOT =
+        std::chrono::milliseconds(1);
+
+public:
+    explicit Scheduler(std::chrono::nanoseconds spin_time = DEFAULT_SPIN_TIME);
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler(Scheduler&&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    Scheduler& operator=(Scheduler&&) = delete;
+
+    ~Scheduler();
+
+    // Becomes readable (signaled) when the timer fires
+#ifdef _WIN32
+    [[nodiscard]] HANDLE handle() const noexcept { return m_timer; }
+#else
+    [[nodiscard]] int fd() const noexcept { return m_timer_fd; }
+#endif
+
+    // Arms the timer for `after` from now, replacing any earlier deadline.
+    // `std::nullopt` disarms it.
+    void schedule(std::optional<std::chrono::nanoseconds> after);
+
+    // Called once the timer fired. Spins until the deadline if it's close
+    // and returns whether it passed, the timer is armed again otherwise.
+    bool expire();
+
+    // Average time the timer fires late by
+    [[nodiscard]] std::chrono::nanoseconds overshoot() const noexcept {
+        return m_overshoot;
+    }
+
+private:
+    void arm(std::chrono::steady_clock::time_point fire_at);
+
+private:
+#ifdef _WIN32
+    HANDLE m_timer = nullptr;
+#else
+    int m_timer_fd = -1;
+#endif
+    std::chrono::nanoseconds m_spin_time;
+    std::chrono::nanoseconds m_overshoot{};
+
+    std::optional<std::chrono::steady_clock::time_point> m_deadline;
+    std::chrono::steady_clock::time_point m_fire_at;
+};
@@ -0,0 +1,72 @@
+#include <cstring>
+#include <netdb.h>
+
+#include "socket_util.hpp"
+
+std::optional<std::string> resolve_address(std::string_view spec, bool passive,
+                                           int family, SocketAddress& address) {
+    std::string host;
+    std::string port(spec);
+    if (spec.starts_with('[')) {
+        const auto bracket = spec.find(']');
+        if (bracket == std::string_view::npos ||
+            spec.substr(bracket + 1, 1) != ":")
+            return "invalid address '" + std::string(spec) + "'";
+
+        host = spec.substr(1, bracket - 1);
+        port = spec.substr(bracket + 2);
+    } else if (const auto colon = spec.rfind(':');
+               colon != std::string_view::npos) {
+        host = spec.substr(0, colon);
+        port = spec.substr(colon + 1);
+    } else if (!passive) {
+        return "missing host in '" + std::string(spec) + "'";
+    }
+
+    addrinfo hints{};
+    hints.ai_family = host.empty() ? family : AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+
+    addrinfo* result = nullptr;
+    if (const auto res = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                                     port.c_str(), &hints, &result);
+        res != 0)
+        return "failed to resolve '" + std::string(spec) +
+               "': " + gai_strerror(res);
+
+    memcpy(&address.storage, result->ai_addr, result->ai_addrlen);
+    address.size = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return std::nullopt;
+}
+
+std::optional<std::string> parse_proxy_filter(const std::string& filter,
+                                              SocketAddress& listen_address,
+                                              SocketAddress& upstream) {
+    const auto separator = filter.find('>');
+    if (separator == std::string::npos)
+        return "filter must be '[listen_host:]port > upstream_host:port'";
+
+    const auto trim = [](std::string_view text) {
+        const auto first = text.find_first_not_of(" \t");
+        if (first == std::string_view::npos)
+            return std::string_view();
+
+        const auto last = text.find_last_not_of(" \t");
+        return text.substr(first, last - first + 1);
+    };
+
+    const auto listen_spec =
+        trim(std::string_view(filter).substr(0, separator));
+    const auto upstream_spec =
+        trim(std::string_view(filter).substr(separator + 1));
+
+    if (const auto err =
+            resolve_address(upstream_spec, false, AF_UNSPEC, upstream))
+        return err;
+
+    return resolve_address(listen_spec, true, upstream.family(),
+                           listen_address);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+struct SocketAddress {
+    sockaddr_storage storage;
+    socklen_t size;
+
+    [[nodiscard]] int family() const { return storage.ss_family; }
+    [[nodiscard]] const sockaddr* get() const {
+        return reinterpret_cast<const sockaddr*>(&storage);
+    }
+};
+
+// Resolves `host:port` or `[host]:port`. Passive addresses may leave out the
+// host, they're bound to the wildcard address of `family` then.
+std::optional<std::string> resolve_address(std::string_view spec, bool passive,
+                                           int family, SocketAddress& address);
+
+// Parses the `[listen_host:]port > upstream_host:port` filter of the proxy
+// backends. The listening address takes the upstream's family unless its host
+// is given.
+std::optional<std::string> parse_proxy_filter(const std::string& filter,
+                                              SocketAddress& listen_address,
+                                              SocketAddress& upstream);
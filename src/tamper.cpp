@@ -1,8 +1,7 @@
 #include <algorithm>
-#include <bit>
 #include <imgui.h>
-#include <windivert.h>
 
+#include "checksum.hpp"
 #include "common.hpp"
 #include "packet.hpp"
 #include "tamper.hpp"
@@ -77,45 +76,55 @@ void TamperModule::apply_config(const toml::table& config) {
     m_max_bit_flips = std::max(config["max_bit_flips"].value_or(1), 1);
 }
 
+void TamperModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& tamper = static_cast<const TamperModule&>(other);
+    m_inbound = tamper.m_inbound;
+    m_outbound = tamper.m_outbound;
+    m_chance = tamper.m_chance;
+    m_max_bit_flips = tamper.m_max_bit_flips;
+}
+
 TamperModule::Result TamperModule::process() {
     const auto total_packets = g_packets.size();
     auto tampered = 0;
-    for (auto it = g_packets.begin(); it != g_packets.end();) {
-        auto& packet = *it;
+    for (auto& packet : g_packets) {
         if (!check_direction(packet.addr.Outbound, m_inbound, m_outbound) ||
             !check_chance(m_chance))
             continue;
 
-        auto& packet_data = packet.packet;
-
-        char* data = nullptr;
-        UINT data_size = 0;
-        if (WinDivertHelperParsePacket(
-                packet_data.data(), packet_data.size(), nullptr, nullptr,
-                nullptr, nullptr, nullptr, nullptr, nullptr,
-                std::bit_cast<PVOID*>(&data), &data_size, nullptr, nullptr) &&
-            data != nullptr && data_size != 0) {
-            for (auto i = 0; i < m_max_bit_flips; i++) {
-                const size_t idx = rand() % data_size;
-                const uint8_t bit = 1 << (rand() % 8);
-
-                // NOLINTBEGIN(cppcoreguidelines-narrowing-conversions)
-                data[idx] ^= bit;
-                // NOLINTEND(cppcoreguidelines-narrowing-conversions)
-            }
-
-            WinDivertHelperCalcChecksums(packet_data.data(), packet_data.size(),
-                                         nullptr, 0);
-            tampered++;
+        const auto& info = packet.info;
+        if (info.payload_length == 0)
+            continue;
+
+        // Copies the packet out if it's a duplicate
+        auto* const packet_data = packet.packet.mutable_data();
+        auto* const data = packet_data + info.payload_offset;
+        for (auto i = 0; i < m_max_bit_flips; i++) {
+            const size_t idx = rand() % info.payload_length;
+            const uint8_t bit = 1 << (rand() % 8);
+            const auto old_byte = data[idx];
+
+            // NOLINTBEGIN(cppcoreguidelines-narrowing-conversions)
+            data[idx] ^= bit;
+            // NOLINTEND(cppcoreguidelines-narrowing-conversions)
+
+            // Only the flipped byte is summed, not the whole packet
+            update_checksums(packet_data, info, info.payload_offset + idx,
+                             &old_byte, 1);
         }
+        tampered++;
     }
 
     const auto indicator =
-        static_cast<float>(tampered) / static_cast<float>(total_packets);
+        total_packets != 0
+            ? static_cast<float>(tampered) / static_cast<float>(total_packets)
+            : 0.f;
     if (!almost_equal(indicator, m_indicator)) {
         m_indicator = indicator;
         return {.dirty = true};
     }
 
     return {};
-}
\ No newline at end of file
+}
@@ -2,8 +2,6 @@
 
 #include "module.hpp"
 
-using namespace std::chrono_literals;
-
 class TamperModule : public Module {
 private:
     // Threshold for how many packet to throttle at most
@@ -23,6 +21,7 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
@@ -0,0 +1,587 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <queue>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "tcp_proxy.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Direction {
+    int from = -1;
+    int to = -1;
+    std::array<int, 2> pipe{-1, -1};
+    size_t capacity = 0;
+    size_t buffered = 0;
+    // Arrival time and size of the data in the pipe
+    std::deque<std::pair<Clock::time_point, size_t>> chunks;
+
+    Clock::time_point stalled_until;
+    double tokens = 0.;
+    Clock::time_point refilled_at;
+
+    bool eof = false;
+    bool write_blocked = false;
+    bool shut = false;
+    // When held data becomes due, set by `drain`
+    std::optional<Clock::time_point> wakeup;
+};
+
+struct Connection {
+    int client = -1;
+    int upstream = -1;
+    // Bumped when the slot is freed, stale events and timers are ignored
+    uint32_t generation = 0;
+    bool connected = false;
+    // Outbound (client to upstream) and inbound
+    std::array<Direction, 2> directions;
+    // Events registered for the client and upstream socket, `std::nullopt`
+    // once the socket hung up and was removed from epoll
+    std::array<std::optional<uint32_t>, 2> events;
+    std::optional<Clock::time_point> timer;
+};
+
+} // namespace
+
+// Epoll tags, connection sockets are tagged with their slot, generation and
+// side
+static const uint64_t STOP_TAG = UINT64_MAX;
+static const uint64_t LISTEN_TAG = UINT64_MAX - 1;
+
+static uint64_t connection_id(uint32_t index, uint32_t generation) {
+    return static_cast<uint64_t>(generation) << 32 | index;
+}
+
+static uint64_t socket_tag(uint32_t index, uint32_t generation, size_t side) {
+    return connection_id(index << 1 | static_cast<uint32_t>(side),
+                         generation);
+}
+
+// Moves due data from the client into the pipe, returns the byte count or -1
+// if the connection failed
+static ssize_t fill(Direction& direction, const StreamPolicy& policy,
+                    Clock::time_point now) {
+    ssize_t moved = 0;
+    while (!direction.eof && direction.buffered < direction.capacity) {
+        const auto res = splice(direction.from, nullptr, direction.pipe[1],
+                                nullptr,
+                                direction.capacity - direction.buffered,
+                                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                break;
+
+            return -1;
+        }
+
+        if (res == 0) {
+            direction.eof = true;
+            break;
+        }
+
+        direction.buffered += res;
+        if (!direction.chunks.empty() && direction.chunks.back().first == now)
+            direction.chunks.back().second += res;
+        else
+            direction.chunks.emplace_back(now, res);
+
+        if (policy.stall_chance > 0.f && now >= direction.stalled_until &&
+            check_chance(policy.stall_chance))
+            direction.stalled_until = now + policy.stall_time;
+
+        moved += res;
+    }
+
+    return moved;
+}
+
+// Moves data out of the pipe once it's due and the rate allows it, returns
+// the byte count or -1 if the connection failed
+static ssize_t drain(Direction& direction, const StreamPolicy& policy,
+                     Clock::time_point now) {
+    direction.wakeup = std::nullopt;
+
+    if (now < direction.stalled_until) {
+        if (direction.buffered > 0)
+            direction.wakeup = direction.stalled_until;
+
+        return 0;
+    }
+
+    size_t due = 0;
+    for (const auto& [arrived_at, size] : direction.chunks) {
+        if (arrived_at + policy.delay > now) {
+            direction.wakeup = arrived_at + policy.delay;
+            break;
+        }
+
+        due += size;
+    }
+
+    if (policy.rate) {
+        const auto rate = static_cast<double>(*policy.rate);
+        const auto elapsed =
+            std::chrono::duration<double>(now - direction.refilled_at).count();
+        direction.tokens = std::min(rate, direction.tokens + elapsed * rate);
+        direction.refilled_at = now;
+
+        if (static_cast<double>(due) > direction.tokens) {
+            // Come back once there's a segment's worth of tokens
+            const auto wanted = std::min<double>(due, 1460.);
+            if (rate > 0. && direction.tokens < wanted) {
+                direction.wakeup =
+                    now + std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double>(
+                                  (wanted - direction.tokens) / rate));
+            }
+
+            due = static_cast<size_t>(std::max(direction.tokens, 0.));
+        }
+    }
+
+    ssize_t moved = 0;
+    while (due > 0) {
+        const auto res =
+            splice(direction.pipe[0], nullptr, direction.to, nullptr, due,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                // Resumed by EPOLLOUT
+                direction.write_blocked = true;
+                direction.wakeup = std::nullopt;
+                break;
+            }
+
+            return -1;
+        }
+
+        direction.write_blocked = false;
+        direction.buffered -= res;
+        direction.tokens -= static_cast<double>(res);
+        due -= res;
+        moved += res;
+
+        auto left = static_cast<size_t>(res);
+        while (left > 0) {
+            auto& chunk = direction.chunks.front();
+            const auto taken = std::min(left, chunk.second);
+            chunk.second -= taken;
+            left -= taken;
+            if (chunk.second == 0)
+                direction.chunks.pop_front();
+        }
+    }
+
+    // Pass on the FIN once everything before it is out
+    if (direction.eof && direction.buffered == 0 && !direction.shut) {
+        shutdown(direction.to, SHUT_WR);
+        direction.shut = true;
+    }
+
+    return moved;
+}
+
+void TcpProxy::close_fds() {
+    for (auto* fd : {&m_listen_fd, &m_stop_fd}) {
+        if (*fd >= 0)
+            close(*fd);
+
+        *fd = -1;
+    }
+}
+
+std::optional<std::string> TcpProxy::start(const std::string& filter) {
+    LOG("Starting");
+
+    SocketAddress listen_address{};
+    SocketAddress upstream{};
+    if (const auto err = parse_proxy_filter(filter, listen_address, upstream))
+        return "Failed to start proxy: " + *err;
+
+    m_listen_fd = socket(listen_address.family(),
+                         SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+        return "Failed to start proxy: failed to create socket";
+
+    const int reuse = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (bind(m_listen_fd, listen_address.get(), listen_address.size) < 0 ||
+        listen(m_listen_fd, SOMAXCONN) < 0) {
+        const auto error = errno;
+        close_fds();
+        return std::string("Failed to start proxy: failed to listen: ") +
+               strerror(error);
+    }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0) {
+        close_fds();
+        return "Failed to start proxy: failed to create eventfd";
+    }
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .listen_fd = m_listen_fd,
+        .stop_fd = m_stop_fd,
+        .upstream = upstream,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+
+    return std::nullopt;
+}
+
+bool TcpProxy::stop() {
+    if (m_stop_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for the proxy thread");
+    m_thread.join();
+
+    close_fds();
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("Proxy stopped");
+
+    return true;
+}
+
+void TcpProxy::thread(ThreadData thread_data) {
+    const auto epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOG("epoll_create1 failed: %s", strerror(errno));
+        return;
+    }
+
+    for (const auto& [fd, tag] : {std::pair{thread_data.stop_fd, STOP_TAG},
+                                  {thread_data.listen_fd, LISTEN_TAG}}) {
+        epoll_event event{.events = EPOLLIN, .data = {.u64 = tag}};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            LOG("epoll_ctl failed: %s", strerror(errno));
+            close(epoll_fd);
+            return;
+        }
+    }
+
+    std::vector<Connection> connections;
+    std::vector<uint32_t> free_connections;
+    size_t connection_count = 0;
+
+    using Timer = std::pair<Clock::time_point, uint64_t>;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<>> timers;
+
+    const auto close_connection = [&](uint32_t index) {
+        auto& connection = connections[index];
+        for (auto& direction : connection.directions) {
+            for (const auto fd : direction.pipe)
+                close(fd);
+        }
+
+        close(connection.client);
+        close(connection.upstream);
+
+        const auto generation = connection.generation + 1;
+        connection = Connection{};
+        connection.generation = generation;
+        free_connections.push_back(index);
+        connection_count--;
+
+        LOG("Connection %u closed, %zu active", index, connection_count);
+    };
+
+    const auto open_connection = [&](int client, Clock::time_point now) {
+        if (free_connections.empty()) {
+            if (connections.size() == MAX_CONNECTIONS) {
+                close(client);
+                return;
+            }
+
+            free_connections.push_back(
+                static_cast<uint32_t>(connections.size()));
+            connections.emplace_back();
+        }
+
+        const auto index = free_connections.back();
+        free_connections.pop_back();
+        connection_count++;
+
+        auto& connection = connections[index];
+        connection.client = client;
+        connection.upstream =
+            socket(thread_data.upstream.family(),
+                   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        auto ok = connection.upstream >= 0 &&
+                  (connect(connection.upstream, thread_data.upstream.get(),
+                           thread_data.upstream.size) == 0 ||
+                   errno == EINPROGRESS);
+
+        const int no_delay = 1;
+        for (const auto fd : {connection.client, connection.upstream}) {
+            if (ok)
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+                           sizeof(no_delay));
+        }
+
+        for (size_t side = 0; side < 2; side++) {
+            auto& direction = connection.directions[side];
+            direction.from =
+                side == 0 ? connection.client : connection.upstream;
+            direction.to = side == 0 ? connection.upstream : connection.client;
+            direction.refilled_at = now;
+
+            if (!ok ||
+                pipe2(direction.pipe.data(), O_NONBLOCK | O_CLOEXEC) < 0) {
+                ok = false;
+                continue;
+            }
+
+            fcntl(direction.pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+            direction.capacity = static_cast<size_t>(
+                std::max(fcntl(direction.pipe[1], F_GETPIPE_SZ), 4096));
+        }
+
+        // Client data waits in its socket until the upstream is connected
+        connection.events = {0u, static_cast<uint32_t>(EPOLLOUT)};
+        for (size_t side = 0; side < 2 && ok; side++) {
+            const auto fd = side == 0 ? connection.client : connection.upstream;
+            epoll_event event{
+                .events = *connection.events[side],
+                .data = {.u64 = socket_tag(index, connection.generation, side)},
+            };
+            ok = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+        }
+
+        if (!ok) {
+            LOG("Failed to open connection: %s", strerror(errno));
+            close_connection(index);
+            return;
+        }
+
+        LOG("Connection %u opened, %zu active", index, connection_count);
+    };
+
+    const auto update_events = [&](uint32_t index) {
+        auto& connection = connections[index];
+        const auto& [outbound, inbound] = connection.directions;
+        const auto wants_read = [&](const Direction& direction) {
+            return connection.connected && !direction.eof &&
+                   direction.buffered < direction.capacity;
+        };
+
+        const std::array<uint32_t, 2> events = {
+            (wants_read(outbound) ? EPOLLIN : 0u) |
+                (inbound.write_blocked ? EPOLLOUT : 0u),
+            (wants_read(inbound) ? EPOLLIN : 0u) |
+                (!connection.connected || outbound.write_blocked ? EPOLLOUT
+                                                                 : 0u),
+        };
+
+        for (size_t side = 0; side < 2; side++) {
+            if (!connection.events[side] ||
+                *connection.events[side] == events[side])
+                continue;
+
+            const auto fd = side == 0 ? connection.client : connection.upstream;
+            epoll_event event{
+                .events = events[side],
+                .data = {.u64 = socket_tag(index, connection.generation, side)},
+            };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+            connection.events[side] = events[side];
+        }
+    };
+
+    // Moves whatever can be moved in both directions, returns false once the
+    // connection is done
+    const auto pump = [&](uint32_t index,
+                          const std::array<StreamPolicy, 2>& policies,
+                          Clock::time_point now) {
+        auto& connection = connections[index];
+        if (!connection.connected)
+            return true;
+
+        // Data that doesn't have to wait goes straight through, which may
+        // make room for more
+        for (size_t round = 0; round < 4; round++) {
+            ssize_t moved = 0;
+            for (size_t side = 0; side < 2; side++) {
+                auto& direction = connection.directions[side];
+                const auto filled = fill(direction, policies[side], now);
+                const auto drained = drain(direction, policies[side], now);
+                if (filled < 0 || drained < 0)
+                    return false;
+
+                moved += filled + drained;
+            }
+
+            if (moved == 0)
+                break;
+        }
+
+        const auto& [outbound, inbound] = connection.directions;
+        if (outbound.shut && inbound.shut)
+            return false;
+
+        std::optional<Clock::time_point> wakeup;
+        for (const auto& direction : connection.directions) {
+            if (direction.wakeup && (!wakeup || *direction.wakeup < *wakeup))
+                wakeup = direction.wakeup;
+        }
+
+        if (wakeup && (!connection.timer || *wakeup < *connection.timer)) {
+            connection.timer = wakeup;
+            timers.emplace(*wakeup,
+                           connection_id(index, connection.generation));
+        }
+
+        update_events(index);
+        return true;
+    };
+
+    std::array<epoll_event, MAX_EVENTS> events{};
+    while (true) {
+        auto timeout = -1;
+        if (!timers.empty()) {
+            const auto until = timers.top().first - Clock::now();
+            timeout = static_cast<int>(std::max<int64_t>(
+                std::chrono::ceil<std::chrono::milliseconds>(until).count(),
+                0));
+        }
+
+        const auto res =
+            epoll_wait(epoll_fd, events.data(), events.size(), timeout);
+        if (res < 0 && errno != EINTR) {
+            LOG("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        const auto now = Clock::now();
+
+        // Settings may change at any time
+        std::array<StreamPolicy, 2> policies{};
+        for (const auto& module : thread_data.modules) {
+            if (!module->m_enabled)
+                continue;
+
+            module->apply_stream_policy(true, policies[0]);
+            module->apply_stream_policy(false, policies[1]);
+        }
+
+        // STOP
+        const auto stopped =
+            std::any_of(events.begin(), events.begin() + std::max(res, 0),
+                        [](const epoll_event& event) {
+                            return event.data.u64 == STOP_TAG;
+                        });
+        if (stopped)
+            break;
+
+        for (int i = 0; i < res; i++) {
+            const auto tag = events[i].data.u64;
+            if (tag == LISTEN_TAG) {
+                // ACCEPT
+                for (size_t accepted = 0; accepted < MAX_EVENTS; accepted++) {
+                    const auto client =
+                        accept4(thread_data.listen_fd, nullptr, nullptr,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (client < 0) {
+                        if (errno != EAGAIN && errno != EINTR)
+                            LOG("accept4 failed: %s", strerror(errno));
+
+                        break;
+                    }
+
+                    open_connection(client, now);
+                }
+
+                continue;
+            }
+
+            const auto index = static_cast<uint32_t>(tag) >> 1;
+            const auto side = static_cast<size_t>(tag & 1);
+            auto& connection = connections[index];
+            if (connection.generation != static_cast<uint32_t>(tag >> 32) ||
+                connection.client < 0)
+                continue;
+
+            const auto flags = events[i].events;
+            auto ok = (flags & EPOLLERR) == 0;
+            if (ok && side == 1 && !connection.connected) {
+                int error = 0;
+                socklen_t error_size = sizeof(error);
+                getsockopt(connection.upstream, SOL_SOCKET, SO_ERROR, &error,
+                           &error_size);
+                ok = error == 0;
+                connection.connected = ok;
+            }
+
+            // Both directions of the socket are shut, it would report
+            // EPOLLHUP forever. What's left to read is picked up by pumps
+            // caused by the other socket.
+            if (ok && (flags & EPOLLHUP) && connection.events[side]) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+                          side == 0 ? connection.client : connection.upstream,
+                          nullptr);
+                connection.events[side] = std::nullopt;
+            }
+
+            if (!ok || !pump(index, policies, now))
+                close_connection(index);
+        }
+
+        // Held data that became due
+        while (!timers.empty() && timers.top().first <= now) {
+            const auto [time, id] = timers.top();
+            timers.pop();
+
+            const auto index = static_cast<uint32_t>(id);
+            auto& connection = connections[index];
+            if (connection.generation != static_cast<uint32_t>(id >> 32) ||
+                connection.timer != time)
+                continue;
+
+            connection.timer = std::nullopt;
+            if (!pump(index, policies, now))
+                close_connection(index);
+        }
+    }
+
+    // Connections are cut, data held in pipes is lost
+    for (uint32_t i = 0; i < connections.size(); i++) {
+        if (connections[i].client >= 0)
+            close_connection(i);
+    }
+
+    close(epoll_fd);
+}
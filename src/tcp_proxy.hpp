@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include "backend.hpp"
+#include "module.hpp"
+#include "socket_util.hpp"
+
+// User-space TCP proxy. Accepted connections are forwarded to the upstream
+// address, bytes move through a pipe per direction with splice() and never
+// enter user space. Instead of running the packet modules, the proxy applies
+// their stream equivalents (`Module::apply_stream_policy`): data is held in
+// the pipe until it's due, rate limited or stalled. Bytes from the client
+// count as outbound.
+// The filter is `[listen_host:]port > upstream_host:port`, IPv6 hosts go into
+// brackets.
+class TcpProxy : public PacketBackend {
+public:
+    // Pipes are grown to this size when allowed (fs.pipe-max-size), it
+    // bounds the bytes in flight per direction and so the throughput under
+    // lag
+    static const inline int PIPE_SIZE = 1 << 20;
+    static const inline size_t MAX_CONNECTIONS = 16384;
+    static const inline size_t MAX_EVENTS = 256;
+
+public:
+    explicit TcpProxy(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    TcpProxy(const TcpProxy&) = delete;
+    TcpProxy(TcpProxy&&) = delete;
+    TcpProxy& operator=(const TcpProxy&) = delete;
+    TcpProxy& operator=(TcpProxy&&) = delete;
+
+    ~TcpProxy() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    struct ThreadData {
+        int listen_fd;
+        int stop_fd;
+        SocketAddress upstream;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+    void close_fds();
+
+private:
+    std::thread m_thread;
+    int m_listen_fd = -1;
+    int m_stop_fd = -1;
+};
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <imgui.h>
 
+#include "clock.hpp"
 #include "common.hpp"
 #include "throttle.hpp"
 
@@ -79,6 +80,17 @@ void ThrottleModule::apply_config(const toml::table& config) {
     m_drop_throttled = config["drop_throttled"].value_or(false);
 }
 
+void ThrottleModule::copy_settings(const Module& other) {
+    Module::copy_settings(other);
+
+    const auto& throttle = static_cast<const ThrottleModule&>(other);
+    m_inbound = throttle.m_inbound;
+    m_outbound = throttle.m_outbound;
+    m_chance = throttle.m_chance;
+    m_timeframe_ms = throttle.m_timeframe_ms;
+    m_drop_throttled = throttle.m_drop_throttled;
+}
+
 void ThrottleModule::flush() {
     LOG("Sending all %zu packets", m_throttle_list.size());
     if (m_drop_throttled)
@@ -90,20 +102,30 @@ void ThrottleModule::flush() {
     m_indicator = 0.f;
 }
 
+void ThrottleModule::apply_stream_policy(bool outbound,
+                                         StreamPolicy& policy) const {
+    // Streams can't drop bytes, throttled data is always held back
+    if (!check_direction(outbound, m_inbound, m_outbound))
+        return;
+
+    policy.stall_chance = std::max(policy.stall_chance, m_chance);
+    policy.stall_time = std::max(policy.stall_time, m_timeframe_ms);
+}
+
 ThrottleModule::Result ThrottleModule::process() {
     auto dirty = false;
     if (!m_throttling && check_chance(m_chance)) {
         LOG("Start new throttling w/ chance %.1f, time frame: %lld", m_chance,
-            m_timeframe_ms.count());
+            static_cast<long long>(m_timeframe_ms.count()));
         m_throttling = true;
-        m_start_point = std::chrono::steady_clock::now();
+        m_start_point = PacketClock::now();
         m_indicator = 1.f;
         dirty = true;
     }
 
     if (m_throttling) {
         // Already throttling, keep filling up
-        const auto current_time_point = std::chrono::steady_clock::now();
+        const auto current_time_point = PacketClock::now();
         for (auto it = g_packets.cbegin();
              it != g_packets.cend() && m_throttle_list.size() < MAX_PACKETS;) {
             const auto it_copy = it++;
@@ -117,14 +139,11 @@ ThrottleModule::Result ThrottleModule::process() {
         // send all when throttled enough, including in current step
         const auto delta_time = current_time_point - m_start_point;
         if (m_throttle_list.size() >= MAX_PACKETS ||
-            delta_time > m_timeframe_ms) {
+            delta_time >= m_timeframe_ms) {
             flush();
             return {.schedule_after = std::nullopt};
         } else {
-            const auto delta_time_ms =
-                std::chrono::duration_cast<std::chrono::milliseconds>(
-                    delta_time);
-            return {.schedule_after = m_timeframe_ms - delta_time_ms};
+            return {.schedule_after = m_timeframe_ms - delta_time};
         }
     }
 
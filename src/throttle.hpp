@@ -1,13 +1,10 @@
 #pragma once
 
 #include <chrono>
-#include <list>
 
 #include "module.hpp"
 #include "packet.hpp"
 
-using namespace std::chrono_literals;
-
 class ThrottleModule : public Module {
 private:
     // Threshold for how many packet to throttle at most
@@ -27,9 +24,13 @@ public:
     void disable() override;
 
     void apply_config(const toml::table& config) override;
+    void copy_settings(const Module& other) override;
 
     Result process() override;
 
+    void apply_stream_policy(bool outbound,
+                             StreamPolicy& policy) const override;
+
 private:
     void flush();
 
@@ -79,10 +80,10 @@ private:
     bool m_inbound = true;
     bool m_outbound = true;
     float m_chance = 10.f;
-    std::chrono::milliseconds m_timeframe_ms = 200ms;
+    std::chrono::milliseconds m_timeframe_ms{200};
     bool m_drop_throttled = false;
 
     bool m_throttling = false;
     std::chrono::steady_clock::time_point m_start_point;
-    std::list<PacketNode> m_throttle_list;
+    PacketList m_throttle_list;
 };
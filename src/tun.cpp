@@ -0,0 +1,616 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "packet.hpp"
+#include "scheduler.hpp"
+#include "tun.hpp"
+#include "uring.hpp"
+
+namespace {
+
+enum Op : uint64_t {
+    OP_READ = 1,
+    OP_WRITE,
+    OP_TIMER,
+    OP_STOP,
+    OP_CANCEL,
+};
+
+struct SlotPool {
+    std::vector<uint32_t> free;
+};
+
+// Returns a read slot to the pool once no packet references it anymore
+struct SlotDeleter {
+    std::shared_ptr<SlotPool> pool;
+    uint32_t slot;
+
+    void operator()(char*) const { pool->free.push_back(slot); }
+};
+
+} // namespace
+
+// Completions are told apart by the operation in the top byte
+static uint64_t user_data(Op op, uint64_t value) {
+    return static_cast<uint64_t>(op) << 56 | value;
+}
+
+static uint64_t to_u64(const void* ptr) {
+    return static_cast<uint64_t>(std::bit_cast<uintptr_t>(ptr));
+}
+
+int TunBackend::open_queue(const std::string& dev) {
+    const auto fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ifreq ifr{};
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+    strncpy(ifr.ifr_name, dev.c_str(), IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+        const auto error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+std::optional<size_t> TunBackend::query_mtu(const std::string& dev) {
+    const auto fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return std::nullopt;
+
+    ifreq ifr{};
+    strncpy(ifr.ifr_name, dev.c_str(), IFNAMSIZ - 1);
+    const auto res = ioctl(fd, SIOCGIFMTU, &ifr);
+    const auto error = res < 0 ? errno : EINVAL;
+    close(fd);
+    if (res < 0 || ifr.ifr_mtu <= 0) {
+        errno = error;
+        return std::nullopt;
+    }
+
+    return static_cast<size_t>(ifr.ifr_mtu);
+}
+
+std::optional<std::string> TunBackend::start(const std::string& filter) {
+    LOG("Starting");
+
+    // dev_a[,dev_b][:queues]
+    std::string devs = filter;
+    size_t queue_count = 1;
+    if (const auto colon = filter.rfind(':'); colon != std::string::npos) {
+        devs = filter.substr(0, colon);
+
+        const auto* const count_begin = filter.data() + colon + 1;
+        const auto* const count_end = filter.data() + filter.size();
+        const auto [ptr, ec] =
+            std::from_chars(count_begin, count_end, queue_count);
+        if (ec != std::errc() || ptr != count_end || queue_count == 0 ||
+            queue_count > MAX_QUEUES)
+            return "Failed to start filtering: invalid TUN queue count";
+    }
+
+    std::string dev_a = devs;
+    std::optional<std::string> dev_b;
+    if (const auto comma = devs.find(','); comma != std::string::npos) {
+        dev_a = devs.substr(0, comma);
+        dev_b = devs.substr(comma + 1);
+    }
+
+    for (const auto* dev : {&dev_a, dev_b ? &*dev_b : nullptr}) {
+        if (dev && (dev->empty() || dev->size() >= IFNAMSIZ))
+            return "Failed to start filtering: filter must be "
+                   "`dev[,dev][:queues]`";
+    }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0)
+        return "Failed to start filtering: failed to create eventfd";
+
+    // Queues of the first device, followed by the second one
+    for (const auto* dev : {&dev_a, dev_b ? &*dev_b : nullptr}) {
+        if (!dev)
+            continue;
+
+        for (size_t i = 0; i < queue_count; i++) {
+            const auto fd = open_queue(*dev);
+            if (fd < 0) {
+                const auto error = errno;
+                close_fds();
+
+                std::string message(512, '\0');
+                snprintf(message.data(), message.capacity(),
+                         "Failed to start filtering: failed to attach queue "
+                         "%zu of %s (%s).\n"
+                         "Create it with `ip tuntap add dev %s mode tun "
+                         "multi_queue` and run cluamsy with CAP_NET_ADMIN.",
+                         i, dev->c_str(), strerror(error), dev->c_str());
+                return message;
+            }
+
+            m_fds.push_back(fd);
+        }
+    }
+
+    // Reads have to fit the largest packet of either device. Guessing the
+    // largest possible one instead would pin 64 MiB of read slots per queue.
+    size_t mtu = 0;
+    for (const auto* dev : {&dev_a, dev_b ? &*dev_b : nullptr}) {
+        if (!dev)
+            continue;
+
+        const auto dev_mtu = query_mtu(*dev);
+        if (!dev_mtu) {
+            const auto error = errno;
+            close_fds();
+
+            std::string message(512, '\0');
+            snprintf(message.data(), message.capacity(),
+                     "Failed to start filtering: failed to query the MTU of "
+                     "%s (%s).",
+                     dev->c_str(), strerror(error));
+            return message;
+        }
+
+        mtu = std::max(mtu, *dev_mtu);
+    }
+
+    LOG("Attached %zu queues, MTU: %zu", queue_count, mtu);
+
+    m_buffer_pool = BufferPool::create({
+        .buffer_size = BUFFER_SIZE,
+        .buffer_count = BUFFER_COUNT * queue_count,
+        .prefault = true,
+        .huge_pages = true,
+    });
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    for (size_t i = 0; i < queue_count; i++) {
+        ThreadData thread_data = {
+            .fd_a = m_fds[i],
+            .fd_b = dev_b ? m_fds[queue_count + i] : -1,
+            .stop_fd = m_stop_fd,
+            .mtu = mtu,
+            .buffer_pool = *m_buffer_pool,
+            // The first queue runs the modules shown in the UI, the rest run
+            // copies of them
+            .modules = i == 0 ? m_modules : create_modules(),
+            .master = m_modules,
+        };
+
+        m_threads.emplace_back(thread, std::move(thread_data));
+    }
+
+    return std::nullopt;
+}
+
+bool TunBackend::stop() {
+    if (m_stop_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for %zu TUN threads", m_threads.size());
+    for (auto& thread : m_threads)
+        thread.join();
+
+    m_threads.clear();
+
+    close_fds();
+    m_buffer_pool = nullptr;
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("TUN stopped");
+
+    return true;
+}
+
+void TunBackend::close_fds() {
+    for (const auto fd : m_fds)
+        close(fd);
+
+    m_fds.clear();
+
+    if (m_stop_fd >= 0)
+        close(m_stop_fd);
+
+    m_stop_fd = -1;
+}
+
+Module::Result TunBackend::run_chain(const ThreadData& thread_data) {
+    // Pick up settings changed from the UI or Lua
+    if (thread_data.modules != thread_data.master) {
+        for (size_t i = 0; i < thread_data.modules.size(); i++)
+            thread_data.modules[i]->copy_settings(*thread_data.master[i]);
+    }
+
+    return run_modules(thread_data.modules);
+}
+
+void TunBackend::thread(ThreadData thread_data) {
+    IoUring ring;
+    if (ring.open(RING_ENTRIES) && uring_loop(thread_data, ring))
+        return;
+
+    LOG("io_uring is unavailable (%s), polling instead", strerror(errno));
+    ring.close();
+    poll_loop(thread_data);
+}
+
+bool TunBackend::uring_loop(const ThreadData& thread_data, IoUring& ring) {
+    const auto reflect = thread_data.fd_b < 0;
+    const std::array<int, 2> in_fds{thread_data.fd_a, thread_data.fd_b};
+    const size_t in_fd_count = reflect ? 1 : 2;
+
+    // Reads go straight into slots of one registered buffer
+    const auto slot_size = thread_data.mtu;
+    std::vector<char> slots(SLOT_COUNT * slot_size);
+    if (!ring.register_buffer(slots.data(), slots.size())) {
+        LOG("Failed to register %zu KiB of read slots (%s), is "
+            "RLIMIT_MEMLOCK too low?",
+            slots.size() >> 10, strerror(errno));
+        return false;
+    }
+
+    // Shared with the deleters of slot buffers
+    const auto pool = std::make_shared<SlotPool>();
+    for (uint32_t i = SLOT_COUNT; i-- > 0;)
+        pool->free.push_back(i);
+
+    // Writes in flight keep their packet alive until they complete
+    std::vector<std::optional<DenseBufferArraySlice>> writes;
+    std::vector<uint32_t> free_writes;
+    size_t writes_in_flight = 0;
+
+    // Reads in flight per input and the input + 1 each slot is read from
+    std::array<size_t, 2> reads_in_flight{};
+    std::vector<uint8_t> reading(SLOT_COUNT);
+    Scheduler scheduler;
+    bool timer_polled = false;
+    bool stop = false;
+
+    const auto submit_read = [&](size_t fd_index) {
+        const auto slot = pool->free.back();
+        auto* const sqe = ring.get_sqe();
+        if (sqe == nullptr)
+            return false;
+
+        pool->free.pop_back();
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = in_fds[fd_index];
+        sqe->addr = to_u64(slots.data() + slot * slot_size);
+        sqe->len = slot_size;
+        sqe->buf_index = 0;
+        sqe->user_data = user_data(OP_READ, fd_index << 32 | slot);
+        reading[slot] = fd_index + 1;
+        reads_in_flight[fd_index]++;
+        return true;
+    };
+
+    const auto on_read = [&](size_t fd_index, uint32_t slot, int res,
+                             std::chrono::steady_clock::time_point now) {
+        reading[slot] = 0;
+        reads_in_flight[fd_index]--;
+        if (res <= 0) {
+            pool->free.push_back(slot);
+            if (res < 0 && res != -EINTR && res != -EAGAIN &&
+                res != -ECANCELED) {
+                LOG("read failed: %s", strerror(-res));
+                stop = true;
+            }
+
+            return;
+        }
+
+        auto* const data = slots.data() + slot * slot_size;
+        const auto size = static_cast<size_t>(res);
+
+        PacketAddress addr{};
+        addr.Outbound = fd_index == 0;
+
+        // Running out of slots (e.g. modules hold lagged packets), copy
+        // the packet out so that reads can go on
+        auto packet = [&] {
+            if (pool->free.size() >= READS_IN_FLIGHT * in_fd_count) {
+                return DenseBufferArraySlice(
+                    std::shared_ptr<char>(data, SlotDeleter{pool, slot}), 0,
+                    size);
+            }
+
+            pool->free.push_back(slot);
+            return DenseBufferArraySlice(
+                std::make_shared<std::vector<char>>(data, data + size), 0,
+                size);
+        }();
+
+        g_packets.emplace_back(PacketNode{
+            .packet = std::move(packet),
+            .addr = addr,
+            .captured_at = now,
+        });
+    };
+
+    const auto write_packets = [&] {
+        auto it = g_packets.begin();
+        for (; it != g_packets.end(); ++it) {
+            auto* const sqe = ring.get_sqe();
+            if (sqe == nullptr)
+                break;
+
+            const auto& slice = it->packet;
+            const auto* const deleter =
+                std::get_deleter<SlotDeleter>(slice.buffer());
+            sqe->opcode = deleter != nullptr && deleter->pool == pool
+                              ? IORING_OP_WRITE_FIXED
+                              : IORING_OP_WRITE;
+            sqe->fd = reflect || !it->addr.Outbound ? thread_data.fd_a
+                                                    : thread_data.fd_b;
+            sqe->addr = to_u64(slice.data());
+            sqe->len = slice.size();
+            sqe->buf_index = 0;
+
+            if (free_writes.empty()) {
+                free_writes.push_back(writes.size());
+                writes.emplace_back();
+            }
+
+            const auto index = free_writes.back();
+            free_writes.pop_back();
+            writes[index] = slice;
+            writes_in_flight++;
+            sqe->user_data = user_data(OP_WRITE, index);
+        }
+
+        g_packets.erase(g_packets.begin(), it);
+    };
+
+    const auto on_write = [&](uint32_t index, int res) {
+        if (res < 0 && res != -EINTR)
+            LOG("write failed: %s", strerror(-res));
+
+        writes[index] = std::nullopt;
+        free_writes.push_back(index);
+        writes_in_flight--;
+    };
+
+    const auto reap = [&] {
+        const auto now = std::chrono::steady_clock::now();
+        ring.for_each_completion([&](const io_uring_cqe& cqe) {
+            const auto value = cqe.user_data & 0xffffffffffffff;
+            switch (cqe.user_data >> 56) {
+            case OP_READ:
+                on_read(value >> 32, value & 0xffffffff, cqe.res, now);
+                break;
+            case OP_WRITE:
+                on_write(value, cqe.res);
+                break;
+            case OP_TIMER:
+                timer_polled = false;
+                scheduler.expire();
+                break;
+            case OP_STOP:
+                stop = true;
+                break;
+            default:
+                break;
+            }
+        });
+    };
+
+    // Wakes the loop up once the stop eventfd is written to, it's shared by
+    // all workers so it's only polled and never read
+    if (auto* const sqe = ring.get_sqe()) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = thread_data.stop_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = user_data(OP_STOP, 0);
+    }
+
+    while (!stop) {
+        // Keep reads in flight
+        for (size_t i = 0; i < in_fd_count; i++) {
+            while (reads_in_flight[i] < READS_IN_FLIGHT &&
+                   !pool->free.empty() && submit_read(i)) {
+            }
+        }
+
+        // One syscall submits everything queued and waits for completions
+        if (ring.submit(1) < 0 && errno != EINTR) {
+            LOG("io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+
+        // READ
+        reap();
+
+        // Run modules
+        scheduler.schedule(run_chain(thread_data).schedule_after);
+
+        // WRITE
+        write_packets();
+
+        // Polls are one-shot, the timer itself can be rearmed any time
+        if (!timer_polled) {
+            if (auto* const sqe = ring.get_sqe()) {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = scheduler.fd();
+                sqe->poll32_events = POLLIN;
+                sqe->user_data = user_data(OP_TIMER, 0);
+                timer_polled = true;
+            }
+        }
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    do {
+        write_packets();
+        if (ring.submit(writes_in_flight != 0 ? 1 : 0) < 0 && errno != EINTR)
+            break;
+
+        reap();
+    } while (writes_in_flight != 0 || !g_packets.empty());
+
+    // The kernel would keep reading into the slots after they're freed
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+        if (reading[slot] == 0)
+            continue;
+
+        if (auto* const sqe = ring.get_sqe()) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = user_data(
+                OP_READ, static_cast<uint64_t>(reading[slot] - 1) << 32 | slot);
+            sqe->user_data = user_data(OP_CANCEL, 0);
+        }
+    }
+
+    if (!stop) {
+        if (auto* const sqe = ring.get_sqe()) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = user_data(OP_STOP, 0);
+            sqe->user_data = user_data(OP_CANCEL, 0);
+        }
+    }
+
+    while (reads_in_flight[0] != 0 || reads_in_flight[1] != 0 || !stop) {
+        if (ring.submit(1) < 0 && errno != EINTR)
+            break;
+
+        reap();
+    }
+
+    g_packets.clear();
+    return true;
+}
+
+void TunBackend::poll_loop(const ThreadData& thread_data) {
+    const auto reflect = thread_data.fd_b < 0;
+
+    auto buffer = thread_data.buffer_pool.lease();
+    size_t offset = 0;
+
+    const auto read_packets = [&](int fd, bool outbound) {
+        DenseBufferArray dense_buffers(buffer);
+
+        size_t packet_count = 0;
+        const auto current_timestamp = std::chrono::steady_clock::now();
+        while (packet_count < MAX_PACKETS) {
+            // Packets in the buffer are still referenced by modules, start
+            // a new one
+            if (BUFFER_SIZE - offset < thread_data.mtu) {
+                buffer = thread_data.buffer_pool.lease();
+                dense_buffers = DenseBufferArray(buffer);
+                offset = 0;
+            }
+
+            const auto read =
+                ::read(fd, buffer.get() + offset, BUFFER_SIZE - offset);
+            if (read < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    LOG("read failed: %s", strerror(errno));
+
+                break;
+            }
+
+            if (read == 0)
+                break;
+
+            PacketAddress addr{};
+            addr.Outbound = outbound;
+
+            g_packets.emplace_back(PacketNode{
+                .packet = dense_buffers.slice(offset, read),
+                .addr = addr,
+                .captured_at = current_timestamp,
+            });
+
+            offset += read;
+            packet_count++;
+        }
+    };
+
+    const auto write_packets = [&] {
+        for (const auto& packet : g_packets) {
+            const auto fd = reflect || !packet.addr.Outbound
+                                ? thread_data.fd_a
+                                : thread_data.fd_b;
+            if (write(fd, packet.packet.data(), packet.packet.size()) < 0)
+                LOG("write failed: %s", strerror(errno));
+        }
+
+        g_packets.clear();
+    };
+
+    Scheduler scheduler;
+    std::array<pollfd, 4> fds{
+        pollfd{.fd = thread_data.fd_a, .events = POLLIN, .revents = 0},
+        // Negative descriptors are ignored
+        pollfd{.fd = thread_data.fd_b, .events = POLLIN, .revents = 0},
+        pollfd{.fd = thread_data.stop_fd, .events = POLLIN, .revents = 0},
+        pollfd{.fd = scheduler.fd(), .events = POLLIN, .revents = 0},
+    };
+    while (true) {
+        const auto res = poll(fds.data(), fds.size(), -1);
+
+        if (res < 0 && errno != EINTR) {
+            LOG("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        // STOP
+        if (fds[2].revents & POLLIN)
+            break;
+
+        // READ
+        if (fds[0].revents & POLLIN)
+            read_packets(thread_data.fd_a, true);
+        if (fds[1].revents & POLLIN)
+            read_packets(thread_data.fd_b, false);
+
+        if ((fds[0].revents | fds[1].revents) & (POLLERR | POLLHUP)) {
+            LOG("TUN device closed");
+            break;
+        }
+
+        // TIMER
+        if (fds[3].revents & POLLIN)
+            scheduler.expire();
+
+        // Run modules
+        scheduler.schedule(run_chain(thread_data).schedule_after);
+
+        // WRITE
+        write_packets();
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    write_packets();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.hpp"
+#include "buffer_pool.hpp"
+#include "module.hpp"
+
+class IoUring;
+
+// Linux TUN backend. Packets routed into the device are read from every queue
+// of a multi-queue TUN interface by a worker thread per queue, each running
+// its own copy of the module chain.
+// The filter is `dev[:queues]` to send packets back into the same device or
+// `dev_a,dev_b[:queues]` to bridge two devices, the queue count defaults to 1.
+// Workers drive the device through io_uring when it's available and fall back
+// to polling otherwise.
+class TunBackend : public PacketBackend {
+public:
+    static const inline size_t MAX_QUEUES = 64;
+    static const inline size_t BUFFER_SIZE = 0x40000;
+    // Pooled buffers per queue, for reads without io_uring
+    static const inline size_t BUFFER_COUNT = 16;
+    static const inline size_t MAX_PACKETS = 32;
+
+    static const inline unsigned RING_ENTRIES = 256;
+    // Reads kept in flight per device
+    static const inline size_t READS_IN_FLIGHT = 32;
+    // MTU sized slots of the registered read buffer
+    static const inline uint32_t SLOT_COUNT = 1024;
+
+public:
+    explicit TunBackend(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    TunBackend(const TunBackend&) = delete;
+    TunBackend(TunBackend&&) = delete;
+    TunBackend& operator=(const TunBackend&) = delete;
+    TunBackend& operator=(TunBackend&&) = delete;
+
+    ~TunBackend() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    struct ThreadData {
+        // Packets read from `fd_a` are outbound, they're written to `fd_b`
+        // when bridging or back into `fd_a` otherwise (`fd_b` is -1)
+        int fd_a;
+        int fd_b;
+        int stop_fd;
+        size_t mtu;
+        BufferPool& buffer_pool;
+        // Module chain the worker runs, settings are copied from `master`
+        // every iteration unless it is the master chain itself
+        std::vector<std::shared_ptr<Module>> modules;
+        const std::vector<std::shared_ptr<Module>>& master;
+    };
+
+    static void thread(ThreadData thread_data);
+    // Returns false if io_uring can't be used, nothing was processed then
+    static bool uring_loop(const ThreadData& thread_data, IoUring& ring);
+    static void poll_loop(const ThreadData& thread_data);
+
+    // Syncs the worker's module chain with the master one and runs it
+    static Module::Result run_chain(const ThreadData& thread_data);
+
+    // Attaches another queue to `dev`, returns -1 on failure
+    static int open_queue(const std::string& dev);
+    static std::optional<size_t> query_mtu(const std::string& dev);
+
+    void close_fds();
+
+private:
+    std::vector<std::thread> m_threads;
+    std::vector<int> m_fds;
+    int m_stop_fd = -1;
+    std::shared_ptr<BufferPool> m_buffer_pool;
+};
@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "common.hpp"
+#include "dense_buffers.hpp"
+#include "packet.hpp"
+#include "scheduler.hpp"
+#include "socket_util.hpp"
+#include "udp_relay.hpp"
+
+namespace {
+
+// Client address with IPv4 mapped into IPv6
+struct ClientKey {
+    std::array<uint8_t, 16> address;
+    uint16_t port;
+
+    bool operator==(const ClientKey&) const = default;
+};
+
+struct ClientKeyHash {
+    size_t operator()(const ClientKey& key) const {
+        uint64_t high = 0;
+        uint64_t low = 0;
+        memcpy(&high, key.address.data(), sizeof(high));
+        memcpy(&low, key.address.data() + 8, sizeof(low));
+        return std::hash<uint64_t>{}(high ^ (low * 0x9e3779b97f4a7c15) ^
+                                     key.port);
+    }
+};
+
+struct Session {
+    // Socket connected to the upstream, -1 for free slots
+    int fd = -1;
+    // Bumped when the slot is freed, so packets of an expired session held
+    // by modules aren't sent to whoever takes the slot next
+    uint32_t generation = 0;
+    sockaddr_storage client{};
+    socklen_t client_size = 0;
+    ClientKey key{};
+    std::chrono::steady_clock::time_point last_active;
+};
+
+} // namespace
+
+// Epoll tags, sessions are tagged with their packet id
+static const uint64_t STOP_TAG = UINT64_MAX;
+static const uint64_t LISTEN_TAG = UINT64_MAX - 1;
+static const uint64_t TIMER_TAG = UINT64_MAX - 2;
+
+static uint64_t session_id(uint32_t index, uint32_t generation) {
+    return static_cast<uint64_t>(generation) << 32 | index;
+}
+
+static ClientKey client_key(const sockaddr_storage& address) {
+    ClientKey key{};
+    if (address.ss_family == AF_INET) {
+        const auto& in = reinterpret_cast<const sockaddr_in&>(address);
+        key.address[10] = key.address[11] = 0xff;
+        memcpy(key.address.data() + 12, &in.sin_addr, 4);
+        key.port = in.sin_port;
+    } else {
+        const auto& in6 = reinterpret_cast<const sockaddr_in6&>(address);
+        memcpy(key.address.data(), &in6.sin6_addr, 16);
+        key.port = in6.sin6_port;
+    }
+
+    return key;
+}
+
+void UdpRelay::close_fds() {
+    for (auto* fd : {&m_listen_fd, &m_stop_fd}) {
+        if (*fd >= 0)
+            close(*fd);
+
+        *fd = -1;
+    }
+}
+
+std::optional<std::string> UdpRelay::start(const std::string& filter) {
+    LOG("Starting");
+
+    SocketAddress listen_address{};
+    SocketAddress upstream{};
+    if (const auto err = parse_proxy_filter(filter, listen_address, upstream))
+        return "Failed to start relay: " + *err;
+
+    m_listen_fd = socket(listen_address.family(),
+                         SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+        return "Failed to start relay: failed to create socket";
+
+    // Bursts are read in batches, give them room. Capped by rmem_max
+    const int buffer_size = 4 << 20;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size,
+               sizeof(buffer_size));
+
+    if (bind(m_listen_fd, listen_address.get(), listen_address.size) < 0) {
+        const auto error = errno;
+        close_fds();
+        return std::string("Failed to start relay: failed to bind: ") +
+               strerror(error);
+    }
+
+    m_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_stop_fd < 0) {
+        close_fds();
+        return "Failed to start relay: failed to create eventfd";
+    }
+
+    m_buffer_pool = BufferPool::create({
+        .buffer_size = BUFFER_SIZE,
+        .buffer_count = BUFFER_COUNT,
+        .prefault = true,
+        .huge_pages = true,
+    });
+
+    // Initialize modules
+    enable_modules();
+
+    LOG("Starting threads");
+
+    ThreadData thread_data = {
+        .listen_fd = m_listen_fd,
+        .stop_fd = m_stop_fd,
+        .upstream = upstream,
+        .buffer_pool = *m_buffer_pool,
+        .modules = m_modules,
+    };
+
+    m_thread = std::thread(thread, thread_data);
+
+    return std::nullopt;
+}
+
+bool UdpRelay::stop() {
+    if (m_stop_fd < 0)
+        return false;
+
+    LOG("Stopping");
+
+    const uint64_t value = 1;
+    [[maybe_unused]] const auto written =
+        write(m_stop_fd, &value, sizeof(value));
+
+    LOG("Waiting for the relay thread");
+    m_thread.join();
+
+    close_fds();
+    m_buffer_pool = nullptr;
+
+    // Run post-disable module cleanups
+    disable_modules();
+
+    LOG("Relay stopped");
+
+    return true;
+}
+
+void UdpRelay::thread(ThreadData thread_data) {
+    const auto epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOG("epoll_create1 failed: %s", strerror(errno));
+        return;
+    }
+
+    const auto watch = [&](int fd, uint64_t tag) {
+        epoll_event event{.events = EPOLLIN, .data = {.u64 = tag}};
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+    };
+
+    Scheduler scheduler;
+    if (!watch(thread_data.stop_fd, STOP_TAG) ||
+        !watch(thread_data.listen_fd, LISTEN_TAG) ||
+        !watch(scheduler.fd(), TIMER_TAG)) {
+        LOG("epoll_ctl failed: %s", strerror(errno));
+        close(epoll_fd);
+        return;
+    }
+
+    std::vector<Session> sessions;
+    std::vector<uint32_t> free_sessions;
+    std::unordered_map<ClientKey, uint32_t, ClientKeyHash> session_indices;
+
+    const auto open_session = [&](const sockaddr_storage& client,
+                                  socklen_t client_size,
+                                  const ClientKey& key) -> Session* {
+        if (free_sessions.empty()) {
+            if (sessions.size() == MAX_SESSIONS)
+                return nullptr;
+
+            free_sessions.push_back(static_cast<uint32_t>(sessions.size()));
+            sessions.emplace_back();
+        }
+
+        const auto fd = socket(thread_data.upstream.family(),
+                               SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return nullptr;
+
+        const auto index = free_sessions.back();
+        auto& session = sessions[index];
+        if (connect(fd, thread_data.upstream.get(),
+                    thread_data.upstream.size) < 0 ||
+            !watch(fd, session_id(index, session.generation))) {
+            close(fd);
+            return nullptr;
+        }
+
+        free_sessions.pop_back();
+        session.fd = fd;
+        session.client = client;
+        session.client_size = client_size;
+        session.key = key;
+        session_indices.emplace(key, index);
+
+        LOG("New session %u, %zu active", index, session_indices.size());
+
+        return &session;
+    };
+
+    const auto close_session = [&](uint32_t index) {
+        auto& session = sessions[index];
+        close(session.fd);
+        session.fd = -1;
+        session.generation++;
+        session_indices.erase(session.key);
+        free_sessions.push_back(index);
+    };
+
+    // Datagrams are received into 64K slots and copied into dense buffers,
+    // they're usually tiny
+    std::vector<char> scratch(MAX_PACKETS * MAX_DATAGRAM_SIZE);
+    std::array<iovec, MAX_PACKETS> iovecs{};
+    std::array<sockaddr_storage, MAX_PACKETS> names{};
+    std::array<mmsghdr, MAX_PACKETS> messages{};
+
+    std::shared_ptr<char> buffer;
+    size_t offset = 0;
+
+    // Datagrams carry no headers, their flow is the session
+    const auto upstream_key = client_key(thread_data.upstream.storage);
+    const auto packet_info = [&](const Session& session, bool outbound,
+                                 size_t size) {
+        const auto& src = outbound ? session.key : upstream_key;
+        const auto& dst = outbound ? upstream_key : session.key;
+
+        PacketInfo info{
+            .parsed = true,
+            .protocol = IPPROTO_UDP,
+            .length = static_cast<uint16_t>(size),
+            .payload_length = static_cast<uint16_t>(size),
+            .src_port = ntohs(src.port),
+            .dst_port = ntohs(dst.port),
+            .src_addr = src.address,
+            .dst_addr = dst.address,
+        };
+        info.flow_hash = flow_hash(info);
+
+        return info;
+    };
+
+    // Reads a batch from the listening socket (`session_index` is
+    // `std::nullopt`) or from the upstream socket of a session
+    const auto read_packets = [&](int fd,
+                                  std::optional<uint32_t> session_index) {
+        for (size_t i = 0; i < MAX_PACKETS; i++) {
+            iovecs[i] = {.iov_base = scratch.data() + i * MAX_DATAGRAM_SIZE,
+                         .iov_len = MAX_DATAGRAM_SIZE};
+            messages[i].msg_hdr = msghdr{
+                .msg_name = session_index ? nullptr : &names[i],
+                .msg_namelen = session_index
+                                   ? 0
+                                   : static_cast<socklen_t>(sizeof(names[i])),
+                .msg_iov = &iovecs[i],
+                .msg_iovlen = 1,
+                .msg_control = nullptr,
+                .msg_controllen = 0,
+                .msg_flags = 0,
+            };
+        }
+
+        const auto count = recvmmsg(fd, messages.data(), MAX_PACKETS,
+                                    MSG_DONTWAIT, nullptr);
+        if (count < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG("recvmmsg failed: %s", strerror(errno));
+
+            return;
+        }
+
+        const auto current_timestamp = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < static_cast<size_t>(count); i++) {
+            Session* session = nullptr;
+            if (session_index) {
+                session = &sessions[*session_index];
+            } else {
+                const auto key = client_key(names[i]);
+                if (const auto it = session_indices.find(key);
+                    it != session_indices.end())
+                    session = &sessions[it->second];
+                else
+                    session = open_session(names[i],
+                                           messages[i].msg_hdr.msg_namelen,
+                                           key);
+
+                // Out of sessions, drop it
+                if (!session)
+                    continue;
+            }
+
+            session->last_active = current_timestamp;
+
+            const size_t size = messages[i].msg_len;
+            if (!buffer || BUFFER_SIZE - offset < size) {
+                buffer = thread_data.buffer_pool.lease();
+                offset = 0;
+            }
+
+            memcpy(buffer.get() + offset, iovecs[i].iov_base, size);
+
+            const auto index =
+                static_cast<uint32_t>(session - sessions.data());
+            PacketAddress addr{};
+            addr.Id = session_id(index, session->generation);
+            addr.Outbound = !session_index;
+
+            g_packets.emplace_back(PacketNode{
+                .packet = DenseBufferArraySlice(buffer, offset, size),
+                .addr = addr,
+                .captured_at = current_timestamp,
+                .info = packet_info(*session, addr.Outbound, size),
+            });
+
+            offset += size;
+        }
+    };
+
+    // Consecutive packets going out of the same socket are sent together
+    size_t pending = 0;
+    int pending_fd = -1;
+    const auto send_pending = [&] {
+        size_t sent = 0;
+        while (sent < pending) {
+            const auto res = sendmmsg(pending_fd, messages.data() + sent,
+                                      pending - sent, 0);
+            if (res < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                LOG("sendmmsg failed, dropping %zu packets: %s",
+                    pending - sent, strerror(errno));
+                break;
+            }
+
+            sent += res;
+        }
+
+        pending = 0;
+    };
+
+    const auto write_packets = [&] {
+        for (const auto& packet : g_packets) {
+            const auto index = static_cast<uint32_t>(packet.addr.Id);
+            const auto generation =
+                static_cast<uint32_t>(packet.addr.Id >> 32);
+
+            // Session expired while a module was holding the packet
+            auto& session = sessions[index];
+            if (session.fd < 0 || session.generation != generation)
+                continue;
+
+            const auto outbound = packet.addr.Outbound;
+            const auto fd = outbound ? session.fd : thread_data.listen_fd;
+            if (pending == MAX_PACKETS || (pending > 0 && fd != pending_fd))
+                send_pending();
+
+            pending_fd = fd;
+            iovecs[pending] = {
+                .iov_base = const_cast<char*>(packet.packet.data()),
+                .iov_len = packet.packet.size()};
+            messages[pending].msg_hdr = msghdr{
+                .msg_name = outbound ? nullptr : &session.client,
+                .msg_namelen = outbound ? 0 : session.client_size,
+                .msg_iov = &iovecs[pending],
+                .msg_iovlen = 1,
+                .msg_control = nullptr,
+                .msg_controllen = 0,
+                .msg_flags = 0,
+            };
+            pending++;
+        }
+
+        send_pending();
+        g_packets.clear();
+    };
+
+    const auto expire_sessions = [&](std::chrono::steady_clock::time_point
+                                         now) {
+        for (uint32_t i = 0; i < sessions.size(); i++) {
+            if (sessions[i].fd >= 0 &&
+                now - sessions[i].last_active > SESSION_TIMEOUT) {
+                LOG("Session %u timed out", i);
+                close_session(i);
+            }
+        }
+    };
+
+    std::array<epoll_event, MAX_PACKETS> events{};
+    auto last_expiry = std::chrono::steady_clock::now();
+    while (true) {
+        // Wake up now and then to forget idle clients
+        const auto timeout = session_indices.empty() ? -1 : 1000;
+        const auto res =
+            epoll_wait(epoll_fd, events.data(), events.size(), timeout);
+
+        if (res < 0 && errno != EINTR) {
+            LOG("epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        // STOP
+        const auto stopped =
+            std::any_of(events.begin(), events.begin() + std::max(res, 0),
+                        [](const epoll_event& event) {
+                            return event.data.u64 == STOP_TAG;
+                        });
+        if (stopped)
+            break;
+
+        // READ
+        for (int i = 0; i < res; i++) {
+            const auto tag = events[i].data.u64;
+            if (tag == LISTEN_TAG) {
+                read_packets(thread_data.listen_fd, std::nullopt);
+                continue;
+            }
+
+            // TIMER
+            if (tag == TIMER_TAG) {
+                scheduler.expire();
+                continue;
+            }
+
+            const auto index = static_cast<uint32_t>(tag);
+            if (sessions[index].generation == static_cast<uint32_t>(tag >> 32))
+                read_packets(sessions[index].fd, index);
+        }
+
+        // Run modules
+        scheduler.schedule(run_modules(thread_data.modules).schedule_after);
+
+        // WRITE
+        write_packets();
+
+        if (const auto now = std::chrono::steady_clock::now();
+            now - last_expiry >= std::chrono::seconds(1)) {
+            expire_sessions(now);
+            last_expiry = now;
+        }
+    }
+
+    // Send out whatever modules are still holding
+    flush_modules(thread_data.modules);
+    write_packets();
+
+    for (uint32_t i = 0; i < sessions.size(); i++) {
+        if (sessions[i].fd >= 0)
+            close_session(i);
+    }
+
+    close(epoll_fd);
+}
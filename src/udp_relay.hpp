@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <thread>
+
+#include "backend.hpp"
+#include "buffer_pool.hpp"
+#include "module.hpp"
+#include "socket_util.hpp"
+
+// User-space UDP proxy, no capture driver or privileges needed. Datagrams
+// sent to the listening port are forwarded to the upstream address and
+// replies are sent back to the client they belong to. Every client gets its
+// own upstream socket, datagrams from clients count as outbound.
+// The filter is `[listen_host:]port > upstream_host:port`, IPv6 hosts go into
+// brackets. Modules see the UDP payload only.
+class UdpRelay : public PacketBackend {
+public:
+    static const inline size_t BUFFER_SIZE = 0x40000;
+    static const inline size_t BUFFER_COUNT = 64;
+    // Datagrams received and sent per system call
+    static const inline size_t MAX_PACKETS = 32;
+    static const inline size_t MAX_DATAGRAM_SIZE = 0x10000;
+    static const inline size_t MAX_SESSIONS = 4096;
+    // Clients are forgotten after this long without traffic in either
+    // direction
+    static const inline std::chrono::seconds SESSION_TIMEOUT{60};
+
+public:
+    explicit UdpRelay(std::vector<std::shared_ptr<Module>> modules)
+        : PacketBackend(std::move(modules)) {}
+
+    UdpRelay(const UdpRelay&) = delete;
+    UdpRelay(UdpRelay&&) = delete;
+    UdpRelay& operator=(const UdpRelay&) = delete;
+    UdpRelay& operator=(UdpRelay&&) = delete;
+
+    ~UdpRelay() override { stop(); };
+
+    std::optional<std::string> start(const std::string& filter) override;
+    bool stop() override;
+
+private:
+    struct ThreadData {
+        int listen_fd;
+        int stop_fd;
+        SocketAddress upstream;
+        BufferPool& buffer_pool;
+        const std::vector<std::shared_ptr<Module>>& modules;
+    };
+
+    static void thread(ThreadData thread_data);
+
+    void close_fds();
+
+private:
+    std::thread m_thread;
+    int m_listen_fd = -1;
+    int m_stop_fd = -1;
+    std::shared_ptr<BufferPool> m_buffer_pool;
+};
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.hpp"
+
+bool IoUring::open(unsigned entries) {
+    io_uring_params params{};
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0)
+        return false;
+
+    m_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Both rings usually live in one mapping
+    const auto single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        m_sq_map_size = m_cq_map_size =
+            std::max(m_sq_map_size, m_cq_map_size);
+
+    m_sq_map = mmap(nullptr, m_sq_map_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_map == MAP_FAILED) {
+        m_sq_map = nullptr;
+        const auto error = errno;
+        close();
+        errno = error;
+        return false;
+    }
+
+    if (single_mmap) {
+        m_cq_map = m_sq_map;
+    } else {
+        m_cq_map = mmap(nullptr, m_cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cq_map == MAP_FAILED) {
+            m_cq_map = nullptr;
+            const auto error = errno;
+            close();
+            errno = error;
+            return false;
+        }
+    }
+
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    auto* const sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        const auto error = errno;
+        close();
+        errno = error;
+        return false;
+    }
+
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    auto* const sq = static_cast<char*>(m_sq_map);
+    m_sq_head = std::bit_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = std::bit_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_mask = std::bit_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_array = std::bit_cast<unsigned*>(sq + params.sq_off.array);
+    m_sq_entries = params.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+
+    auto* const cq = static_cast<char*>(m_cq_map);
+    m_cq_head = std::bit_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = std::bit_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask = std::bit_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = std::bit_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+void IoUring::close() {
+    if (m_sqes != nullptr)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_map != nullptr && m_cq_map != m_sq_map)
+        munmap(m_cq_map, m_cq_map_size);
+    if (m_sq_map != nullptr)
+        munmap(m_sq_map, m_sq_map_size);
+
+    m_sqes = nullptr;
+    m_cq_map = nullptr;
+    m_sq_map = nullptr;
+
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+    m_fd = -1;
+}
+
+bool IoUring::register_buffer(void* data, size_t size) {
+    iovec iov{.iov_base = data, .iov_len = size};
+    return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, &iov,
+                   1) == 0;
+}
+
+io_uring_sqe* IoUring::get_sqe() {
+    auto head = std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+    if (m_sq_local_tail - head >= m_sq_entries) {
+        if (submit() < 0)
+            return nullptr;
+
+        head = std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+        if (m_sq_local_tail - head >= m_sq_entries)
+            return nullptr;
+    }
+
+    const auto index = m_sq_local_tail & *m_sq_mask;
+    m_sq_array[index] = index;
+    m_sq_local_tail++;
+
+    auto* const sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int IoUring::submit(unsigned wait_count) {
+    std::atomic_ref(*m_sq_tail)
+        .store(m_sq_local_tail, std::memory_order_release);
+
+    const auto to_submit =
+        m_sq_local_tail -
+        std::atomic_ref(*m_sq_head).load(std::memory_order_acquire);
+    return static_cast<int>(
+        syscall(__NR_io_uring_enter, m_fd, to_submit, wait_count,
+                wait_count != 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+}
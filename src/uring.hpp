@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper on top of the raw syscalls. Only used from a single
+// thread, no SQPOLL.
+class IoUring {
+public:
+    IoUring() = default;
+
+    IoUring(const IoUring&) = delete;
+    IoUring(IoUring&&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    IoUring& operator=(IoUring&&) = delete;
+
+    ~IoUring() { close(); }
+
+    // Returns false and leaves errno set on failure
+    bool open(unsigned entries);
+    void close();
+
+    // Registers `size` bytes at `data` as fixed buffer 0
+    bool register_buffer(void* data, size_t size);
+
+    // Returns a zeroed submission entry, queued entries are submitted first
+    // if the queue is full. Returns `nullptr` if that fails.
+    [[nodiscard]] io_uring_sqe* get_sqe();
+
+    // Submits queued entries and waits for at least `wait_count` completions
+    int submit(unsigned wait_count = 0);
+
+    // Calls `callback(const io_uring_cqe&)` for every available completion
+    template <typename F> void for_each_completion(F&& callback) {
+        auto head = std::atomic_ref(*m_cq_head).load(std::memory_order_relaxed);
+        const auto tail =
+            std::atomic_ref(*m_cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; head++)
+            callback(m_cqes[head & *m_cq_mask]);
+
+        std::atomic_ref(*m_cq_head).store(head, std::memory_order_release);
+    }
+
+private:
+    int m_fd = -1;
+
+    void* m_sq_map = nullptr;
+    size_t m_sq_map_size = 0;
+    void* m_cq_map = nullptr;
+    size_t m_cq_map_size = 0;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+
+    unsigned* m_sq_head = nullptr;
+    unsigned* m_sq_tail = nullptr;
+    unsigned* m_sq_mask = nullptr;
+    unsigned* m_sq_array = nullptr;
+    unsigned m_sq_entries = 0;
+    // Entries queued but not yet published to the kernel
+    unsigned m_sq_local_tail = 0;
+
+    unsigned* m_cq_head = nullptr;
+    unsigned* m_cq_tail = nullptr;
+    unsigned* m_cq_mask = nullptr;
+    io_uring_cqe* m_cqes = nullptr;
+};
@@ -0,0 +1,130 @@
+// Holds fragments captured into large pooled buffers and checks that
+// reassembly stays within its memory limit without pinning the buffers
+#define TOML_IMPLEMENTATION
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "buffer_pool.hpp"
+#include "checksum.hpp"
+#include "defragment.hpp"
+
+namespace {
+
+constexpr size_t BUFFER_SIZE = 256 << 10;
+constexpr size_t BUFFER_COUNT = 8;
+constexpr size_t FRAGMENT_DATA = 1000;
+constexpr int MEMORY_LIMIT = 64;
+
+// IPv4 UDP fragment of datagram `id`, written to `data`
+size_t write_fragment(char* data, uint16_t id, size_t offset, bool more) {
+    auto* const bytes = std::bit_cast<uint8_t*>(data);
+    const size_t size = 20 + FRAGMENT_DATA;
+    std::memset(bytes, 0, size);
+    bytes[0] = 0x45;
+    store_be16(bytes + 2, static_cast<uint16_t>(size));
+    store_be16(bytes + 4, id);
+    store_be16(bytes + 6, static_cast<uint16_t>((more ? 0x2000 : 0) |
+                                                (offset / 8)));
+    bytes[8] = 64;
+    bytes[9] = 17;
+    bytes[12] = 10;
+    bytes[15] = 1;
+    bytes[16] = 10;
+    bytes[19] = 2;
+    std::memset(bytes + 20, static_cast<int>(id), FRAGMENT_DATA);
+    calculate_ipv4_checksum(data, 20);
+
+    return size;
+}
+
+void push(const std::shared_ptr<char>& buffer, size_t offset, size_t size) {
+    DenseBufferArraySlice slice(buffer, offset, size);
+    const auto info = parse_packet(slice.data(), size);
+    g_packets.emplace_back(PacketNode{
+        .packet = std::move(slice),
+        .addr = {},
+        .captured_at = PacketClock::now(),
+        .info = info,
+    });
+}
+
+bool check(bool ok, const char* what) {
+    if (!ok)
+        std::fprintf(stderr, "FAILED: %s\n", what);
+
+    return ok;
+}
+
+} // namespace
+
+int main() {
+    const auto pool = BufferPool::create({
+        .buffer_size = BUFFER_SIZE,
+        .buffer_count = BUFFER_COUNT + 1,
+        .prefault = false,
+    });
+
+    DefragmentModule module;
+    module.apply_config(toml::table{
+        {"enabled", true},
+        {"memory_limit", MEMORY_LIMIT},
+    });
+    module.enable();
+
+    // First fragments of datagrams that never complete, a pool buffer full
+    // of them at a time
+    std::vector<std::weak_ptr<char>> leased;
+    uint16_t id = 0;
+    for (size_t i = 0; i < BUFFER_COUNT; i++) {
+        const auto buffer = pool->lease();
+        leased.push_back(buffer);
+        for (size_t offset = 0; offset + 20 + FRAGMENT_DATA <= BUFFER_SIZE;
+             offset += 20 + FRAGMENT_DATA) {
+            const auto size = write_fragment(buffer.get() + offset, id++, 0,
+                                             true);
+            push(buffer, offset, size);
+        }
+
+        module.process();
+    }
+
+    bool ok = check(g_packets.empty(), "fragments left in the chain");
+    for (const auto& buffer : leased)
+        ok &= check(buffer.expired(), "held fragment pins a pool buffer");
+
+    // A datagram completed from pooled buffers is still reassembled
+    {
+        const auto buffer = pool->lease();
+        const auto first = write_fragment(buffer.get(), 0xffff, 0, true);
+        const auto last = write_fragment(buffer.get() + first, 0xffff,
+                                         FRAGMENT_DATA, false);
+        push(buffer, 0, first);
+        push(buffer, first, last);
+    }
+
+    module.process();
+    ok &= check(g_packets.size() == 1, "datagram wasn't reassembled");
+    if (g_packets.size() == 1) {
+        ok &= check(g_packets.front().info.length == 20 + 2 * FRAGMENT_DATA,
+                    "reassembled datagram has the wrong size");
+    }
+    g_packets.clear();
+
+    // Everything still held comes back on disable, all of it counted
+    module.disable();
+    size_t held = 0;
+    for (const auto& packet : g_packets)
+        held += packet.packet.size() + sizeof(PacketNode);
+
+    std::printf("held %zu fragments, %zu bytes of %d KiB\n", g_packets.size(),
+                held, MEMORY_LIMIT);
+    ok &= check(!g_packets.empty(), "nothing was held");
+    ok &= check(held <= static_cast<size_t>(MEMORY_LIMIT) << 10,
+                "memory limit exceeded");
+    g_packets.clear();
+
+    return ok ? 0 : 1;
+}